@@ -0,0 +1,206 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// adapt.c: This file contains the adaptive rate controller, which sets
+//          the polling thread's read interval and the reply timeout
+//          from the outcome and timing of each read cycle: backing off
+//          quickly when exchanges fail, and tightening slowly while
+//          the link stays clean.
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Number of consecutive clean cycles after which the controller tightens
+#define MEMS_ADAPT_CLEAN_CYCLES 16
+
+//! Smallest step by which the interval grows on a failure
+#define MEMS_ADAPT_BACKOFF_STEP_MS 10
+
+/**
+ * Fills in the default limits: the interval may range from nothing (reading
+ * as fast as the ECU replies) to one second, and the reply margin from 5 ms
+ * to 250 ms.
+ */
+void mems_adaptive_options_init(mems_adaptive_options* options)
+{
+  options->min_interval_ms = 0;
+  options->max_interval_ms = 1000;
+  options->min_reply_margin_ms = 5;
+  options->max_reply_margin_ms = 250;
+}
+
+/**
+ * Limits a value to a range.
+ */
+static uint32_t mems_adapt_clamp(uint64_t value, uint32_t min, uint32_t max)
+{
+  return (value < min) ? min : ((value > max) ? max : (uint32_t)value);
+}
+
+/**
+ * Returns the number of failed exchanges recorded in a command's counters.
+ */
+static uint64_t mems_adapt_failures(const mems_command_stats* stats)
+{
+  return (uint64_t)stats->timeouts + stats->short_reads + stats->mismatches;
+}
+
+/**
+ * Enables the controller with the given limits (starting from the polling
+ * interval requested and the current reply margin), or disables it and
+ * restores the reply margin that was in effect before it was enabled.
+ * This is called by the polling thread; the reply margin is changed with
+ * the link held, as other threads' exchanges read it.
+ * @param options Limits, or NULL to disable the controller
+ * @param interval_ms Interval requested when polling was started
+ */
+void mems_adapt_configure(mems_info* info, mems_adaptive* adapt, const mems_adaptive_options* options,
+                          uint32_t interval_ms)
+{
+  if (!mems_lock(info))
+  {
+    return;
+  }
+
+  if (options == NULL)
+  {
+    if (adapt->state.enabled)
+    {
+      info->reply_margin_us = adapt->restore_margin_us;
+    }
+    memset(adapt, 0, sizeof(mems_adaptive));
+    mems_unlock(info);
+    return;
+  }
+
+  if (!adapt->state.enabled)
+  {
+    adapt->restore_margin_us = info->reply_margin_us;
+  }
+
+  adapt->options = *options;
+  if (adapt->options.max_interval_ms < adapt->options.min_interval_ms)
+  {
+    adapt->options.max_interval_ms = adapt->options.min_interval_ms;
+  }
+  if (adapt->options.max_reply_margin_ms < adapt->options.min_reply_margin_ms)
+  {
+    adapt->options.max_reply_margin_ms = adapt->options.min_reply_margin_ms;
+  }
+
+  adapt->state.enabled = true;
+  adapt->state.interval_ms = mems_adapt_clamp(interval_ms, adapt->options.min_interval_ms,
+                                              adapt->options.max_interval_ms);
+  adapt->state.reply_margin_us = mems_adapt_clamp(info->reply_margin_us,
+                                                  adapt->options.min_reply_margin_ms * 1000,
+                                                  adapt->options.max_reply_margin_ms * 1000);
+  adapt->state.clean_cycles = 0;
+  adapt->primed = false;
+  info->reply_margin_us = adapt->state.reply_margin_us;
+
+  mems_unlock(info);
+}
+
+/**
+ * Adjusts the interval and reply margin after one read cycle. Any timeout,
+ * short read or echo mismatch on the data frame requests since the previous
+ * cycle doubles both (so that a flaky link is not driven into a storm of
+ * resynchronizations). After each run of clean cycles, the interval is
+ * reduced by an eighth, and the margin is brought down towards twice the
+ * worst recent turnaround of the ECU (the time taken by a 0x80 exchange
+ * beyond the transfer time of its bytes).
+ * This is called by the polling thread, which holds the link while it
+ * reads the counters and sets the reply margin.
+ * @return The interval to wait until the start of the next cycle, in milliseconds
+ */
+uint32_t mems_adapt_cycle(mems_info* info, mems_adaptive* adapt)
+{
+  mems_adaptive_options* options = &adapt->options;
+  mems_adaptive_state* state = &adapt->state;
+  mems_command_stats stats80;
+  mems_command_stats stats7d;
+  mems_frame_times times;
+  uint64_t failures = 0;
+  uint64_t transfer_us = 0;
+  uint64_t overhead_us = 0;
+  uint32_t target = 0;
+
+  memset(&stats80, 0, sizeof(stats80));
+  memset(&stats7d, 0, sizeof(stats7d));
+  if (!mems_lock(info))
+  {
+    return state->interval_ms;
+  }
+  if (info->stats)
+  {
+    memcpy(&stats80, &info->stats[MEMS_ReqData80], sizeof(mems_command_stats));
+    memcpy(&stats7d, &info->stats[MEMS_ReqData7D], sizeof(mems_command_stats));
+  }
+  memcpy(&times, &info->frame_times.frame80, sizeof(mems_frame_times));
+
+  failures = mems_adapt_failures(&stats80) + mems_adapt_failures(&stats7d);
+
+  // the first cycle (or one after the counters were reset) only sets the baseline
+  if (!adapt->primed || (failures < adapt->last_failures))
+  {
+    adapt->primed = true;
+    adapt->last_failures = failures;
+    adapt->last_sent_us = times.sent_us;
+    mems_unlock(info);
+    return state->interval_ms;
+  }
+
+  if (failures > adapt->last_failures)
+  {
+    adapt->last_failures = failures;
+    state->backoffs++;
+    state->clean_cycles = 0;
+    state->interval_ms = mems_adapt_clamp((uint64_t)state->interval_ms * 2 + MEMS_ADAPT_BACKOFF_STEP_MS,
+                                          options->min_interval_ms, options->max_interval_ms);
+    state->reply_margin_us = mems_adapt_clamp((uint64_t)state->reply_margin_us * 2,
+                                              options->min_reply_margin_ms * 1000,
+                                              options->max_reply_margin_ms * 1000);
+    info->reply_margin_us = state->reply_margin_us;
+    mems_unlock(info);
+    return state->interval_ms;
+  }
+
+  // follow the ECU's turnaround on each newly completed 0x80 exchange,
+  // keeping a peak that decays slowly
+  if ((times.sent_us != adapt->last_sent_us) && (times.last_byte_us > times.sent_us))
+  {
+    adapt->last_sent_us = times.sent_us;
+    // the span covers the command byte, its echo and the frame itself
+    transfer_us = (uint64_t)(2 + sizeof(mems_data_frame_80)) * info->byte_time_us;
+    overhead_us = times.last_byte_us - times.sent_us;
+    overhead_us = (overhead_us > transfer_us) ? overhead_us - transfer_us : 0;
+    state->peak_turnaround_us -= state->peak_turnaround_us / 16;
+    if (overhead_us > state->peak_turnaround_us)
+    {
+      state->peak_turnaround_us = (uint32_t)overhead_us;
+    }
+  }
+
+  if (++state->clean_cycles >= MEMS_ADAPT_CLEAN_CYCLES)
+  {
+    state->clean_cycles = 0;
+    state->interval_ms = mems_adapt_clamp(state->interval_ms - ((state->interval_ms + 7) / 8),
+                                          options->min_interval_ms, options->max_interval_ms);
+
+    target = mems_adapt_clamp((uint64_t)state->peak_turnaround_us * 2, options->min_reply_margin_ms * 1000,
+                              options->max_reply_margin_ms * 1000);
+    if (state->reply_margin_us > target)
+    {
+      state->reply_margin_us -= (state->reply_margin_us - target + 7) / 8;
+    }
+    else
+    {
+      state->reply_margin_us = target;
+    }
+    info->reply_margin_us = state->reply_margin_us;
+  }
+
+  mems_unlock(info);
+  return state->interval_ms;
+}
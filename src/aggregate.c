@@ -0,0 +1,241 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// aggregate.c: This file contains the aggregator, which reduces a
+//              stream of decoded samples to per-channel min/max/mean
+//              summaries over fixed windows, for long-duration logging.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+struct mems_aggregator
+{
+  uint64_t window_us;
+  uint32_t window_ms;
+  //! Start of the window being collected, and the number of samples in it
+  uint64_t start_us;
+  uint32_t count;
+  double min[MEMS_Num_Channels];
+  double max[MEMS_Num_Channels];
+  double sum[MEMS_Num_Channels];
+  mems_rollup_callback callback;
+  void* user;
+  //! Destinations that receive every rollup (any of which may be NULL)
+  mems_log_writer* log;
+  mems_column_store* min_store;
+  mems_column_store* max_store;
+  mems_column_store* mean_store;
+};
+
+/**
+ * Creates an aggregator that summarizes samples over windows of the given
+ * length. Windows are aligned to multiples of their length on the clock of
+ * mems_time_us(), and a window in which no samples arrive produces nothing.
+ * @param window_ms Length of each window (such as MEMS_ROLLUP_10S)
+ * @param callback Function that receives each rollup (may be NULL)
+ * @param user Opaque pointer that is passed to the callback
+ * @return The aggregator, or NULL if the window is zero or memory could not be allocated
+ */
+mems_aggregator* mems_aggregator_create(uint32_t window_ms, mems_rollup_callback callback, void* user)
+{
+  mems_aggregator* agg = NULL;
+
+  if (window_ms == 0)
+  {
+    return NULL;
+  }
+
+  agg = (mems_aggregator*)calloc(1, sizeof(mems_aggregator));
+  if (agg != NULL)
+  {
+    agg->window_ms = window_ms;
+    agg->window_us = (uint64_t)window_ms * 1000;
+    agg->callback = callback;
+    agg->user = user;
+  }
+
+  return agg;
+}
+
+/**
+ * Frees an aggregator, discarding any partly-collected window (which may
+ * be written out first with mems_aggregator_flush()).
+ */
+void mems_aggregator_destroy(mems_aggregator* agg)
+{
+  free(agg);
+}
+
+/**
+ * Chooses where rollups are written, in addition to being passed to the
+ * callback: a binary log (as rollup records) and/or columnar stores that
+ * receive the min, max and mean of each window as one sample each. Any of
+ * them may be NULL. They are not closed or destroyed by the aggregator.
+ */
+void mems_aggregator_set_outputs(mems_aggregator* agg, mems_log_writer* log, mems_column_store* min_store,
+                                 mems_column_store* max_store, mems_column_store* mean_store)
+{
+  agg->log = log;
+  agg->min_store = min_store;
+  agg->max_store = max_store;
+  agg->mean_store = mean_store;
+}
+
+/**
+ * Stores a value into a channel's field, rounding it for integer channels.
+ */
+static void mems_aggregator_store(mems_data* data, int ch, double value)
+{
+  uint8_t* field = (uint8_t*)data + mems_channel_table[ch].offset;
+
+  switch (mems_channel_table[ch].type)
+  {
+  case MEMS_Type_U8:
+    *field = (uint8_t)(value + 0.5);
+    break;
+  case MEMS_Type_U16:
+    *(uint16_t*)field = (uint16_t)(value + 0.5);
+    break;
+  default:
+    *(float*)field = (float)value;
+    break;
+  }
+}
+
+/**
+ * Completes the window being collected (if it holds any samples) and passes
+ * the rollup to the callback and to each output.
+ * @return True unless writing to an output failed
+ */
+static bool mems_aggregator_emit(mems_aggregator* agg)
+{
+  mems_rollup rollup;
+  bool status = true;
+  int ch = 0;
+
+  if (agg->count == 0)
+  {
+    return true;
+  }
+
+  memset(&rollup, 0, sizeof(rollup));
+  rollup.start_us = agg->start_us;
+  rollup.window_ms = agg->window_ms;
+  rollup.count = agg->count;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    mems_aggregator_store(&rollup.min, ch, agg->min[ch]);
+    mems_aggregator_store(&rollup.max, ch, agg->max[ch]);
+    mems_aggregator_store(&rollup.mean, ch, agg->sum[ch] / agg->count);
+  }
+  agg->count = 0;
+
+  if (agg->callback)
+  {
+    agg->callback(&rollup, agg->user);
+  }
+
+  if (agg->log)
+  {
+    status = mems_log_write_rollup(agg->log, &rollup) && status;
+  }
+  if (agg->min_store)
+  {
+    status = mems_column_store_append(agg->min_store, &rollup.min, 1) && status;
+  }
+  if (agg->max_store)
+  {
+    status = mems_column_store_append(agg->max_store, &rollup.max, 1) && status;
+  }
+  if (agg->mean_store)
+  {
+    status = mems_column_store_append(agg->mean_store, &rollup.mean, 1) && status;
+  }
+
+  return status;
+}
+
+/**
+ * Adds one decoded sample to the aggregator, in constant time. A sample
+ * that falls after the end of the current window first completes that
+ * window, so each rollup is produced as soon as the next window begins.
+ * @param data Decoded sample
+ * @param timestamp_us Time at which the sample was read (from mems_time_us()); samples must be added in order
+ * @return True unless a completed window could not be written to an output
+ */
+bool mems_aggregator_add(mems_aggregator* agg, const mems_data* data, uint64_t timestamp_us)
+{
+  bool status = true;
+  double value = 0.0;
+  int ch = 0;
+
+  if ((agg->count > 0) && (timestamp_us >= agg->start_us + agg->window_us))
+  {
+    status = mems_aggregator_emit(agg);
+  }
+
+  if (agg->count == 0)
+  {
+    agg->start_us = timestamp_us - (timestamp_us % agg->window_us);
+    for (ch = 0; ch < MEMS_Num_Channels; ch++)
+    {
+      value = mems_channel_value(data, (mems_channel)ch);
+      agg->min[ch] = value;
+      agg->max[ch] = value;
+      agg->sum[ch] = value;
+    }
+  }
+  else
+  {
+    for (ch = 0; ch < MEMS_Num_Channels; ch++)
+    {
+      value = mems_channel_value(data, (mems_channel)ch);
+      agg->min[ch] = (value < agg->min[ch]) ? value : agg->min[ch];
+      agg->max[ch] = (value > agg->max[ch]) ? value : agg->max[ch];
+      agg->sum[ch] += value;
+    }
+  }
+  agg->count++;
+
+  return status;
+}
+
+/**
+ * Completes the window being collected now, without waiting for a sample
+ * from the next window (for example, before closing the log at the end of
+ * a run).
+ * @return True unless the rollup could not be written to an output
+ */
+bool mems_aggregator_flush(mems_aggregator* agg)
+{
+  return mems_aggregator_emit(agg);
+}
+
+/**
+ * Data callback that adds each sample to the aggregator given as the user
+ * pointer, timestamped with the arrival of the reply to the later of the
+ * exchanges that read it (see mems_get_frame_times()), which is when the ECU
+ * sampled the data. Subscribing it to the polling thread
+ * (with mems_subscribe()) aggregates every sample read at full rate:
+ *   mems_subscribe(&info, mems_aggregator_callback, agg);
+ */
+void mems_aggregator_callback(mems_info* info, const mems_data* data, void* user)
+{
+  mems_sample_times times;
+  uint64_t timestamp_us = 0;
+
+  mems_get_frame_times(info, &times);
+  timestamp_us = (times.frame80.first_byte_us > times.frame7d.first_byte_us) ?
+                 times.frame80.first_byte_us : times.frame7d.first_byte_us;
+
+  // fall back on the time of delivery for a sample with no recorded exchanges
+  if (timestamp_us == 0)
+  {
+    timestamp_us = mems_time_us();
+  }
+
+  mems_aggregator_add((mems_aggregator*)user, data, timestamp_us);
+}
@@ -0,0 +1,230 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// alarm.c: This file contains the alarm engine, which compiles
+//          declarative per-channel rules into a flat table and
+//          evaluates it against each decoded sample, reporting
+//          only the transitions of each alarm.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * One compiled rule, with its state. Every condition is reduced to "the
+ * (signed) quantity is above a level": a falling value or rate is tested by
+ * negating it, so evaluation is the same comparison for every rule.
+ */
+typedef struct
+{
+  //! Where the channel is stored in mems_data, and how
+  size_t offset;
+  mems_value_type type;
+  //! True if the rule tests the rate of change rather than the value
+  bool rate;
+  //! 1.0 for rising/above conditions, -1.0 for falling/below
+  double sign;
+  //! Signed levels above which the alarm is raised, and below which it is cleared
+  double set_level;
+  double clear_level;
+  uint64_t duration_us;
+  uint32_t id;
+
+  bool active;
+  //! Time at which the condition started to hold (0 if it does not)
+  uint64_t pending_since_us;
+  //! Previous value and its time, for the rate conditions (time 0 if none yet)
+  double last_value;
+  uint64_t last_us;
+} mems_alarm_slot;
+
+struct mems_alarm_table
+{
+  mems_alarm_callback callback;
+  void* user;
+  size_t count;
+  mems_alarm_slot slots[1];
+};
+
+/**
+ * Compiles a set of alarm rules into a table that can be evaluated against
+ * each sample with mems_alarm_evaluate(), or attached to the polling thread
+ * with mems_set_alarms(). The rules are copied, so the array need not be kept.
+ * @param rules Array of rules
+ * @param count Number of rules in the array
+ * @param callback Function told of every alarm that is raised or cleared (may be NULL)
+ * @param user Opaque pointer that is passed to the callback
+ * @return The compiled table, or NULL if a rule is invalid or memory could not be allocated
+ */
+mems_alarm_table* mems_alarm_compile(const mems_alarm_rule* rules, size_t count,
+                                     mems_alarm_callback callback, void* user)
+{
+  mems_alarm_table* alarms = NULL;
+  mems_alarm_slot* slot = NULL;
+  size_t idx = 0;
+
+  for (idx = 0; idx < count; idx++)
+  {
+    if ((rules[idx].channel >= MEMS_Num_Channels) || (rules[idx].hysteresis < 0) ||
+        (rules[idx].condition > MEMS_Alarm_FallingFaster))
+    {
+      dprintf_err("mems_alarm_compile(): rule %u is invalid\n", (unsigned)idx);
+      return NULL;
+    }
+  }
+
+  alarms = (mems_alarm_table*)calloc(1, sizeof(mems_alarm_table) +
+                                        ((count > 0) ? count - 1 : 0) * sizeof(mems_alarm_slot));
+  if (alarms == NULL)
+  {
+    return NULL;
+  }
+
+  alarms->callback = callback;
+  alarms->user = user;
+  alarms->count = count;
+
+  for (idx = 0; idx < count; idx++)
+  {
+    slot = &alarms->slots[idx];
+    slot->offset = mems_channel_table[rules[idx].channel].offset;
+    slot->type = mems_channel_table[rules[idx].channel].type;
+    slot->rate = (rules[idx].condition == MEMS_Alarm_RisingFaster) ||
+                 (rules[idx].condition == MEMS_Alarm_FallingFaster);
+    slot->sign = ((rules[idx].condition == MEMS_Alarm_Below) ||
+                  (rules[idx].condition == MEMS_Alarm_FallingFaster)) ? -1.0 : 1.0;
+    slot->set_level = slot->sign * rules[idx].threshold;
+    slot->clear_level = slot->set_level - rules[idx].hysteresis;
+    slot->duration_us = (uint64_t)rules[idx].duration_ms * 1000;
+    slot->id = rules[idx].id;
+  }
+
+  return alarms;
+}
+
+/**
+ * Frees a table of alarm rules. It must not be attached to a polling thread.
+ */
+void mems_alarm_destroy(mems_alarm_table* alarms)
+{
+  free(alarms);
+}
+
+/**
+ * Returns every alarm in a table to its initial (inactive) state, without
+ * reporting anything.
+ */
+void mems_alarm_reset(mems_alarm_table* alarms)
+{
+  size_t idx = 0;
+
+  for (idx = 0; idx < alarms->count; idx++)
+  {
+    alarms->slots[idx].active = false;
+    alarms->slots[idx].pending_since_us = 0;
+    alarms->slots[idx].last_us = 0;
+  }
+}
+
+/**
+ * Passes a change in the state of one alarm to the table's callback.
+ */
+static void mems_alarm_report(mems_alarm_table* alarms, mems_info* info, size_t idx,
+                              double value, uint64_t timestamp_us)
+{
+  mems_alarm_event event;
+
+  if (alarms->callback)
+  {
+    event.id = alarms->slots[idx].id;
+    event.rule = (uint32_t)idx;
+    event.active = alarms->slots[idx].active;
+    event.value = value;
+    event.timestamp_us = timestamp_us;
+    alarms->callback(info, &event, alarms->user);
+  }
+}
+
+/**
+ * Evaluates every rule in a table against one decoded sample, and reports
+ * each alarm that is raised or cleared as a result. Samples must be passed
+ * in the order in which they were read; a rate condition is first tested on
+ * the second sample.
+ * @param info Connection from which the sample was read (passed to the callback)
+ * @param data Decoded sample
+ * @param timestamp_us Time (from mems_time_us()) at which the sample was read
+ * @return Number of alarms that were raised or cleared
+ */
+int mems_alarm_evaluate(mems_alarm_table* alarms, mems_info* info, const mems_data* data, uint64_t timestamp_us)
+{
+  mems_alarm_slot* slot = NULL;
+  double value = 0.0;
+  double level = 0.0;
+  size_t idx = 0;
+  int changes = 0;
+
+  for (idx = 0; idx < alarms->count; idx++)
+  {
+    slot = &alarms->slots[idx];
+    value = mems_value_at(slot->type, (const uint8_t*)data + slot->offset, 0);
+
+    if (slot->rate)
+    {
+      if ((slot->last_us == 0) || (timestamp_us <= slot->last_us))
+      {
+        slot->last_value = value;
+        slot->last_us = timestamp_us;
+        continue;
+      }
+
+      level = (value - slot->last_value) * 1000000.0 / (double)(timestamp_us - slot->last_us);
+      slot->last_value = value;
+      slot->last_us = timestamp_us;
+      value = level;
+    }
+
+    level = slot->sign * value;
+
+    if (slot->active)
+    {
+      if (level < slot->clear_level)
+      {
+        slot->active = false;
+        slot->pending_since_us = 0;
+        mems_alarm_report(alarms, info, idx, value, timestamp_us);
+        changes++;
+      }
+    }
+    else if (level > slot->set_level)
+    {
+      if (slot->pending_since_us == 0)
+      {
+        slot->pending_since_us = timestamp_us;
+      }
+
+      if ((timestamp_us - slot->pending_since_us) >= slot->duration_us)
+      {
+        slot->active = true;
+        mems_alarm_report(alarms, info, idx, value, timestamp_us);
+        changes++;
+      }
+    }
+    else
+    {
+      slot->pending_since_us = 0;
+    }
+  }
+
+  return changes;
+}
+
+/**
+ * Returns true if the given alarm is currently raised.
+ * @param rule Index of the rule in the array passed to mems_alarm_compile()
+ */
+bool mems_alarm_is_active(const mems_alarm_table* alarms, size_t rule)
+{
+  return (rule < alarms->count) && alarms->slots[rule].active;
+}
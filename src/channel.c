@@ -0,0 +1,126 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// channel.c: This file contains the table describing each data
+//            channel (field) of the mems_data structure, and the
+//            accessors that let other modules treat the fields
+//            generically.
+
+#include <stddef.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+#define MEMS_CHANNEL(name, field, type, cmd) \
+  { name, type, offsetof(mems_data, field), cmd }
+
+const mems_channel_desc mems_channel_table[MEMS_Num_Channels] =
+{
+  MEMS_CHANNEL("engine_rpm",           engine_rpm,           MEMS_Type_U16,   MEMS_ReqData80),
+  MEMS_CHANNEL("coolant_temp_f",       coolant_temp_f,       MEMS_Type_U8,    MEMS_ReqData80),
+  MEMS_CHANNEL("ambient_temp_f",       ambient_temp_f,       MEMS_Type_U8,    MEMS_ReqData80),
+  MEMS_CHANNEL("intake_air_temp_f",    intake_air_temp_f,    MEMS_Type_U8,    MEMS_ReqData80),
+  MEMS_CHANNEL("fuel_temp_f",          fuel_temp_f,          MEMS_Type_U8,    MEMS_ReqData80),
+  MEMS_CHANNEL("map_kpa",              map_kpa,              MEMS_Type_Float, MEMS_ReqData80),
+  MEMS_CHANNEL("battery_voltage",      battery_voltage,      MEMS_Type_Float, MEMS_ReqData80),
+  MEMS_CHANNEL("throttle_pot_voltage", throttle_pot_voltage, MEMS_Type_Float, MEMS_ReqData80),
+  MEMS_CHANNEL("idle_switch",          idle_switch,          MEMS_Type_U8,    MEMS_ReqData80),
+  MEMS_CHANNEL("park_neutral_switch",  park_neutral_switch,  MEMS_Type_U8,    MEMS_ReqData80),
+  MEMS_CHANNEL("fault_codes",          fault_codes,          MEMS_Type_U8,    MEMS_ReqData80),
+  MEMS_CHANNEL("iac_position",         iac_position,         MEMS_Type_U8,    MEMS_ReqData80),
+  MEMS_CHANNEL("idle_error",           idle_error,           MEMS_Type_U16,   MEMS_ReqData80),
+  MEMS_CHANNEL("ignition_advance",     ignition_advance,     MEMS_Type_Float, MEMS_ReqData80),
+  MEMS_CHANNEL("coil_time",            coil_time,            MEMS_Type_Float, MEMS_ReqData80),
+  MEMS_CHANNEL("lambda_voltage_mv",    lambda_voltage_mv,    MEMS_Type_U16,   MEMS_ReqData7D),
+  MEMS_CHANNEL("fuel_trim",            fuel_trim,            MEMS_Type_U8,    MEMS_ReqData7D),
+  MEMS_CHANNEL("closed_loop",          closed_loop,          MEMS_Type_U8,    MEMS_ReqData7D),
+  MEMS_CHANNEL("idle_base_pos",        idle_base_pos,        MEMS_Type_U8,    MEMS_ReqData7D)
+};
+
+/**
+ * Returns the name of a data channel (which matches the name of its field
+ * in mems_data), or NULL if the channel number is invalid.
+ */
+const char* mems_channel_name(mems_channel ch)
+{
+  return (ch < MEMS_Num_Channels) ? mems_channel_table[ch].name : NULL;
+}
+
+/**
+ * Returns the storage type of a data channel.
+ */
+mems_value_type mems_channel_type(mems_channel ch)
+{
+  return mems_channel_table[ch].type;
+}
+
+/**
+ * Returns the size (in bytes) of one value of the given type.
+ */
+size_t mems_value_size(mems_value_type type)
+{
+  switch (type)
+  {
+  case MEMS_Type_U8:
+    return sizeof(uint8_t);
+  case MEMS_Type_U16:
+    return sizeof(uint16_t);
+  default:
+    return sizeof(float);
+  }
+}
+
+/**
+ * Returns the value of one channel in a raw array of values of the given type.
+ */
+double mems_value_at(mems_value_type type, const void* values, size_t idx)
+{
+  switch (type)
+  {
+  case MEMS_Type_U8:
+    return ((const uint8_t*)values)[idx];
+  case MEMS_Type_U16:
+    return ((const uint16_t*)values)[idx];
+  default:
+    return ((const float*)values)[idx];
+  }
+}
+
+/**
+ * Returns the value of one channel from a decoded sample.
+ * @param data Decoded sample
+ * @param ch Channel to retrieve
+ */
+double mems_channel_value(const mems_data* data, mems_channel ch)
+{
+  const mems_channel_desc* desc = &mems_channel_table[ch];
+  return mems_value_at(desc->type, (const uint8_t*)data + desc->offset, 0);
+}
+
+/**
+ * Returns the command that requests the frame from which a data channel
+ * is decoded (MEMS_ReqData80 or MEMS_ReqData7D).
+ */
+uint8_t mems_channel_source(mems_channel ch)
+{
+  return mems_channel_table[ch].source_cmd;
+}
+
+/**
+ * Returns the set of channels (as a mask of MEMS_CHANNEL_BIT() values) that
+ * are decoded from the frame requested by the given command.
+ */
+uint32_t mems_frame_channels(uint8_t cmd)
+{
+  uint32_t mask = 0;
+  int ch = 0;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    if (mems_channel_table[ch].source_cmd == cmd)
+    {
+      mask |= MEMS_CHANNEL_BIT(ch);
+    }
+  }
+
+  return mask;
+}
@@ -0,0 +1,441 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// columns.c: This file contains the columnar sample store, which
+//            keeps decoded samples as one contiguous array per
+//            channel (in fixed-size chunks) along with running
+//            min/max/mean summaries of each channel.
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * A block of MEMS_COLUMN_CHUNK_SIZE samples, stored as one array per channel.
+ */
+typedef struct
+{
+  size_t count;
+  void* columns[MEMS_Num_Channels];
+} mems_column_chunk;
+
+typedef struct
+{
+  double min;
+  double max;
+  double sum;
+} mems_column_stats;
+
+struct mems_column_store
+{
+  mems_column_chunk** chunks;
+  size_t chunk_count;
+  size_t chunk_capacity;
+  size_t sample_count;
+  mems_column_stats stats[MEMS_Num_Channels];
+};
+
+/**
+ * Allocates a chunk, with the arrays for all channels in a single block.
+ */
+static mems_column_chunk* mems_column_chunk_create()
+{
+  mems_column_chunk* chunk = NULL;
+  size_t bytes = 0;
+  uint8_t* mem = NULL;
+  int ch = 0;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    bytes += MEMS_COLUMN_CHUNK_SIZE * mems_value_size(mems_channel_table[ch].type);
+  }
+
+  chunk = (mems_column_chunk*)malloc(sizeof(mems_column_chunk) + bytes);
+  if (chunk != NULL)
+  {
+    chunk->count = 0;
+
+    // the float columns come first so every array stays naturally aligned
+    mem = (uint8_t*)(chunk + 1);
+    for (ch = 0; ch < MEMS_Num_Channels; ch++)
+    {
+      if (mems_channel_table[ch].type == MEMS_Type_Float)
+      {
+        chunk->columns[ch] = mem;
+        mem += MEMS_COLUMN_CHUNK_SIZE * sizeof(float);
+      }
+    }
+    for (ch = 0; ch < MEMS_Num_Channels; ch++)
+    {
+      if (mems_channel_table[ch].type == MEMS_Type_U16)
+      {
+        chunk->columns[ch] = mem;
+        mem += MEMS_COLUMN_CHUNK_SIZE * sizeof(uint16_t);
+      }
+    }
+    for (ch = 0; ch < MEMS_Num_Channels; ch++)
+    {
+      if (mems_channel_table[ch].type == MEMS_Type_U8)
+      {
+        chunk->columns[ch] = mem;
+        mem += MEMS_COLUMN_CHUNK_SIZE * sizeof(uint8_t);
+      }
+    }
+  }
+
+  return chunk;
+}
+
+/**
+ * Returns the chunk that new samples should be added to, allocating a new
+ * one if the last chunk is full.
+ */
+static mems_column_chunk* mems_column_store_tail(mems_column_store* store)
+{
+  mems_column_chunk** grown = NULL;
+  mems_column_chunk* chunk = NULL;
+
+  if ((store->chunk_count > 0) &&
+      (store->chunks[store->chunk_count - 1]->count < MEMS_COLUMN_CHUNK_SIZE))
+  {
+    return store->chunks[store->chunk_count - 1];
+  }
+
+  if (store->chunk_count == store->chunk_capacity)
+  {
+    grown = (mems_column_chunk**)realloc(store->chunks,
+                                         (store->chunk_capacity * 2 + 8) * sizeof(mems_column_chunk*));
+    if (grown == NULL)
+    {
+      return NULL;
+    }
+    store->chunks = grown;
+    store->chunk_capacity = store->chunk_capacity * 2 + 8;
+  }
+
+  chunk = mems_column_chunk_create();
+  if (chunk != NULL)
+  {
+    store->chunks[store->chunk_count++] = chunk;
+  }
+
+  return chunk;
+}
+
+/**
+ * Folds newly-added values (at positions start..start+n of a chunk) into
+ * the running summary of every channel.
+ */
+static void mems_column_store_update_stats(mems_column_store* store, mems_column_chunk* chunk,
+                                           size_t start, size_t n)
+{
+  mems_column_stats* st = NULL;
+  mems_value_type type;
+  double val = 0;
+  size_t idx = 0;
+  int ch = 0;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    st = &store->stats[ch];
+    type = mems_channel_table[ch].type;
+
+    for (idx = start; idx < start + n; idx++)
+    {
+      val = mems_value_at(type, chunk->columns[ch], idx);
+      st->min = (val < st->min) ? val : st->min;
+      st->max = (val > st->max) ? val : st->max;
+      st->sum += val;
+    }
+  }
+}
+
+/**
+ * Creates an empty columnar sample store.
+ * @return Handle to the store, or NULL if it couldn't be allocated
+ */
+mems_column_store* mems_column_store_create()
+{
+  mems_column_store* store = (mems_column_store*)calloc(1, sizeof(mems_column_store));
+
+  if (store != NULL)
+  {
+    mems_column_store_clear(store);
+  }
+
+  return store;
+}
+
+/**
+ * Frees a columnar sample store and all of its samples.
+ */
+void mems_column_store_destroy(mems_column_store* store)
+{
+  if (store)
+  {
+    mems_column_store_clear(store);
+    free(store->chunks);
+    free(store);
+  }
+}
+
+/**
+ * Removes all samples from the store and resets the channel summaries.
+ */
+void mems_column_store_clear(mems_column_store* store)
+{
+  size_t idx = 0;
+  int ch = 0;
+
+  for (idx = 0; idx < store->chunk_count; idx++)
+  {
+    free(store->chunks[idx]);
+  }
+  store->chunk_count = 0;
+  store->sample_count = 0;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    store->stats[ch].min = DBL_MAX;
+    store->stats[ch].max = -DBL_MAX;
+    store->stats[ch].sum = 0;
+  }
+}
+
+/**
+ * Appends decoded samples to the store.
+ * @param data Array of n decoded samples
+ * @param n Number of samples to append
+ * @return True if all of the samples were appended
+ */
+bool mems_column_store_append(mems_column_store* store, const mems_data* data, size_t n)
+{
+  mems_column_chunk* chunk = NULL;
+  const mems_channel_desc* desc = NULL;
+  size_t done = 0;
+  size_t batch = 0;
+  size_t idx = 0;
+  size_t size = 0;
+  int ch = 0;
+
+  while (done < n)
+  {
+    if ((chunk = mems_column_store_tail(store)) == NULL)
+    {
+      return false;
+    }
+
+    batch = MEMS_COLUMN_CHUNK_SIZE - chunk->count;
+    batch = (batch < n - done) ? batch : n - done;
+
+    for (ch = 0; ch < MEMS_Num_Channels; ch++)
+    {
+      desc = &mems_channel_table[ch];
+      size = mems_value_size(desc->type);
+      for (idx = 0; idx < batch; idx++)
+      {
+        memcpy((uint8_t*)chunk->columns[ch] + ((chunk->count + idx) * size),
+               (const uint8_t*)&data[done + idx] + desc->offset, size);
+      }
+    }
+
+    mems_column_store_update_stats(store, chunk, chunk->count, batch);
+    chunk->count += batch;
+    store->sample_count += batch;
+    done += batch;
+  }
+
+  return true;
+}
+
+/**
+ * Decodes raw frame pairs directly into the store's column arrays, using
+ * the same scalings as mems_decode_batch().
+ * @param frames80 Array of n frames received in reply to command 0x80
+ * @param frames7d Array of n frames received in reply to command 0x7D
+ * @param n Number of frame pairs to decode
+ * @return True if all of the frames were decoded and appended
+ */
+bool mems_column_store_decode(mems_column_store* store, const mems_data_frame_80* frames80,
+                              const mems_data_frame_7d* frames7d, size_t n)
+{
+  mems_column_chunk* chunk = NULL;
+  void* dest[MEMS_Num_Channels];
+  size_t done = 0;
+  size_t batch = 0;
+  int ch = 0;
+
+  while (done < n)
+  {
+    if ((chunk = mems_column_store_tail(store)) == NULL)
+    {
+      return false;
+    }
+
+    batch = MEMS_COLUMN_CHUNK_SIZE - chunk->count;
+    batch = (batch < n - done) ? batch : n - done;
+
+    for (ch = 0; ch < MEMS_Num_Channels; ch++)
+    {
+      dest[ch] = (uint8_t*)chunk->columns[ch] +
+                 (chunk->count * mems_value_size(mems_channel_table[ch].type));
+    }
+    mems_decode_columns(frames80 + done, frames7d + done, batch, dest);
+
+    mems_column_store_update_stats(store, chunk, chunk->count, batch);
+    chunk->count += batch;
+    store->sample_count += batch;
+    done += batch;
+  }
+
+  return true;
+}
+
+/**
+ * Returns the number of samples in the store.
+ */
+size_t mems_column_store_count(const mems_column_store* store)
+{
+  return store->sample_count;
+}
+
+/**
+ * Returns the number of chunks that the samples are stored in. Every chunk
+ * but the last holds exactly MEMS_COLUMN_CHUNK_SIZE samples.
+ */
+size_t mems_column_store_chunk_count(const mems_column_store* store)
+{
+  return store->chunk_count;
+}
+
+/**
+ * Returns the contiguous array of one channel's values within a chunk. The
+ * array's element type is given by mems_channel_type().
+ * @param ch Channel to retrieve
+ * @param chunk_idx Index of the chunk
+ * @param count Receives the number of values in the array
+ * @return Pointer to the values, or NULL if the chunk index is out of range
+ */
+const void* mems_column_store_chunk(const mems_column_store* store, mems_channel ch,
+                                    size_t chunk_idx, size_t* count)
+{
+  if ((chunk_idx >= store->chunk_count) || (ch >= MEMS_Num_Channels))
+  {
+    return NULL;
+  }
+
+  if (count)
+  {
+    *count = store->chunks[chunk_idx]->count;
+  }
+
+  return store->chunks[chunk_idx]->columns[ch];
+}
+
+/**
+ * Copies a range of one channel's values out of the store, converted to float.
+ * @param ch Channel to retrieve
+ * @param start Index of the first sample to copy
+ * @param n Maximum number of values to copy
+ * @param out Array receiving the values
+ * @return Number of values copied
+ */
+size_t mems_column_store_copy(const mems_column_store* store, mems_channel ch,
+                              size_t start, size_t n, float* out)
+{
+  mems_value_type type = mems_channel_table[ch].type;
+  const mems_column_chunk* chunk = NULL;
+  size_t copied = 0;
+  size_t pos = 0;
+
+  while ((copied < n) && (start + copied < store->sample_count))
+  {
+    chunk = store->chunks[(start + copied) / MEMS_COLUMN_CHUNK_SIZE];
+    pos = (start + copied) % MEMS_COLUMN_CHUNK_SIZE;
+    while ((copied < n) && (pos < chunk->count))
+    {
+      out[copied++] = (float)mems_value_at(type, chunk->columns[ch], pos++);
+    }
+  }
+
+  return copied;
+}
+
+/**
+ * Computes a min/max envelope of one channel over a range of samples,
+ * divided into equal-sized buckets (e.g. one per horizontal pixel of a plot).
+ * @param ch Channel to summarize
+ * @param start Index of the first sample in the range
+ * @param n Number of samples in the range
+ * @param buckets Number of buckets to divide the range into
+ * @param mins Array of 'buckets' values receiving the minimum of each bucket
+ * @param maxs Array of 'buckets' values receiving the maximum of each bucket
+ * @return Number of buckets filled
+ */
+size_t mems_column_store_envelope(const mems_column_store* store, mems_channel ch,
+                                  size_t start, size_t n, size_t buckets,
+                                  float* mins, float* maxs)
+{
+  mems_value_type type = mems_channel_table[ch].type;
+  const mems_column_chunk* chunk = NULL;
+  size_t bucket = 0;
+  size_t from = 0;
+  size_t to = 0;
+  size_t idx = 0;
+  float val = 0;
+
+  if (start >= store->sample_count)
+  {
+    return 0;
+  }
+  if (start + n > store->sample_count)
+  {
+    n = store->sample_count - start;
+  }
+  if (buckets > n)
+  {
+    buckets = n;
+  }
+
+  for (bucket = 0; bucket < buckets; bucket++)
+  {
+    from = start + ((bucket * n) / buckets);
+    to = start + (((bucket + 1) * n) / buckets);
+
+    mins[bucket] = FLT_MAX;
+    maxs[bucket] = -FLT_MAX;
+    for (idx = from; idx < to; idx++)
+    {
+      chunk = store->chunks[idx / MEMS_COLUMN_CHUNK_SIZE];
+      val = (float)mems_value_at(type, chunk->columns[ch], idx % MEMS_COLUMN_CHUNK_SIZE);
+      mins[bucket] = (val < mins[bucket]) ? val : mins[bucket];
+      maxs[bucket] = (val > maxs[bucket]) ? val : maxs[bucket];
+    }
+  }
+
+  return buckets;
+}
+
+/**
+ * Retrieves the running summary of one channel over every sample in the store.
+ * @param ch Channel to summarize
+ * @param summary Receives the minimum, maximum, mean and sample count
+ * @return True if the summary was retrieved; false if the store is empty
+ */
+bool mems_column_store_summary(const mems_column_store* store, mems_channel ch,
+                               mems_column_summary* summary)
+{
+  if ((store->sample_count == 0) || (ch >= MEMS_Num_Channels))
+  {
+    return false;
+  }
+
+  summary->min = store->stats[ch].min;
+  summary->max = store->stats[ch].max;
+  summary->mean = store->stats[ch].sum / store->sample_count;
+  summary->count = store->sample_count;
+
+  return true;
+}
@@ -0,0 +1,282 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// decode.c: This file contains the conversion of raw data frames
+//           into the compact mems_data structure, driven by the
+//           table of fields of the ECU variant. Each field is
+//           decoded by a separate simple loop over a block of frames,
+//           with one-byte fields precomputed into lookup tables, so
+//           that large batches of frames (e.g. from a log) can be
+//           decoded quickly.
+
+#include <string.h>
+
+#if defined(WIN32)
+  #include <windows.h>
+#else
+  #include <pthread.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Number of frames decoded at a time, so that each field's loop runs over frames already in cache
+#define MEMS_DECODE_BLOCK 64
+
+#if defined(WIN32)
+static INIT_ONCE decode_tables_once = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_once_t decode_tables_once = PTHREAD_ONCE_INIT;
+#endif
+
+/**
+ * Converts the raw value of a field, as described by its kind.
+ */
+static double mems_field_value(const mems_field_desc* field, uint32_t raw)
+{
+  switch (field->kind)
+  {
+  case MEMS_Field_Linear:
+    return (raw * field->scale / field->divisor) + field->bias;
+  case MEMS_Field_TempF:
+    return temperature_value_to_degrees_f((uint8_t)raw);
+  case MEMS_Field_Bit:
+    return ((raw & field->mask) != 0) << field->shift;
+  default:
+    return raw;
+  }
+}
+
+/**
+ * Fills the lookup table of every one-byte field of every variant. Each
+ * entry is computed with exactly the same expression as a two-byte field
+ * is converted with directly, so table-driven decoding gives the same results.
+ */
+static void mems_build_decode_tables()
+{
+  const mems_variant* variant = NULL;
+  const mems_field_desc* field = NULL;
+  mems_field_table* table = NULL;
+  size_t vi = 0;
+  size_t fi = 0;
+  unsigned int val = 0;
+  double value = 0;
+
+  for (vi = 0; (variant = mems_variant_at(vi)) != NULL; vi++)
+  {
+    for (fi = 0; fi < variant->num_fields; fi++)
+    {
+      field = &variant->fields[fi];
+      table = &variant->tables[fi];
+      for (val = 0; (field->width == 1) && (val < 256); val++)
+      {
+        value = mems_field_value(field, val);
+        switch (mems_channel_table[field->channel].type)
+        {
+        case MEMS_Type_U8:
+          table->u8[val] = (uint8_t)value;
+          break;
+        case MEMS_Type_U16:
+          table->u16[val] = (uint16_t)value;
+          break;
+        default:
+          table->f[val] = (float)value;
+          break;
+        }
+      }
+    }
+  }
+}
+
+#if defined(WIN32)
+static BOOL CALLBACK mems_build_decode_tables_once(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+  mems_build_decode_tables();
+  return TRUE;
+}
+#endif
+
+/**
+ * Builds the lookup tables on first use.
+ */
+static void mems_init_decode_tables()
+{
+#if defined(WIN32)
+  InitOnceExecuteOnce(&decode_tables_once, mems_build_decode_tables_once, NULL, NULL);
+#else
+  pthread_once(&decode_tables_once, mems_build_decode_tables);
+#endif
+}
+
+/**
+ * Decodes one field from a block of frames, into values 'dst_stride' bytes
+ * apart. One-byte fields are looked up in the field's table; the bits of
+ * MEMS_Field_Bit fields are ORed into the channel.
+ */
+static void mems_decode_field(const mems_field_desc* field, const mems_field_table* table,
+                              const uint8_t* restrict src, size_t src_stride,
+                              uint8_t* restrict dst, size_t dst_stride, mems_value_type type, size_t n)
+{
+  size_t idx = 0;
+  uint32_t raw = 0;
+
+  if (field->width == 2)
+  {
+    for (idx = 0; idx < n; idx++)
+    {
+      raw = ((uint32_t)src[idx * src_stride] << 8) | src[(idx * src_stride) + 1];
+      if (type == MEMS_Type_U16)
+        *(uint16_t*)(dst + (idx * dst_stride)) = (uint16_t)mems_field_value(field, raw);
+      else
+        *(float*)(dst + (idx * dst_stride)) = (float)mems_field_value(field, raw);
+    }
+  }
+  else if (field->kind == MEMS_Field_Bit)
+  {
+    for (idx = 0; idx < n; idx++)
+      dst[idx * dst_stride] |= table->u8[src[idx * src_stride]];
+  }
+  else if (type == MEMS_Type_U8)
+  {
+    for (idx = 0; idx < n; idx++)
+      dst[idx * dst_stride] = table->u8[src[idx * src_stride]];
+  }
+  else if (type == MEMS_Type_U16)
+  {
+    for (idx = 0; idx < n; idx++)
+      *(uint16_t*)(dst + (idx * dst_stride)) = table->u16[src[idx * src_stride]];
+  }
+  else
+  {
+    for (idx = 0; idx < n; idx++)
+      *(float*)(dst + (idx * dst_stride)) = table->f[src[idx * src_stride]];
+  }
+}
+
+/**
+ * Decodes every field of a variant's data frames from a series of raw frame
+ * pairs. The frames are taken a block at a time, and within a block each
+ * field is decoded by its own simple loop, so there is no per-field
+ * branching within a loop and a variant is described wholly by its table of
+ * fields. The destinations must be cleared beforehand, since the bits of
+ * MEMS_Field_Bit fields are ORed into them.
+ * @param variant Variant whose fields are decoded
+ * @param frames80 Array of n frames received in reply to command 0x80
+ * @param frames7d Array of n frames received in reply to command 0x7D
+ * @param n Number of frame pairs to decode
+ * @param dest Location of the first value of each channel, indexed by mems_channel
+ * @param stride Distance in bytes between successive values of a channel, or
+ *   0 if each channel is a contiguous array of its storage type
+ */
+void mems_decode_fields(const mems_variant* variant, const mems_data_frame_80* frames80,
+                        const mems_data_frame_7d* frames7d, size_t n,
+                        void* const dest[MEMS_Num_Channels], size_t stride)
+{
+  const mems_field_desc* field = NULL;
+  const uint8_t* src = NULL;
+  mems_value_type type;
+  size_t src_stride = 0;
+  size_t dst_stride = 0;
+  size_t start = 0;
+  size_t count = 0;
+  size_t fi = 0;
+
+  mems_init_decode_tables();
+
+  for (start = 0; start < n; start += MEMS_DECODE_BLOCK)
+  {
+    count = (n - start < MEMS_DECODE_BLOCK) ? (n - start) : MEMS_DECODE_BLOCK;
+
+    for (fi = 0; fi < variant->num_fields; fi++)
+    {
+      field = &variant->fields[fi];
+      if (field->source_cmd == MEMS_ReqData80)
+      {
+        src = (const uint8_t*)(frames80 + start) + field->offset;
+        src_stride = sizeof(mems_data_frame_80);
+      }
+      else
+      {
+        src = (const uint8_t*)(frames7d + start) + field->offset;
+        src_stride = sizeof(mems_data_frame_7d);
+      }
+      type = mems_channel_table[field->channel].type;
+      dst_stride = (stride != 0) ? stride : mems_value_size(type);
+
+      mems_decode_field(field, &variant->tables[fi], src, src_stride,
+                        (uint8_t*)dest[field->channel] + (start * dst_stride), dst_stride, type, count);
+    }
+  }
+}
+
+/**
+ * Converts a series of raw frame pairs from a MEMS 1.6 ECU into the
+ * compact data structure, with mems_decode_fields(). The results are
+ * identical to those of mems_read().
+ * @param frames80 Array of n frames received in reply to command 0x80
+ * @param frames7d Array of n frames received in reply to command 0x7D
+ * @param n Number of frame pairs to decode
+ * @param out Array of n structures to receive the decoded data
+ */
+void mems_decode_batch(const mems_data_frame_80* frames80, const mems_data_frame_7d* frames7d,
+                       size_t n, mems_data* out)
+{
+  mems_variant_decode_batch(mems_default_variant, frames80, frames7d, n, out);
+}
+
+/**
+ * Converts a pair of raw data frames into the compact data structure, with
+ * the table of fields of the given ECU variant. If one of the frames is NULL
+ * (because it was not read), the channels that are decoded from it are
+ * left unchanged.
+ */
+void mems_decode_frames(const mems_variant* variant, const mems_data_frame_80* dframe80,
+                        const mems_data_frame_7d* dframe7d, mems_data* data)
+{
+  static const mems_data_frame_80 empty80;
+  static const mems_data_frame_7d empty7d;
+  const mems_channel_desc* desc = NULL;
+  mems_data previous;
+  uint8_t stale_cmd = 0;
+  int ch = 0;
+
+  if (dframe80 && dframe7d)
+  {
+    mems_variant_decode_batch(variant, dframe80, dframe7d, 1, data);
+    return;
+  }
+
+  memcpy(&previous, data, sizeof(mems_data));
+  stale_cmd = dframe80 ? MEMS_ReqData7D : MEMS_ReqData80;
+  mems_variant_decode_batch(variant, dframe80 ? dframe80 : &empty80, dframe7d ? dframe7d : &empty7d, 1, data);
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    desc = &mems_channel_table[ch];
+    if (desc->source_cmd == stale_cmd)
+    {
+      memcpy((uint8_t*)data + desc->offset, (const uint8_t*)&previous + desc->offset,
+             mems_value_size(desc->type));
+    }
+  }
+}
+
+/**
+ * Converts a series of raw frame pairs from a MEMS 1.6 ECU directly into
+ * per-channel arrays (one contiguous array per field of mems_data, each of
+ * the channel's storage type), with the same scalings as mems_decode_batch().
+ * @param frames80 Array of n frames received in reply to command 0x80
+ * @param frames7d Array of n frames received in reply to command 0x7D
+ * @param n Number of frame pairs to decode
+ * @param columns Destination array for each channel, indexed by mems_channel
+ */
+void mems_decode_columns(const mems_data_frame_80* frames80, const mems_data_frame_7d* frames7d,
+                         size_t n, void* const columns[MEMS_Num_Channels])
+{
+  int ch = 0;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    memset(columns[ch], 0, n * mems_value_size(mems_channel_table[ch].type));
+  }
+  mems_decode_fields(mems_default_variant, frames80, frames7d, n, columns, 0);
+}
@@ -0,0 +1,205 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// delta.c: This file contains the delta encoder and decoder for raw
+//          frames, which send only the bytes that changed since the
+//          previous pair of frames, with periodic keyframes.
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Packet flag: the packet is a keyframe, holding every byte of both frames
+#define MEMS_DELTA_FLAG_KEYFRAME 0x01
+
+//! Bytes covered by each bit of the group mask
+#define MEMS_DELTA_GROUP_SIZE 8
+
+/**
+ * Copies a pair of frames into one contiguous array of bytes.
+ */
+static void mems_delta_flatten(const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d,
+                               uint8_t* bytes)
+{
+  memcpy(bytes, frame80, sizeof(mems_data_frame_80));
+  memcpy(bytes + sizeof(mems_data_frame_80), frame7d, sizeof(mems_data_frame_7d));
+}
+
+/**
+ * Copies a contiguous array of bytes back into a pair of frames.
+ */
+static void mems_delta_unflatten(const uint8_t* bytes, mems_data_frame_80* frame80, mems_data_frame_7d* frame7d)
+{
+  memcpy(frame80, bytes, sizeof(mems_data_frame_80));
+  memcpy(frame7d, bytes + sizeof(mems_data_frame_80), sizeof(mems_data_frame_7d));
+}
+
+/**
+ * Prepares a delta encoder. The first packet it produces is a keyframe.
+ * @param keyframe_interval Number of packets between keyframes (0 for the default)
+ */
+void mems_delta_encoder_init(mems_delta_encoder* enc, uint32_t keyframe_interval)
+{
+  memset(enc, 0, sizeof(mems_delta_encoder));
+  enc->keyframe_interval = keyframe_interval ? keyframe_interval : MEMS_DELTA_KEYFRAME_INTERVAL;
+  enc->since_keyframe = enc->keyframe_interval;
+}
+
+/**
+ * Makes the next packet produced by the encoder a keyframe (for example,
+ * when a new consumer joins a stream).
+ */
+void mems_delta_force_keyframe(mems_delta_encoder* enc)
+{
+  enc->since_keyframe = enc->keyframe_interval;
+}
+
+/**
+ * Encodes a pair of raw frames relative to the previous pair. A packet is a
+ * flags byte followed by either every byte of both frames (a keyframe) or a
+ * two-level mask of the bytes that changed and then the changed bytes
+ * themselves: one bit per group of eight bytes, then a byte mask for each
+ * group that has changes. A pair that is unchanged encodes to two bytes.
+ * @param out Buffer of at least MEMS_DELTA_MAX_SIZE bytes to receive the packet
+ * @return Number of bytes in the packet
+ */
+size_t mems_delta_encode(mems_delta_encoder* enc, const mems_data_frame_80* frame80,
+                         const mems_data_frame_7d* frame7d, uint8_t* out)
+{
+  uint8_t prev[MEMS_DELTA_FRAME_SIZE];
+  uint8_t cur[MEMS_DELTA_FRAME_SIZE];
+  uint8_t group_mask = 0;
+  uint8_t byte_mask = 0;
+  size_t len = 2;
+  size_t group = 0;
+  size_t idx = 0;
+  size_t end = 0;
+
+  mems_delta_flatten(frame80, frame7d, cur);
+
+  if (enc->since_keyframe >= enc->keyframe_interval)
+  {
+    out[0] = MEMS_DELTA_FLAG_KEYFRAME;
+    memcpy(out + 1, cur, MEMS_DELTA_FRAME_SIZE);
+    len = 1 + MEMS_DELTA_FRAME_SIZE;
+    enc->since_keyframe = 1;
+  }
+  else
+  {
+    mems_delta_flatten(&enc->frame80, &enc->frame7d, prev);
+
+    // masks for every changed group come first, then the changed bytes
+    for (group = 0; group * MEMS_DELTA_GROUP_SIZE < MEMS_DELTA_FRAME_SIZE; group++)
+    {
+      byte_mask = 0;
+      end = (group + 1) * MEMS_DELTA_GROUP_SIZE;
+      end = (end > MEMS_DELTA_FRAME_SIZE) ? MEMS_DELTA_FRAME_SIZE : end;
+      for (idx = group * MEMS_DELTA_GROUP_SIZE; idx < end; idx++)
+      {
+        if (cur[idx] != prev[idx])
+        {
+          byte_mask |= (1 << (idx % MEMS_DELTA_GROUP_SIZE));
+        }
+      }
+
+      if (byte_mask)
+      {
+        group_mask |= (1 << group);
+        out[len++] = byte_mask;
+      }
+    }
+
+    for (idx = 0; idx < MEMS_DELTA_FRAME_SIZE; idx++)
+    {
+      if (cur[idx] != prev[idx])
+      {
+        out[len++] = cur[idx];
+      }
+    }
+
+    out[0] = 0;
+    out[1] = group_mask;
+    enc->since_keyframe++;
+  }
+
+  memcpy(&enc->frame80, frame80, sizeof(mems_data_frame_80));
+  memcpy(&enc->frame7d, frame7d, sizeof(mems_data_frame_7d));
+
+  return len;
+}
+
+/**
+ * Decodes one packet produced by mems_delta_encode(), updating the frames
+ * in place. Unless the packet is a keyframe, the frames must hold the
+ * result of decoding the previous packet in the stream.
+ * @param in Packet data
+ * @param len Number of bytes available at 'in'
+ * @param frame80 Previous 0x80 frame on entry; receives the decoded frame
+ * @param frame7d Previous 0x7D frame on entry; receives the decoded frame
+ * @return Number of bytes consumed, or 0 if the packet is truncated or malformed
+ */
+size_t mems_delta_decode(const uint8_t* in, size_t len,
+                         mems_data_frame_80* frame80, mems_data_frame_7d* frame7d)
+{
+  uint8_t cur[MEMS_DELTA_FRAME_SIZE];
+  uint8_t masks[(MEMS_DELTA_FRAME_SIZE + MEMS_DELTA_GROUP_SIZE - 1) / MEMS_DELTA_GROUP_SIZE];
+  uint8_t group_mask = 0;
+  size_t pos = 2;
+  size_t group = 0;
+  size_t idx = 0;
+
+  if (len < 1)
+  {
+    return 0;
+  }
+
+  if (in[0] & MEMS_DELTA_FLAG_KEYFRAME)
+  {
+    if (len < 1 + MEMS_DELTA_FRAME_SIZE)
+    {
+      return 0;
+    }
+    mems_delta_unflatten(in + 1, frame80, frame7d);
+    return 1 + MEMS_DELTA_FRAME_SIZE;
+  }
+
+  if (len < 2)
+  {
+    return 0;
+  }
+
+  group_mask = in[1];
+  if (group_mask >> sizeof(masks))
+  {
+    return 0;
+  }
+
+  for (group = 0; group < sizeof(masks); group++)
+  {
+    masks[group] = 0;
+    if (group_mask & (1 << group))
+    {
+      if (pos >= len)
+      {
+        return 0;
+      }
+      masks[group] = in[pos++];
+    }
+  }
+
+  mems_delta_flatten(frame80, frame7d, cur);
+  for (idx = 0; idx < MEMS_DELTA_FRAME_SIZE; idx++)
+  {
+    if (masks[idx / MEMS_DELTA_GROUP_SIZE] & (1 << (idx % MEMS_DELTA_GROUP_SIZE)))
+    {
+      if (pos >= len)
+      {
+        return 0;
+      }
+      cur[idx] = in[pos++];
+    }
+  }
+  mems_delta_unflatten(cur, frame80, frame7d);
+
+  return pos;
+}
@@ -0,0 +1,417 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// export.c: This file contains the bulk exporter, which formats
+//           decoded samples as CSV or JSON lines into a reusable
+//           buffer and writes each full buffer with a single call.
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#if defined(WIN32)
+  #include <io.h>
+#else
+  #include <unistd.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Size of the exporter's output buffer
+#define MEMS_EXPORT_BUFFER_SIZE 65536
+
+//! Longest formatted channel key or prefix
+#define MEMS_EXPORT_KEY_MAX 32
+
+//! Room that must be left in the buffer before a row is formatted (the
+//! longest row: every channel with its JSON key, at most 24 characters per value)
+#define MEMS_EXPORT_ROW_MAX (MEMS_Num_Channels * (MEMS_EXPORT_KEY_MAX + 24) + 64)
+
+//! Number of decimal places written for floating-point channels
+#define MEMS_EXPORT_DECIMALS 3
+#define MEMS_EXPORT_SCALE 1000
+
+struct mems_exporter
+{
+  int fd;
+  bool owns_fd;
+  mems_export_format format;
+  bool header_written;
+  //! Channels that are exported, in channel order
+  int channels[MEMS_Num_Channels];
+  int channel_count;
+  //! Text written before each value: a comma (CSV) or the quoted key (JSON)
+  char prefix[MEMS_Num_Channels][MEMS_EXPORT_KEY_MAX];
+  uint8_t prefix_len[MEMS_Num_Channels];
+  size_t len;
+  char buf[MEMS_EXPORT_BUFFER_SIZE];
+};
+
+/**
+ * Creates an exporter that writes to an open file descriptor (which is not
+ * closed by mems_exporter_close()).
+ * @param fd Descriptor to write to (such as 1, for standard output)
+ * @param format Output format
+ * @param channels Mask of MEMS_CHANNEL_BIT() values for the channels to export
+ * @return The exporter, or NULL if it could not be allocated
+ */
+mems_exporter* mems_exporter_create(int fd, mems_export_format format, uint32_t channels)
+{
+  mems_exporter* exp = (mems_exporter*)malloc(sizeof(mems_exporter));
+  int ch = 0;
+  int n = 0;
+
+  if (exp == NULL)
+  {
+    return NULL;
+  }
+
+  exp->fd = fd;
+  exp->owns_fd = false;
+  exp->format = format;
+  exp->header_written = false;
+  exp->channel_count = 0;
+  exp->len = 0;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    if (channels & MEMS_CHANNEL_BIT(ch))
+    {
+      if (format == MEMS_Export_JSONL)
+      {
+        n = snprintf(exp->prefix[exp->channel_count], MEMS_EXPORT_KEY_MAX, ",\"%s\":", mems_channel_table[ch].name);
+      }
+      else
+      {
+        n = snprintf(exp->prefix[exp->channel_count], MEMS_EXPORT_KEY_MAX, ",");
+      }
+      exp->prefix_len[exp->channel_count] = (uint8_t)n;
+      exp->channels[exp->channel_count++] = ch;
+    }
+  }
+
+  return exp;
+}
+
+/**
+ * Creates an exporter that writes to a new file (or standard output, if the
+ * path is "-").
+ * @param path Name of the file to create
+ * @param format Output format
+ * @param channels Mask of MEMS_CHANNEL_BIT() values for the channels to export
+ * @return The exporter, or NULL if the file could not be created
+ */
+mems_exporter* mems_exporter_open(const char* path, mems_export_format format, uint32_t channels)
+{
+  mems_exporter* exp = NULL;
+  int fd = 1;
+
+  if (strcmp(path, "-") != 0)
+  {
+#if defined(WIN32)
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+#else
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0)
+    {
+      dprintf_err("mems_exporter_open(): could not create %s\n", path);
+      return NULL;
+    }
+  }
+
+  exp = mems_exporter_create(fd, format, channels);
+  if (exp == NULL)
+  {
+    if (fd != 1)
+    {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  exp->owns_fd = (fd != 1);
+  return exp;
+}
+
+/**
+ * Writes out everything in the buffer, with as few calls as the descriptor allows.
+ * @return True if all of the buffered text was written
+ */
+bool mems_exporter_flush(mems_exporter* exp)
+{
+  size_t done = 0;
+  int rc = 0;
+
+  while (done < exp->len)
+  {
+    rc = write(exp->fd, exp->buf + done, (unsigned int)(exp->len - done));
+    if (rc <= 0)
+    {
+      dprintf_err("mems_exporter_flush(): write failed\n");
+      return false;
+    }
+    done += rc;
+  }
+
+  exp->len = 0;
+  return true;
+}
+
+/**
+ * Flushes and frees the exporter, closing its file if it opened one.
+ * @return True if all of the output was written
+ */
+bool mems_exporter_close(mems_exporter* exp)
+{
+  bool status = false;
+
+  if (exp == NULL)
+  {
+    return false;
+  }
+
+  status = mems_exporter_flush(exp);
+  if (exp->owns_fd)
+  {
+    status = (close(exp->fd) == 0) && status;
+  }
+  free(exp);
+
+  return status;
+}
+
+/**
+ * Formats an unsigned integer in decimal at the given position.
+ * @return Number of characters written
+ */
+static size_t mems_export_uint(char* out, uint64_t value)
+{
+  char digits[20];
+  size_t count = 0;
+  size_t idx = 0;
+
+  do
+  {
+    digits[count++] = (char)('0' + (value % 10));
+    value /= 10;
+  } while (value > 0);
+
+  for (idx = 0; idx < count; idx++)
+  {
+    out[idx] = digits[count - 1 - idx];
+  }
+
+  return count;
+}
+
+/**
+ * Formats a value in fixed point (with MEMS_EXPORT_DECIMALS places), by
+ * integer arithmetic only.
+ * @return Number of characters written
+ */
+static size_t mems_export_fixed(char* out, double value)
+{
+  uint64_t scaled = 0;
+  uint64_t frac = 0;
+  size_t len = 0;
+  int idx = 0;
+
+  if (value < 0)
+  {
+    out[len++] = '-';
+    value = -value;
+  }
+
+  scaled = (uint64_t)(value * MEMS_EXPORT_SCALE + 0.5);
+  len += mems_export_uint(out + len, scaled / MEMS_EXPORT_SCALE);
+  out[len++] = '.';
+
+  frac = scaled % MEMS_EXPORT_SCALE;
+  for (idx = MEMS_EXPORT_DECIMALS - 1; idx >= 0; idx--)
+  {
+    out[len + idx] = (char)('0' + (frac % 10));
+    frac /= 10;
+  }
+
+  return len + MEMS_EXPORT_DECIMALS;
+}
+
+/**
+ * Writes the CSV header line, the first time that a row is exported.
+ */
+static void mems_export_header(mems_exporter* exp)
+{
+  const char* name = NULL;
+  size_t n = 0;
+  int idx = 0;
+
+  exp->header_written = true;
+  if (exp->format != MEMS_Export_CSV)
+  {
+    return;
+  }
+
+  memcpy(exp->buf + exp->len, "timestamp_us", 12);
+  exp->len += 12;
+  for (idx = 0; idx < exp->channel_count; idx++)
+  {
+    name = mems_channel_table[exp->channels[idx]].name;
+    n = strlen(name);
+    exp->buf[exp->len++] = ',';
+    memcpy(exp->buf + exp->len, name, n);
+    exp->len += n;
+  }
+  exp->buf[exp->len++] = '\n';
+}
+
+/**
+ * Formats one row, given a pointer to each exported channel's raw value,
+ * flushing the buffer first if the row might not fit.
+ * @param values Address of the value of each exported channel, in order
+ */
+static bool mems_export_row(mems_exporter* exp, uint64_t timestamp_us, const void* const* values)
+{
+  char* out = NULL;
+  int idx = 0;
+  int ch = 0;
+
+  if ((MEMS_EXPORT_BUFFER_SIZE - exp->len < MEMS_EXPORT_ROW_MAX) && !mems_exporter_flush(exp))
+  {
+    return false;
+  }
+
+  if (!exp->header_written)
+  {
+    mems_export_header(exp);
+  }
+
+  out = exp->buf + exp->len;
+  if (exp->format == MEMS_Export_JSONL)
+  {
+    memcpy(out, "{\"timestamp_us\":", 16);
+    out += 16;
+  }
+  out += mems_export_uint(out, timestamp_us);
+
+  for (idx = 0; idx < exp->channel_count; idx++)
+  {
+    ch = exp->channels[idx];
+    memcpy(out, exp->prefix[idx], exp->prefix_len[idx]);
+    out += exp->prefix_len[idx];
+
+    switch (mems_channel_table[ch].type)
+    {
+    case MEMS_Type_U8:
+      out += mems_export_uint(out, *(const uint8_t*)values[idx]);
+      break;
+    case MEMS_Type_U16:
+      out += mems_export_uint(out, *(const uint16_t*)values[idx]);
+      break;
+    default:
+      out += mems_export_fixed(out, *(const float*)values[idx]);
+      break;
+    }
+  }
+
+  if (exp->format == MEMS_Export_JSONL)
+  {
+    *out++ = '}';
+  }
+  *out++ = '\n';
+
+  exp->len = out - exp->buf;
+  return true;
+}
+
+/**
+ * Exports a batch of decoded samples, one row (or JSON object) per sample.
+ * Rows are collected in the exporter's buffer, which is written out each
+ * time it fills, and by mems_exporter_flush() or mems_exporter_close().
+ * @param timestamps Time of each sample (from mems_time_us()), or NULL to number the samples from 0
+ * @param data Array of n decoded samples
+ * @param n Number of samples
+ * @return True unless writing the buffer failed
+ */
+bool mems_export_batch(mems_exporter* exp, const uint64_t* timestamps, const mems_data* data, size_t n)
+{
+  const void* values[MEMS_Num_Channels];
+  size_t row = 0;
+  int idx = 0;
+
+  for (row = 0; row < n; row++)
+  {
+    for (idx = 0; idx < exp->channel_count; idx++)
+    {
+      values[idx] = (const uint8_t*)&data[row] + mems_channel_table[exp->channels[idx]].offset;
+    }
+
+    if (!mems_export_row(exp, timestamps ? timestamps[row] : row, values))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Exports one decoded sample.
+ * @param timestamp_us Time of the sample (from mems_time_us())
+ */
+bool mems_export_sample(mems_exporter* exp, uint64_t timestamp_us, const mems_data* data)
+{
+  return mems_export_batch(exp, &timestamp_us, data, 1);
+}
+
+/**
+ * Exports every sample in a columnar store, reading each channel's values
+ * directly from its column arrays. The store holds no timestamps, so the
+ * samples are taken to be evenly spaced (as the rollups of an aggregator are).
+ * @param start_us Timestamp given to the first sample
+ * @param interval_us Time between successive samples
+ * @return True unless writing the buffer failed
+ */
+bool mems_export_column_store(mems_exporter* exp, const mems_column_store* store,
+                              uint64_t start_us, uint64_t interval_us)
+{
+  const uint8_t* columns[MEMS_Num_Channels];
+  const void* values[MEMS_Num_Channels];
+  size_t chunks = mems_column_store_chunk_count(store);
+  size_t chunk_idx = 0;
+  size_t count = 0;
+  size_t pos = 0;
+  uint64_t row = 0;
+  int idx = 0;
+  int ch = 0;
+
+  for (chunk_idx = 0; chunk_idx < chunks; chunk_idx++)
+  {
+    for (idx = 0; idx < exp->channel_count; idx++)
+    {
+      columns[idx] = (const uint8_t*)mems_column_store_chunk(store, (mems_channel)exp->channels[idx],
+                                                             chunk_idx, &count);
+    }
+
+    for (pos = 0; pos < count; pos++, row++)
+    {
+      for (idx = 0; idx < exp->channel_count; idx++)
+      {
+        ch = exp->channels[idx];
+        values[idx] = columns[idx] + (pos * mems_value_size(mems_channel_table[ch].type));
+      }
+
+      if (!mems_export_row(exp, start_us + (row * interval_us), values))
+      {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
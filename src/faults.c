@@ -0,0 +1,259 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// faults.c: This file contains routines that follow the fault bits
+//           (dtc0 and dtc1) of successive 0x80 frames, and report
+//           each fault as it is set or cleared.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Descriptions of the fault bits. Only some of the bits are documented for
+ * the MEMS 1.6; the others are named by their position.
+ */
+static const char* const mems_fault_names[MEMS_NUM_FAULTS] =
+{
+  "Coolant temp sensor circuit (1)",
+  "Inlet air temp sensor circuit (2)",
+  "dtc0 bit 2",
+  "dtc0 bit 3",
+  "dtc0 bit 4",
+  "dtc0 bit 5",
+  "dtc0 bit 6",
+  "dtc0 bit 7",
+  "dtc1 bit 0",
+  "Fuel pump circuit (10)",
+  "dtc1 bit 2",
+  "dtc1 bit 3",
+  "dtc1 bit 4",
+  "dtc1 bit 5",
+  "dtc1 bit 6",
+  "Throttle pot circuit (16)"
+};
+
+/**
+ * Returns the tracker for a connection, allocating it if necessary.
+ */
+static mems_fault_tracker* mems_faults_get(mems_info* info)
+{
+  if (info->faults == NULL)
+  {
+    info->faults = (mems_fault_tracker*)calloc(1, sizeof(mems_fault_tracker));
+  }
+  return info->faults;
+}
+
+/**
+ * Records a change in the state of one fault and passes it to the callback.
+ * @param by_request True if the fault was cleared by mems_clear_faults()
+ */
+static void mems_faults_change(mems_info* info, mems_fault_tracker* tracker, uint8_t fault,
+                               bool active, bool by_request, uint64_t timestamp_us)
+{
+  mems_fault_status* status = &tracker->faults[fault];
+  mems_fault_event event;
+
+  status->active = active;
+  if (active)
+  {
+    status->set_count++;
+    if (status->first_set_us == 0)
+    {
+      status->first_set_us = timestamp_us;
+    }
+    status->last_set_us = timestamp_us;
+    tracker->active |= (1 << fault);
+  }
+  else
+  {
+    status->last_cleared_us = timestamp_us;
+    tracker->active &= ~(1 << fault);
+  }
+
+  if (tracker->callback)
+  {
+    event.timestamp_us = timestamp_us;
+    event.fault = fault;
+    event.active = active;
+    event.by_request = by_request;
+    event.set_count = status->set_count;
+    tracker->callback(info, &event, tracker->user);
+  }
+}
+
+/**
+ * Compares the fault bits of a newly-read 0x80 frame with those of the
+ * previous frame, and records (and reports) any that changed. Faults are
+ * rare, so the usual case is a single comparison. The caller must have
+ * exclusive use of the link (normally by holding the lock).
+ * @param timestamp_us Time (from mems_time_us()) at which the frame was received
+ */
+void mems_faults_update(mems_info* info, const mems_data_frame_80* frame80, uint64_t timestamp_us)
+{
+  mems_fault_tracker* tracker = mems_faults_get(info);
+  uint16_t bits = frame80->dtc0 | (frame80->dtc1 << 8);
+  uint16_t changed = 0;
+  uint8_t fault = 0;
+
+  if (tracker == NULL)
+  {
+    return;
+  }
+
+  // before the first frame, every fault counts as inactive
+  changed = bits ^ tracker->active;
+
+  for (fault = 0; changed != 0; fault++, changed >>= 1)
+  {
+    if (changed & 1)
+    {
+      mems_faults_change(info, tracker, fault, (bits >> fault) & 1, false, timestamp_us);
+    }
+  }
+}
+
+/**
+ * Records that the ECU has acknowledged a request to clear its faults: each
+ * active fault is reported as cleared by request. Any that persist will be
+ * set again by the next frame that is read. The caller must have exclusive
+ * use of the link.
+ */
+void mems_faults_cleared(mems_info* info, uint64_t timestamp_us)
+{
+  mems_fault_tracker* tracker = info->faults;
+  uint16_t active = 0;
+  uint8_t fault = 0;
+
+  if (tracker == NULL)
+  {
+    return;
+  }
+
+  for (active = tracker->active; active != 0; fault++, active >>= 1)
+  {
+    if (active & 1)
+    {
+      mems_faults_change(info, tracker, fault, false, true, timestamp_us);
+    }
+  }
+}
+
+/**
+ * Frees the fault tracker.
+ */
+void mems_faults_free(mems_info* info)
+{
+  free(info->faults);
+  info->faults = NULL;
+}
+
+/**
+ * Sets the function that is told each time a fault is set or cleared
+ * (replacing any previous one). Faults are tracked on every 0x80 frame read
+ * from the ECU, by any means, whether or not a function is set.
+ * @param callback Function to call, or NULL to stop reporting changes
+ * @param user Pointer passed to the callback
+ */
+void mems_set_fault_callback(mems_info* info, mems_fault_callback callback, void* user)
+{
+  mems_fault_tracker* tracker = NULL;
+
+  if (mems_lock(info))
+  {
+    tracker = mems_faults_get(info);
+    if (tracker)
+    {
+      tracker->callback = callback;
+      tracker->user = user;
+    }
+    mems_unlock(info);
+  }
+}
+
+/**
+ * Returns the faults reported in the most recently read 0x80 frame, with
+ * dtc0 in the low byte and dtc1 in the high byte (so that fault number N is
+ * bit N).
+ */
+uint16_t mems_get_active_faults(mems_info* info)
+{
+  uint16_t active = 0;
+
+  if (mems_lock(info))
+  {
+    if (info->faults)
+    {
+      active = info->faults->active;
+    }
+    mems_unlock(info);
+  }
+
+  return active;
+}
+
+/**
+ * Retrieves the history of one fault since mems_init() (or since the last
+ * call to mems_reset_fault_history()).
+ * @param fault Fault number (see MEMS_FAULT_DTC0() and MEMS_FAULT_DTC1())
+ * @param status Receives the history (all zero if the fault has never been set)
+ * @return True if the history was retrieved
+ */
+bool mems_get_fault_status(mems_info* info, uint8_t fault, mems_fault_status* status)
+{
+  bool result = false;
+
+  if (fault >= MEMS_NUM_FAULTS)
+  {
+    return false;
+  }
+
+  if (mems_lock(info))
+  {
+    if (info->faults)
+    {
+      memcpy(status, &info->faults->faults[fault], sizeof(mems_fault_status));
+    }
+    else
+    {
+      memset(status, 0, sizeof(mems_fault_status));
+    }
+    result = true;
+    mems_unlock(info);
+  }
+
+  return result;
+}
+
+/**
+ * Clears the counts and times recorded for every fault. Faults that are
+ * currently active remain so (and are not reported again).
+ */
+void mems_reset_fault_history(mems_info* info)
+{
+  uint8_t fault = 0;
+
+  if (mems_lock(info))
+  {
+    if (info->faults)
+    {
+      for (fault = 0; fault < MEMS_NUM_FAULTS; fault++)
+      {
+        memset(&info->faults->faults[fault], 0, sizeof(mems_fault_status));
+        info->faults->faults[fault].active = (info->faults->active >> fault) & 1;
+      }
+    }
+    mems_unlock(info);
+  }
+}
+
+/**
+ * Returns a description of a fault bit.
+ * @param fault Fault number (see MEMS_FAULT_DTC0() and MEMS_FAULT_DTC1())
+ */
+const char* mems_fault_name(uint8_t fault)
+{
+  return (fault < MEMS_NUM_FAULTS) ? mems_fault_names[fault] : "unknown";
+}
@@ -0,0 +1,1153 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// log.c: This file contains a writer for the compact binary log
+//        format (timestamped raw 0x80/0x7D frames, optionally
+//        delta-encoded, with periodic index blocks) and a reader
+//        that memory-maps a log file and iterates over its frames.
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32)
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Size of the stdio buffer used by the log writer
+#define MEMS_LOG_WRITE_BUFFER 65536
+
+static const char mems_log_magic[8] = { 'R', 'O', 'S', 'C', 'O', 'L', 'O', 'G' };
+
+/**
+ * Fixed header at the start of every log file.
+ */
+typedef struct
+{
+  char magic[8];
+  uint16_t version;
+  uint16_t header_size;
+  //! Always 0x0102 when written; used to detect a file from a machine of the other byte order
+  uint16_t byte_order;
+  uint8_t frame80_size;
+  uint8_t frame7d_size;
+  //! Number of frames between successive index entries
+  uint32_t index_interval;
+  uint32_t flags;
+  //! Wall-clock time (microseconds since the Unix epoch) at which the log was created
+  uint64_t start_wall_us;
+  //! Value of mems_time_us() at which the log was created
+  uint64_t start_mono_us;
+  uint8_t reserved[24];
+} mems_log_file_header;
+
+/**
+ * Header at the start of every record. Records are padded to a multiple of
+ * eight bytes so that this header is always naturally aligned in the map.
+ */
+typedef struct
+{
+  uint16_t type;
+  uint16_t flags;
+  //! Total length of the record, including this header and any padding
+  uint32_t length;
+  uint64_t timestamp_us;
+} mems_log_record_header;
+
+typedef enum
+{
+  MEMS_LOG_Frame   = 1,
+  MEMS_LOG_Index   = 2,
+  MEMS_LOG_Trailer = 3,
+  MEMS_LOG_Block   = 4,
+  MEMS_LOG_Rollup  = 5
+} mems_log_record_type;
+
+/**
+ * A timestamped pair of raw frames.
+ */
+typedef struct
+{
+  mems_log_record_header hdr;
+  mems_data_frame_80 frame80;
+  mems_data_frame_7d frame7d;
+  uint8_t pad[4];
+} mems_log_frame_record;
+
+/**
+ * A block of delta-encoded frames (in logs created with MEMS_LOG_DELTA).
+ * It is followed by 'count' frames, each of which is the difference between
+ * its timestamp and that of the previous frame (as a zigzag varint, and
+ * zero for the first frame), followed by a packet from mems_delta_encode().
+ * The first packet of every block is a keyframe, so that decoding may start
+ * at any block. The header's timestamp is that of the first frame.
+ */
+typedef struct
+{
+  mems_log_record_header hdr;
+  uint32_t count;
+  uint32_t reserved;
+} mems_log_block_record;
+
+/**
+ * Summary of one window of samples (see mems_aggregator). Rollups are not
+ * frames: they are skipped by mems_log_next() and read with
+ * mems_log_next_rollup(). The header's timestamp is the start of the window.
+ * It is followed by the min, max and mean of the window, each of which is
+ * every channel in turn, in the fixed width of its type (little-endian,
+ * with floats as their IEEE 754 bits), padded to a multiple of eight bytes.
+ */
+typedef struct
+{
+  mems_log_record_header hdr;
+  uint32_t window_ms;
+  uint32_t count;
+} mems_log_rollup_record;
+
+//! Largest encoding of the values that follow a rollup record
+#define MEMS_LOG_ROLLUP_VALUES_MAX (3 * MEMS_Num_Channels * sizeof(float))
+
+//! Largest encoding of one frame within a block (ten-byte varint plus a packet)
+#define MEMS_LOG_BLOCK_FRAME_MAX (10 + MEMS_DELTA_MAX_SIZE)
+
+/**
+ * One entry in an index block: the timestamp and file offset of a frame.
+ */
+typedef struct
+{
+  uint64_t timestamp_us;
+  uint64_t offset;
+} mems_log_index_entry;
+
+/**
+ * Index block. It is followed by 'count' index entries, and links to the
+ * previous index block so that a reader can find all of them from the last.
+ */
+typedef struct
+{
+  mems_log_record_header hdr;
+  uint64_t prev_index_offset;
+  uint32_t count;
+  uint32_t reserved;
+} mems_log_index_record;
+
+/**
+ * Final record written when a log is closed cleanly.
+ */
+typedef struct
+{
+  mems_log_record_header hdr;
+  uint64_t last_index_offset;
+  uint64_t frame_count;
+} mems_log_trailer_record;
+
+struct mems_log_writer
+{
+  FILE* fp;
+  uint32_t flags;
+  uint64_t offset;
+  uint64_t frame_count;
+  uint64_t last_index_offset;
+  uint32_t index_interval;
+  uint32_t pending_count;
+  mems_log_index_entry pending[MEMS_LOG_INDEX_ENTRIES];
+  //! Block of delta-encoded frames being collected (MEMS_LOG_DELTA only)
+  mems_delta_encoder encoder;
+  uint8_t* block;
+  uint32_t block_len;
+  uint32_t block_count;
+  uint64_t block_first_us;
+  uint64_t block_last_us;
+};
+
+struct mems_log_reader
+{
+  const uint8_t* map;
+  uint64_t size;
+  uint64_t frame_count;
+  uint64_t data_start;
+  uint64_t data_end;
+  const mems_log_file_header* header;
+  //! Checkpoints (timestamp and offset of every index_interval'th frame), in order
+  mems_log_index_entry* checkpoints;
+  uint64_t checkpoint_count;
+#if defined(WIN32)
+  HANDLE file;
+  HANDLE mapping;
+#endif
+};
+
+static bool mems_log_put(mems_log_writer* log, const void* data, size_t len)
+{
+  if (fwrite(data, 1, len, log->fp) != len)
+  {
+    dprintf_err("mems_log_put(): write failed\n");
+    return false;
+  }
+
+  log->offset += len;
+  return true;
+}
+
+/**
+ * Writes an index block containing the pending index entries.
+ */
+static bool mems_log_write_index(mems_log_writer* log)
+{
+  mems_log_index_record rec;
+  uint64_t offset = log->offset;
+
+  if (log->pending_count == 0)
+  {
+    return true;
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  rec.hdr.type = MEMS_LOG_Index;
+  rec.hdr.length = sizeof(rec) + (log->pending_count * sizeof(mems_log_index_entry));
+  rec.hdr.timestamp_us = log->pending[0].timestamp_us;
+  rec.prev_index_offset = log->last_index_offset;
+  rec.count = log->pending_count;
+
+  if (!mems_log_put(log, &rec, sizeof(rec)) ||
+      !mems_log_put(log, log->pending, log->pending_count * sizeof(mems_log_index_entry)))
+  {
+    return false;
+  }
+
+  log->last_index_offset = offset;
+  log->pending_count = 0;
+
+  return true;
+}
+
+/**
+ * Writes the block of delta-encoded frames that is being collected.
+ */
+static bool mems_log_write_block(mems_log_writer* log)
+{
+  mems_log_block_record rec;
+  uint8_t pad[8];
+  uint32_t padded = 0;
+
+  if (log->block_count == 0)
+  {
+    return true;
+  }
+
+  padded = (sizeof(rec) + log->block_len + 7) & ~7U;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.hdr.type = MEMS_LOG_Block;
+  rec.hdr.length = padded;
+  rec.hdr.timestamp_us = log->block_first_us;
+  rec.count = log->block_count;
+
+  memset(pad, 0, sizeof(pad));
+  if (!mems_log_put(log, &rec, sizeof(rec)) ||
+      !mems_log_put(log, log->block, log->block_len) ||
+      !mems_log_put(log, pad, padded - sizeof(rec) - log->block_len))
+  {
+    return false;
+  }
+
+  log->block_len = 0;
+  log->block_count = 0;
+
+  // emit an index block once enough entries have accumulated
+  if (log->pending_count == MEMS_LOG_INDEX_ENTRIES)
+  {
+    return mems_log_write_index(log);
+  }
+
+  return true;
+}
+
+/**
+ * Adds a frame to the block of delta-encoded frames that is being
+ * collected. Each block starts with a keyframe and is indexed.
+ */
+static bool mems_log_write_delta(mems_log_writer* log, uint64_t timestamp_us,
+                                 const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d)
+{
+  int64_t diff = 0;
+  uint64_t zigzag = 0;
+
+  if (log->block_count == 0)
+  {
+    mems_delta_force_keyframe(&log->encoder);
+    log->block_first_us = timestamp_us;
+    log->block_last_us = timestamp_us;
+
+    // the block will be written at the current offset
+    log->pending[log->pending_count].timestamp_us = timestamp_us;
+    log->pending[log->pending_count].offset = log->offset;
+    log->pending_count++;
+  }
+
+  diff = (int64_t)(timestamp_us - log->block_last_us);
+  zigzag = ((uint64_t)diff << 1) ^ (uint64_t)(diff >> 63);
+  while (zigzag >= 0x80)
+  {
+    log->block[log->block_len++] = (uint8_t)(zigzag | 0x80);
+    zigzag >>= 7;
+  }
+  log->block[log->block_len++] = (uint8_t)zigzag;
+  log->block_last_us = timestamp_us;
+
+  log->block_len += mems_delta_encode(&log->encoder, frame80, frame7d, log->block + log->block_len);
+  log->block_count++;
+  log->frame_count++;
+
+  if (log->block_count == log->index_interval)
+  {
+    return mems_log_write_block(log);
+  }
+
+  return true;
+}
+
+/**
+ * Creates a new binary log file (replacing any existing file of that name)
+ * and writes its header.
+ * @param path Path of the log file
+ * @return Handle to the log writer, or NULL if the file couldn't be created
+ */
+mems_log_writer* mems_log_create(const char* path)
+{
+  return mems_log_create_ex(path, 0);
+}
+
+/**
+ * Creates a new binary log file (replacing any existing file of that name)
+ * and writes its header. With MEMS_LOG_DELTA, each frame is stored as the
+ * difference from the one before, in blocks of MEMS_LOG_INDEX_INTERVAL
+ * frames that each begin with a keyframe; since most bytes of the frames
+ * rarely change, this is several times smaller than storing whole frames.
+ * Such logs can only be read by versions of the library that support them.
+ * @param path Path of the log file
+ * @param flags Zero, or MEMS_LOG_DELTA
+ * @return Handle to the log writer, or NULL if the file couldn't be created
+ */
+mems_log_writer* mems_log_create_ex(const char* path, uint32_t flags)
+{
+  mems_log_writer* log = NULL;
+  mems_log_file_header hdr;
+
+  log = (mems_log_writer*)calloc(1, sizeof(mems_log_writer));
+  if (log == NULL)
+  {
+    return NULL;
+  }
+
+  log->flags = flags;
+  if (flags & MEMS_LOG_DELTA)
+  {
+    log->block = (uint8_t*)malloc(MEMS_LOG_INDEX_INTERVAL * MEMS_LOG_BLOCK_FRAME_MAX);
+    if (log->block == NULL)
+    {
+      free(log);
+      return NULL;
+    }
+    mems_delta_encoder_init(&log->encoder, MEMS_LOG_INDEX_INTERVAL);
+  }
+
+  log->fp = fopen(path, "wb");
+  if (log->fp == NULL)
+  {
+    dprintf_err("mems_log_create(): could not create %s\n", path);
+    free(log->block);
+    free(log);
+    return NULL;
+  }
+  setvbuf(log->fp, NULL, _IOFBF, MEMS_LOG_WRITE_BUFFER);
+
+  log->index_interval = MEMS_LOG_INDEX_INTERVAL;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, mems_log_magic, sizeof(hdr.magic));
+  hdr.version = (flags & MEMS_LOG_DELTA) ? MEMS_LOG_VERSION_DELTA : MEMS_LOG_VERSION;
+  hdr.header_size = sizeof(hdr);
+  hdr.byte_order = 0x0102;
+  hdr.frame80_size = sizeof(mems_data_frame_80);
+  hdr.frame7d_size = sizeof(mems_data_frame_7d);
+  hdr.index_interval = log->index_interval;
+  hdr.flags = flags;
+  hdr.start_wall_us = mems_wall_time_us();
+  hdr.start_mono_us = mems_time_us();
+
+  if (!mems_log_put(log, &hdr, sizeof(hdr)))
+  {
+    fclose(log->fp);
+    free(log->block);
+    free(log);
+    return NULL;
+  }
+
+  return log;
+}
+
+/**
+ * Appends a timestamped pair of raw frames to the log.
+ * @param timestamp_us Time at which the frames were received (from mems_time_us())
+ * @return True if the frames were written
+ */
+bool mems_log_write(mems_log_writer* log, uint64_t timestamp_us,
+                    const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d)
+{
+  mems_log_frame_record rec;
+
+  if (log->flags & MEMS_LOG_DELTA)
+  {
+    return mems_log_write_delta(log, timestamp_us, frame80, frame7d);
+  }
+
+  if ((log->frame_count % log->index_interval) == 0)
+  {
+    log->pending[log->pending_count].timestamp_us = timestamp_us;
+    log->pending[log->pending_count].offset = log->offset;
+    log->pending_count++;
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  rec.hdr.type = MEMS_LOG_Frame;
+  rec.hdr.length = sizeof(rec);
+  rec.hdr.timestamp_us = timestamp_us;
+  memcpy(&rec.frame80, frame80, sizeof(mems_data_frame_80));
+  memcpy(&rec.frame7d, frame7d, sizeof(mems_data_frame_7d));
+
+  if (!mems_log_put(log, &rec, sizeof(rec)))
+  {
+    return false;
+  }
+  log->frame_count++;
+
+  // emit an index block once enough entries have accumulated
+  if (log->pending_count == MEMS_LOG_INDEX_ENTRIES)
+  {
+    return mems_log_write_index(log);
+  }
+
+  return true;
+}
+
+/**
+ * Appends a sample's raw frames to the log, using the sample's timestamp.
+ */
+bool mems_log_write_sample(mems_log_writer* log, const mems_sample* sample)
+{
+  return mems_log_write(log, sample->timestamp_us, &sample->frame80, &sample->frame7d);
+}
+
+/**
+ * Appends every channel of a sample to a buffer, each in the fixed width
+ * of its type.
+ * @return Number of bytes written
+ */
+static size_t mems_log_put_values(uint8_t* out, const mems_data* data)
+{
+  const uint8_t* field = NULL;
+  uint32_t value = 0;
+  size_t len = 0;
+  size_t width = 0;
+  size_t idx = 0;
+  int ch = 0;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    field = (const uint8_t*)data + mems_channel_table[ch].offset;
+    width = mems_value_size(mems_channel_table[ch].type);
+
+    switch (mems_channel_table[ch].type)
+    {
+    case MEMS_Type_U8:
+      value = *field;
+      break;
+    case MEMS_Type_U16:
+      value = *(const uint16_t*)field;
+      break;
+    default:
+      memcpy(&value, field, sizeof(float));
+      break;
+    }
+
+    for (idx = 0; idx < width; idx++)
+    {
+      out[len++] = (uint8_t)(value >> (8 * idx));
+    }
+  }
+
+  return len;
+}
+
+/**
+ * Reads every channel of a sample from a buffer written by
+ * mems_log_put_values().
+ * @return Number of bytes read
+ */
+static size_t mems_log_get_values(const uint8_t* in, mems_data* data)
+{
+  uint8_t* field = NULL;
+  uint32_t value = 0;
+  size_t len = 0;
+  size_t width = 0;
+  size_t idx = 0;
+  int ch = 0;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    field = (uint8_t*)data + mems_channel_table[ch].offset;
+    width = mems_value_size(mems_channel_table[ch].type);
+
+    value = 0;
+    for (idx = 0; idx < width; idx++)
+    {
+      value |= (uint32_t)in[len++] << (8 * idx);
+    }
+
+    switch (mems_channel_table[ch].type)
+    {
+    case MEMS_Type_U8:
+      *field = (uint8_t)value;
+      break;
+    case MEMS_Type_U16:
+      *(uint16_t*)field = (uint16_t)value;
+      break;
+    default:
+      memcpy(field, &value, sizeof(float));
+      break;
+    }
+  }
+
+  return len;
+}
+
+/**
+ * Returns the length of the values that follow a rollup record.
+ */
+static size_t mems_log_rollup_values_size()
+{
+  size_t len = 0;
+  int ch = 0;
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    len += mems_value_size(mems_channel_table[ch].type);
+  }
+
+  return 3 * len;
+}
+
+/**
+ * Appends the summary of one window of samples to the log. In a
+ * delta-encoded log, this ends the current block first, so that the
+ * block's index entry still points at the block itself.
+ * @return True if the rollup was written
+ */
+bool mems_log_write_rollup(mems_log_writer* log, const mems_rollup* rollup)
+{
+  uint8_t buf[sizeof(mems_log_rollup_record) + MEMS_LOG_ROLLUP_VALUES_MAX + 8];
+  mems_log_rollup_record* rec = (mems_log_rollup_record*)buf;
+  size_t len = sizeof(mems_log_rollup_record);
+
+  if (!mems_log_write_block(log))
+  {
+    return false;
+  }
+
+  memset(buf, 0, sizeof(buf));
+  len += mems_log_put_values(buf + len, &rollup->min);
+  len += mems_log_put_values(buf + len, &rollup->max);
+  len += mems_log_put_values(buf + len, &rollup->mean);
+  len = (len + 7) & ~(size_t)7;
+
+  rec->hdr.type = MEMS_LOG_Rollup;
+  rec->hdr.length = (uint32_t)len;
+  rec->hdr.timestamp_us = rollup->start_us;
+  rec->window_ms = rollup->window_ms;
+  rec->count = rollup->count;
+
+  return mems_log_put(log, buf, len);
+}
+
+/**
+ * Flushes buffered frames to the file. In a delta-encoded log, this ends
+ * the current block early.
+ */
+bool mems_log_flush(mems_log_writer* log)
+{
+  return mems_log_write_block(log) && (fflush(log->fp) == 0);
+}
+
+/**
+ * Writes the final index block and trailer, closes the file, and frees the writer.
+ * @return True if the log was completed and closed successfully
+ */
+bool mems_log_close(mems_log_writer* log)
+{
+  mems_log_trailer_record trailer;
+  bool status = false;
+
+  if (log == NULL)
+  {
+    return false;
+  }
+
+  if (mems_log_write_block(log) && mems_log_write_index(log))
+  {
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.hdr.type = MEMS_LOG_Trailer;
+    trailer.hdr.length = sizeof(trailer);
+    trailer.last_index_offset = log->last_index_offset;
+    trailer.frame_count = log->frame_count;
+    status = mems_log_put(log, &trailer, sizeof(trailer));
+  }
+
+  status = (fclose(log->fp) == 0) && status;
+  free(log->block);
+  free(log);
+
+  return status;
+}
+
+/**
+ * Returns the record header at the given offset, or NULL if there is no
+ * complete record there.
+ */
+static const mems_log_record_header* mems_log_record_at(const mems_log_reader* log, uint64_t offset)
+{
+  const mems_log_record_header* hdr = NULL;
+
+  if ((offset < log->data_start) || (offset + sizeof(mems_log_record_header) > log->data_end))
+  {
+    return NULL;
+  }
+
+  hdr = (const mems_log_record_header*)(log->map + offset);
+  if ((hdr->length < sizeof(mems_log_record_header)) || (hdr->length % 8 != 0) ||
+      (offset + hdr->length > log->data_end))
+  {
+    return NULL;
+  }
+
+  return hdr;
+}
+
+/**
+ * Returns a pointer to the index block at the given offset, or NULL if
+ * there is no well-formed index block there: one whose entries fit within
+ * its record, and which links only to an earlier block.
+ */
+static const mems_log_index_record* mems_log_index_at(const mems_log_reader* log, uint64_t offset)
+{
+  const mems_log_record_header* hdr = mems_log_record_at(log, offset);
+  const mems_log_index_record* idx = NULL;
+
+  if ((hdr == NULL) || (hdr->type != MEMS_LOG_Index) || (hdr->length < sizeof(mems_log_index_record)))
+  {
+    return NULL;
+  }
+
+  idx = (const mems_log_index_record*)hdr;
+  if ((sizeof(mems_log_index_record) + ((uint64_t)idx->count * sizeof(mems_log_index_entry)) > hdr->length) ||
+      (idx->prev_index_offset >= offset))
+  {
+    return NULL;
+  }
+
+  return idx;
+}
+
+/**
+ * Loads the checkpoint list from the chain of index blocks, starting with
+ * the one referenced by the trailer.
+ */
+static bool mems_log_load_index(mems_log_reader* log, uint64_t last_index_offset)
+{
+  const mems_log_index_record* idx = NULL;
+  uint64_t offset = last_index_offset;
+  uint64_t total = 0;
+  uint64_t pos = 0;
+
+  // first pass counts the entries, second pass fills them in back to front
+  while (offset != 0)
+  {
+    idx = mems_log_index_at(log, offset);
+    if (idx == NULL)
+    {
+      return false;
+    }
+    total += idx->count;
+    offset = idx->prev_index_offset;
+  }
+
+  log->checkpoints = (mems_log_index_entry*)malloc((total ? total : 1) * sizeof(mems_log_index_entry));
+  if (log->checkpoints == NULL)
+  {
+    return false;
+  }
+  log->checkpoint_count = total;
+
+  pos = total;
+  offset = last_index_offset;
+  while (offset != 0)
+  {
+    // the chain was checked by the first pass
+    idx = mems_log_index_at(log, offset);
+    pos -= idx->count;
+    memcpy(&log->checkpoints[pos], (const uint8_t*)idx + sizeof(mems_log_index_record),
+           idx->count * sizeof(mems_log_index_entry));
+    offset = idx->prev_index_offset;
+  }
+
+  return true;
+}
+
+/**
+ * Rebuilds the checkpoint list by walking the record headers. Used when the
+ * log was not closed cleanly (so has no trailer).
+ */
+static bool mems_log_scan_index(mems_log_reader* log)
+{
+  const mems_log_record_header* hdr = NULL;
+  uint64_t offset = log->data_start;
+  uint64_t capacity = 64;
+  mems_log_index_entry* grown = NULL;
+
+  log->frame_count = 0;
+  log->checkpoint_count = 0;
+  log->checkpoints = (mems_log_index_entry*)malloc(capacity * sizeof(mems_log_index_entry));
+  if (log->checkpoints == NULL)
+  {
+    return false;
+  }
+
+  while ((hdr = mems_log_record_at(log, offset)) != NULL)
+  {
+    if (hdr->type == MEMS_LOG_Frame)
+    {
+      if ((log->frame_count % log->header->index_interval) == 0)
+      {
+        if (log->checkpoint_count == capacity)
+        {
+          capacity *= 2;
+          grown = (mems_log_index_entry*)realloc(log->checkpoints, capacity * sizeof(mems_log_index_entry));
+          if (grown == NULL)
+          {
+            return false;
+          }
+          log->checkpoints = grown;
+        }
+        log->checkpoints[log->checkpoint_count].timestamp_us = hdr->timestamp_us;
+        log->checkpoints[log->checkpoint_count].offset = offset;
+        log->checkpoint_count++;
+      }
+      log->frame_count++;
+    }
+    else if ((hdr->type == MEMS_LOG_Block) && (hdr->length >= sizeof(mems_log_block_record)))
+    {
+      // every block starts with a keyframe, so each one is a checkpoint
+      if (log->checkpoint_count == capacity)
+      {
+        capacity *= 2;
+        grown = (mems_log_index_entry*)realloc(log->checkpoints, capacity * sizeof(mems_log_index_entry));
+        if (grown == NULL)
+        {
+          return false;
+        }
+        log->checkpoints = grown;
+      }
+      log->checkpoints[log->checkpoint_count].timestamp_us = hdr->timestamp_us;
+      log->checkpoints[log->checkpoint_count].offset = offset;
+      log->checkpoint_count++;
+      log->frame_count += ((const mems_log_block_record*)hdr)->count;
+    }
+    offset += hdr->length;
+  }
+
+  // ignore any partially-written record at the end
+  log->data_end = offset;
+
+  return true;
+}
+
+/**
+ * Maps the whole file into memory.
+ */
+static bool mems_log_map(mems_log_reader* log, const char* path)
+{
+#if defined(WIN32)
+  LARGE_INTEGER size;
+
+  log->file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (log->file == INVALID_HANDLE_VALUE)
+  {
+    return false;
+  }
+
+  if ((GetFileSizeEx(log->file, &size) != TRUE) || (size.QuadPart == 0))
+  {
+    CloseHandle(log->file);
+    return false;
+  }
+  log->size = size.QuadPart;
+
+  log->mapping = CreateFileMapping(log->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (log->mapping != NULL)
+  {
+    log->map = (const uint8_t*)MapViewOfFile(log->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (log->map == NULL)
+    {
+      CloseHandle(log->mapping);
+    }
+  }
+  if (log->map == NULL)
+  {
+    CloseHandle(log->file);
+    return false;
+  }
+#else
+  struct stat st;
+  void* map = NULL;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  if ((fstat(fd, &st) != 0) || (st.st_size == 0))
+  {
+    close(fd);
+    return false;
+  }
+  log->size = st.st_size;
+
+  map = mmap(NULL, log->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return false;
+  }
+  log->map = (const uint8_t*)map;
+#endif
+
+  return true;
+}
+
+static void mems_log_unmap(mems_log_reader* log)
+{
+#if defined(WIN32)
+  UnmapViewOfFile(log->map);
+  CloseHandle(log->mapping);
+  CloseHandle(log->file);
+#else
+  munmap((void*)log->map, log->size);
+#endif
+}
+
+/**
+ * Opens a binary log file for reading by mapping it into memory. The frame
+ * index is loaded from the index blocks (or rebuilt from the record headers
+ * if the log was not closed cleanly), so opening does not depend on the
+ * length of the log.
+ * @param path Path of the log file
+ * @return Handle to the log reader, or NULL if the file couldn't be opened
+ *   or is not a valid log
+ */
+mems_log_reader* mems_log_open(const char* path)
+{
+  mems_log_reader* log = NULL;
+  const mems_log_trailer_record* trailer = NULL;
+  bool indexed = false;
+
+  log = (mems_log_reader*)calloc(1, sizeof(mems_log_reader));
+  if (log == NULL)
+  {
+    return NULL;
+  }
+
+  if (!mems_log_map(log, path))
+  {
+    dprintf_err("mems_log_open(): could not map %s\n", path);
+    free(log);
+    return NULL;
+  }
+
+  log->header = (const mems_log_file_header*)log->map;
+  if ((log->size < sizeof(mems_log_file_header)) ||
+      (memcmp(log->header->magic, mems_log_magic, sizeof(mems_log_magic)) != 0) ||
+      (log->header->byte_order != 0x0102) ||
+      ((log->header->version != MEMS_LOG_VERSION) && (log->header->version != MEMS_LOG_VERSION_DELTA)) ||
+      (log->header->frame80_size != sizeof(mems_data_frame_80)) ||
+      (log->header->frame7d_size != sizeof(mems_data_frame_7d)) ||
+      (log->header->index_interval == 0))
+  {
+    dprintf_err("mems_log_open(): %s is not a compatible log file\n", path);
+    mems_log_unmap(log);
+    free(log);
+    return NULL;
+  }
+
+  log->data_start = log->header->header_size;
+  log->data_end = log->size;
+
+  if (log->size >= log->data_start + sizeof(mems_log_trailer_record))
+  {
+    trailer = (const mems_log_trailer_record*)(log->map + log->size - sizeof(mems_log_trailer_record));
+    if ((trailer->hdr.type == MEMS_LOG_Trailer) &&
+        (trailer->hdr.length == sizeof(mems_log_trailer_record)))
+    {
+      log->data_end = log->size - sizeof(mems_log_trailer_record);
+      log->frame_count = trailer->frame_count;
+      indexed = mems_log_load_index(log, trailer->last_index_offset);
+    }
+  }
+
+  if (!indexed)
+  {
+    free(log->checkpoints);
+    log->checkpoints = NULL;
+    log->data_end = log->size;
+    if (!mems_log_scan_index(log))
+    {
+      mems_log_reader_close(log);
+      return NULL;
+    }
+  }
+
+  return log;
+}
+
+/**
+ * Unmaps the log file and frees the reader. Frame pointers obtained from
+ * the reader become invalid.
+ */
+void mems_log_reader_close(mems_log_reader* log)
+{
+  if (log)
+  {
+    mems_log_unmap(log);
+    free(log->checkpoints);
+    free(log);
+  }
+}
+
+/**
+ * Returns the number of frames in the log.
+ */
+uint64_t mems_log_frame_count(const mems_log_reader* log)
+{
+  return log->frame_count;
+}
+
+/**
+ * Returns the wall-clock time (microseconds since the Unix epoch) at which
+ * the log was created, and the mems_time_us() value at that moment, so that
+ * frame timestamps may be converted to wall-clock time.
+ */
+void mems_log_start_time(const mems_log_reader* log, uint64_t* wall_us, uint64_t* mono_us)
+{
+  if (wall_us)
+  {
+    *wall_us = log->header->start_wall_us;
+  }
+  if (mono_us)
+  {
+    *mono_us = log->header->start_mono_us;
+  }
+}
+
+/**
+ * Positions a cursor before the first frame of the log.
+ */
+void mems_log_rewind(const mems_log_reader* log, mems_log_cursor* cursor)
+{
+  cursor->offset = log->data_start;
+  cursor->block_remaining = 0;
+}
+
+/**
+ * Decodes the next frame of the delta-encoded block the cursor is in.
+ * @return True if a frame was decoded; false if the block is malformed
+ */
+static bool mems_log_next_in_block(const mems_log_reader* log, mems_log_cursor* cursor, mems_log_frame* frame)
+{
+  uint64_t zigzag = 0;
+  size_t used = 0;
+  int shift = 0;
+
+  do
+  {
+    if ((cursor->block_pos >= cursor->block_end) || (shift > 63))
+    {
+      cursor->block_remaining = 0;
+      return false;
+    }
+    zigzag |= (uint64_t)(log->map[cursor->block_pos] & 0x7F) << shift;
+    shift += 7;
+  } while (log->map[cursor->block_pos++] & 0x80);
+
+  used = mems_delta_decode(log->map + cursor->block_pos, cursor->block_end - cursor->block_pos,
+                           &cursor->frame80, &cursor->frame7d);
+  if (used == 0)
+  {
+    cursor->block_remaining = 0;
+    return false;
+  }
+
+  cursor->block_pos += used;
+  cursor->block_remaining--;
+  cursor->timestamp_us += (uint64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+
+  frame->timestamp_us = cursor->timestamp_us;
+  frame->frame80 = &cursor->frame80;
+  frame->frame7d = &cursor->frame7d;
+  return true;
+}
+
+/**
+ * Retrieves the frame at the cursor and advances the cursor past it. The
+ * frame pointers refer directly to the mapped file and remain valid until
+ * the reader is closed, except in delta-encoded logs, where they refer to
+ * the frames reconstructed in the cursor.
+ * @param cursor Cursor positioned by mems_log_rewind() or mems_log_seek()
+ * @param frame Receives the frame's timestamp and pointers to its raw frames
+ * @return True if a frame was retrieved; false at the end of the log
+ */
+bool mems_log_next(const mems_log_reader* log, mems_log_cursor* cursor, mems_log_frame* frame)
+{
+  const mems_log_record_header* hdr = NULL;
+  const mems_log_frame_record* rec = NULL;
+
+  if ((cursor->block_remaining > 0) && mems_log_next_in_block(log, cursor, frame))
+  {
+    return true;
+  }
+
+  while ((hdr = mems_log_record_at(log, cursor->offset)) != NULL)
+  {
+    cursor->offset += hdr->length;
+
+    if ((hdr->type == MEMS_LOG_Block) && (hdr->length >= sizeof(mems_log_block_record)))
+    {
+      cursor->block_pos = (uint64_t)((const uint8_t*)hdr - log->map) + sizeof(mems_log_block_record);
+      cursor->block_end = cursor->offset;
+      cursor->block_remaining = ((const mems_log_block_record*)hdr)->count;
+      cursor->timestamp_us = hdr->timestamp_us;
+      if ((cursor->block_remaining > 0) && mems_log_next_in_block(log, cursor, frame))
+      {
+        return true;
+      }
+      continue;
+    }
+
+    if (hdr->type == MEMS_LOG_Frame)
+    {
+      rec = (const mems_log_frame_record*)hdr;
+      frame->timestamp_us = hdr->timestamp_us;
+      frame->frame80 = &rec->frame80;
+      frame->frame7d = &rec->frame7d;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Retrieves the next window summary (written by mems_log_write_rollup())
+ * after the cursor, skipping any frames, and advances the cursor past it.
+ * A cursor that is used for rollups should not also be used for frames.
+ * @param cursor Cursor positioned by mems_log_rewind() or mems_log_seek()
+ * @param rollup Receives a copy of the rollup
+ * @return True if a rollup was retrieved; false at the end of the log
+ */
+bool mems_log_next_rollup(const mems_log_reader* log, mems_log_cursor* cursor, mems_rollup* rollup)
+{
+  const mems_log_record_header* hdr = NULL;
+  const mems_log_rollup_record* rec = NULL;
+  const uint8_t* values = NULL;
+
+  cursor->block_remaining = 0;
+  while ((hdr = mems_log_record_at(log, cursor->offset)) != NULL)
+  {
+    cursor->offset += hdr->length;
+
+    if ((hdr->type == MEMS_LOG_Rollup) &&
+        (hdr->length >= sizeof(mems_log_rollup_record) + mems_log_rollup_values_size()))
+    {
+      rec = (const mems_log_rollup_record*)hdr;
+      values = (const uint8_t*)(rec + 1);
+
+      memset(rollup, 0, sizeof(mems_rollup));
+      rollup->start_us = hdr->timestamp_us;
+      rollup->window_ms = rec->window_ms;
+      rollup->count = rec->count;
+      values += mems_log_get_values(values, &rollup->min);
+      values += mems_log_get_values(values, &rollup->max);
+      mems_log_get_values(values, &rollup->mean);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Positions a cursor at the first frame whose timestamp is no earlier than
+ * the one given. The index is binary-searched, so only the frames between
+ * two index checkpoints need to be examined.
+ * @param timestamp_us Timestamp to seek to (on the same clock as the frames)
+ * @param cursor Cursor to position
+ * @return True if such a frame exists; false if every frame is earlier
+ */
+bool mems_log_seek(const mems_log_reader* log, uint64_t timestamp_us, mems_log_cursor* cursor)
+{
+  uint64_t lo = 0;
+  uint64_t hi = log->checkpoint_count;
+  uint64_t mid = 0;
+  mems_log_cursor probe;
+  mems_log_frame frame;
+
+  // find the last checkpoint that is no later than the requested time
+  while (hi - lo > 1)
+  {
+    mid = lo + ((hi - lo) / 2);
+    if (log->checkpoints[mid].timestamp_us <= timestamp_us)
+    {
+      lo = mid;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  cursor->offset = (log->checkpoint_count > 0) ? log->checkpoints[lo].offset : log->data_start;
+  cursor->block_remaining = 0;
+
+  probe = *cursor;
+  while (mems_log_next(log, &probe, &frame))
+  {
+    if (frame.timestamp_us >= timestamp_us)
+    {
+      return true;
+    }
+    *cursor = probe;
+  }
+
+  return false;
+}
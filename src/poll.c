@@ -0,0 +1,843 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// poll.c: This file contains the background polling thread, which
+//         owns the serial link while it runs, reads data frames
+//         continuously, and delivers decoded data to subscribers.
+//         Commands issued from other threads are queued to it.
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32)
+  #include <windows.h>
+#else
+  #include <pthread.h>
+  #include <time.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+static void mems_poller_lock(mems_poller* poller)
+{
+#if defined(WIN32)
+  EnterCriticalSection(&poller->lock);
+#else
+  pthread_mutex_lock(&poller->lock);
+#endif
+}
+
+static void mems_poller_unlock(mems_poller* poller)
+{
+#if defined(WIN32)
+  LeaveCriticalSection(&poller->lock);
+#else
+  pthread_mutex_unlock(&poller->lock);
+#endif
+}
+
+static void mems_poller_signal(mems_poller* poller)
+{
+#if defined(WIN32)
+  WakeAllConditionVariable(&poller->cond);
+#else
+  pthread_cond_broadcast(&poller->cond);
+#endif
+}
+
+/**
+ * Waits on the poller's condition variable (with the poller lock held) for
+ * at most the given number of microseconds. A timeout of zero means that
+ * the wait may only be ended by a signal.
+ */
+static void mems_poller_wait(mems_poller* poller, uint64_t timeout_us)
+{
+#if defined(WIN32)
+  SleepConditionVariableCS(&poller->cond, &poller->lock,
+                           (timeout_us == 0) ? INFINITE : (DWORD)((timeout_us + 999) / 1000));
+#else
+  struct timespec ts;
+
+  if (timeout_us == 0)
+  {
+    pthread_cond_wait(&poller->cond, &poller->lock);
+  }
+  else
+  {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_us / 1000000;
+    ts.tv_nsec += (timeout_us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec += 1;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&poller->cond, &poller->lock, &ts);
+  }
+#endif
+}
+
+/**
+ * Returns true if the calling thread is the polling thread for this connection.
+ */
+static bool mems_poller_is_current_thread(mems_poller* poller)
+{
+#if defined(WIN32)
+  return (GetCurrentThreadId() == poller->thread_id);
+#else
+  return pthread_equal(pthread_self(), poller->thread);
+#endif
+}
+
+/**
+ * Runs every request in the queue on the polling thread, signalling
+ * completion to each waiting submitter.
+ */
+static void mems_poller_run_requests(mems_info* info, mems_poller* poller)
+{
+  mems_request* req = NULL;
+
+  mems_poller_lock(poller);
+  while (poller->queue_head != NULL)
+  {
+    req = poller->queue_head;
+    poller->queue_head = req->next;
+    if (poller->queue_head == NULL)
+    {
+      poller->queue_tail = NULL;
+    }
+    mems_poller_unlock(poller);
+
+    req->status = mems_run_command(info, req->cmd, req->priority, &req->response);
+
+    mems_poller_lock(poller);
+    req->done = true;
+    mems_poller_signal(poller);
+  }
+  mems_poller_unlock(poller);
+}
+
+/**
+ * Evaluates the attached alarm rules against a freshly-read sample, and
+ * then delivers it to every registered subscriber. The subscriber list is
+ * copied first so that callbacks may themselves subscribe or unsubscribe;
+ * mems_unsubscribe() waits for a delivery from the copy to finish.
+ */
+static void mems_poller_publish(mems_info* info, mems_poller* poller, const mems_sample* sample)
+{
+  mems_subscriber subs[MEMS_MAX_SUBSCRIBERS];
+  mems_alarm_table* alarms = NULL;
+  const mems_data* data = &sample->data;
+  int idx = 0;
+
+  mems_poller_lock(poller);
+  memcpy(subs, poller->subscribers, sizeof(subs));
+  alarms = poller->alarms;
+  poller->evaluating = (alarms != NULL);
+  poller->delivering = true;
+  mems_poller_unlock(poller);
+
+  if (poller->shm)
+  {
+    mems_shm_update(poller->shm, info);
+  }
+
+  // alarms are evaluated first, so that they fire within the same sample
+  if (alarms)
+  {
+    mems_alarm_evaluate(alarms, info, data, sample->timestamp_us);
+
+    mems_poller_lock(poller);
+    poller->evaluating = false;
+    mems_poller_signal(poller);
+    mems_poller_unlock(poller);
+  }
+
+  for (idx = 0; idx < MEMS_MAX_SUBSCRIBERS; idx++)
+  {
+    if (subs[idx].callback)
+    {
+      subs[idx].callback(info, data, subs[idx].user);
+    }
+  }
+
+  mems_poller_lock(poller);
+  poller->delivering = false;
+  poller->deliveries++;
+  mems_poller_signal(poller);
+  mems_poller_unlock(poller);
+}
+
+/**
+ * Main loop of the polling thread.
+ */
+#if defined(WIN32)
+static DWORD WINAPI mems_poller_main(LPVOID arg)
+#else
+static void* mems_poller_main(void* arg)
+#endif
+{
+  mems_info* info = (mems_info*)arg;
+  mems_poller* poller = info->poller;
+  mems_sample empty;
+  mems_sample* previous = &empty;
+  mems_sample* sample = NULL;
+  mems_request* req = NULL;
+  uint64_t cycle_start = 0;
+  uint64_t elapsed = 0;
+  uint64_t interval_us = 0;
+  uint32_t fast_channels = 0;
+  uint32_t slow_interval = 0;
+  uint32_t cycle = 0;
+  bool primed = false;
+  bool slow = false;
+  bool read80 = false;
+  bool read7d = false;
+  bool adapt_pending = false;
+  bool adapt_enable = false;
+  mems_adaptive_options adapt_options;
+
+  memset(&empty, 0, sizeof(empty));
+
+  while (MEMS_ATOMIC_LOAD(&poller->running))
+  {
+    cycle_start = mems_time_us();
+
+    // queued commands take their turn before the next data read
+    mems_poller_run_requests(info, poller);
+
+    mems_poller_lock(poller);
+    fast_channels = poller->fast_channels;
+    slow_interval = poller->slow_interval;
+    adapt_pending = poller->adapt_pending;
+    adapt_enable = poller->adapt_enable;
+    adapt_options = poller->adapt_options;
+    poller->adapt_pending = false;
+    mems_poller_unlock(poller);
+
+    // the controller takes the link to change the reply margin, so it is
+    // reconfigured without the poller's lock held
+    if (adapt_pending)
+    {
+      mems_adapt_configure(info, &poller->adaptive, adapt_enable ? &adapt_options : NULL, poller->interval_ms);
+      mems_poller_lock(poller);
+      poller->adapt_snapshot = poller->adaptive.state;
+      mems_poller_unlock(poller);
+    }
+
+    // frames that aren't re-read on this cycle keep their previous contents
+    slow = !primed || ((slow_interval > 0) && ((cycle % slow_interval) == 0));
+    read80 = slow || (fast_channels & mems_frame_channels(MEMS_ReqData80));
+    read7d = slow || (fast_channels & mems_frame_channels(MEMS_ReqData7D));
+
+    // the frames are read straight into the ring's next slot; whatever is
+    // not re-read on this cycle is carried over from the previous sample.
+    // This relies on the ring holding at least MEMS_RING_MIN_CAPACITY (2)
+    // slots: the reserved slot is then never the one 'previous' points to,
+    // and readers always have a complete sample to read while it is written
+    // (or after it is cancelled)
+    sample = mems_ring_reserve(poller->ring);
+    memcpy(&sample->data, &previous->data, sizeof(mems_data));
+    if (!read80)
+    {
+      memcpy(&sample->frame80, &previous->frame80, sizeof(mems_data_frame_80));
+    }
+    if (!read7d)
+    {
+      memcpy(&sample->frame7d, &previous->frame7d, sizeof(mems_data_frame_7d));
+    }
+
+    if (mems_read_raw(info, read80 ? &sample->frame80 : NULL, read7d ? &sample->frame7d : NULL))
+    {
+      sample->timestamp_us = mems_time_us();
+      memcpy(&sample->times, &info->frame_times, sizeof(mems_sample_times));
+      mems_decode_frames(info->variant, read80 ? &sample->frame80 : NULL,
+                         read7d ? &sample->frame7d : NULL, &sample->data);
+      primed = primed || (read80 && read7d);
+      cycle++;
+      mems_ring_commit(poller->ring);
+      previous = sample;
+      mems_poller_publish(info, poller, sample);
+    }
+    else
+    {
+      mems_ring_cancel(poller->ring);
+    }
+
+    if (poller->adaptive.state.enabled)
+    {
+      mems_adapt_cycle(info, &poller->adaptive);
+    }
+
+    mems_poller_lock(poller);
+    if (poller->adaptive.state.enabled)
+    {
+      poller->adapt_snapshot = poller->adaptive.state;
+      interval_us = (uint64_t)poller->adaptive.state.interval_ms * 1000;
+    }
+    else
+    {
+      interval_us = (uint64_t)poller->interval_ms * 1000;
+    }
+    elapsed = mems_time_us() - cycle_start;
+    if (MEMS_ATOMIC_LOAD(&poller->running) && (poller->queue_head == NULL) && (elapsed < interval_us))
+    {
+      mems_poller_wait(poller, interval_us - elapsed);
+    }
+    mems_poller_unlock(poller);
+  }
+
+  // the reply margin chosen by the controller doesn't outlive polling
+  mems_adapt_configure(info, &poller->adaptive, NULL, 0);
+
+  // commands queued after the last cycle are failed
+  mems_poller_lock(poller);
+  poller->adapt_snapshot = poller->adaptive.state;
+  while (poller->queue_head != NULL)
+  {
+    req = poller->queue_head;
+    poller->queue_head = req->next;
+    req->status = false;
+    req->done = true;
+  }
+  poller->queue_tail = NULL;
+  mems_poller_signal(poller);
+  mems_poller_unlock(poller);
+
+#if defined(WIN32)
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+/**
+ * Waits for a stopped polling thread to exit, and releases it. This must
+ * not be called by the polling thread itself.
+ */
+static void mems_poller_join(mems_poller* poller)
+{
+#if defined(WIN32)
+  WaitForSingleObject(poller->thread, INFINITE);
+  CloseHandle(poller->thread);
+  poller->thread = NULL;
+#else
+  pthread_join(poller->thread, NULL);
+#endif
+  poller->started = false;
+}
+
+/**
+ * Allocates the polling state for a connection, if it hasn't been already.
+ */
+static mems_poller* mems_poller_get(mems_info* info)
+{
+  if (info->poller == NULL)
+  {
+    info->poller = (mems_poller*)calloc(1, sizeof(mems_poller));
+    if (info->poller != NULL)
+    {
+      info->poller->fast_channels = MEMS_ALL_CHANNELS;
+      info->poller->slow_interval = 1;
+      info->poller->ring = mems_ring_create(MEMS_DEFAULT_RING_CAPACITY);
+      if (info->poller->ring == NULL)
+      {
+        free(info->poller);
+        info->poller = NULL;
+        return NULL;
+      }
+
+#if defined(WIN32)
+      InitializeCriticalSection(&info->poller->lock);
+      InitializeConditionVariable(&info->poller->cond);
+#else
+      pthread_mutex_init(&info->poller->lock, NULL);
+      pthread_cond_init(&info->poller->cond, NULL);
+#endif
+    }
+  }
+
+  return info->poller;
+}
+
+/**
+ * Frees the polling state for a connection. The polling thread must already
+ * have been stopped.
+ */
+void mems_poller_free(mems_info* info)
+{
+  if (info->poller != NULL)
+  {
+#if defined(WIN32)
+    DeleteCriticalSection(&info->poller->lock);
+#else
+    pthread_mutex_destroy(&info->poller->lock);
+    pthread_cond_destroy(&info->poller->cond);
+#endif
+    mems_ring_destroy(info->poller->ring);
+    mems_shm_detach(info->poller->shm);
+    free(info->poller);
+    info->poller = NULL;
+  }
+}
+
+/**
+ * Returns true if commands issued by the calling thread should be queued to
+ * the polling thread rather than sent directly.
+ */
+bool mems_poller_owns_link(mems_info* info)
+{
+  return (info->poller != NULL) && MEMS_ATOMIC_LOAD(&info->poller->running) &&
+         !mems_poller_is_current_thread(info->poller);
+}
+
+/**
+ * Returns true if the caller is the connection's polling thread (that is,
+ * a subscriber's callback).
+ */
+bool mems_poller_is_caller(mems_info* info)
+{
+  return (info->poller != NULL) && info->poller->started &&
+         mems_poller_is_current_thread(info->poller);
+}
+
+/**
+ * Queues a command to be sent by the polling thread, and waits until it has
+ * been sent and its one-byte reply received. Commands are sent in order of
+ * priority, so an actuator command overtakes queued heartbeats and reads.
+ * @param cmd Command byte to send
+ * @param priority Class of work the command belongs to
+ * @param response Receives the byte that follows the command's echo
+ * @return True if the command was echoed and its reply received
+ */
+bool mems_poller_submit(mems_info* info, uint8_t cmd, mems_priority priority, uint8_t* response)
+{
+  mems_poller* poller = info->poller;
+  mems_request req;
+  mems_request* prev = NULL;
+  mems_request* next = NULL;
+
+  memset(&req, 0, sizeof(req));
+  req.cmd = cmd;
+  req.priority = priority;
+
+  mems_poller_lock(poller);
+  if (!MEMS_ATOMIC_LOAD(&poller->running))
+  {
+    // the thread stopped in the meantime, so send the command directly
+    mems_poller_unlock(poller);
+    return mems_run_command(info, cmd, priority, response);
+  }
+
+  // queue behind every request of the same or a higher priority
+  next = poller->queue_head;
+  while ((next != NULL) && (next->priority >= priority))
+  {
+    prev = next;
+    next = next->next;
+  }
+
+  req.next = next;
+  if (prev != NULL)
+  {
+    prev->next = &req;
+  }
+  else
+  {
+    poller->queue_head = &req;
+  }
+  if (next == NULL)
+  {
+    poller->queue_tail = &req;
+  }
+  mems_poller_signal(poller);
+
+  while (!req.done)
+  {
+    mems_poller_wait(poller, 0);
+  }
+  mems_poller_unlock(poller);
+
+  if (response)
+  {
+    *response = req.response;
+  }
+
+  return req.status;
+}
+
+/**
+ * Starts a background thread that continuously reads data from the ECU and
+ * passes each decoded sample to the callback. While the thread is running,
+ * commands sent from other threads (with mems_test_actuator(),
+ * mems_heartbeat(), etc.) are queued to it and sent between data reads.
+ * The link must already be initialized with mems_init_link().
+ * @param info State information for the current connection.
+ * @param interval_ms Minimum time between the starts of successive reads,
+ *   in milliseconds; zero reads as fast as the ECU allows
+ * @param callback Function to receive each sample (may be NULL if
+ *   subscribers will be added later with mems_subscribe()); it is not
+ *   registered again if it is still registered with the same user pointer,
+ *   as it is after polling was stopped
+ * @param user Opaque pointer that is passed to the callback
+ * @return True if the polling thread was started
+ */
+bool mems_start_polling(mems_info* info, uint32_t interval_ms, mems_data_callback callback, void* user)
+{
+  mems_poller* poller = mems_poller_get(info);
+  bool subscribed = false;
+  bool status = false;
+  int idx = 0;
+
+  if ((poller == NULL) || MEMS_ATOMIC_LOAD(&poller->running) || !mems_is_connected(info))
+  {
+    return false;
+  }
+
+  // a thread that was stopped from its own callback may still be finishing
+  if (poller->started)
+  {
+    if (mems_poller_is_current_thread(poller))
+    {
+      dprintf_err("mems_start_polling(): cannot restart polling from the polling thread\n");
+      return false;
+    }
+    mems_poller_join(poller);
+  }
+
+  poller->interval_ms = interval_ms;
+  poller->started = true;
+  if (poller->adapt_enable)
+  {
+    poller->adapt_pending = true;
+  }
+  MEMS_ATOMIC_STORE(&poller->running, true);
+
+  // the callback is still registered if polling was started with it before
+  mems_poller_lock(poller);
+  for (idx = 0; callback && !subscribed && (idx < MEMS_MAX_SUBSCRIBERS); idx++)
+  {
+    subscribed = (poller->subscribers[idx].callback == callback) && (poller->subscribers[idx].user == user);
+  }
+  mems_poller_unlock(poller);
+
+  if (callback && !subscribed && !mems_subscribe(info, callback, user))
+  {
+    poller->started = false;
+    MEMS_ATOMIC_STORE(&poller->running, false);
+    return false;
+  }
+
+#if defined(WIN32)
+  poller->thread = CreateThread(NULL, 0, mems_poller_main, info, 0, &poller->thread_id);
+  status = (poller->thread != NULL);
+#else
+  status = (pthread_create(&poller->thread, NULL, mems_poller_main, info) == 0);
+#endif
+
+  if (!status)
+  {
+    poller->started = false;
+    MEMS_ATOMIC_STORE(&poller->running, false);
+    if (!subscribed)
+    {
+      mems_unsubscribe(info, callback, user);
+    }
+  }
+
+  return status;
+}
+
+/**
+ * Stops the background polling thread (if it is running) and waits for it
+ * to exit. Commands still queued to it are failed. Subscribers remain
+ * registered for the next call to mems_start_polling() (which does not
+ * register its callback a second time).
+ * This may be called from a subscriber's callback, in which case the
+ * thread stops once the callback returns, without being waited for.
+ * @param info State information for the current connection.
+ */
+void mems_stop_polling(mems_info* info)
+{
+  mems_poller* poller = info->poller;
+
+  if ((poller == NULL) || !poller->started)
+  {
+    return;
+  }
+
+  mems_poller_lock(poller);
+  MEMS_ATOMIC_STORE(&poller->running, false);
+  mems_poller_signal(poller);
+  mems_poller_unlock(poller);
+
+  // the thread can't wait for itself to exit
+  if (!mems_poller_is_current_thread(poller))
+  {
+    mems_poller_join(poller);
+  }
+}
+
+/**
+ * Chooses which frames the polling thread reads on each cycle. Frames that
+ * carry any of the given channels are read every cycle; the other frame is
+ * read only every slow_interval'th cycle, and in between its channels keep
+ * the values from the last time it was read. For example, polling only for
+ * channels from the 0x80 frame with a slow interval of 10 nearly doubles
+ * the sample rate while still refreshing the 0x7D channels regularly. The
+ * first cycle always reads both frames. The default is every channel.
+ * @param info State information for the current connection.
+ * @param channels Mask of MEMS_CHANNEL_BIT() values for the channels needed on every cycle
+ * @param slow_interval Number of cycles between reads of the other frame (0 for never)
+ */
+void mems_set_poll_channels(mems_info* info, uint32_t channels, uint32_t slow_interval)
+{
+  mems_poller* poller = mems_poller_get(info);
+
+  if (poller)
+  {
+    mems_poller_lock(poller);
+    poller->fast_channels = channels;
+    poller->slow_interval = slow_interval;
+    mems_poller_unlock(poller);
+  }
+}
+
+/**
+ * Attaches a table of alarm rules to the polling thread, which evaluates it
+ * against every sample it reads (before passing the sample to subscribers),
+ * so that each alarm is raised or cleared within one sample. This replaces
+ * any table that was attached before; once it returns, the polling thread
+ * has finished with that table, and it may be destroyed.
+ * @param info State information for the current connection.
+ * @param alarms Compiled rules (from mems_alarm_compile()), or NULL to detach them
+ */
+void mems_set_alarms(mems_info* info, mems_alarm_table* alarms)
+{
+  mems_poller* poller = mems_poller_get(info);
+
+  if (poller)
+  {
+    mems_poller_lock(poller);
+    poller->alarms = alarms;
+    while (poller->evaluating && MEMS_ATOMIC_LOAD(&poller->running) && !mems_poller_is_current_thread(poller))
+    {
+      mems_poller_wait(poller, 0);
+    }
+    mems_poller_unlock(poller);
+  }
+}
+
+/**
+ * Publishes every sample that the polling thread reads to other processes,
+ * by moving its ring buffer into a named shared memory segment (a POSIX
+ * shared memory object, or a named file mapping on Windows), alongside a
+ * summary of the link's state. Other processes attach to the segment with
+ * mems_shm_attach() and read the ring directly, so all of them share the
+ * one link's reads. The segment is removed by mems_cleanup().
+ * This must be called before polling is started, and it replaces the ring
+ * returned by any earlier call to mems_get_ring().
+ * @param info State information for the current connection.
+ * @param name Name under which other processes may attach
+ * @param capacity Number of samples that the ring should retain (0 for
+ *   MEMS_DEFAULT_RING_CAPACITY; at least MEMS_RING_MIN_CAPACITY are retained)
+ * @return True if the segment was created
+ */
+bool mems_publish(mems_info* info, const char* name, uint32_t capacity)
+{
+  mems_poller* poller = mems_poller_get(info);
+  mems_shm* shm = NULL;
+
+  if ((poller == NULL) || poller->started || (poller->shm != NULL))
+  {
+    dprintf_err("mems_publish(): polling must be stopped, and not already published\n");
+    return false;
+  }
+
+  if (capacity == 0)
+  {
+    capacity = MEMS_DEFAULT_RING_CAPACITY;
+  }
+  else if (capacity < MEMS_RING_MIN_CAPACITY)
+  {
+    capacity = MEMS_RING_MIN_CAPACITY;
+  }
+
+  shm = mems_shm_create(name, capacity);
+  if (shm == NULL)
+  {
+    return false;
+  }
+
+  mems_ring_destroy(poller->ring);
+  poller->ring = mems_shm_publisher_ring(shm);
+  poller->shm = shm;
+  mems_shm_update(shm, info);
+
+  return true;
+}
+
+/**
+ * Lets the polling thread choose its own read interval and reply timeout
+ * from the health of the link, within the given limits, in place of the
+ * fixed interval passed to mems_start_polling() (from which it starts).
+ * This may be called before or while polling; when polling stops, the
+ * reply margin is put back, and the controller starts afresh from the
+ * new interval when polling is started again.
+ * It backs off (doubling both) as soon as a data frame exchange times out,
+ * is cut short or has a mismatched echo, and tightens them gradually while
+ * every exchange succeeds, so that the link runs near its fastest sustained
+ * rate without being driven into repeated resynchronization.
+ * @param info State information for the current connection.
+ * @param options Limits (see mems_adaptive_options_init()), or NULL to
+ *   return to the fixed interval and the reply margin set before
+ */
+void mems_set_adaptive_polling(mems_info* info, const mems_adaptive_options* options)
+{
+  mems_poller* poller = mems_poller_get(info);
+
+  if (poller)
+  {
+    mems_poller_lock(poller);
+    if (options)
+    {
+      poller->adapt_options = *options;
+    }
+    poller->adapt_enable = (options != NULL);
+
+    // the thread applies the change at the start of its next cycle (or of
+    // its first, in which case mems_start_polling() marks it pending)
+    if (poller->started)
+    {
+      poller->adapt_pending = true;
+      mems_poller_signal(poller);
+    }
+    mems_poller_unlock(poller);
+  }
+}
+
+/**
+ * Retrieves the settings chosen most recently by the adaptive rate controller.
+ * @param info State information for the current connection.
+ * @param state Receives the settings (with 'enabled' clear if the controller is off)
+ * @return True if the settings were retrieved
+ */
+bool mems_get_adaptive_state(mems_info* info, mems_adaptive_state* state)
+{
+  mems_poller* poller = info->poller;
+
+  memset(state, 0, sizeof(mems_adaptive_state));
+  if (poller == NULL)
+  {
+    return false;
+  }
+
+  mems_poller_lock(poller);
+  *state = poller->adapt_snapshot;
+  mems_poller_unlock(poller);
+
+  return true;
+}
+
+/**
+ * Returns true if the background polling thread is running.
+ * @param info State information for the current connection.
+ */
+bool mems_is_polling(mems_info* info)
+{
+  return (info->poller != NULL) && MEMS_ATOMIC_LOAD(&info->poller->running);
+}
+
+/**
+ * Registers an additional function to receive each sample read by the
+ * polling thread.
+ * @param info State information for the current connection.
+ * @param callback Function to receive each sample
+ * @param user Opaque pointer that is passed to the callback
+ * @return True if the subscriber was added; false if the maximum number
+ *   of subscribers (MEMS_MAX_SUBSCRIBERS) is already registered
+ */
+bool mems_subscribe(mems_info* info, mems_data_callback callback, void* user)
+{
+  mems_poller* poller = mems_poller_get(info);
+  bool status = false;
+  int idx = 0;
+
+  if ((poller == NULL) || (callback == NULL))
+  {
+    return false;
+  }
+
+  mems_poller_lock(poller);
+  for (idx = 0; !status && (idx < MEMS_MAX_SUBSCRIBERS); idx++)
+  {
+    if (poller->subscribers[idx].callback == NULL)
+    {
+      poller->subscribers[idx].callback = callback;
+      poller->subscribers[idx].user = user;
+      status = true;
+    }
+  }
+  mems_poller_unlock(poller);
+
+  return status;
+}
+
+/**
+ * Removes a subscriber that was registered with mems_subscribe() or
+ * mems_start_polling(). If the polling thread is delivering a sample, this
+ * waits for the delivery to finish, so once it returns the callback is not
+ * running and will not be called again, and 'user' may be freed. (Called
+ * from a callback, it returns at once; the delivery in progress continues.)
+ * @param info State information for the current connection.
+ * @param callback Function that was registered
+ * @param user Opaque pointer that was registered with the function
+ */
+void mems_unsubscribe(mems_info* info, mems_data_callback callback, void* user)
+{
+  mems_poller* poller = info->poller;
+  uint64_t deliveries = 0;
+  int idx = 0;
+
+  if (poller == NULL)
+  {
+    return;
+  }
+
+  mems_poller_lock(poller);
+  for (idx = 0; idx < MEMS_MAX_SUBSCRIBERS; idx++)
+  {
+    if ((poller->subscribers[idx].callback == callback) &&
+        (poller->subscribers[idx].user == user))
+    {
+      poller->subscribers[idx].callback = NULL;
+      poller->subscribers[idx].user = NULL;
+    }
+  }
+
+  // a delivery in progress may be from a copy of the list taken before
+  deliveries = poller->deliveries;
+  while (poller->delivering && (poller->deliveries == deliveries) && !mems_poller_is_current_thread(poller))
+  {
+    mems_poller_wait(poller, 0);
+  }
+  mems_poller_unlock(poller);
+}
+
+/**
+ * Returns the ring buffer into which the polling thread publishes every
+ * sample it reads. Any number of threads may read from the ring (with
+ * mems_ring_latest() or mems_ring_read_since()) without taking any lock.
+ * The ring remains valid until mems_cleanup() is called.
+ * @param info State information for the current connection.
+ * @return The sample ring, or NULL if polling has never been started
+ */
+mems_ring* mems_get_ring(mems_info* info)
+{
+  return (info->poller != NULL) ? info->poller->ring : NULL;
+}
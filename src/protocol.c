@@ -18,40 +18,137 @@
   #include <string.h>
 #endif
 
+#if !defined(WIN32)
+  #include <time.h>
+  #include <poll.h>
+  #include <errno.h>
+  #include <sys/time.h>
+#endif
+
 #include "rosco.h"
 #include "rosco_internal.h"
 
 /**
- * Reads bytes from the serial device using an OS-specific call.
+ * Returns the absolute time (on the mems_time_us() clock) by which a reply
+ * of the given length should have been completely received, if it was
+ * requested just now. The allowance is the transfer time of the reply at
+ * the link's baud rate plus a fixed margin for the ECU's turnaround.
+ * @param quantity Number of bytes expected in the reply
+ */
+uint64_t mems_reply_deadline(mems_info* info, uint16_t quantity)
+{
+  return mems_time_us() + ((uint64_t)quantity * info->byte_time_us) + info->reply_margin_us;
+}
+
+/**
+ * Waits until the serial device has data available to be read, or until
+ * the deadline passes.
+ * @param deadline_us Absolute time (from mems_time_us()) at which to give up
+ * @return True if data may be read from the device, false if the deadline
+ *   passed or the wait failed
+ */
+bool mems_wait_readable(mems_info* info, uint64_t deadline_us)
+{
+  if (info->transport)
+  {
+    return info->transport->wait_readable(info->transport_ctx, deadline_us);
+  }
+
+#if defined(WIN32)
+  // ReadFile() itself waits (for up to info->read_poll_ms) for the first byte
+  return true;
+#else
+  struct pollfd pfd;
+  uint64_t now = 0;
+  int timeout_ms = 0;
+  int rc = 0;
+
+  pfd.fd = info->sd;
+  pfd.events = POLLIN;
+
+  // if the deadline has already passed, still check once without waiting
+  do
+  {
+    now = mems_time_us();
+    timeout_ms = (now < deadline_us) ? (int)((deadline_us - now + 999) / 1000) : 0;
+
+    pfd.revents = 0;
+    rc = poll(&pfd, 1, timeout_ms);
+
+  } while (((rc == 0) && (timeout_ms > 0)) || ((rc < 0) && (errno == EINTR)));
+
+  return (rc > 0) && (pfd.revents & POLLIN);
+#endif
+}
+
+/**
+ * Waits for data (until the deadline) and then performs a single read from
+ * the serial device (or the connection's transport), returning as many bytes as are immediately available
+ * (up to the requested quantity).
  * @param buffer Buffer into which data should be read
- * @param quantity Number of bytes to read
- * @return Number of bytes read from the device, or -1 if no bytes could be read
+ * @param quantity Maximum number of bytes to read
+ * @param deadline_us Absolute time (from mems_time_us()) at which to give up
+ * @return Number of bytes read from the device (0 if the deadline passed),
+ *   or -1 if the read failed
  */
-int16_t mems_read_serial(mems_info* info, uint8_t* buffer, uint16_t quantity)
+int16_t mems_read_available(mems_info* info, uint8_t* buffer, uint16_t quantity, uint64_t deadline_us)
 {
-  int16_t totalBytesRead = 0;
   int16_t bytesRead = -1;
-  uint8_t *buffer_pt = buffer;
-  int x = 0;
 
   if (mems_is_connected(info))
   {
-    do
+    if (!mems_wait_readable(info, deadline_us))
+    {
+      return 0;
+    }
+
+    if (info->transport)
     {
+      return info->transport->read(info->transport_ctx, buffer, quantity);
+    }
+
 #if defined(WIN32)
-      DWORD w32BytesRead = 0;
-      if ((ReadFile(info->sd, (UCHAR *) buffer_pt, quantity, &w32BytesRead, NULL) == TRUE) &&
-          (w32BytesRead > 0))
-      {
-        bytesRead = w32BytesRead;
-      }
+    DWORD w32BytesRead = 0;
+    if (ReadFile(info->sd, (UCHAR *) buffer, quantity, &w32BytesRead, NULL) == TRUE)
+    {
+      bytesRead = w32BytesRead;
+    }
 #else
-      bytesRead = read(info->sd, buffer_pt, quantity);
+    bytesRead = read(info->sd, buffer, quantity);
+    if ((bytesRead < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+    {
+      bytesRead = 0;
+    }
 #endif
-      totalBytesRead += bytesRead;
-      buffer_pt += bytesRead;
+  }
+
+  return bytesRead;
+}
+
+/**
+ * Reads bytes from the serial device, returning as soon as the requested
+ * quantity has arrived or the deadline has passed.
+ * @param buffer Buffer into which data should be read
+ * @param quantity Number of bytes to read
+ * @param deadline_us Absolute time (from mems_time_us()) at which to give up
+ * @return Number of bytes read from the device
+ */
+int16_t mems_read_serial_deadline(mems_info* info, uint8_t* buffer, uint16_t quantity, uint64_t deadline_us)
+{
+  int16_t totalBytesRead = 0;
+  int16_t bytesRead = 0;
 
-    } while ((bytesRead > 0) && (totalBytesRead < quantity));
+  while (totalBytesRead < quantity)
+  {
+    bytesRead = mems_read_available(info, buffer + totalBytesRead, quantity - totalBytesRead, deadline_us);
+    if (bytesRead > 0)
+    {
+      totalBytesRead += bytesRead;
+    }
+    else if ((bytesRead < 0) || (mems_time_us() >= deadline_us))
+    {
+      break;
+    }
   }
 
   if (totalBytesRead < quantity)
@@ -63,7 +160,21 @@ int16_t mems_read_serial(mems_info* info, uint8_t* buffer, uint16_t quantity)
 }
 
 /**
- * Writes bytes to the serial device using an OS-specific call
+ * Reads bytes from the serial device using an OS-specific call. The read is
+ * abandoned if the bytes have not all arrived within the time it should take
+ * to transfer them (plus a margin for the ECU's response time).
+ * @param buffer Buffer into which data should be read
+ * @param quantity Number of bytes to read
+ * @return Number of bytes read from the device
+ */
+int16_t mems_read_serial(mems_info* info, uint8_t* buffer, uint16_t quantity)
+{
+  return mems_read_serial_deadline(info, buffer, quantity, mems_reply_deadline(info, quantity));
+}
+
+/**
+ * Writes bytes to the serial device using an OS-specific call (or to the
+ * connection's transport, if it has one)
  * @param buffer Buffer from which written data should be drawn
  * @param quantity Number of bytes to write
  * @return Number of bytes written to the device, or -1 if no bytes could be written
@@ -73,6 +184,11 @@ int16_t mems_write_serial(mems_info* info, uint8_t* buffer, uint16_t quantity)
   int16_t bytesWritten = -1;
   int x = 0;
 
+  if (info->transport)
+  {
+    return info->transport->write(info->transport_ctx, buffer, quantity);
+  }
+
   if (mems_is_connected(info))
   {
 #if defined(WIN32)
@@ -91,341 +207,1247 @@ int16_t mems_write_serial(mems_info* info, uint8_t* buffer, uint16_t quantity)
 }
 
 /**
- * Sends a single command byte to the ECU and waits for the same byte to be
- * echoed as a response. Note that if the ECU sends one or more bytes of
- * data in addition to the echoed command byte, mems_read_serial() must also
- * be called to retrieve that data from the input buffer.
+ * Sleeps until the given time (on the mems_time_us() clock).
  */
-bool mems_send_command(mems_info *info, uint8_t cmd)
+static void mems_sleep_until(uint64_t wake_us)
 {
-  bool result = false;
-  uint8_t response = 0xFF;
+#if !defined(WIN32)
+  struct timespec ts;
+  uint64_t now = mems_time_us();
+
+  if (wake_us > now)
+  {
+    ts.tv_sec = (wake_us - now) / 1000000;
+    ts.tv_nsec = ((wake_us - now) % 1000000) * 1000;
+    while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR))
+      ;
+  }
+#endif
+  // under Win32 the scheduler's granularity is far coarser than the
+  // character time, so nothing is gained by sleeping
+}
+
+/**
+ * Collects the replies to commands that have just been written, into part
+ * of the connection's receive buffer, through a chain of frame parsers
+ * (one for each command, each set up with its reply's place in the buffer,
+ * back to back). Rather than waking for each character as it arrives, the
+ * wait for the first byte is followed by a sleep until all of the replies
+ * should have been transferred, so that they are normally collected with
+ * a single read. Each read is placed just after the bytes accepted so far,
+ * so that intact replies are parsed where they lie, and stray bytes are
+ * skipped by the parsers and then overwritten by the next read.
+ * @param parsers Parser for each reply, in the order the commands were written
+ * @param count Number of parsers
+ * @param rx Where in the receive buffer the replies are put
+ * @param sent_us Time at which the (first) command was written
+ * @return Number of parsers that completed (all of those before the first that didn't)
+ */
+static uint8_t mems_collect_replies(mems_info* info, mems_frame_parser* parsers, uint8_t count,
+                                    uint8_t* rx, uint64_t sent_us)
+{
+  uint64_t expected = 0;
+  uint64_t deadline = 0;
+  uint64_t arrived = 0;
+  uint16_t total = 0;
+  uint16_t accepted = 0;
+  uint16_t pos = 0;
+  uint8_t* chunk = NULL;
+  int16_t bytesRead = 0;
+  uint8_t cur = 0;
+  uint8_t idx = 0;
+
+  for (idx = 0; idx < count; idx++)
+  {
+    total += parsers[idx].payload_len + 1;
+  }
 
-  if (mems_write_serial(info, &cmd, 1) == 1)
+  // the command byte itself must go out before its echo and payload return
+  expected = sent_us + ((uint64_t)(total + 1) * info->byte_time_us);
+  deadline = mems_reply_deadline(info, total + 1);
+
+  while ((cur < count) && (parsers[cur].status == MEMS_Parse_Incomplete))
   {
-    if (mems_read_serial(info, &response, 1) == 1)
+    if (!mems_wait_readable(info, deadline))
     {
-      if (response == cmd)
-      {
-        result = true;
-      }
-      else
+      break;
+    }
+
+    if (arrived == 0)
+    {
+      arrived = mems_time_us();
+    }
+    mems_sleep_until(expected);
+
+    chunk = rx + accepted + parsers[cur].received;
+    bytesRead = mems_read_available(info, chunk, total - accepted - parsers[cur].received, deadline);
+    if (bytesRead < 0)
+    {
+      break;
+    }
+
+    pos = 0;
+    while ((pos < bytesRead) && (cur < count) && (parsers[cur].status == MEMS_Parse_Incomplete))
+    {
+      pos += mems_parser_feed(&parsers[cur], chunk + pos, bytesRead - pos);
+      if (parsers[cur].status == MEMS_Parse_Complete)
       {
-        dprintf_err("mems_send_command(): received one nonmatching byte (%02X) in response to command %02X\n", response, cmd);
+        accepted += parsers[cur].payload_len + 1;
+        cur++;
       }
     }
-    else
+  }
+
+  // an echo that was the first byte to arrive was timed before the sleep
+  if ((count > 0) && (parsers[0].echo_us != 0) && (parsers[0].skipped == 0))
+  {
+    parsers[0].echo_us = arrived;
+  }
+
+  return cur;
+}
+
+/**
+ * Discards the remains of a failed exchange: whatever has already arrived,
+ * and anything still on its way (such as the rest of a reply that came too
+ * late), until the line has been quiet for the reply margin. This is what
+ * keeps the next exchange from starting part of the way through a stale
+ * reply. The wait is bounded by the time that two full receive buffers of
+ * bytes would take, so that a noisy line cannot hold the caller for long.
+ * The bytes that the exchange's parser had already skipped are counted
+ * with these, as a single resynchronization. The caller must hold the lock.
+ * @param cmd Command of the failed exchange, under which the discarded bytes are counted
+ * @param skipped Number of stray bytes skipped by the exchange's parser
+ * @return Number of bytes discarded by the drain
+ */
+static uint16_t mems_drain_input(mems_info* info, uint8_t cmd, uint16_t skipped)
+{
+  uint8_t scratch[MEMS_RX_BUFFER_SIZE];
+  uint64_t quiet_us = info->reply_margin_us + (2 * info->byte_time_us);
+  uint64_t limit = mems_time_us() + ((uint64_t)MEMS_RX_BUFFER_SIZE * 2 * info->byte_time_us) + quiet_us;
+  uint64_t deadline = 0;
+  uint16_t discarded = 0;
+  int16_t bytesRead = 0;
+
+  while ((deadline = mems_time_us() + quiet_us) < limit)
+  {
+    bytesRead = mems_read_available(info, scratch, sizeof(scratch), deadline);
+    if (bytesRead <= 0)
     {
-      dprintf_err("mems_send_command(): did not receive echo of command %02X\n", cmd);
+      break;
     }
+    discarded += bytesRead;
   }
-  else
+
+  if (discarded > 0)
   {
-    dprintf_err("mems_send_command(): failed to send command %02X\n", cmd);
+    dprintf_err("mems_drain_input(): discarded %d stray bytes after command %02X\n", discarded, cmd);
   }
+  mems_stats_record_discard(info, cmd, skipped + discarded);
 
-  return result;
+  return discarded;
 }
 
 /**
- * Sends an initialization/startup sequence to the ECU. Required to enable further communication.
+ * Runs one complete exchange with the ECU: sends a single command byte,
+ * waits for it to be echoed, and then reads the fixed number of payload
+ * bytes that follow the echo. The echo and payload are collected together
+ * in the given part of the connection's receive buffer, where they are
+ * left, and the outcome and latencies are recorded in the per-command
+ * statistics. Stray bytes ahead of the echo are skipped by the frame
+ * parser, and if the exchange fails nonetheless, the input is drained so
+ * that the next exchange starts in step. The caller must hold the lock.
+ * @param cmd Command byte to send
+ * @param rx Where in the receive buffer to put the echo and payload
+ * @param payload_len Number of bytes expected after the echo (may be 0)
+ * @return True if the echo matched and the full payload was received
  */
-bool mems_init_link(mems_info* info, uint8_t* d0_response_buffer)
+static bool mems_transact_in_place(mems_info* info, uint8_t cmd, uint8_t* rx, uint16_t payload_len)
 {
-  uint8_t command_a = 0xCA;
-  uint8_t command_b = 0x75;
-  uint8_t command_c = MEMS_Heartbeat;
-  uint8_t command_d = 0xD0;
-  uint8_t buffer = 0x00;
+  mems_frame_parser parser;
 
-  if (!mems_send_command(info, command_a))
+  if ((rx + payload_len + 1) > (info->rxbuf + MEMS_RX_BUFFER_SIZE))
   {
-    dprintf_err("mems_init_link(): Did not see %02X command echo\n", command_a);
+    dprintf_err("mems_transact(): reply to command %02X is too long (%d bytes)\n", cmd, payload_len);
     return false;
   }
-  if (!mems_send_command(info, command_b))
+
+  mems_parser_init(&parser, cmd, rx + 1, payload_len);
+
+  info->txbuf[0] = cmd;
+  parser.sent_us = mems_time_us();
+  if (mems_write_serial(info, info->txbuf, 1) != 1)
   {
-    dprintf_err("mems_init_link(): Did not see %02X command echo\n", command_b);
+    dprintf_err("mems_transact(): failed to send command %02X\n", cmd);
     return false;
   }
-  if (!mems_send_command(info, command_c))
+
+  mems_collect_replies(info, &parser, 1, rx, parser.sent_us);
+
+  if (parser.status == MEMS_Parse_Complete)
+  {
+    rx[0] = cmd;
+  }
+  else if (parser.received > 0)
   {
-    dprintf_err("mems_init_link(): Did not see %02X command echo\n", command_c);
-    return false;
+    dprintf_err("mems_transact(): expected %d bytes after echo of %02X, got %d\n",
+                payload_len, cmd, parser.received - 1);
   }
-  if (mems_read_serial(info, &buffer, 1) != 1)
+  else if (parser.skipped > 0)
   {
-    dprintf_err("mems_init_link(): Did not see null terminator for %02X command\n", command_c);
-    return false;
+    dprintf_err("mems_transact(): received %d nonmatching bytes in response to command %02X\n",
+                parser.skipped, cmd);
   }
-  if (!mems_send_command(info, command_d))
+  else
+  {
+    dprintf_err("mems_transact(): did not receive echo of command %02X\n", cmd);
+  }
+
+  mems_stats_record_parser(info, &parser);
+  if (parser.status != MEMS_Parse_Complete)
   {
-    dprintf_err("mems_init_link(): Did not see %02X command echo\n", command_d);
+    mems_drain_input(info, cmd, parser.skipped);
     return false;
   }
 
-  // Expect four more bytes after the echo of the D0 command byte.
-  // Response is 99 00 03 03 for Mini SPi.
-  if (mems_read_serial(info, d0_response_buffer, 4) != 4)
+  return true;
+}
+
+/**
+ * Runs one complete exchange with the ECU (as mems_transact_in_place()),
+ * and copies the payload that followed the echo. The caller must hold the lock.
+ * @param cmd Command byte to send
+ * @param payload Buffer that receives the bytes following the echo
+ * @param payload_len Number of bytes expected after the echo (may be 0)
+ * @return True if the echo matched and the full payload was received
+ */
+bool mems_transact(mems_info* info, uint8_t cmd, uint8_t* payload, uint16_t payload_len)
+{
+  if (!mems_transact_in_place(info, cmd, info->rxbuf, payload_len))
   {
-    dprintf_err("mems_init_link(): Received fewer bytes than expected after echo of %02X command", command_d);
     return false;
   }
 
+  if (payload_len > 0)
+  {
+    memcpy(payload, info->rxbuf + 1, payload_len);
+  }
+
   return true;
 }
 
 /**
- * Locks the mutex used for threadsafe access
+ * Sends the same command (one whose reply is its echo and a single byte of
+ * data, such as an actuator command) several times with a single write,
+ * and collects all of the replies with as few reads as possible. The ECU
+ * handles the commands in turn as they arrive. Each reply has its own frame
+ * parser, so stray bytes ahead of any of them are skipped. The caller must
+ * hold the lock.
+ * @param cmd Command byte to send
+ * @param count Number of times to send the command (at most MEMS_MAX_BURST)
+ * @param response Receives the data byte from the last reply (may be NULL)
+ * @return Number of commands whose replies were received intact
  */
-bool mems_lock(mems_info* info)
+uint8_t mems_transact_burst(mems_info* info, uint8_t cmd, uint8_t count, uint8_t* response)
+{
+  mems_frame_parser parsers[MEMS_MAX_BURST];
+  uint64_t sent = 0;
+  uint8_t completed = 0;
+  uint8_t idx = 0;
+
+  if (count > MEMS_MAX_BURST)
+  {
+    count = MEMS_MAX_BURST;
+  }
+
+  // each reply is the echo followed by one byte of data
+  for (idx = 0; idx < count; idx++)
+  {
+    mems_parser_init(&parsers[idx], cmd, info->rxbuf + (idx * 2) + 1, 1);
+  }
+
+  memset(info->txbuf, cmd, count);
+  sent = mems_time_us();
+  if (mems_write_serial(info, info->txbuf, count) != count)
+  {
+    dprintf_err("mems_transact_burst(): failed to send %d copies of command %02X\n", count, cmd);
+    return 0;
+  }
+
+  for (idx = 0; idx < count; idx++)
+  {
+    parsers[idx].sent_us = sent;
+  }
+  completed = mems_collect_replies(info, parsers, count, info->rxbuf, sent);
+
+  if ((completed > 0) && response)
+  {
+    *response = parsers[completed - 1].payload[0];
+  }
+
+  for (idx = 0; idx < count; idx++)
+  {
+    mems_stats_record_parser(info, &parsers[idx]);
+  }
+
+  if (completed < count)
+  {
+    dprintf_err("mems_transact_burst(): %d of %d replies to command %02X were received\n", completed, count, cmd);
+    mems_drain_input(info, cmd, parsers[completed].skipped);
+  }
+
+  return completed;
+}
+
+/**
+ * Sends a single command byte to the ECU and waits for the same byte to be
+ * echoed as a response. Note that if the ECU sends one or more bytes of
+ * data in addition to the echoed command byte, mems_read_serial() must also
+ * be called to retrieve that data from the input buffer.
+ */
+bool mems_send_command(mems_info *info, uint8_t cmd)
+{
+  return mems_transact(info, cmd, NULL, 0);
+}
+
+/**
+ * Returns the current value of a monotonic clock, in microseconds.
+ */
+uint64_t mems_time_us()
 {
 #if defined(WIN32)
-  if (WaitForSingleObject(info->mutex, INFINITE) != WAIT_OBJECT_0)
-    return false;
+  LARGE_INTEGER freq;
+  LARGE_INTEGER count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (uint64_t)((count.QuadPart / freq.QuadPart) * 1000000ULL +
+                    ((count.QuadPart % freq.QuadPart) * 1000000ULL) / freq.QuadPart);
 #else
-  pthread_mutex_lock(&info->mutex);
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
 #endif
-  return true;
 }
 
 /**
- * Releases the mutex used for threadsafe access
+ * Returns the current wall-clock time in microseconds since the Unix epoch.
  */
-void mems_unlock(mems_info* info)
+uint64_t mems_wall_time_us()
 {
 #if defined(WIN32)
-  ReleaseMutex(info->mutex);
+  FILETIME ft;
+  ULARGE_INTEGER t;
+
+  GetSystemTimeAsFileTime(&ft);
+  t.LowPart = ft.dwLowDateTime;
+  t.HighPart = ft.dwHighDateTime;
+
+  // FILETIME counts 100ns intervals since 1601-01-01
+  return (t.QuadPart / 10) - 11644473600000000ULL;
 #else
-  pthread_mutex_unlock(&info->mutex);
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ((uint64_t)tv.tv_sec * 1000000ULL) + tv.tv_usec;
 #endif
 }
 
 /**
- * Converts the temperature value used by the ECU into degrees Fahrenheit.
+ * Converts a timestamp from the monotonic clock of mems_time_us() to
+ * wall-clock time (microseconds since the Unix epoch), using the current
+ * offset between the two clocks. Timestamps are kept on the monotonic
+ * clock so that intervals are unaffected by adjustments to the wall clock;
+ * they need only be converted when they are correlated with other sources.
+ * @param timestamp_us Time from mems_time_us() (or from a sample or view)
  */
-uint8_t temperature_value_to_degrees_f(uint8_t val)
+uint64_t mems_to_wall_time_us(uint64_t timestamp_us)
 {
-  uint8_t degrees_c = val - 55;
-  return (uint8_t)((float)degrees_c * 1.8 + 32);
+  uint64_t mono = mems_time_us();
+  uint64_t wall = mems_wall_time_us();
+
+  return wall - (mono - timestamp_us);
 }
 
 /**
- * Sends a command to read a frame of data from the ECU, and returns the raw frame.
+ * Prepares a parser to receive the echo of the given command byte followed
+ * by the specified number of payload bytes. The data frames sent in reply
+ * to 0x80 and 0x7D begin with their own length, and so for those commands
+ * the echo is only accepted when it is followed by that length byte.
  */
-bool mems_read_raw(mems_info* info, mems_data_frame_80* frame80, mems_data_frame_7d* frame7d)
+void mems_parser_init(mems_frame_parser* parser, uint8_t cmd, uint8_t* payload, uint16_t payload_len)
 {
-    bool status = false;
+  parser->cmd = cmd;
+  parser->payload = payload;
+  parser->payload_len = payload_len;
+  parser->received = 0;
+  parser->header = -1;
+  parser->skipped = 0;
+  parser->status = MEMS_Parse_Incomplete;
+  parser->sent_us = 0;
+  parser->echo_us = 0;
+  parser->done_us = 0;
 
-    if (mems_lock(info))
+  if (((cmd == MEMS_ReqData80) && (payload_len == sizeof(mems_data_frame_80))) ||
+      ((cmd == MEMS_ReqData7D) && (payload_len == sizeof(mems_data_frame_7d))))
+  {
+    parser->header = payload_len;
+  }
+}
+
+/**
+ * Feeds received bytes into the parser. Bytes are skipped until the
+ * expected echo (and, for a data frame, its length byte) is found, so that
+ * the remains of an earlier reply are passed over; the bytes that follow
+ * the echo are copied into the payload buffer. If more than
+ * MEMS_PARSER_MAX_SKIP bytes have to be skipped, the exchange is failed as
+ * a mismatch. Bytes beyond the end of this exchange are left unconsumed so
+ * that they may be given to the parser for the following exchange.
+ * @return Number of bytes consumed from the data buffer (including any skipped)
+ */
+uint16_t mems_parser_feed(mems_frame_parser* parser, const uint8_t* data, uint16_t count)
+{
+  uint16_t consumed = 0;
+  uint16_t needed = 0;
+
+  while ((parser->status == MEMS_Parse_Incomplete) && (consumed < count) &&
+         ((parser->received == 0) || ((parser->received == 1) && (parser->header >= 0))))
+  {
+    if (parser->received == 0)
     {
-      if (mems_send_command(info, MEMS_ReqData80))
+      if (data[consumed] == parser->cmd)
       {
-        if (mems_read_serial(info, (uint8_t*)(frame80), sizeof(mems_data_frame_80)) == sizeof(mems_data_frame_80))
-        {
-          status = true;
-        }
-        else
-        {
-          dprintf_err("mems_read_raw(): failed to read data frame in response to cmd 0x80\n");
-        }
+        parser->received = 1;
+        parser->echo_us = mems_time_us();
       }
       else
       {
-        dprintf_err("mems_read_raw(): failed to send read command 0x80\n");
+        parser->skipped++;
       }
+      consumed++;
+    }
+    else if (data[consumed] == parser->header)
+    {
+      break;
+    }
+    else
+    {
+      // what looked like the echo was a stray byte; look again from here
+      parser->received = 0;
+      parser->echo_us = 0;
+      parser->skipped++;
+    }
 
-      if (status)
-      {
-        if (mems_send_command(info, MEMS_ReqData7D))
-        {
-          if (!mems_read_serial(info, (uint8_t*)(frame7d), sizeof(mems_data_frame_7d)) == sizeof(mems_data_frame_7d))
-          {
-            dprintf_err("mems_read_raw(): failed to read data frame in response to cmd 0x7D\n");
-            status = false;
-          }
-        }
-        else
-        {
-          dprintf_err("mems_read_raw(): failed to send read command 0x7D\n");
-          status = false;
-        }
-      }
+    if (parser->skipped > MEMS_PARSER_MAX_SKIP)
+    {
+      dprintf_err("mems_parser_feed(): no echo of command %02X in %d bytes\n", parser->cmd, parser->skipped);
+      parser->status = MEMS_Parse_Mismatch;
+    }
+  }
 
-      mems_unlock(info);
+  if ((parser->status == MEMS_Parse_Incomplete) && (parser->received > 0))
+  {
+    needed = parser->payload_len - (parser->received - 1);
+    if (needed > (count - consumed))
+    {
+      needed = count - consumed;
     }
 
-    return status;
+    // the payload may already be in place, if the caller is building a
+    // view of the receive buffer, or may have to be moved back over
+    // skipped bytes within it
+    if ((parser->payload + (parser->received - 1)) != (data + consumed))
+    {
+      memmove(parser->payload + (parser->received - 1), data + consumed, needed);
+    }
+    parser->received += needed;
+    consumed += needed;
+
+    if (parser->received == parser->payload_len + 1)
+    {
+      parser->status = MEMS_Parse_Complete;
+      parser->done_us = mems_time_us();
+    }
+  }
+
+  return consumed;
 }
 
 /**
- * Sends an command to read a frame of data from the ECU, and parses the returned frame.
+ * Fills in the exchanges that make up the initialization/startup sequence:
+ * CA and 75 (echo only), then F4 (one null byte) and D0 (four bytes that
+ * identify the ECU). Both the blocking mems_init_link() and the session
+ * manager's non-blocking state machine run this same sequence.
+ * @param steps Array of at least MEMS_HANDSHAKE_STEPS exchanges to fill in
+ * @param f4_reply Receives the byte that follows the echo of F4
+ * @param d0_reply Receives the four bytes that follow the echo of D0
+ * @return Number of exchanges in the sequence
  */
-bool mems_read(mems_info* info, mems_data* data)
+int mems_handshake_program(mems_exchange* steps, uint8_t* f4_reply, uint8_t* d0_reply)
 {
-  bool success = false;
-  mems_data_frame_80 dframe80;
-  mems_data_frame_7d dframe7d;
+  steps[0].cmd = 0xCA;
+  steps[0].payload = NULL;
+  steps[0].payload_len = 0;
 
-  if (mems_read_raw(info, &dframe80, &dframe7d))
-  {
-    memset(data, 0, sizeof(mems_data));
+  steps[1].cmd = 0x75;
+  steps[1].payload = NULL;
+  steps[1].payload_len = 0;
 
-    data->engine_rpm           = ((uint16_t)dframe80.engine_rpm_hi << 8) | dframe80.engine_rpm_lo;
-    data->coolant_temp_f       = temperature_value_to_degrees_f(dframe80.coolant_temp);
-    data->ambient_temp_f       = temperature_value_to_degrees_f(dframe80.ambient_temp);
-    data->intake_air_temp_f    = temperature_value_to_degrees_f(dframe80.intake_air_temp);
-    data->fuel_temp_f          = temperature_value_to_degrees_f(dframe80.fuel_temp);
-    data->map_kpa              = dframe80.map_kpa;
-    data->battery_voltage      = dframe80.battery_voltage / 10.0;
-    data->throttle_pot_voltage = dframe80.throttle_pot * 0.02;
-    data->idle_switch          = ((dframe80.idle_switch & 0x10) == 0) ? 0 : 1;
-    data->park_neutral_switch  = (dframe80.park_neutral_switch == 0) ? 0 : 1;
-    data->fault_codes          = 0;
-    data->iac_position         = dframe80.iac_position;
-    data->coil_time            = (((uint16_t)dframe80.coil_time_hi << 8) | dframe80.coil_time_lo) * 0.002;
-    data->idle_error           = ((uint16_t)dframe80.idle_error_hi << 8) | dframe80.idle_error_lo;
-    data->ignition_advance     = (dframe80.ignition_advance * 0.5) - 24.0;
-    data->lambda_voltage_mv    = dframe7d.lambda_voltage * 5;
-    data->fuel_trim            = dframe7d.fuel_trim;
-    data->closed_loop          = dframe7d.closed_loop;
-    data->idle_base_pos        = dframe7d.idle_base_pos;
+  steps[2].cmd = MEMS_Heartbeat;
+  steps[2].payload = f4_reply;
+  steps[2].payload_len = 1;
 
-    if (dframe80.dtc0 & 0x01)   // coolant temp sensor fault
-      data->fault_codes |= (1 << 0);
+  // Response is 99 00 03 03 for Mini SPi.
+  steps[3].cmd = 0xD0;
+  steps[3].payload = d0_reply;
+  steps[3].payload_len = 4;
 
-    if (dframe80.dtc0 & 0x02)   // intake air temp sensor fault
-      data->fault_codes |= (1 << 1);
+  return MEMS_HANDSHAKE_STEPS;
+}
 
-    if (dframe80.dtc1 & 0x02)   // fuel pump circuit fault
-      data->fault_codes |= (1 << 2);
+/**
+ * Runs the initialization sequence, one blocking exchange at a time, after
+ * flushing any stray bytes (such as the tail of a reply to an abandoned
+ * command) from the input. The caller must hold the lock.
+ */
+static bool mems_run_handshake(mems_info* info)
+{
+  mems_exchange steps[MEMS_HANDSHAKE_STEPS];
+  uint8_t f4_reply = 0x00;
+  int count = mems_handshake_program(steps, &f4_reply, info->d0_response);
+  int idx = 0;
 
-    if (dframe80.dtc1 & 0x80)   // throttle pot circuit fault
-      data->fault_codes |= (1 << 3);
+  info->linked = false;
+  mems_flush_input(info);
 
-    success = true;
+  for (idx = 0; idx < count; idx++)
+  {
+    if (!mems_transact(info, steps[idx].cmd, steps[idx].payload, steps[idx].payload_len))
+    {
+      dprintf_err("mems_init_link(): Did not receive the expected reply to %02X command\n", steps[idx].cmd);
+      return false;
+    }
   }
 
-  return success;
+  info->linked = true;
+  info->failures = 0;
+  mems_select_variant(info);
+
+  return true;
 }
 
 /**
- * Reads the current idle air control motor position.
+ * Sends an initialization/startup sequence to the ECU. Required to enable further communication.
+ * @param d0_response_buffer If not NULL, receives the four bytes sent by
+ *   the ECU in reply to the D0 command
  */
-bool mems_read_iac_position(mems_info* info, uint8_t* position)
+bool mems_init_link(mems_info* info, uint8_t* d0_response_buffer)
 {
   bool status = false;
 
-  if (mems_lock(info))
+  if (mems_lock_priority(info, MEMS_Priority_Keepalive))
   {
-    status = mems_send_command(info, MEMS_GetIACPosition) &&
-             (mems_read_serial(info, position, 1) == 1);
+    status = mems_run_handshake(info);
     mems_unlock(info);
   }
-  return status;
-}
+
+  if (status && d0_response_buffer)
+  {
+    memcpy(d0_response_buffer, info->d0_response, sizeof(info->d0_response));
+  }
+
+  return status;
+}
 
 /**
- * Repeatedly send command to open or close the idle air control valve until
- * it is in the desired position. The valve does not necessarily move one full
- * step per serial command, depending on the rate at which the commands are
- * issued.
+ * Re-establishes communication with the ECU without reopening the serial
+ * port (for example, after the ignition has been cycled): the input buffer
+ * is flushed of any stray bytes and the initialization sequence is re-run.
+ * @param d0_response_buffer If not NULL, receives the four bytes sent by
+ *   the ECU in reply to the D0 command
+ * @return True if the ECU responded to the initialization sequence
  */
-bool mems_move_iac(mems_info* info, uint8_t desired_pos)
+bool mems_reinit_link(mems_info* info, uint8_t* d0_response_buffer)
 {
   bool status = false;
-  uint16_t attempts = 0;
-  uint8_t current_pos = 0;
-  actuator_cmd cmd;
 
-  // read the current IAC position, and only take action
-  // if we're not already at the desired point
-  if (mems_read_iac_position(info, &current_pos))
+  if (mems_lock_priority(info, MEMS_Priority_Keepalive))
   {
-    if ((desired_pos < current_pos) ||
-        ((desired_pos > current_pos) && (current_pos < IAC_MAXIMUM)))
+    status = mems_run_handshake(info);
+    if (status)
     {
-      cmd = (desired_pos > current_pos) ? MEMS_OpenIAC : MEMS_CloseIAC;
-
-      do {
-        status = mems_test_actuator(info, cmd, &current_pos);
-        attempts += 1;
-      } while (status && (current_pos != desired_pos) && (attempts < 300));
+      info->reconnects++;
     }
+    mems_unlock(info);
   }
 
-  status = (desired_pos == current_pos);
+  if (status && d0_response_buffer)
+  {
+    memcpy(d0_response_buffer, info->d0_response, sizeof(info->d0_response));
+  }
 
   return status;
 }
 
 /**
- * Sends a command to run an actuator test, and returns the single byte of data.
+ * Records the outcome of an exchange with the ECU. When automatic
+ * reconnection is enabled and MEMS_RECONNECT_THRESHOLD exchanges in a row
+ * have failed (through a timeout or a mismatched echo), the link is assumed
+ * to have been lost; the input is flushed and the initialization sequence
+ * is re-run immediately. The caller must hold the lock.
+ * @param ok True if the exchange succeeded
  */
-bool mems_test_actuator(mems_info* info, actuator_cmd cmd, uint8_t* data)
+void mems_link_result(mems_info* info, bool ok)
 {
-  bool status = false;
-  uint8_t response = 0x00;
+  if (ok)
+  {
+    info->failures = 0;
+  }
+  else if ((++info->failures >= MEMS_RECONNECT_THRESHOLD) && info->auto_reconnect)
+  {
+    dprintf_err("mems_link_result(): %d consecutive failures; re-initializing link\n", info->failures);
+    if (mems_run_handshake(info))
+    {
+      info->reconnects++;
+    }
+  }
+}
+
+/**
+ * Returns true if any thread is waiting for the link in a class above the given one.
+ */
+static bool mems_higher_priority_waiting(mems_info* info, mems_priority priority)
+{
+  int idx = 0;
+
+  for (idx = priority + 1; idx < MEMS_Num_Priorities; idx++)
+  {
+    if (info->sched_waiting[idx] > 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Waits for exclusive use of the link on behalf of the given class of work.
+ * When the link is released, it is handed to the waiter in the highest
+ * class, and to the earliest arrival within that class, so a thread that
+ * reads data in a tight loop cannot starve an actuator command or a
+ * heartbeat: those wait only for the operation already in progress.
+ * @return True once the link is held (to be released with mems_unlock())
+ */
+bool mems_lock_priority(mems_info* info, mems_priority priority)
+{
+  uint32_t ticket = 0;
+
+#if defined(WIN32)
+  EnterCriticalSection(&info->mutex);
+#else
+  pthread_mutex_lock(&info->mutex);
+#endif
+
+  ticket = info->sched_next[priority]++;
+  info->sched_waiting[priority]++;
+
+  while (info->link_busy ||
+         (ticket != info->sched_serving[priority]) ||
+         mems_higher_priority_waiting(info, priority))
+  {
+#if defined(WIN32)
+    SleepConditionVariableCS(&info->link_free, &info->mutex, INFINITE);
+#else
+    pthread_cond_wait(&info->link_free, &info->mutex);
+#endif
+  }
+
+  info->sched_waiting[priority]--;
+  info->sched_serving[priority]++;
+  info->link_busy = true;
+
+#if defined(WIN32)
+  LeaveCriticalSection(&info->mutex);
+#else
+  pthread_mutex_unlock(&info->mutex);
+#endif
+  return true;
+}
+
+/**
+ * Waits for exclusive use of the link, for reading data or for any other
+ * housekeeping that is not time-critical.
+ */
+bool mems_lock(mems_info* info)
+{
+  return mems_lock_priority(info, MEMS_Priority_Data);
+}
+
+/**
+ * Releases the link, and wakes the threads waiting for it so that the next
+ * one in line can take it.
+ */
+void mems_unlock(mems_info* info)
+{
+#if defined(WIN32)
+  EnterCriticalSection(&info->mutex);
+  info->link_busy = false;
+  WakeAllConditionVariable(&info->link_free);
+  LeaveCriticalSection(&info->mutex);
+#else
+  pthread_mutex_lock(&info->mutex);
+  info->link_busy = false;
+  pthread_cond_broadcast(&info->link_free);
+  pthread_mutex_unlock(&info->mutex);
+#endif
+}
+
+/**
+ * Converts the temperature value used by the ECU into degrees Fahrenheit.
+ */
+uint8_t temperature_value_to_degrees_f(uint8_t val)
+{
+  uint8_t degrees_c = val - 55;
+  return (uint8_t)((float)degrees_c * 1.8 + 32);
+}
 
-  if (mems_lock(info))
+/**
+ * Reads both data frames from the ECU with the two exchanges overlapped.
+ * The 0x7D request is written as soon as the final byte of the 0x80 reply
+ * is expected to arrive (or as soon as it actually arrives, if sooner), and
+ * the incoming byte stream is split between the two frames by a pair of
+ * frame parsers, which skip any stray bytes ahead of either reply. If
+ * either exchange fails, the input is drained before returning, so that
+ * the next cycle starts in step. The caller must hold the lock.
+ */
+bool mems_read_raw_pipelined(mems_info* info, mems_data_frame_80* frame80, mems_data_frame_7d* frame7d)
+{
+  uint8_t cmd80 = MEMS_ReqData80;
+  uint8_t cmd7d = MEMS_ReqData7D;
+  uint8_t* rxbuf = info->rxbuf;
+  uint16_t total = 0;
+  uint16_t expected = 2 + sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d);
+  uint16_t consumed = 0;
+  int16_t bytesRead = 0;
+  bool sent7d = false;
+  bool ok = false;
+  uint64_t now = 0;
+  uint64_t due7d = 0;
+  uint64_t deadline = 0;
+  mems_frame_parser parser80;
+  mems_frame_parser parser7d;
+
+  mems_parser_init(&parser80, cmd80, (uint8_t*)frame80, sizeof(mems_data_frame_80));
+  mems_parser_init(&parser7d, cmd7d, (uint8_t*)frame7d, sizeof(mems_data_frame_7d));
+
+  parser80.sent_us = mems_time_us();
+  if (mems_write_serial(info, &cmd80, 1) != 1)
   {
-    if (mems_send_command(info, cmd) &&
-        (mems_read_serial(info, &response, 1) == 1))
+    dprintf_err("mems_read_raw_pipelined(): failed to send command %02X\n", cmd80);
+    return false;
+  }
+
+  // the command byte goes out, its echo comes back, and the frame follows
+  now = parser80.sent_us;
+  due7d = now + ((2 + sizeof(mems_data_frame_80)) * info->byte_time_us);
+  deadline = now + ((2 + expected) * info->byte_time_us) + info->reply_margin_us;
+
+  while ((parser7d.status == MEMS_Parse_Incomplete) &&
+         (parser80.status != MEMS_Parse_Mismatch))
+  {
+    if (!sent7d &&
+        ((parser80.status == MEMS_Parse_Complete) || (mems_time_us() >= due7d)))
     {
-      if (data)
+      parser7d.sent_us = mems_time_us();
+      if (mems_write_serial(info, &cmd7d, 1) != 1)
       {
-        *data = response;
+        dprintf_err("mems_read_raw_pipelined(): failed to send command %02X\n", cmd7d);
+        mems_stats_record_parser(info, &parser80);
+        mems_drain_input(info, cmd80, parser80.skipped);
+        return false;
       }
-      status = true;
+      sent7d = true;
+    }
+
+    // until the second request is out, wake up in time to send it
+    // the replies are collected one after the other, so that they end up
+    // at the same places in the receive buffer as with stop-and-wait reads;
+    // each read goes just after the bytes accepted so far, so that stray
+    // bytes are overwritten by the next read instead of taking up room
+    total = parser80.received + parser7d.received;
+    bytesRead = mems_read_available(info, rxbuf + total, expected - total, sent7d ? deadline : due7d);
+    if ((bytesRead < 0) || ((bytesRead == 0) && sent7d))
+    {
+      dprintf_err("mems_read_raw_pipelined(): timed out with %d bytes outstanding\n", expected - total);
+      break;
+    }
+
+    consumed = mems_parser_feed(&parser80, rxbuf + total, bytesRead);
+    if (consumed < bytesRead)
+    {
+      mems_parser_feed(&parser7d, rxbuf + total + consumed, bytesRead - consumed);
+    }
+  }
+
+  mems_stats_record_parser(info, &parser80);
+  if (sent7d)
+  {
+    mems_stats_record_parser(info, &parser7d);
+  }
+
+  ok = (parser80.status == MEMS_Parse_Complete) && (parser7d.status == MEMS_Parse_Complete);
+  if (!ok)
+  {
+    if (parser80.status == MEMS_Parse_Complete)
+    {
+      mems_drain_input(info, cmd7d, parser7d.skipped);
+    }
+    else
+    {
+      mems_drain_input(info, cmd80, parser80.skipped);
+    }
+  }
+
+  return ok;
+}
+
+/**
+ * Sends a command to read a frame of data from the ECU, and returns the raw frame.
+ * Either frame pointer may be NULL, in which case that frame is not requested.
+ */
+bool mems_read_raw(mems_info* info, mems_data_frame_80* frame80, mems_data_frame_7d* frame7d)
+{
+    bool status = false;
+
+    if (mems_lock(info))
+    {
+      if (info->pipelined && frame80 && frame7d)
+      {
+        status = mems_read_raw_pipelined(info, frame80, frame7d);
+      }
+      else
+      {
+        status = true;
+
+        if (frame80 &&
+            !mems_transact(info, MEMS_ReqData80, (uint8_t*)frame80, sizeof(mems_data_frame_80)))
+        {
+          dprintf_err("mems_read_raw(): failed to read data frame in response to cmd 0x80\n");
+          status = false;
+        }
+
+        if (status && frame7d &&
+            !mems_transact(info, MEMS_ReqData7D, (uint8_t*)frame7d, sizeof(mems_data_frame_7d)))
+        {
+          dprintf_err("mems_read_raw(): failed to read data frame in response to cmd 0x7D\n");
+          status = false;
+        }
+      }
+
+      if (status && frame80)
+      {
+        mems_faults_update(info, frame80, mems_time_us());
+      }
+      mems_link_result(info, status);
+      mems_unlock(info);
     }
+
+    return status;
+}
+
+/**
+ * Reads both data frames from the ECU, and provides a read-only view of
+ * them in place in the connection's receive buffer, so that they can be
+ * decoded or logged without first being copied. The replies to 0x80 and
+ * 0x7D are collected back to back in the buffer (by stop-and-wait or
+ * pipelined reads alike), and the frames are viewed just after each echo.
+ * On success the link remains held, and so the view must be released
+ * promptly with mems_release_view().
+ * @param view Receives the view of the frames
+ * @return True if both frames were read; false otherwise (in which case
+ *   there is nothing to release)
+ */
+bool mems_read_raw_view(mems_info* info, mems_frame_view* view)
+{
+  bool status = false;
+  uint8_t* rx80 = info->rxbuf;
+  uint8_t* rx7d = info->rxbuf + 1 + sizeof(mems_data_frame_80);
+
+  if (!mems_lock(info))
+  {
+    return false;
+  }
+
+  if (info->pipelined)
+  {
+    status = mems_read_raw_pipelined(info, (mems_data_frame_80*)(rx80 + 1), (mems_data_frame_7d*)(rx7d + 1));
+  }
+  else
+  {
+    status = mems_transact_in_place(info, MEMS_ReqData80, rx80, sizeof(mems_data_frame_80)) &&
+             mems_transact_in_place(info, MEMS_ReqData7D, rx7d, sizeof(mems_data_frame_7d));
+  }
+  mems_link_result(info, status);
+
+  if (!status)
+  {
+    dprintf_err("mems_read_raw_view(): failed to read data frames\n");
     mems_unlock(info);
+    return false;
   }
-  return status;
+
+  view->timestamp_us = mems_time_us();
+  memcpy(&view->times, &info->frame_times, sizeof(mems_sample_times));
+  view->frame80 = (const mems_data_frame_80*)(rx80 + 1);
+  view->frame7d = (const mems_data_frame_7d*)(rx7d + 1);
+  mems_faults_update(info, view->frame80, view->timestamp_us);
+
+  return true;
 }
 
 /**
- * Sends a command to clear any stored fault codes
+ * Releases a view obtained from mems_read_raw_view(), and with it the link.
  */
-bool mems_clear_faults(mems_info* info)
+void mems_release_view(mems_info* info, mems_frame_view* view)
+{
+  view->frame80 = NULL;
+  view->frame7d = NULL;
+  mems_unlock(info);
+}
+
+/**
+ * Sends an command to read a frame of data from the ECU, and parses the
+ * returned frame (directly from the receive buffer).
+ */
+bool mems_read(mems_info* info, mems_data* data)
+{
+  return mems_read_timed(info, data, NULL);
+}
+
+/**
+ * Reads and decodes both data frames, as mems_read(), and also provides
+ * the times at which each request was sent and its reply was received.
+ * @param times Receives the times of the two exchanges (may be NULL)
+ */
+bool mems_read_timed(mems_info* info, mems_data* data, mems_sample_times* times)
+{
+  mems_frame_view view;
+
+  if (!mems_read_raw_view(info, &view))
+  {
+    return false;
+  }
+
+  mems_decode_frames(info->variant, view.frame80, view.frame7d, data);
+  if (times)
+  {
+    memcpy(times, &view.times, sizeof(mems_sample_times));
+  }
+  mems_release_view(info, &view);
+
+  return true;
+}
+
+/**
+ * Provides the times of the exchanges that most recently read each data
+ * frame. This is meant to be called from a data callback (of the polling
+ * thread or a session), where it gives the times of the sample being
+ * delivered; samples in the polling thread's ring carry their own times.
+ * @param times Receives the times of the two exchanges (all zero if a frame has not been read)
+ */
+void mems_get_frame_times(mems_info* info, mems_sample_times* times)
+{
+  memcpy(times, &info->frame_times, sizeof(mems_sample_times));
+}
+
+/**
+ * Reads only the data frames that carry the requested channels: a caller
+ * that wants only channels from the 0x80 frame (such as engine speed and
+ * MAP) avoids the 0x7D exchange and so can sample nearly twice as often.
+ * Channels from frames that were not read are left unchanged in 'data'.
+ * @param channels Mask of MEMS_CHANNEL_BIT() values for the wanted channels
+ * @param data Receives the decoded channels
+ * @return True if the required frames were read
+ */
+bool mems_read_channels(mems_info* info, uint32_t channels, mems_data* data)
+{
+  mems_data_frame_80 dframe80;
+  mems_data_frame_7d dframe7d;
+  bool need80 = (channels & mems_frame_channels(MEMS_ReqData80)) != 0;
+  bool need7d = (channels & mems_frame_channels(MEMS_ReqData7D)) != 0;
+
+  if (!need80 && !need7d)
+  {
+    return true;
+  }
+
+  if (!mems_read_raw(info, need80 ? &dframe80 : NULL, need7d ? &dframe7d : NULL))
+  {
+    return false;
+  }
+
+  mems_decode_frames(info->variant, need80 ? &dframe80 : NULL, need7d ? &dframe7d : NULL, data);
+  return true;
+}
+
+/**
+ * Sends a command that is answered with its echo and one byte of data, and
+ * returns that byte. This is the common form of the actuator, heartbeat and
+ * IAC position commands.
+ * @param cmd Command byte to send
+ * @param priority Class of work, which decides the order in which waiting threads get the link
+ * @param response Receives the byte that follows the echo (may be NULL)
+ */
+bool mems_run_command(mems_info* info, uint8_t cmd, mems_priority priority, uint8_t* response)
 {
   bool status = false;
-  uint8_t response = 0xFF;
+  uint8_t reply = 0x00;
 
-  if (mems_lock(info))
+  if (mems_lock_priority(info, priority))
   {
-    // send the command and check for one additional byte after the
-    // echoed command byte (should be 0x00)
-    status = mems_send_command(info, (uint8_t)MEMS_ClearFaults) &&
-      (mems_read_serial(info, &response, 1) == 1);
+    if (mems_transact(info, cmd, &reply, 1))
     {
+      if (response)
+      {
+        *response = reply;
+      }
       status = true;
     }
+    if (status && (cmd == MEMS_ClearFaults))
+    {
+      mems_faults_cleared(info, mems_time_us());
+    }
+    mems_link_result(info, status);
     mems_unlock(info);
   }
-
   return status;
 }
 
 /**
- * Sends a simple heartbeat (ping) command to check connectivity
+ * Reads the current idle air control motor position.
  */
-bool mems_heartbeat(mems_info* info)
+bool mems_read_iac_position(mems_info* info, uint8_t* position)
 {
-  bool status = false;
-  uint8_t response = 0xFF;
+  if (mems_poller_owns_link(info))
+  {
+    return mems_poller_submit(info, MEMS_GetIACPosition, MEMS_Priority_Data, position);
+  }
+  return mems_run_command(info, MEMS_GetIACPosition, MEMS_Priority_Data, position);
+}
+
+/**
+ * Sends the same actuator command several times and returns the data byte
+ * from the last reply. Unless the polling thread owns the link, the
+ * commands are sent in bursts of up to MEMS_MAX_BURST with a single write
+ * each, rather than one round trip per command.
+ * @param cmd Actuator command to send
+ * @param count Number of times to send the command
+ * @param data Receives the data byte from the last reply (may be NULL)
+ * @return Number of commands that were answered
+ */
+uint16_t mems_repeat_actuator(mems_info* info, actuator_cmd cmd, uint16_t count, uint8_t* data)
+{
+  uint16_t answered = 0;
+  uint8_t burst = 0;
+  uint8_t sent = 0;
 
-  if (mems_lock(info))
+  while (answered < count)
   {
-    // send the command and check for one additional byte after the
-    // echoed command byte (should be 0x00)
-    if (mems_send_command(info, (uint8_t)MEMS_Heartbeat) &&
-        (mems_read_serial(info, &response, 1) == 1))
+    burst = ((count - answered) < MEMS_MAX_BURST) ? (count - answered) : MEMS_MAX_BURST;
+
+    if (mems_poller_owns_link(info))
     {
-      status = true;
+      sent = mems_poller_submit(info, cmd, MEMS_Priority_Actuator, data) ? 1 : 0;
     }
-    mems_unlock(info);
+    else
+    {
+      sent = 0;
+      if (mems_lock_priority(info, MEMS_Priority_Actuator))
+      {
+        sent = mems_transact_burst(info, cmd, burst, data);
+        mems_link_result(info, sent == burst);
+        mems_unlock(info);
+      }
+    }
+
+    if (sent == 0)
+    {
+      break;
+    }
+    answered += sent;
   }
 
-  return status;
+  return answered;
 }
 
+/**
+ * Repeatedly send command to open or close the idle air control valve until
+ * it is in the desired position. The valve does not necessarily move one full
+ * step per serial command, depending on the rate at which the commands are
+ * issued.
+ */
+bool mems_move_iac(mems_info* info, uint8_t desired_pos)
+{
+  return mems_move_iac_ex(info, desired_pos, NULL, NULL);
+}
+
+/**
+ * Moves the idle air control valve to the desired position under closed-loop
+ * control. After each round trip, the number of steps the valve actually
+ * moved is compared with the number of commands sent, and this running
+ * estimate of steps-per-command sizes the next burst of commands so that
+ * the remaining distance is covered in as few round trips as possible. The
+ * direction is re-evaluated after every round trip, so an overshoot is
+ * corrected; the move is abandoned if the valve stops responding to
+ * commands or if MEMS_IAC_MAX_COMMANDS have been sent.
+ * @param desired_pos Target position
+ * @param callback Called after each round trip with the current position (may be NULL)
+ * @param user Passed through to the callback
+ * @return True if the valve reached the desired position
+ */
+bool mems_move_iac_ex(mems_info* info, uint8_t desired_pos, mems_iac_progress_callback callback, void* user)
+{
+  uint16_t commands = 0;
+  uint8_t current_pos = 0;
+  uint8_t previous_pos = 0;
+  uint8_t distance = 0;
+  uint8_t moved = 0;
+  uint16_t stalled = 0;
+  uint16_t burst = 0;
+  uint8_t sent = 0;
+  // running estimate of valve steps per command, in 1/256ths of a step
+  uint32_t rate = 256;
+  actuator_cmd cmd;
+
+  if (!mems_read_iac_position(info, &current_pos))
+  {
+    return false;
+  }
+
+  while ((current_pos != desired_pos) && (commands < MEMS_IAC_MAX_COMMANDS))
+  {
+    if ((desired_pos > current_pos) && (current_pos >= IAC_MAXIMUM))
+    {
+      break;
+    }
+
+    cmd = (desired_pos > current_pos) ? MEMS_OpenIAC : MEMS_CloseIAC;
+    distance = (desired_pos > current_pos) ? (desired_pos - current_pos) : (current_pos - desired_pos);
+
+    // enough commands to cover the distance at the observed rate; the valve
+    // can move further than the estimate predicts, so a burst may overshoot
+    // the target, in which case the next round reverses the direction
+    if (mems_poller_owns_link(info))
+    {
+      burst = 1;
+    }
+    else
+    {
+      burst = (uint16_t)((((uint32_t)distance * 256) + rate - 1) / rate);
+      burst = (burst > MEMS_MAX_BURST) ? MEMS_MAX_BURST : ((burst < 1) ? 1 : burst);
+    }
+
+    previous_pos = current_pos;
+    sent = (uint8_t)mems_repeat_actuator(info, cmd, burst, &current_pos);
+    if (sent == 0)
+    {
+      break;
+    }
+    commands += sent;
+
+    moved = (current_pos > previous_pos) ? (current_pos - previous_pos) : (previous_pos - current_pos);
+    if (moved == 0)
+    {
+      stalled += sent;
+      if (stalled >= MEMS_IAC_STALL_LIMIT)
+      {
+        dprintf_err("mems_move_iac_ex(): valve did not move in response to %d commands\n", stalled);
+        break;
+      }
+    }
+    else
+    {
+      stalled = 0;
+    }
+
+    // blend the steps/command observed in this round into the estimate,
+    // never letting it drop below the point at which a full burst is used
+    rate = (rate + (((uint32_t)moved * 256) / sent)) / 2;
+    if (rate < (256 / MEMS_MAX_BURST))
+    {
+      rate = 256 / MEMS_MAX_BURST;
+    }
+
+    if (callback)
+    {
+      callback(info, current_pos, desired_pos, commands, user);
+    }
+  }
+
+  return (current_pos == desired_pos);
+}
+
+/**
+ * Sends a command to run an actuator test, and returns the single byte of data.
+ * If the polling thread is running, the command is queued to it.
+ */
+bool mems_test_actuator(mems_info* info, actuator_cmd cmd, uint8_t* data)
+{
+  if (mems_poller_owns_link(info))
+  {
+    return mems_poller_submit(info, cmd, MEMS_Priority_Actuator, data);
+  }
+  return mems_run_command(info, cmd, MEMS_Priority_Actuator, data);
+}
+
+/**
+ * Sends a command to clear any stored fault codes. Once the ECU has
+ * acknowledged it, each active fault is reported to the fault callback as
+ * cleared by request.
+ */
+bool mems_clear_faults(mems_info* info)
+{
+  // send the command and check for one additional byte after the
+  // echoed command byte (should be 0x00)
+  uint8_t response = 0xFF;
+
+  if (mems_poller_owns_link(info))
+  {
+    return mems_poller_submit(info, MEMS_ClearFaults, MEMS_Priority_Actuator, &response);
+  }
+  return mems_run_command(info, MEMS_ClearFaults, MEMS_Priority_Actuator, &response);
+}
+
+/**
+ * Sends a simple heartbeat (ping) command to check connectivity. Any
+ * successful exchange keeps the ECU's link alive, so while the link is
+ * initialized and its last exchange succeeded, the command is only sent if
+ * there has been none for MEMS_KEEPALIVE_IDLE_MS; otherwise the link is
+ * known to be working and this returns true immediately.
+ */
+bool mems_heartbeat(mems_info* info)
+{
+  uint8_t response = 0xFF;
+  uint64_t last = MEMS_ATOMIC_LOAD_RELAXED(&info->last_exchange_us);
+
+  if (!mems_is_connected(info))
+  {
+    return false;
+  }
+
+  // a recent exchange shows nothing about a link that has since gone down
+  if (MEMS_ATOMIC_LOAD_RELAXED(&info->linked) && (MEMS_ATOMIC_LOAD_RELAXED(&info->failures) == 0) &&
+      (last != 0) && ((mems_time_us() - last) < (MEMS_KEEPALIVE_IDLE_MS * 1000ULL)))
+  {
+    return true;
+  }
+
+  // send the command and check for one additional byte after the
+  // echoed command byte (should be 0x00)
+  if (mems_poller_owns_link(info))
+  {
+    return mems_poller_submit(info, MEMS_Heartbeat, MEMS_Priority_Keepalive, &response);
+  }
+  return mems_run_command(info, MEMS_Heartbeat, MEMS_Priority_Keepalive, &response);
+}
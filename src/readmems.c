@@ -6,6 +6,10 @@
 #include <strings.h>
 #include <stdlib.h>
 #include <libgen.h>
+#include <signal.h>
+#if !defined(WIN32)
+#include <poll.h>
+#endif
 #include "rosco.h"
 
 enum command_idx
@@ -21,7 +25,12 @@ enum command_idx
   MC_Coil = 8,
   MC_Injectors = 9,
   MC_Interactive = 10,
-  MC_Num_Commands = 11
+  MC_Record = 11,
+  MC_Replay = 12,
+  MC_Export = 13,
+  MC_Publish = 14,
+  MC_Attach = 15,
+  MC_Num_Commands = 16
 };
 
 static const char* commands[] = { "read",
@@ -34,9 +43,22 @@ static const char* commands[] = { "read",
   "ac",
   "coil",
   "injectors",
-  "interactive"
+  "interactive",
+  "record",
+  "replay",
+  "export",
+  "publish",
+  "attach"
 };
 
+//! Number of samples taken from the polling thread's ring at a time while recording
+#define RECORD_BATCH 64
+
+//! Number of frames decoded at a time by an offline replay
+#define REPLAY_BATCH 1024
+
+static volatile sig_atomic_t stop_requested = 0;
+
 
 void printbuf(uint8_t* buf, unsigned int count)
 {
@@ -67,7 +89,17 @@ int16_t readserial(mems_info* info, uint8_t* buffer, uint16_t quantity)
     bytesread = w32BytesRead;
   }
 #else
-  bytesread = read(info->sd, buffer, quantity);
+  // the library configures the port for non-blocking reads, so wait here
+  // until a byte arrives or the line has been quiet for 100 ms
+  struct pollfd pfd;
+  pfd.fd = info->sd;
+  pfd.events = POLLIN;
+
+  bytesread = poll(&pfd, 1, 100);
+  if (bytesread > 0)
+  {
+    bytesread = read(info->sd, buffer, quantity);
+  }
 #endif
 
   return bytesread;
@@ -94,6 +126,404 @@ int16_t writeserial(mems_info* info, uint8_t* buffer, uint16_t quantity)
 }
 
 
+void print_data(const mems_data* data)
+{
+  printf("RPM: %u\nCoolant (deg F): %u\nAmbient (deg F): %u\nIntake air (deg F): %u\n"
+         "Fuel temp (deg F): %u\nMAP (kPa): %f\nMain voltage: %f\nThrottle pot voltage: %f\n"
+         "Idle switch: %u\nPark/neutral switch: %u\nFault codes: %u\nIAC position: %u\n"
+         "-------------\n",
+         data->engine_rpm, data->coolant_temp_f, data->ambient_temp_f,
+         data->intake_air_temp_f, data->fuel_temp_f, data->map_kpa, data->battery_voltage,
+         data->throttle_pot_voltage, data->idle_switch, data->park_neutral_switch,
+         data->fault_codes, data->iac_position);
+}
+
+
+void handle_stop(int sig)
+{
+  (void)sig;
+  stop_requested = 1;
+}
+
+
+/**
+ * Polls the ECU continuously on the library's polling thread, and writes
+ * every raw sample it publishes to a binary log. This thread only wakes a
+ * few times a second to drain the ring, so recording costs little CPU.
+ */
+bool record_log(mems_info* info, const char* path, bool forever, int count)
+{
+  mems_log_writer* log = NULL;
+  mems_sample* samples = NULL;
+  mems_ring* ring = NULL;
+  uint64_t seq = 0;
+  uint64_t expected = 0;
+  uint64_t written = 0;
+  uint64_t lost = 0;
+  uint32_t got = 0;
+  uint32_t idx = 0;
+  bool status = true;
+  mems_adaptive_options adaptive;
+  mems_adaptive_state rate;
+
+  if ((log = mems_log_create(path)) == NULL)
+  {
+    printf("Error: could not create log file (%s).\n", path);
+    return false;
+  }
+
+  samples = (mems_sample*)malloc(RECORD_BATCH * sizeof(mems_sample));
+  mems_set_pipelined(info, true);
+  mems_adaptive_options_init(&adaptive);
+  mems_set_adaptive_polling(info, &adaptive);
+  if ((samples == NULL) || !mems_start_polling(info, 0, NULL, NULL))
+  {
+    printf("Error: could not start polling the ECU.\n");
+    free(samples);
+    mems_log_close(log);
+    return false;
+  }
+
+  signal(SIGINT, handle_stop);
+  printf("Recording to %s (interrupt to stop)...\n", path);
+
+  ring = mems_get_ring(info);
+  while (status && !stop_requested && (forever || (written < (uint64_t)count)))
+  {
+    usleep(200000);
+
+    while ((got = mems_ring_read_since(ring, seq, samples, RECORD_BATCH, &seq)) > 0)
+    {
+      for (idx = 0; status && (idx < got) && (forever || (written < (uint64_t)count)); idx++)
+      {
+        // the ring only overwrites samples if this thread falls far behind
+        if (samples[idx].seq != expected)
+        {
+          lost += samples[idx].seq - expected;
+        }
+        expected = samples[idx].seq + 1;
+
+        status = mems_log_write_sample(log, &samples[idx]);
+        written++;
+      }
+    }
+  }
+
+  mems_get_adaptive_state(info, &rate);
+  mems_stop_polling(info);
+  signal(SIGINT, SIG_DFL);
+  free(samples);
+
+  status = mems_log_close(log) && status;
+  printf("Recorded %llu frames", (unsigned long long)written);
+  if (lost > 0)
+  {
+    printf(" (%llu lost)", (unsigned long long)lost);
+  }
+  printf(".\n");
+  if (rate.backoffs > 0)
+  {
+    printf("Backed off %u times because of link errors; final interval %u ms.\n",
+           rate.backoffs, rate.interval_ms);
+  }
+
+  return status && (written > 0);
+}
+
+
+/**
+ * Polls the ECU continuously, publishing every sample in a shared memory
+ * segment from which other processes (such as 'readmems <name> attach') can
+ * read, until interrupted.
+ */
+bool publish_link(mems_info* info, const char* name)
+{
+  mems_adaptive_options adaptive;
+
+  mems_set_pipelined(info, true);
+  mems_adaptive_options_init(&adaptive);
+  mems_set_adaptive_polling(info, &adaptive);
+  if (!mems_publish(info, name, 0) || !mems_start_polling(info, 0, NULL, NULL))
+  {
+    printf("Error: could not publish the ECU's data as %s.\n", name);
+    return false;
+  }
+
+  signal(SIGINT, handle_stop);
+  printf("Publishing as %s (interrupt to stop)...\n", name);
+  while (!stop_requested && mems_is_polling(info))
+  {
+    usleep(200000);
+  }
+
+  mems_stop_polling(info);
+  signal(SIGINT, SIG_DFL);
+  printf("Published %llu samples.\n", (unsigned long long)mems_ring_head(mems_get_ring(info)));
+
+  return true;
+}
+
+
+/**
+ * Attaches to the shared memory segment of a publishing readmems (or any
+ * other publisher), and prints each sample that it reads from the ECU.
+ */
+bool attach_monitor(const char* name, bool forever, int count)
+{
+  mems_shm* shm = NULL;
+  const mems_ring* ring = NULL;
+  mems_shm_status status;
+  mems_sample sample;
+  uint64_t seq = 0;
+  int printed = 0;
+
+  if ((shm = mems_shm_attach(name)) == NULL)
+  {
+    printf("Error: nothing is published as %s.\n", name);
+    return false;
+  }
+
+  ring = mems_shm_get_ring(shm);
+  seq = mems_ring_head(ring);
+  signal(SIGINT, handle_stop);
+
+  while (!stop_requested && (forever || (printed < count)))
+  {
+    if (mems_ring_read_since(ring, seq, &sample, 1, &seq) == 1)
+    {
+      print_data(&sample.data);
+      printed++;
+    }
+    else if (mems_shm_get_status(shm, &status) && !status.publishing)
+    {
+      printf("The publisher has stopped.\n");
+      break;
+    }
+    else
+    {
+      usleep(10000);
+    }
+  }
+
+  if (mems_shm_get_status(shm, &status))
+  {
+    printf("Publisher %u: %s, %u reconnects, %u/%u 0x80 requests completed\n",
+           status.publisher_pid, status.variant_name, status.reconnects,
+           status.stats80.completed, status.stats80.requests);
+  }
+
+  signal(SIGINT, SIG_DFL);
+  mems_shm_detach(shm);
+
+  return (printed > 0);
+}
+
+
+/**
+ * Decodes every frame of a binary log as fast as possible, and prints a
+ * summary of each channel.
+ */
+bool replay_offline(mems_log_reader* log)
+{
+  mems_data_frame_80* frames80 = NULL;
+  mems_data_frame_7d* frames7d = NULL;
+  mems_column_store* store = NULL;
+  mems_column_summary summary;
+  mems_log_cursor cursor;
+  mems_log_frame frame;
+  uint64_t start_us = 0;
+  uint64_t elapsed_us = 0;
+  size_t count = 0;
+  bool status = true;
+  int ch = 0;
+
+  frames80 = (mems_data_frame_80*)malloc(REPLAY_BATCH * sizeof(mems_data_frame_80));
+  frames7d = (mems_data_frame_7d*)malloc(REPLAY_BATCH * sizeof(mems_data_frame_7d));
+  store = mems_column_store_create();
+
+  if ((frames80 == NULL) || (frames7d == NULL) || (store == NULL))
+  {
+    printf("Error allocating replay buffers.\n");
+    status = false;
+  }
+  else
+  {
+    start_us = mems_time_us();
+    mems_log_rewind(log, &cursor);
+    do
+    {
+      count = 0;
+      while ((count < REPLAY_BATCH) && mems_log_next(log, &cursor, &frame))
+      {
+        memcpy(&frames80[count], frame.frame80, sizeof(mems_data_frame_80));
+        memcpy(&frames7d[count], frame.frame7d, sizeof(mems_data_frame_7d));
+        count++;
+      }
+      status = mems_column_store_decode(store, frames80, frames7d, count);
+    } while (status && (count == REPLAY_BATCH));
+    elapsed_us = mems_time_us() - start_us;
+
+    printf("Decoded %u frames in %.3f s\n\n", (unsigned int)mems_column_store_count(store),
+           elapsed_us / 1000000.0);
+    for (ch = 0; ch < MEMS_Num_Channels; ch++)
+    {
+      if (mems_column_store_summary(store, (mems_channel)ch, &summary))
+      {
+        printf("%-22s min %10.3f  max %10.3f  mean %10.3f\n", mems_channel_name((mems_channel)ch),
+               summary.min, summary.max, summary.mean);
+      }
+    }
+  }
+
+  mems_column_store_destroy(store);
+  free(frames80);
+  free(frames7d);
+
+  return status;
+}
+
+
+/**
+ * Writes every frame of a binary log to standard output as CSV or JSON
+ * lines, decoding the frames in batches.
+ */
+bool export_log(const char* path, const char* format_name)
+{
+  mems_log_reader* log = NULL;
+  mems_exporter* exp = NULL;
+  mems_data_frame_80* frames80 = NULL;
+  mems_data_frame_7d* frames7d = NULL;
+  mems_data* data = NULL;
+  uint64_t* timestamps = NULL;
+  mems_export_format format = MEMS_Export_CSV;
+  mems_log_cursor cursor;
+  mems_log_frame frame;
+  size_t count = 0;
+  bool status = true;
+
+  if (strcasecmp(format_name, "jsonl") == 0)
+  {
+    format = MEMS_Export_JSONL;
+  }
+  else if (strcasecmp(format_name, "csv") != 0)
+  {
+    printf("Error: unknown export format (%s).\n", format_name);
+    return false;
+  }
+
+  if ((log = mems_log_open(path)) == NULL)
+  {
+    printf("Error: could not open log file (%s).\n", path);
+    return false;
+  }
+
+  frames80 = (mems_data_frame_80*)malloc(REPLAY_BATCH * sizeof(mems_data_frame_80));
+  frames7d = (mems_data_frame_7d*)malloc(REPLAY_BATCH * sizeof(mems_data_frame_7d));
+  data = (mems_data*)malloc(REPLAY_BATCH * sizeof(mems_data));
+  timestamps = (uint64_t*)malloc(REPLAY_BATCH * sizeof(uint64_t));
+  exp = mems_exporter_create(1, format, MEMS_ALL_CHANNELS);
+
+  if ((frames80 == NULL) || (frames7d == NULL) || (data == NULL) || (timestamps == NULL) || (exp == NULL))
+  {
+    printf("Error allocating export buffers.\n");
+    status = false;
+  }
+  else
+  {
+    mems_log_rewind(log, &cursor);
+    do
+    {
+      count = 0;
+      while ((count < REPLAY_BATCH) && mems_log_next(log, &cursor, &frame))
+      {
+        memcpy(&frames80[count], frame.frame80, sizeof(mems_data_frame_80));
+        memcpy(&frames7d[count], frame.frame7d, sizeof(mems_data_frame_7d));
+        timestamps[count] = frame.timestamp_us;
+        count++;
+      }
+      mems_decode_batch(frames80, frames7d, count, data);
+      status = mems_export_batch(exp, timestamps, data, count);
+    } while (status && (count == REPLAY_BATCH));
+  }
+
+  if (exp != NULL)
+  {
+    status = mems_exporter_close(exp) && status;
+  }
+  mems_log_reader_close(log);
+  free(frames80);
+  free(frames7d);
+  free(data);
+  free(timestamps);
+
+  return status;
+}
+
+
+/**
+ * Replays a binary log, either by decoding it offline (at a speed of 0) or
+ * by serving its frames from the simulated ECU at the given multiple of the
+ * real serial link's speed, and reading them back as a live ECU would be.
+ */
+bool replay_log(const char* path, double speed)
+{
+  mems_log_reader* log = NULL;
+  mems_sim_options options;
+  mems_sim* sim = NULL;
+  mems_info info;
+  mems_data data;
+  uint64_t frames = 0;
+  uint64_t idx = 0;
+  bool status = false;
+
+  if ((log = mems_log_open(path)) == NULL)
+  {
+    printf("Error: could not open log file (%s).\n", path);
+    return false;
+  }
+
+  frames = mems_log_frame_count(log);
+  if (speed <= 0)
+  {
+    status = replay_offline(log);
+    mems_log_reader_close(log);
+    return status;
+  }
+  mems_log_reader_close(log);
+
+  mems_sim_options_init(&options);
+  options.byte_time_us = (uint32_t)(options.byte_time_us / speed);
+  options.turnaround_us = (uint32_t)(options.turnaround_us / speed);
+  if (options.byte_time_us == 0)
+  {
+    options.byte_time_us = 1;
+  }
+
+  mems_init(&info);
+  if (((sim = mems_sim_create(&options)) != NULL) && mems_sim_load_log(sim, path) &&
+      mems_sim_connect(&info, sim) && mems_init_link(&info, NULL))
+  {
+    status = true;
+    for (idx = 0; status && (idx < frames); idx++)
+    {
+      if ((status = mems_read(&info, &data)))
+      {
+        print_data(&data);
+      }
+    }
+  }
+  else
+  {
+    printf("Error: could not replay log file (%s) through the simulator.\n", path);
+  }
+
+  mems_cleanup(&info);
+  mems_sim_destroy(sim);
+
+  return status;
+}
+
+
 bool interactive_mode(mems_info* info, uint8_t* response_buffer)
 {
   size_t icmd_size = 8;
@@ -167,11 +597,10 @@ int main(int argc, char **argv)
   bool success = false;
   int cmd_idx = 0;
   mems_data data;
-  mems_data_frame_80 frame80;
-  mems_data_frame_7d frame7d;
+  mems_frame_view view;
   librosco_version ver;
   mems_info info;
-  uint8_t* frameptr;
+  const uint8_t* frameptr;
   uint8_t bufidx;
   uint8_t readval = 0;
   uint8_t iac_limit_count = 80; // number of times to re-send an IAC move command when
@@ -179,6 +608,7 @@ int main(int argc, char **argv)
   // the ECU is already reporting that the valve has
   // reached its requested position
   int read_loop_count = 1;
+  int loop_arg = 3;
   bool read_inf = false;
 
   // this is twice as large as the micro's on-chip ROM, so it's probably sufficient
@@ -193,12 +623,22 @@ int main(int argc, char **argv)
     printf("readmems using librosco v%d.%d.%d\n", ver.major, ver.minor, ver.patch);
     printf("Diagnostic utility using ROSCO protocol for MEMS 1.6 systems\n");
     printf("Usage: %s <serial device> <command> [read-loop-count]\n", basename(argv[0]));
+    printf("       %s <serial device> record <log file> [read-loop-count]\n", basename(argv[0]));
+    printf("       %s <log file> replay [speed]\n", basename(argv[0]));
+    printf("       %s <log file> export [csv|jsonl]\n", basename(argv[0]));
+    printf("       %s <serial device> publish <name>\n", basename(argv[0]));
+    printf("       %s <name> attach [read-loop-count]\n", basename(argv[0]));
     printf(" where <command> is one of the following:\n");
     for (cmd_idx = 0; cmd_idx < MC_Num_Commands; ++cmd_idx)
     {
       printf("\t%s\n", commands[cmd_idx]);
     }
     printf(" and [read-loop-count] is either a number or 'inf' to read forever.\n");
+    printf(" 'replay' serves the log from a simulated ECU at [speed] times the real\n");
+    printf(" link's rate, or decodes it offline as fast as possible if [speed] is 0 (the default).\n");
+    printf(" 'export' writes the log to standard output as CSV (the default) or JSON lines.\n");
+    printf(" 'publish' shares the ECU's data in shared memory, where any number of\n");
+    printf(" 'attach' commands (in other processes) can read it at the same time.\n");
 
     return 0;
   }
@@ -214,15 +654,47 @@ int main(int argc, char **argv)
     return -1;
   }
 
-  if (argc >= 4)
+  if (cmd_idx == MC_Replay)
+  {
+    return replay_log(argv[1], (argc >= 4) ? strtod(argv[3], NULL) : 0.0) ? 0 : -2;
+  }
+
+  if (cmd_idx == MC_Export)
+  {
+    return export_log(argv[1], (argc >= 4) ? argv[3] : "csv") ? 0 : -2;
+  }
+
+  if (((cmd_idx == MC_Record) || (cmd_idx == MC_Publish)) && (argc < 4))
+  {
+    printf("Error: the %s command needs %s.\n", commands[cmd_idx],
+           (cmd_idx == MC_Record) ? "the name of a log file" : "a name to publish as");
+    return -1;
+  }
+
+  if (cmd_idx == MC_Attach)
   {
-    if (strcmp(argv[3], "inf") == 0)
+    read_inf = (argc < 4) || (strcmp(argv[3], "inf") == 0);
+    read_loop_count = (argc >= 4) ? strtoul(argv[3], NULL, 0) : 0;
+    return attach_monitor(argv[1], read_inf, read_loop_count) ? 0 : -2;
+  }
+
+  // the record command's loop count follows the name of its log file
+  loop_arg = (cmd_idx == MC_Record) ? 4 : 3;
+  if (cmd_idx == MC_Record)
+  {
+    read_inf = true;
+  }
+
+  if (argc > loop_arg)
+  {
+    if (strcmp(argv[loop_arg], "inf") == 0)
     {
       read_inf = true;
     }
     else
     {
-      read_loop_count = strtoul(argv[3], NULL, 0);
+      read_inf = false;
+      read_loop_count = strtoul(argv[loop_arg], NULL, 0);
     }
   }
 
@@ -246,6 +718,10 @@ int main(int argc, char **argv)
     {
       printf("ECU responded to D0 command with: %02X %02X %02X %02X\n\n",
              response_buffer[0], response_buffer[1], response_buffer[2], response_buffer[3]);
+      if (mems_find_variant(response_buffer) == NULL)
+      {
+        printf("(Unrecognized ECU; decoding as %s)\n\n", mems_variant_name(mems_get_variant(&info)));
+      }
 
       switch (cmd_idx)
       {
@@ -254,14 +730,7 @@ int main(int argc, char **argv)
         {
           if (mems_read(&info, &data))
           {
-            printf("RPM: %u\nCoolant (deg F): %u\nAmbient (deg F): %u\nIntake air (deg F): %u\n"
-                   "Fuel temp (deg F): %u\nMAP (kPa): %f\nMain voltage: %f\nThrottle pot voltage: %f\n"
-                   "Idle switch: %u\nPark/neutral switch: %u\nFault codes: %u\nIAC position: %u\n"
-                   "-------------\n",
-                   data.engine_rpm, data.coolant_temp_f, data.ambient_temp_f,
-                   data.intake_air_temp_f, data.fuel_temp_f, data.map_kpa, data.battery_voltage,
-                   data.throttle_pot_voltage, data.idle_switch, data.park_neutral_switch,
-                   data.fault_codes, data.iac_position);
+            print_data(&data);
             success = true;
           }
         }
@@ -270,9 +739,9 @@ int main(int argc, char **argv)
       case MC_Read_Raw:
         while (read_inf || (read_loop_count-- > 0))
         {
-          if (mems_read_raw(&info, &frame80, &frame7d))
+          if (mems_read_raw_view(&info, &view))
           {
-            frameptr = (uint8_t*)&frame80;
+            frameptr = (const uint8_t*)view.frame80;
             printf("80: ");
             for (bufidx = 0; bufidx < sizeof(mems_data_frame_80); ++bufidx)
             {
@@ -280,7 +749,7 @@ int main(int argc, char **argv)
             }
             printf("\n");
 
-            frameptr = (uint8_t*)&frame7d;
+            frameptr = (const uint8_t*)view.frame7d;
             printf("7D: ");
             for (bufidx = 0; bufidx < sizeof(mems_data_frame_7d); ++bufidx)
             {
@@ -288,6 +757,8 @@ int main(int argc, char **argv)
             }
             printf("\n");
 
+            mems_release_view(&info, &view);
+
             success = true;
           }
         }
@@ -318,28 +789,26 @@ int main(int argc, char **argv)
         break;
 
       case MC_IAC_Close:
-        do
+        // The valve is moved under closed-loop control, so this fails if the
+        // valve stops moving before it is closed (see MEMS_IAC_STALL_LIMIT),
+        // rather than re-sending the command for as long as the ECU answers.
+        success = mems_move_iac_ex(&info, 0x00, NULL, NULL);
+
+        // For some reason, diagnostic tools will continue to send send the
+        // 'close' command many times after the IAC has already reached the
+        // fully-closed position. Emulate that behavior here. The commands
+        // are sent in bursts, and each one counts whatever position its
+        // reply reports (not only replies that report the closed position).
+        if (success)
         {
-          success = mems_test_actuator(&info, MEMS_CloseIAC, &readval);
-
-          // For some reason, diagnostic tools will continue to send send the
-          // 'close' command many times after the IAC has already reached the
-          // fully-closed position. Emulate that behavior here.
-          if (success && (readval == 0x00))
-          {
-            iac_limit_count -= 1;
-          }
-        } while (success && iac_limit_count);
+          success = (mems_repeat_actuator(&info, MEMS_CloseIAC, iac_limit_count, &readval) == iac_limit_count);
+        }
         break;
 
       case MC_IAC_Open:
         // The SP Rover 1 pod considers a value of 0xB4 to represent an opened
-        // IAC valve, so repeat the open command until the valve is opened to
-        // that point.
-        do
-        {
-          success = mems_test_actuator(&info, MEMS_OpenIAC, &readval);
-        } while (success && (readval < 0xB4));
+        // IAC valve, so move the valve until it is opened to that point.
+        success = mems_move_iac_ex(&info, IAC_MAXIMUM, NULL, NULL);
         break;
 
       case MC_AC:
@@ -362,6 +831,14 @@ int main(int argc, char **argv)
         success = interactive_mode(&info, response_buffer);
         break;
 
+      case MC_Record:
+        success = record_log(&info, argv[3], read_inf, read_loop_count);
+        break;
+
+      case MC_Publish:
+        success = publish_link(&info, argv[3]);
+        break;
+
       default:
         printf("Error: invalid command\n");
         break;
@@ -0,0 +1,293 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// ring.c: This file contains a lock-free ring buffer of timestamped
+//         samples, written by a single producer (the polling thread)
+//         and readable by any number of consumers without locking.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Identifies memory that has been initialized as a sample ring
+#define MEMS_RING_MAGIC 0x524E4752
+
+/**
+ * Each slot carries a stamp that doubles as a per-slot sequence lock: it is
+ * odd while the producer is writing the slot, and (seq + 1) * 2 once the
+ * sample with sequence number 'seq' is complete. A stamp of zero means that
+ * the slot has never been written.
+ */
+typedef struct
+{
+  uint64_t stamp;
+  mems_sample sample;
+} mems_ring_slot;
+
+struct mems_ring
+{
+  uint32_t magic;
+  uint32_t capacity;
+  //! Sequence number that will be given to the next sample written
+  uint64_t head;
+  //! True if the ring was allocated by mems_ring_create()
+  uint32_t owned;
+  uint32_t reserved;
+  mems_ring_slot slots[];
+};
+
+/**
+ * Returns the smallest power of two that is no smaller than the requested
+ * capacity or MEMS_RING_MIN_CAPACITY.
+ */
+static uint32_t mems_ring_round_capacity(uint32_t capacity)
+{
+  uint32_t rounded = MEMS_RING_MIN_CAPACITY;
+
+  while ((rounded < capacity) && (rounded < 0x80000000))
+  {
+    rounded <<= 1;
+  }
+
+  return rounded;
+}
+
+/**
+ * Returns the number of bytes of memory needed to hold a sample ring of the
+ * given capacity. The capacity is rounded up to a power of two, and to at
+ * least MEMS_RING_MIN_CAPACITY.
+ * @param capacity Number of samples that the ring should retain
+ */
+size_t mems_ring_size(uint32_t capacity)
+{
+  return sizeof(mems_ring) + ((size_t)mems_ring_round_capacity(capacity) * sizeof(mems_ring_slot));
+}
+
+/**
+ * Initializes a sample ring in caller-provided memory (which may, for
+ * example, be a shared memory segment). The memory must be at least
+ * mems_ring_size(capacity) bytes and aligned for 64-bit access.
+ * @param mem Memory in which to create the ring
+ * @param capacity Number of samples that the ring should retain
+ * @return Handle to the ring (equal to mem)
+ */
+mems_ring* mems_ring_init(void* mem, uint32_t capacity)
+{
+  mems_ring* ring = (mems_ring*)mem;
+
+  memset(mem, 0, mems_ring_size(capacity));
+  ring->capacity = mems_ring_round_capacity(capacity);
+  MEMS_ATOMIC_STORE(&ring->magic, MEMS_RING_MAGIC);
+
+  return ring;
+}
+
+/**
+ * Allocates and initializes a sample ring.
+ * @param capacity Number of samples that the ring should retain
+ * @return Handle to the ring, or NULL if the memory could not be allocated
+ */
+mems_ring* mems_ring_create(uint32_t capacity)
+{
+  mems_ring* ring = NULL;
+  void* mem = malloc(mems_ring_size(capacity));
+
+  if (mem != NULL)
+  {
+    ring = mems_ring_init(mem, capacity);
+    ring->owned = 1;
+  }
+
+  return ring;
+}
+
+/**
+ * Frees a ring that was allocated by mems_ring_create(). Rings created in
+ * caller-provided memory with mems_ring_init() are left alone.
+ */
+void mems_ring_destroy(mems_ring* ring)
+{
+  if (ring && ring->owned)
+  {
+    free(ring);
+  }
+}
+
+/**
+ * Returns the number of samples that the ring retains.
+ */
+uint32_t mems_ring_capacity(const mems_ring* ring)
+{
+  return ring->capacity;
+}
+
+/**
+ * Returns the sequence number that will be given to the next sample written
+ * (which is also the total number of samples written so far).
+ */
+uint64_t mems_ring_head(const mems_ring* ring)
+{
+  return MEMS_ATOMIC_LOAD(&ring->head);
+}
+
+/**
+ * Claims the slot for the next sample, so that the sample can be written in
+ * place (for example, by reading raw frames straight into it) rather than
+ * being built elsewhere and copied in. The sample is published to readers
+ * by mems_ring_commit(), or abandoned with mems_ring_cancel(); the slot's
+ * previous occupant, the oldest sample, is no longer readable either way.
+ * Only one thread may write to a given ring.
+ * @return The slot's sample, whose contents are those of the oldest sample
+ */
+mems_sample* mems_ring_reserve(mems_ring* ring)
+{
+  uint64_t seq = MEMS_ATOMIC_LOAD_RELAXED(&ring->head);
+  mems_ring_slot* slot = &ring->slots[seq & (ring->capacity - 1)];
+
+  MEMS_ATOMIC_STORE_RELAXED(&slot->stamp, ((seq + 1) * 2) - 1);
+  MEMS_ATOMIC_FENCE_RELEASE();
+
+  return &slot->sample;
+}
+
+/**
+ * Publishes the sample written into the slot claimed by mems_ring_reserve().
+ * The sample's sequence number is assigned here.
+ * @return Sequence number assigned to the sample
+ */
+uint64_t mems_ring_commit(mems_ring* ring)
+{
+  uint64_t seq = MEMS_ATOMIC_LOAD_RELAXED(&ring->head);
+  mems_ring_slot* slot = &ring->slots[seq & (ring->capacity - 1)];
+
+  slot->sample.seq = seq;
+
+  MEMS_ATOMIC_STORE(&slot->stamp, (seq + 1) * 2);
+  MEMS_ATOMIC_STORE(&ring->head, seq + 1);
+
+  return seq;
+}
+
+/**
+ * Abandons the slot claimed by mems_ring_reserve() without publishing a sample.
+ */
+void mems_ring_cancel(mems_ring* ring)
+{
+  uint64_t seq = MEMS_ATOMIC_LOAD_RELAXED(&ring->head);
+  mems_ring_slot* slot = &ring->slots[seq & (ring->capacity - 1)];
+
+  MEMS_ATOMIC_STORE(&slot->stamp, 0);
+}
+
+/**
+ * Appends a sample to the ring, overwriting the oldest sample if the ring is
+ * full. The sample's sequence number is assigned here. Only one thread may
+ * write to a given ring.
+ * @param sample Sample to copy into the ring
+ * @return Sequence number assigned to the sample
+ */
+uint64_t mems_ring_push(mems_ring* ring, const mems_sample* sample)
+{
+  memcpy(mems_ring_reserve(ring), sample, sizeof(mems_sample));
+  return mems_ring_commit(ring);
+}
+
+/**
+ * Copies the sample with the given sequence number out of the ring.
+ * @return True if the sample was copied; false if it has not been written
+ *   yet or has already been overwritten
+ */
+static bool mems_ring_copy(const mems_ring* ring, uint64_t seq, mems_sample* out)
+{
+  const mems_ring_slot* slot = &ring->slots[seq & (ring->capacity - 1)];
+  uint64_t expected = (seq + 1) * 2;
+  uint64_t before = 0;
+  uint64_t after = 0;
+
+  before = MEMS_ATOMIC_LOAD(&slot->stamp);
+  if (before != expected)
+  {
+    return false;
+  }
+
+  memcpy(out, &slot->sample, sizeof(mems_sample));
+  MEMS_ATOMIC_FENCE_ACQUIRE();
+  after = MEMS_ATOMIC_LOAD_RELAXED(&slot->stamp);
+
+  return (after == expected);
+}
+
+/**
+ * Retrieves the most recent sample in the ring.
+ * @param out Receives a copy of the sample
+ * @return True if a sample was retrieved; false if the ring is empty
+ */
+bool mems_ring_latest(const mems_ring* ring, mems_sample* out)
+{
+  uint64_t head = 0;
+
+  // if the producer laps us while copying, simply try the newer sample
+  while ((head = MEMS_ATOMIC_LOAD(&ring->head)) > 0)
+  {
+    if (mems_ring_copy(ring, head - 1, out))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Retrieves samples in order, starting with sequence number 'seq'. If the
+ * requested samples have already been overwritten, retrieval starts with
+ * the oldest sample still in the ring; callers can detect the gap from the
+ * sequence numbers of the returned samples.
+ * @param seq Sequence number of the first sample wanted
+ * @param out Array that receives copies of the samples
+ * @param max Maximum number of samples to retrieve
+ * @param next_seq If not NULL, receives the sequence number to pass in the
+ *   next call to continue where this one left off
+ * @return Number of samples copied into 'out'
+ */
+uint32_t mems_ring_read_since(const mems_ring* ring, uint64_t seq, mems_sample* out, uint32_t max, uint64_t* next_seq)
+{
+  uint64_t head = MEMS_ATOMIC_LOAD(&ring->head);
+  uint32_t count = 0;
+
+  if (head > ring->capacity && seq < head - ring->capacity)
+  {
+    seq = head - ring->capacity;
+  }
+
+  while ((count < max) && (seq < head))
+  {
+    if (mems_ring_copy(ring, seq, &out[count]))
+    {
+      count++;
+      seq++;
+    }
+    else
+    {
+      // the slot was overwritten while we were reading; skip ahead to the
+      // oldest sample that is still present
+      head = MEMS_ATOMIC_LOAD(&ring->head);
+      if (seq < head - ring->capacity)
+      {
+        seq = head - ring->capacity;
+      }
+      else
+      {
+        seq++;
+      }
+    }
+  }
+
+  if (next_seq)
+  {
+    *next_seq = seq;
+  }
+
+  return count;
+}
@@ -7,15 +7,24 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #if defined(WIN32)
+  // mems_info contains a condition variable, which requires Vista or later
+  #if !defined(_WIN32_WINNT) || (_WIN32_WINNT < 0x0600)
+    #undef _WIN32_WINNT
+    #define _WIN32_WINNT 0x0600
+  #endif
   #include <windows.h>
 #else
   #include <pthread.h>
   #include <errno.h>
 #endif
 
-#define DEBUG_P
+// diagnostic messages are printed unless disabled at build time
+#if !defined(MEMS_NO_DEBUG_OUTPUT) && !defined(DEBUG_P)
+  #define DEBUG_P
+#endif
 
 #ifdef DEBUG_P
   #define dprintf_err printf
@@ -29,6 +38,12 @@ extern "C" {
 
 #define IAC_MAXIMUM 0xB4
 
+//! Largest number of commands that mems_move_iac() sends in a single move
+#define MEMS_IAC_MAX_COMMANDS 300
+
+//! Number of consecutive commands without valve movement after which a move is abandoned
+#define MEMS_IAC_STALL_LIMIT 24
+
 /**
  * These general commands are used to request data and clear fault codes.
  */
@@ -172,6 +187,7 @@ typedef struct
      * Bit 1: Inlet air temp sensor CCT fault (2)
      * Bit 2: Fuel pump circuit fault (10)
      * Bit 3: Throttle pot circuit fault (16)
+     * (Every bit of dtc0 and dtc1 is tracked by mems_get_fault_status().)
      */
     uint8_t fault_codes;
     uint8_t iac_position;
@@ -184,6 +200,414 @@ typedef struct
     uint8_t idle_base_pos;
 } mems_data;
 
+/**
+ * Identifies one data channel (field) of the mems_data structure.
+ */
+enum mems_channel
+{
+    MEMS_Channel_EngineRPM          = 0,
+    MEMS_Channel_CoolantTemp        = 1,
+    MEMS_Channel_AmbientTemp        = 2,
+    MEMS_Channel_IntakeAirTemp      = 3,
+    MEMS_Channel_FuelTemp           = 4,
+    MEMS_Channel_MAP                = 5,
+    MEMS_Channel_BatteryVoltage     = 6,
+    MEMS_Channel_ThrottlePot        = 7,
+    MEMS_Channel_IdleSwitch         = 8,
+    MEMS_Channel_ParkNeutralSwitch  = 9,
+    MEMS_Channel_FaultCodes         = 10,
+    MEMS_Channel_IACPosition        = 11,
+    MEMS_Channel_IdleError          = 12,
+    MEMS_Channel_IgnitionAdvance    = 13,
+    MEMS_Channel_CoilTime           = 14,
+    MEMS_Channel_LambdaVoltage      = 15,
+    MEMS_Channel_FuelTrim           = 16,
+    MEMS_Channel_ClosedLoop         = 17,
+    MEMS_Channel_IdleBasePos        = 18,
+    MEMS_Num_Channels               = 19
+};
+
+typedef enum mems_channel mems_channel;
+
+//! Bit representing a channel in a channel mask
+#define MEMS_CHANNEL_BIT(ch) (1UL << (ch))
+
+//! Channel mask that includes every channel
+#define MEMS_ALL_CHANNELS ((1UL << MEMS_Num_Channels) - 1)
+
+/**
+ * Storage type of a data channel.
+ */
+typedef enum
+{
+    MEMS_Type_U8,
+    MEMS_Type_U16,
+    MEMS_Type_Float
+} mems_value_type;
+
+/**
+ * Columnar store of decoded samples, with one contiguous array per channel.
+ */
+typedef struct mems_column_store mems_column_store;
+
+//! Number of samples held by each chunk of a columnar store
+#define MEMS_COLUMN_CHUNK_SIZE 4096
+
+/**
+ * Summary of one channel over all of the samples in a columnar store.
+ */
+typedef struct
+{
+    double min;
+    double max;
+    double mean;
+    uint64_t count;
+} mems_column_summary;
+
+/**
+ * Times (from the monotonic clock of mems_time_us()) of the exchange that
+ * read one data frame. The ECU produces the frame between the arrival of
+ * the command and the start of its echo, so the best single estimate of
+ * the time the data was sampled is just before first_byte_us.
+ */
+typedef struct
+{
+    //! Time at which the request was written
+    uint64_t sent_us;
+    //! Time at which the first byte of the reply (the echo) was received
+    uint64_t first_byte_us;
+    //! Time at which the last byte of the reply was received
+    uint64_t last_byte_us;
+} mems_frame_times;
+
+//! Midpoint of the exchange that read a frame, from a mems_frame_times
+#define MEMS_FRAME_MIDPOINT_US(t) ((t).sent_us + (((t).last_byte_us - (t).sent_us) / 2))
+
+/**
+ * Times of the exchanges that read each of the frames behind a sample. A
+ * frame that was not re-read for the sample keeps the times of the
+ * exchange that last read it.
+ */
+typedef struct
+{
+    mems_frame_times frame80;
+    mems_frame_times frame7d;
+} mems_sample_times;
+
+/**
+ * A decoded sample together with the raw frames it was decoded from.
+ */
+typedef struct
+{
+    //! Position of this sample in the sequence produced by the polling thread
+    uint64_t seq;
+    //! Time at which the sample was received (from mems_time_us())
+    uint64_t timestamp_us;
+    //! Times of the exchanges that read the frames
+    mems_sample_times times;
+    mems_data data;
+    mems_data_frame_80 frame80;
+    mems_data_frame_7d frame7d;
+} mems_sample;
+
+/**
+ * Read-only view of a pair of raw frames in place in a connection's
+ * receive buffer (see mems_read_raw_view()). The frames remain valid, and
+ * the link remains held, until the view is released with mems_release_view().
+ */
+typedef struct
+{
+    //! Time at which the frames were received (from mems_time_us())
+    uint64_t timestamp_us;
+    //! Times of the exchanges that read the frames
+    mems_sample_times times;
+    const mems_data_frame_80* frame80;
+    const mems_data_frame_7d* frame7d;
+} mems_frame_view;
+
+/**
+ * Condition tested by an alarm rule against the value of its channel.
+ */
+typedef enum
+{
+    //! The value is above the threshold
+    MEMS_Alarm_Above,
+    //! The value is below the threshold
+    MEMS_Alarm_Below,
+    //! The value is rising faster than the threshold (in units per second)
+    MEMS_Alarm_RisingFaster,
+    //! The value is falling faster than the threshold (in units per second)
+    MEMS_Alarm_FallingFaster
+} mems_alarm_condition;
+
+/**
+ * Declarative description of one alarm, as passed to mems_alarm_compile().
+ * An alarm is raised once its condition has held for the given duration,
+ * and cleared once the value (or rate) has come back past the threshold by
+ * at least the hysteresis.
+ */
+typedef struct
+{
+    //! Identifies the rule to the callback
+    uint32_t id;
+    //! Channel whose value is tested
+    mems_channel channel;
+    mems_alarm_condition condition;
+    //! Level (or, for the rate conditions, units per second) at which the condition is met
+    double threshold;
+    //! Distance back past the threshold that the value must reach to clear the alarm
+    double hysteresis;
+    //! Time for which the condition must hold before the alarm is raised (0 for immediately)
+    uint32_t duration_ms;
+} mems_alarm_rule;
+
+/**
+ * An alarm being raised or cleared, as passed to a mems_alarm_callback.
+ */
+typedef struct
+{
+    //! Identifier of the rule (from mems_alarm_rule)
+    uint32_t id;
+    //! Index of the rule in the array passed to mems_alarm_compile()
+    uint32_t rule;
+    //! True if the alarm was raised; false if it was cleared
+    bool active;
+    //! Value (or rate, in units per second) that caused the change
+    double value;
+    //! Time (from mems_time_us()) of the sample in which the change was seen
+    uint64_t timestamp_us;
+} mems_alarm_event;
+
+/**
+ * A set of alarm rules prepared for evaluation, with the state of each.
+ */
+typedef struct mems_alarm_table mems_alarm_table;
+
+/**
+ * Lock-free ring buffer of samples, with one writer and any number of readers.
+ */
+typedef struct mems_ring mems_ring;
+
+//! Number of samples retained by the polling thread's ring buffer
+#define MEMS_DEFAULT_RING_CAPACITY 256
+
+//! Smallest number of samples that a ring buffer holds, so that the slot
+//! being written is never the one holding the most recent complete sample
+#define MEMS_RING_MIN_CAPACITY 2
+
+/**
+ * Named shared memory segment holding a polling thread's sample ring, as
+ * created by mems_publish() or attached by mems_shm_attach().
+ */
+typedef struct mems_shm mems_shm;
+
+//! Longest name that may be given to a shared memory segment
+#define MEMS_SHM_NAME_MAX 62
+
+//! Number of bytes in a pair of raw frames, as covered by the delta encoding
+#define MEMS_DELTA_FRAME_SIZE (sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d))
+
+//! Largest possible delta-encoded packet (flags, group mask, eight byte masks and every byte)
+#define MEMS_DELTA_MAX_SIZE (2 + 8 + MEMS_DELTA_FRAME_SIZE)
+
+//! Default number of frames between keyframes
+#define MEMS_DELTA_KEYFRAME_INTERVAL 64
+
+/**
+ * State of a delta encoder, which turns a stream of raw frame pairs into
+ * packets that carry only the bytes that changed since the previous pair.
+ * Every keyframe_interval'th packet is a keyframe containing the whole pair,
+ * so that a reader can start decoding there.
+ */
+typedef struct
+{
+    //! Previous pair of frames, against which the next pair is compared
+    mems_data_frame_80 frame80;
+    mems_data_frame_7d frame7d;
+    uint32_t keyframe_interval;
+    //! Number of packets since the last keyframe (keyframe_interval forces one)
+    uint32_t since_keyframe;
+} mems_delta_encoder;
+
+//! Log file flag: frames are stored in delta-encoded blocks
+#define MEMS_LOG_DELTA 0x0001
+
+/**
+ * Sends the polling thread's samples to a remote receiver in batches.
+ */
+typedef struct mems_streamer mems_streamer;
+
+/**
+ * Transport used by a streamer.
+ */
+typedef enum
+{
+    MEMS_Stream_TCP,
+    MEMS_Stream_UDP
+} mems_stream_protocol;
+
+/**
+ * Destination and batching options for a streamer.
+ */
+typedef struct
+{
+    mems_stream_protocol protocol;
+    //! Name or address of the receiver, and its port
+    const char* host;
+    uint16_t port;
+    //! When set, frames are delta-encoded (each batch starting with a keyframe)
+    bool delta;
+    //! Number of frames between keyframes within a batch (0 for the default)
+    uint32_t keyframe_interval;
+    //! Largest batch, in bytes (with UDP, the largest datagram)
+    uint32_t max_batch_bytes;
+    //! Longest time a frame waits for its batch to fill before the batch is sent
+    uint32_t max_batch_ms;
+    //! Number of batches held while the network is slow or down; beyond
+    //! this, the oldest queued batch is dropped
+    uint32_t queue_batches;
+} mems_stream_options;
+
+/**
+ * Counters kept by a streamer.
+ */
+typedef struct
+{
+    //! Frames taken from the polling thread's ring and added to batches
+    uint64_t frames_queued;
+    //! Frames and batches handed to the network
+    uint64_t frames_sent;
+    uint64_t batches_sent;
+    uint64_t bytes_sent;
+    //! Frames and batches discarded because the queue was full (or, over UDP, the send failed)
+    uint64_t frames_dropped;
+    uint64_t batches_dropped;
+    //! Samples overwritten in the ring before the streamer could take them
+    uint64_t frames_lost;
+    //! Number of times the socket was connected
+    uint64_t connects;
+} mems_stream_stats;
+
+/**
+ * Writer for the binary log format, which stores timestamped raw frames.
+ */
+typedef struct mems_log_writer mems_log_writer;
+
+/**
+ * Reader for the binary log format, which maps the log file into memory.
+ */
+typedef struct mems_log_reader mems_log_reader;
+
+/**
+ * One frame from a binary log. The frame pointers refer directly to the
+ * mapped log file, except in delta-encoded logs, where they refer to the
+ * reconstructed frames held in the cursor (and so remain valid only until
+ * the cursor is next used).
+ */
+typedef struct
+{
+    uint64_t timestamp_us;
+    const mems_data_frame_80* frame80;
+    const mems_data_frame_7d* frame7d;
+} mems_log_frame;
+
+/**
+ * Position of an iteration over the frames of a binary log.
+ */
+typedef struct
+{
+    //! Offset of the next record to be examined
+    uint64_t offset;
+    //! Within a block of delta-encoded frames: offset of the next encoded
+    //! frame, offset of the end of the block, and number of frames left
+    uint64_t block_pos;
+    uint64_t block_end;
+    uint32_t block_remaining;
+    //! Timestamp and contents of the most recently decoded frame of the block
+    uint64_t timestamp_us;
+    mems_data_frame_80 frame80;
+    mems_data_frame_7d frame7d;
+} mems_log_cursor;
+
+/**
+ * Summary of every channel over one fixed window of samples, as produced by
+ * an aggregator. The min, max and mean of each channel are stored in the
+ * channel's own field of the corresponding mems_data (means of integer
+ * channels are rounded to the nearest value).
+ */
+typedef struct
+{
+    //! Start of the window (from mems_time_us()), a multiple of its length
+    uint64_t start_us;
+    //! Length of the window
+    uint32_t window_ms;
+    //! Number of samples in the window
+    uint32_t count;
+    mems_data min;
+    mems_data max;
+    mems_data mean;
+} mems_rollup;
+
+/**
+ * Reduces a stream of decoded samples to one mems_rollup per fixed window.
+ */
+typedef struct mems_aggregator mems_aggregator;
+
+//! Window lengths for which aggregators are commonly configured
+#define MEMS_ROLLUP_1S   1000
+#define MEMS_ROLLUP_10S  10000
+#define MEMS_ROLLUP_60S  60000
+
+/**
+ * Text formats written by the bulk exporter.
+ */
+typedef enum
+{
+    //! Comma-separated values, with a header line naming the columns
+    MEMS_Export_CSV,
+    //! One JSON object per line, keyed by channel name
+    MEMS_Export_JSONL
+} mems_export_format;
+
+/**
+ * Formats decoded samples as text into a reusable buffer, which is written
+ * out in large blocks.
+ */
+typedef struct mems_exporter mems_exporter;
+
+/**
+ * Event loop that drives the read cycles of many ECU connections at once.
+ */
+typedef struct mems_session mems_session;
+
+/**
+ * Simulated MEMS 1.6 ECU, which answers commands with recorded (or
+ * built-in) data frames at the timing of a real serial link.
+ */
+typedef struct mems_sim mems_sim;
+
+/**
+ * Behaviour of a simulated ECU.
+ */
+typedef struct
+{
+    //! Time to transfer one character in either direction (default: 9600 baud)
+    uint32_t byte_time_us;
+    //! Time between the arrival of a command and the start of its echo (default 500 us)
+    uint32_t turnaround_us;
+    //! Largest random delay added to the turnaround of each reply (default 0)
+    uint32_t jitter_us;
+    //! Chance, in thousandths, that a command receives no reply at all (default 0)
+    uint16_t dropout_per_mille;
+    //! Seed for the jitter and dropouts, so that runs can be repeated exactly
+    uint32_t seed;
+    //! Reply to the D0 command of the initialization sequence
+    uint8_t d0_response[4];
+} mems_sim_options;
+
+//! Maximum number of connections in one session
+#define MEMS_SESSION_MAX_LINKS 64
+
 /**
  * Major/minor/patch version numbers for this build of the library
  */
@@ -197,6 +621,212 @@ typedef struct
   uint8_t patch;
 } librosco_version;
 
+//! Number of buckets in the latency histogram of each command
+#define MEMS_STATS_HIST_BUCKETS 12
+
+/**
+ * Counters and timings for one command byte, accumulated over every
+ * exchange with the ECU that used that command. The latency histogram
+ * counts completed exchanges by their total (echo plus payload) latency:
+ * bucket 0 holds those under 1 ms, and each following bucket doubles the
+ * bound (under 2 ms, under 4 ms, ...), with the last bucket holding
+ * everything beyond.
+ */
+typedef struct
+{
+  //! Number of times the command was sent
+  uint32_t requests;
+  //! Number of exchanges in which the echo and the full reply were received
+  uint32_t completed;
+  //! Number of exchanges in which no echo was received
+  uint32_t timeouts;
+  //! Number of exchanges in which the echo arrived, but not all of the reply
+  uint32_t short_reads;
+  //! Number of exchanges in which the echo did not match the command
+  uint32_t mismatches;
+  //! Number of times that stray bytes (such as the remains of a late or
+  //! partial reply) were discarded to bring the input back into step
+  uint32_t resyncs;
+  //! Total number of stray bytes discarded
+  uint32_t discarded;
+  //! Sum and maximum of the time from sending the command to receiving the echo
+  uint64_t echo_us_total;
+  uint32_t echo_us_max;
+  //! Sum and maximum of the time from receiving the echo to receiving the full reply
+  uint64_t payload_us_total;
+  uint32_t payload_us_max;
+  //! Completed exchanges, by total latency
+  uint32_t histogram[MEMS_STATS_HIST_BUCKETS];
+} mems_command_stats;
+
+/**
+ * State of a publishing process's link, as seen through its shared memory
+ * segment (see mems_shm_get_status()).
+ */
+typedef struct
+{
+    //! True until the publisher calls mems_cleanup()
+    bool publishing;
+    //! True while the publisher's link to the ECU is initialized
+    bool linked;
+    //! Process ID of the publisher
+    uint32_t publisher_pid;
+    //! Number of times the publisher has re-initialized the link
+    uint32_t reconnects;
+    //! Time (from mems_time_us()) of the most recent update, made after every sample
+    uint64_t updated_us;
+    //! ECU's reply to the D0 command, and the name of the variant it identified
+    uint8_t d0_response[4];
+    char variant_name[28];
+    //! Statistics for the two data frame requests (see mems_get_stats())
+    mems_command_stats stats80;
+    mems_command_stats stats7d;
+} mems_shm_status;
+
+/**
+ * Limits within which the adaptive rate controller (see
+ * mems_set_adaptive_polling()) may set the polling interval and the
+ * allowance for the ECU's turnaround on each reply.
+ */
+typedef struct
+{
+    uint32_t min_interval_ms;
+    uint32_t max_interval_ms;
+    uint32_t min_reply_margin_ms;
+    uint32_t max_reply_margin_ms;
+} mems_adaptive_options;
+
+/**
+ * Current settings of the adaptive rate controller.
+ */
+typedef struct
+{
+    bool enabled;
+    //! Interval between the starts of read cycles, and the reply margin, now in effect
+    uint32_t interval_ms;
+    uint32_t reply_margin_us;
+    //! Recent worst time taken by the ECU to turn a 0x80 request around
+    uint32_t peak_turnaround_us;
+    //! Number of times the controller has backed off because of failed exchanges
+    uint32_t backoffs;
+    //! Clean cycles since the controller last backed off or tightened
+    uint32_t clean_cycles;
+} mems_adaptive_state;
+
+//! Number of fault bits reported by the ECU: fault numbers 0-7 are the
+//! bits of the dtc0 byte of the 0x80 frame, and 8-15 the bits of dtc1
+#define MEMS_NUM_FAULTS 16
+
+//! Fault number of a bit of the dtc0 or dtc1 byte
+#define MEMS_FAULT_DTC0(bit) (bit)
+#define MEMS_FAULT_DTC1(bit) (8 + (bit))
+
+/**
+ * History of one fault bit, as tracked across every 0x80 frame read from
+ * the ECU (see mems_get_fault_status()).
+ */
+typedef struct
+{
+  //! True if the fault was reported in the most recent frame
+  bool active;
+  //! Number of times the fault has gone from inactive to active
+  uint32_t set_count;
+  //! Times (from mems_time_us()) at which the fault was first and last set
+  uint64_t first_set_us;
+  uint64_t last_set_us;
+  //! Time at which the fault last went inactive (0 if it never has)
+  uint64_t last_cleared_us;
+} mems_fault_status;
+
+/**
+ * A change in the state of one fault, as passed to a mems_fault_callback.
+ */
+typedef struct
+{
+  //! Time (from mems_time_us()) of the frame in which the change was seen
+  uint64_t timestamp_us;
+  //! Fault number (see MEMS_FAULT_DTC0() and MEMS_FAULT_DTC1())
+  uint8_t fault;
+  //! True if the fault was set; false if it was cleared
+  bool active;
+  //! True if the fault was cleared by mems_clear_faults() rather than by the ECU itself
+  bool by_request;
+  //! Number of times the fault has been set, including this time
+  uint32_t set_count;
+} mems_fault_event;
+
+/**
+ * Settings for the serial link, used by mems_connect_ex(). Fields that are
+ * left at zero take their default values; mems_connect_options_init() fills
+ * in all of the defaults explicitly.
+ */
+typedef struct
+{
+  //! Baud rate of the link (default 9600, which is what the ECU uses)
+  uint32_t baud_rate;
+  //! Allowance for the ECU's turnaround, added to the transfer time of each reply (default 60 ms)
+  uint32_t reply_margin_ms;
+  //! Longest single wait for the first byte of a read, under Win32 only (default 10 ms)
+  uint32_t read_poll_ms;
+  //! When set, asks the driver and adapter to deliver received bytes without
+  //! buffering delays (Linux only: ASYNC_LOW_LATENCY and the FTDI latency timer)
+  bool low_latency;
+  //! Latency timer written to FTDI adapters in low-latency mode (default 1 ms)
+  uint8_t ftdi_latency_ms;
+} mems_connect_options;
+
+//! Size of the receive buffer used to collect each reply from the ECU (large
+//! enough to hold the replies to 0x80 and 0x7D back to back, with their echoes)
+#define MEMS_RX_BUFFER_SIZE 64
+
+//! Largest number of commands sent with a single write
+#define MEMS_MAX_BURST 8
+
+/**
+ * Functions through which a connection exchanges bytes with the ECU in
+ * place of a serial device (see mems_connect_transport()). Each is passed
+ * the transport's context pointer, and is only called by the thread that
+ * holds the link.
+ */
+typedef struct
+{
+    //! Returns the bytes available now (up to quantity) without waiting, or -1 on error
+    int16_t (*read)(void* ctx, uint8_t* buffer, uint16_t quantity);
+    //! Sends bytes, returning the number sent or -1 on error
+    int16_t (*write)(void* ctx, const uint8_t* buffer, uint16_t quantity);
+    //! Waits until data may be read, or the deadline (from mems_time_us()) passes
+    bool (*wait_readable)(void* ctx, uint64_t deadline_us);
+    //! Discards any bytes received but not yet read
+    void (*flush_input)(void* ctx);
+    //! Called when the connection is closed (may be NULL)
+    void (*close)(void* ctx);
+} mems_transport;
+
+/**
+ * Classes of work that compete for the serial link. When several threads
+ * are waiting for the link, it is handed to the highest class first, and
+ * in order of arrival within a class.
+ */
+typedef enum
+{
+    //! Data reads (mems_read(), mems_read_raw(), etc.)
+    MEMS_Priority_Data = 0,
+    //! Heartbeats and (re)initialization of the link
+    MEMS_Priority_Keepalive = 1,
+    //! Actuator tests, fault clearing and IAC control
+    MEMS_Priority_Actuator = 2,
+    MEMS_Num_Priorities = 3
+} mems_priority;
+
+struct mems_poller;
+struct mems_fault_tracker;
+
+/**
+ * An ECU variant that the library can decode, identified by its reply to
+ * the D0 command of the initialization sequence.
+ */
+typedef struct mems_variant mems_variant;
+
 /**
  * Contains information about the state of the current connection to the ECU.
  */
@@ -205,30 +835,282 @@ typedef struct
 #if defined(WIN32)
     //! Descriptor for the serial port device
     HANDLE sd;
-    //! Lock to prevent multiple simultaneous open/close/read/write operations
-    HANDLE mutex;
+    //! Guards the scheduler state below
+    CRITICAL_SECTION mutex;
+    //! Signalled whenever the link is released
+    CONDITION_VARIABLE link_free;
 #else
     //! Descriptor for the serial port device
     int sd;
-    //! Lock to prevent multiple simultaneous open/close/read/write operations
+    //! Guards the scheduler state below
     pthread_mutex_t mutex;
+    //! Signalled whenever the link is released
+    pthread_cond_t link_free;
 #endif
+    //! When not NULL, used instead of the serial device
+    const mems_transport* transport;
+    void* transport_ctx;
+    //! Set while a thread has exclusive use of the link (see mems_lock())
+    bool link_busy;
+    //! Number of threads waiting for the link in each priority class
+    uint32_t sched_waiting[MEMS_Num_Priorities];
+    //! Tickets that keep the waiters in each class in order of arrival
+    uint32_t sched_next[MEMS_Num_Priorities];
+    uint32_t sched_serving[MEMS_Num_Priorities];
+    //! Time (from mems_time_us()) at which the last successful exchange completed
+    uint64_t last_exchange_us;
+    //! Times of the exchanges that most recently read each data frame
+    mems_sample_times frame_times;
+    //! Time needed to transfer one character at the link's baud rate
+    uint32_t byte_time_us;
+    //! Allowance for the ECU's turnaround time, added to the transfer time of each reply
+    uint32_t reply_margin_us;
+    //! Longest single wait for the first byte of a read (Win32 only)
+    uint32_t read_poll_ms;
+    //! When set, the 0x7D request is issued before the 0x80 reply has been fully received
+    bool pipelined;
+    //! State of the background polling thread (allocated by mems_start_polling())
+    struct mems_poller* poller;
+    //! True once the initialization sequence has completed
+    bool linked;
+    //! When set, a lost link is re-initialized automatically
+    bool auto_reconnect;
+    //! Number of consecutive failed exchanges with the ECU
+    uint8_t failures;
+    //! Number of times the link has been re-initialized
+    uint32_t reconnects;
+    //! Bytes sent by the ECU in reply to the D0 command of the initialization sequence
+    uint8_t d0_response[4];
+    //! Variant identified by the D0 reply, which supplies the frame decoder
+    const mems_variant* variant;
+    //! Per-command counters, indexed by command byte (allocated on first use)
+    mems_command_stats* stats;
+    //! State of each fault bit, and the function told of changes (allocated on first use)
+    struct mems_fault_tracker* faults;
+    //! Staging buffers for outgoing command bursts and incoming replies
+    uint8_t txbuf[MEMS_MAX_BURST];
+    uint8_t rxbuf[MEMS_RX_BUFFER_SIZE];
 } mems_info;
 
+//! Maximum number of functions that may be subscribed to the polling thread's samples
+#define MEMS_MAX_SUBSCRIBERS 8
+
+/**
+ * Type of function that receives each sample read by the polling thread.
+ * It is called on the polling thread, so it should return promptly.
+ */
+typedef void (*mems_data_callback)(mems_info* info, const mems_data* data, void* user);
+
+/**
+ * Type of the function called by mems_move_iac_ex() as the idle air control
+ * valve moves: with the current position, the target position and the
+ * number of commands sent so far.
+ */
+typedef void (*mems_iac_progress_callback)(mems_info* info, uint8_t position, uint8_t target,
+                                           uint16_t commands, void* user);
+
+/**
+ * Type of function that is told when a fault is set or cleared. It is called
+ * by whichever thread read the frame in which the change was seen, while that
+ * thread holds the link, so it must not call back into the library for the
+ * same connection.
+ */
+typedef void (*mems_fault_callback)(mems_info* info, const mems_fault_event* event, void* user);
+
+/**
+ * Type of function that is told when an alarm is raised or cleared. When
+ * the alarms are evaluated by the polling thread, it is called on that
+ * thread (between reads, without the link held), so it should return promptly.
+ */
+typedef void (*mems_alarm_callback)(mems_info* info, const mems_alarm_event* event, void* user);
+
+/**
+ * Type of function that receives each window summary produced by an
+ * aggregator. It is called by whichever thread adds the sample that ends
+ * the window (the polling thread, if the aggregator is subscribed to it).
+ */
+typedef void (*mems_rollup_callback)(const mems_rollup* rollup, void* user);
+
 void mems_init(mems_info* info);
 bool mems_init_link(mems_info* info, uint8_t* d0_response_buffer);
+bool mems_reinit_link(mems_info* info, uint8_t* d0_response_buffer);
+void mems_set_auto_reconnect(mems_info* info, bool enable);
 void mems_cleanup(mems_info* info);
 bool mems_connect(mems_info* info, const char* devPath);
+void mems_connect_options_init(mems_connect_options* options);
+bool mems_connect_ex(mems_info* info, const char* devPath, const mems_connect_options* options);
+bool mems_connect_transport(mems_info* info, const mems_transport* transport, void* ctx,
+                            const mems_connect_options* options);
 void mems_disconnect(mems_info* info);
 bool mems_is_connected(mems_info* info);
+void mems_set_pipelined(mems_info* info, bool enable);
 bool mems_read_raw(mems_info* info, mems_data_frame_80* frame80, mems_data_frame_7d* frame7d);
+bool mems_read_raw_view(mems_info* info, mems_frame_view* view);
+void mems_release_view(mems_info* info, mems_frame_view* view);
 bool mems_read(mems_info* info, mems_data* data);
+bool mems_read_timed(mems_info* info, mems_data* data, mems_sample_times* times);
+bool mems_read_channels(mems_info* info, uint32_t channels, mems_data* data);
 bool mems_read_iac_position(mems_info* info, uint8_t* position);
 bool mems_move_iac(mems_info* info, uint8_t desired_pos);
+bool mems_move_iac_ex(mems_info* info, uint8_t desired_pos, mems_iac_progress_callback callback, void* user);
+uint16_t mems_repeat_actuator(mems_info* info, actuator_cmd cmd, uint16_t count, uint8_t* data);
 bool mems_test_actuator(mems_info* info, actuator_cmd cmd, uint8_t* data);
 bool mems_clear_faults(mems_info* info);
 bool mems_heartbeat(mems_info* info);
 
+void mems_get_frame_times(mems_info* info, mems_sample_times* times);
+bool mems_get_stats(mems_info* info, uint8_t cmd, mems_command_stats* stats);
+void mems_reset_stats(mems_info* info);
+
+void mems_set_fault_callback(mems_info* info, mems_fault_callback callback, void* user);
+uint16_t mems_get_active_faults(mems_info* info);
+bool mems_get_fault_status(mems_info* info, uint8_t fault, mems_fault_status* status);
+void mems_reset_fault_history(mems_info* info);
+const char* mems_fault_name(uint8_t fault);
+
+bool mems_start_polling(mems_info* info, uint32_t interval_ms, mems_data_callback callback, void* user);
+void mems_stop_polling(mems_info* info);
+bool mems_is_polling(mems_info* info);
+bool mems_subscribe(mems_info* info, mems_data_callback callback, void* user);
+void mems_unsubscribe(mems_info* info, mems_data_callback callback, void* user);
+
+void mems_set_poll_channels(mems_info* info, uint32_t channels, uint32_t slow_interval);
+mems_ring* mems_get_ring(mems_info* info);
+bool mems_publish(mems_info* info, const char* name, uint32_t capacity);
+void mems_adaptive_options_init(mems_adaptive_options* options);
+void mems_set_adaptive_polling(mems_info* info, const mems_adaptive_options* options);
+bool mems_get_adaptive_state(mems_info* info, mems_adaptive_state* state);
+void mems_set_alarms(mems_info* info, mems_alarm_table* alarms);
+
+void mems_sim_options_init(mems_sim_options* options);
+mems_sim* mems_sim_create(const mems_sim_options* options);
+void mems_sim_destroy(mems_sim* sim);
+bool mems_sim_set_frames(mems_sim* sim, const mems_data_frame_80* frames80,
+                         const mems_data_frame_7d* frames7d, size_t count);
+bool mems_sim_load_log(mems_sim* sim, const char* path);
+bool mems_sim_connect(mems_info* info, mems_sim* sim);
+bool mems_sim_start_pty(mems_sim* sim, char* path, size_t path_len);
+void mems_sim_stop_pty(mems_sim* sim);
+void mems_sim_counts(mems_sim* sim, uint32_t* commands, uint32_t* dropped);
+
+mems_session* mems_session_create();
+void mems_session_destroy(mems_session* session);
+bool mems_session_add(mems_session* session, mems_info* info, uint32_t interval_ms,
+                      mems_data_callback callback, void* user);
+bool mems_session_remove(mems_session* session, mems_info* info);
+int mems_session_run_once(mems_session* session, uint32_t timeout_ms);
+bool mems_session_run(mems_session* session);
+void mems_session_stop(mems_session* session);
+
+mems_alarm_table* mems_alarm_compile(const mems_alarm_rule* rules, size_t count,
+                                     mems_alarm_callback callback, void* user);
+void mems_alarm_destroy(mems_alarm_table* alarms);
+void mems_alarm_reset(mems_alarm_table* alarms);
+int mems_alarm_evaluate(mems_alarm_table* alarms, mems_info* info, const mems_data* data, uint64_t timestamp_us);
+bool mems_alarm_is_active(const mems_alarm_table* alarms, size_t rule);
+
+const mems_variant* mems_get_variant(mems_info* info);
+const mems_variant* mems_find_variant(const uint8_t* d0_response);
+const char* mems_variant_name(const mems_variant* variant);
+void mems_variant_decode_batch(const mems_variant* variant, const mems_data_frame_80* frames80,
+                               const mems_data_frame_7d* frames7d, size_t n, mems_data* out);
+
+mems_aggregator* mems_aggregator_create(uint32_t window_ms, mems_rollup_callback callback, void* user);
+void mems_aggregator_destroy(mems_aggregator* agg);
+void mems_aggregator_set_outputs(mems_aggregator* agg, mems_log_writer* log, mems_column_store* min_store,
+                                 mems_column_store* max_store, mems_column_store* mean_store);
+bool mems_aggregator_add(mems_aggregator* agg, const mems_data* data, uint64_t timestamp_us);
+bool mems_aggregator_flush(mems_aggregator* agg);
+void mems_aggregator_callback(mems_info* info, const mems_data* data, void* user);
+
+mems_exporter* mems_exporter_create(int fd, mems_export_format format, uint32_t channels);
+mems_exporter* mems_exporter_open(const char* path, mems_export_format format, uint32_t channels);
+bool mems_export_sample(mems_exporter* exp, uint64_t timestamp_us, const mems_data* data);
+bool mems_export_batch(mems_exporter* exp, const uint64_t* timestamps, const mems_data* data, size_t n);
+bool mems_export_column_store(mems_exporter* exp, const mems_column_store* store,
+                              uint64_t start_us, uint64_t interval_us);
+bool mems_exporter_flush(mems_exporter* exp);
+bool mems_exporter_close(mems_exporter* exp);
+
+void mems_decode_batch(const mems_data_frame_80* frames80, const mems_data_frame_7d* frames7d,
+                       size_t n, mems_data* out);
+
+const char* mems_channel_name(mems_channel ch);
+mems_value_type mems_channel_type(mems_channel ch);
+double mems_channel_value(const mems_data* data, mems_channel ch);
+uint8_t mems_channel_source(mems_channel ch);
+uint32_t mems_frame_channels(uint8_t cmd);
+
+mems_column_store* mems_column_store_create();
+void mems_column_store_destroy(mems_column_store* store);
+void mems_column_store_clear(mems_column_store* store);
+bool mems_column_store_append(mems_column_store* store, const mems_data* data, size_t n);
+bool mems_column_store_decode(mems_column_store* store, const mems_data_frame_80* frames80,
+                              const mems_data_frame_7d* frames7d, size_t n);
+size_t mems_column_store_count(const mems_column_store* store);
+size_t mems_column_store_chunk_count(const mems_column_store* store);
+const void* mems_column_store_chunk(const mems_column_store* store, mems_channel ch,
+                                    size_t chunk_idx, size_t* count);
+size_t mems_column_store_copy(const mems_column_store* store, mems_channel ch,
+                              size_t start, size_t n, float* out);
+size_t mems_column_store_envelope(const mems_column_store* store, mems_channel ch,
+                                  size_t start, size_t n, size_t buckets,
+                                  float* mins, float* maxs);
+bool mems_column_store_summary(const mems_column_store* store, mems_channel ch,
+                               mems_column_summary* summary);
+
+size_t mems_ring_size(uint32_t capacity);
+mems_ring* mems_ring_init(void* mem, uint32_t capacity);
+mems_ring* mems_ring_create(uint32_t capacity);
+void mems_ring_destroy(mems_ring* ring);
+uint32_t mems_ring_capacity(const mems_ring* ring);
+uint64_t mems_ring_head(const mems_ring* ring);
+uint64_t mems_ring_push(mems_ring* ring, const mems_sample* sample);
+mems_sample* mems_ring_reserve(mems_ring* ring);
+uint64_t mems_ring_commit(mems_ring* ring);
+void mems_ring_cancel(mems_ring* ring);
+bool mems_ring_latest(const mems_ring* ring, mems_sample* out);
+uint32_t mems_ring_read_since(const mems_ring* ring, uint64_t seq, mems_sample* out, uint32_t max, uint64_t* next_seq);
+
+mems_shm* mems_shm_attach(const char* name);
+const mems_ring* mems_shm_get_ring(const mems_shm* shm);
+bool mems_shm_get_status(const mems_shm* shm, mems_shm_status* status);
+void mems_shm_detach(mems_shm* shm);
+
+mems_log_writer* mems_log_create(const char* path);
+mems_log_writer* mems_log_create_ex(const char* path, uint32_t flags);
+bool mems_log_write(mems_log_writer* log, uint64_t timestamp_us,
+                    const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d);
+bool mems_log_write_sample(mems_log_writer* log, const mems_sample* sample);
+bool mems_log_write_rollup(mems_log_writer* log, const mems_rollup* rollup);
+bool mems_log_flush(mems_log_writer* log);
+bool mems_log_close(mems_log_writer* log);
+
+mems_log_reader* mems_log_open(const char* path);
+void mems_log_reader_close(mems_log_reader* log);
+uint64_t mems_log_frame_count(const mems_log_reader* log);
+void mems_log_start_time(const mems_log_reader* log, uint64_t* wall_us, uint64_t* mono_us);
+void mems_log_rewind(const mems_log_reader* log, mems_log_cursor* cursor);
+bool mems_log_next(const mems_log_reader* log, mems_log_cursor* cursor, mems_log_frame* frame);
+bool mems_log_seek(const mems_log_reader* log, uint64_t timestamp_us, mems_log_cursor* cursor);
+bool mems_log_next_rollup(const mems_log_reader* log, mems_log_cursor* cursor, mems_rollup* rollup);
+
+void mems_delta_encoder_init(mems_delta_encoder* enc, uint32_t keyframe_interval);
+void mems_delta_force_keyframe(mems_delta_encoder* enc);
+size_t mems_delta_encode(mems_delta_encoder* enc, const mems_data_frame_80* frame80,
+                         const mems_data_frame_7d* frame7d, uint8_t* out);
+size_t mems_delta_decode(const uint8_t* in, size_t len,
+                         mems_data_frame_80* frame80, mems_data_frame_7d* frame7d);
+
+void mems_stream_options_init(mems_stream_options* options);
+mems_streamer* mems_stream_start(mems_info* info, const mems_stream_options* options);
+void mems_stream_stop(mems_streamer* streamer);
+void mems_stream_get_stats(const mems_streamer* streamer, mems_stream_stats* stats);
+size_t mems_stream_decode(const uint8_t* in, size_t len, mems_sample* out, size_t max, size_t* count);
+
+uint64_t mems_time_us();
+uint64_t mems_wall_time_us();
+uint64_t mems_to_wall_time_us(uint64_t timestamp_us);
 librosco_version mems_get_lib_version();
 
 /* Closing brace for 'extern "C"' */
@@ -0,0 +1,484 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// rosco_bench.c: Benchmarks the library against the simulated ECU, and
+//                prints the results as a single JSON object so that they
+//                can be compared between releases.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "rosco.h"
+
+//! Number of frame pairs generated for the decode and log benchmarks
+#define BENCH_FRAMES 65536
+
+//! Number of passes over the generated frames in the decode benchmark
+#define BENCH_DECODE_PASSES 16
+
+typedef struct
+{
+  uint32_t cycles;
+  uint32_t baud_rate;
+  uint32_t jitter_us;
+  uint16_t dropout_per_mille;
+  uint32_t seed;
+  const char* log_path;
+  const char* output_path;
+} bench_config;
+
+typedef struct
+{
+  uint32_t count;
+  uint32_t* samples;
+} bench_latency;
+
+//! Destination of the results (stdout unless -o is given)
+static FILE* json = NULL;
+
+
+int compare_u32(const void* a, const void* b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+
+  return (x > y) - (x < y);
+}
+
+uint32_t percentile(const bench_latency* lat, double p)
+{
+  uint32_t idx = 0;
+
+  if (lat->count == 0)
+  {
+    return 0;
+  }
+
+  idx = (uint32_t)(p * (lat->count - 1) + 0.5);
+  return lat->samples[idx];
+}
+
+double seconds_since(uint64_t start_us)
+{
+  uint64_t elapsed = mems_time_us() - start_us;
+
+  return (elapsed > 0) ? (elapsed / 1000000.0) : 1e-6;
+}
+
+long file_size(const char* path)
+{
+  FILE* fp = fopen(path, "rb");
+  long size = -1;
+
+  if (fp)
+  {
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+  }
+
+  return size;
+}
+
+/**
+ * Connects a fresh simulator to the connection and initializes the link.
+ */
+mems_sim* start_sim(mems_info* info, const bench_config* cfg)
+{
+  mems_sim_options opts;
+  mems_sim* sim = NULL;
+
+  mems_sim_options_init(&opts);
+  opts.byte_time_us = (10 * 1000000UL) / cfg->baud_rate;
+  opts.jitter_us = cfg->jitter_us;
+  opts.dropout_per_mille = cfg->dropout_per_mille;
+  opts.seed = cfg->seed;
+
+  sim = mems_sim_create(&opts);
+  if (sim && (!mems_sim_connect(info, sim) || !mems_init_link(info, NULL)))
+  {
+    mems_disconnect(info);
+    mems_sim_destroy(sim);
+    sim = NULL;
+  }
+
+  return sim;
+}
+
+void stop_sim(mems_info* info, mems_sim* sim)
+{
+  mems_disconnect(info);
+  mems_sim_destroy(sim);
+}
+
+/**
+ * Runs complete read cycles with mems_read() and reports the rate achieved.
+ */
+void bench_read_cycles(mems_info* info, const bench_config* cfg, bool pipelined, const char* name, bool last)
+{
+  mems_sim* sim = start_sim(info, cfg);
+  mems_data data;
+  uint32_t ok = 0;
+  uint32_t idx = 0;
+  uint64_t start = 0;
+  double elapsed = 0.0;
+
+  if (sim)
+  {
+    mems_set_pipelined(info, pipelined);
+    start = mems_time_us();
+    for (idx = 0; idx < cfg->cycles; idx++)
+    {
+      if (mems_read(info, &data))
+      {
+        ok++;
+      }
+    }
+    elapsed = seconds_since(start);
+    mems_set_pipelined(info, false);
+    stop_sim(info, sim);
+  }
+
+  fprintf(json, "    \"%s\": { \"cycles\": %u, \"completed\": %u, \"seconds\": %.3f, \"cycles_per_sec\": %.2f }%s\n",
+          name, cfg->cycles, ok, elapsed, (elapsed > 0.0) ? ok / elapsed : 0.0, last ? "" : ",");
+}
+
+void print_latency(const char* name, bench_latency* lat, bool last)
+{
+  qsort(lat->samples, lat->count, sizeof(uint32_t), compare_u32);
+  fprintf(json, "    \"%s\": { \"count\": %u, \"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u }%s\n",
+          name, lat->count, percentile(lat, 0.5), percentile(lat, 0.99), percentile(lat, 0.999),
+          lat->count ? lat->samples[lat->count - 1] : 0, last ? "" : ",");
+}
+
+/**
+ * Times each kind of command individually, and reports the distribution of
+ * the time taken by those that succeeded.
+ */
+void bench_latencies(mems_info* info, const bench_config* cfg)
+{
+  mems_sim* sim = start_sim(info, cfg);
+  mems_data_frame_80 frame80;
+  mems_data_frame_7d frame7d;
+  bench_latency lat80 = { 0, NULL };
+  bench_latency lat7d = { 0, NULL };
+  bench_latency latfb = { 0, NULL };
+  uint64_t start = 0;
+  uint32_t idx = 0;
+  uint8_t pos = 0;
+
+  lat80.samples = (uint32_t*)malloc(cfg->cycles * sizeof(uint32_t));
+  lat7d.samples = (uint32_t*)malloc(cfg->cycles * sizeof(uint32_t));
+  latfb.samples = (uint32_t*)malloc(cfg->cycles * sizeof(uint32_t));
+
+  if (sim && lat80.samples && lat7d.samples && latfb.samples)
+  {
+    for (idx = 0; idx < cfg->cycles; idx++)
+    {
+      start = mems_time_us();
+      if (mems_read_raw(info, &frame80, NULL))
+      {
+        lat80.samples[lat80.count++] = (uint32_t)(mems_time_us() - start);
+      }
+
+      start = mems_time_us();
+      if (mems_read_raw(info, NULL, &frame7d))
+      {
+        lat7d.samples[lat7d.count++] = (uint32_t)(mems_time_us() - start);
+      }
+
+      start = mems_time_us();
+      if (mems_read_iac_position(info, &pos))
+      {
+        latfb.samples[latfb.count++] = (uint32_t)(mems_time_us() - start);
+      }
+    }
+  }
+
+  if (sim)
+  {
+    stop_sim(info, sim);
+  }
+
+  fprintf(json, "  \"latency_us\": {\n");
+  print_latency("0x80", &lat80, false);
+  print_latency("0x7D", &lat7d, false);
+  print_latency("0xFB", &latfb, true);
+  fprintf(json, "  },\n");
+
+  free(lat80.samples);
+  free(lat7d.samples);
+  free(latfb.samples);
+}
+
+/**
+ * Fills the frame arrays with a plausible, slowly-varying run of data.
+ * @return True if the simulator's frames could be read to start from
+ */
+bool generate_frames(mems_data_frame_80* frames80, mems_data_frame_7d* frames7d, size_t n)
+{
+  mems_sim* sim = mems_sim_create(NULL);
+  mems_info info;
+  uint16_t rpm = 0;
+  size_t idx = 0;
+  bool status = false;
+
+  // start from the simulator's built-in frames
+  mems_init(&info);
+  memset(frames80, 0, sizeof(mems_data_frame_80));
+  memset(frames7d, 0, sizeof(mems_data_frame_7d));
+  if (sim && mems_sim_connect(&info, sim))
+  {
+    mems_set_pipelined(&info, false);
+    status = mems_read_raw(&info, &frames80[0], &frames7d[0]);
+    mems_disconnect(&info);
+  }
+  mems_cleanup(&info);
+  mems_sim_destroy(sim);
+
+  if (!status)
+  {
+    return false;
+  }
+
+  for (idx = 1; idx < n; idx++)
+  {
+    memcpy(&frames80[idx], &frames80[0], sizeof(mems_data_frame_80));
+    memcpy(&frames7d[idx], &frames7d[0], sizeof(mems_data_frame_7d));
+
+    rpm = (uint16_t)(800 + (idx * 7) % 3000);
+    frames80[idx].engine_rpm_hi = rpm >> 8;
+    frames80[idx].engine_rpm_lo = rpm & 0xFF;
+    frames80[idx].map_kpa = (uint8_t)(30 + (idx / 3) % 60);
+    frames80[idx].throttle_pot = (uint8_t)(0x20 + (idx / 5) % 0x80);
+    frames80[idx].ignition_advance = (uint8_t)(0x40 + (idx / 11) % 0x30);
+    frames7d[idx].lambda_voltage = (uint8_t)((idx * 13) & 0xFF);
+    frames7d[idx].fuel_trim = (uint8_t)(0x78 + (idx / 17) % 0x10);
+  }
+
+  return true;
+}
+
+/**
+ * Compares decoding one frame pair per call (as mems_read() does) with
+ * decoding whole arrays of frame pairs in a single call.
+ */
+void bench_decode(const mems_data_frame_80* frames80, const mems_data_frame_7d* frames7d)
+{
+  mems_data* out = (mems_data*)malloc(BENCH_FRAMES * sizeof(mems_data));
+  uint64_t start = 0;
+  double single = 0.0;
+  double batch = 0.0;
+  uint32_t pass = 0;
+  size_t idx = 0;
+  volatile uint32_t sink = 0;
+
+  if (out == NULL)
+  {
+    return;
+  }
+
+  start = mems_time_us();
+  for (pass = 0; pass < BENCH_DECODE_PASSES; pass++)
+  {
+    for (idx = 0; idx < BENCH_FRAMES; idx++)
+    {
+      mems_decode_batch(&frames80[idx], &frames7d[idx], 1, &out[idx]);
+    }
+    sink += out[pass].engine_rpm;
+  }
+  single = seconds_since(start);
+
+  start = mems_time_us();
+  for (pass = 0; pass < BENCH_DECODE_PASSES; pass++)
+  {
+    mems_decode_batch(frames80, frames7d, BENCH_FRAMES, out);
+    sink += out[pass].engine_rpm;
+  }
+  batch = seconds_since(start);
+
+  fprintf(json, "  \"decode\": { \"frames\": %u, \"per_frame_frames_per_sec\": %.0f, \"batch_frames_per_sec\": %.0f },\n",
+          BENCH_FRAMES * BENCH_DECODE_PASSES,
+          (BENCH_FRAMES * BENCH_DECODE_PASSES) / single,
+          (BENCH_FRAMES * BENCH_DECODE_PASSES) / batch);
+
+  free(out);
+}
+
+/**
+ * Writes the frames to a binary log in the given format, then reads them
+ * all back, and reports the rates in megabytes of log file per second.
+ */
+void bench_log(const bench_config* cfg, const mems_data_frame_80* frames80, const mems_data_frame_7d* frames7d,
+          uint32_t flags, const char* name, bool last)
+{
+  mems_log_writer* writer = mems_log_create_ex(cfg->log_path, flags);
+  mems_log_reader* reader = NULL;
+  mems_log_cursor cursor;
+  mems_log_frame frame;
+  uint64_t start = 0;
+  double write_secs = 0.0;
+  double read_secs = 0.0;
+  long size = 0;
+  size_t idx = 0;
+  size_t read_count = 0;
+  volatile uint32_t sink = 0;
+
+  if (writer == NULL)
+  {
+    fprintf(json, "    \"%s\": null%s\n", name, last ? "" : ",");
+    return;
+  }
+
+  start = mems_time_us();
+  for (idx = 0; idx < BENCH_FRAMES; idx++)
+  {
+    mems_log_write(writer, idx * 70000ULL, &frames80[idx], &frames7d[idx]);
+  }
+  mems_log_close(writer);
+  write_secs = seconds_since(start);
+  size = file_size(cfg->log_path);
+
+  start = mems_time_us();
+  reader = mems_log_open(cfg->log_path);
+  if (reader)
+  {
+    mems_log_rewind(reader, &cursor);
+    while (mems_log_next(reader, &cursor, &frame))
+    {
+      sink += frame.frame80->engine_rpm_lo;
+      read_count++;
+    }
+    mems_log_reader_close(reader);
+  }
+  read_secs = seconds_since(start);
+  remove(cfg->log_path);
+
+  fprintf(json, "    \"%s\": { \"frames\": %u, \"frames_read\": %u, \"bytes\": %ld, \"bytes_per_frame\": %.2f, "
+          "\"write_mb_per_sec\": %.2f, \"read_mb_per_sec\": %.2f }%s\n",
+          name, BENCH_FRAMES, (unsigned int)read_count, size, (double)size / BENCH_FRAMES,
+          (size / 1e6) / write_secs, (size / 1e6) / read_secs, last ? "" : ",");
+}
+
+void usage(const char* name)
+{
+  printf("Usage: %s [-n cycles] [-b baud] [-j jitter_us] [-d dropout_per_mille] [-s seed]\n"
+         "       [-l log_path] [-o output_path]\n", name);
+  printf("Runs the benchmarks against the simulated ECU and writes the results as JSON.\n");
+  printf("Results written to stdout are mixed with the library's diagnostic messages\n");
+  printf("unless it was built with ENABLE_DEBUG_OUTPUT=OFF; use -o to keep them apart.\n");
+}
+
+int main(int argc, char** argv)
+{
+  bench_config cfg;
+  mems_info info;
+  librosco_version ver = mems_get_lib_version();
+  mems_data_frame_80* frames80 = NULL;
+  mems_data_frame_7d* frames7d = NULL;
+  int arg = 0;
+  unsigned long value = 0;
+
+  cfg.cycles = 100;
+  cfg.baud_rate = 9600;
+  cfg.jitter_us = 0;
+  cfg.dropout_per_mille = 0;
+  cfg.seed = 1;
+  cfg.output_path = NULL;
+#if defined(WIN32)
+  cfg.log_path = "rosco_bench.log";
+#else
+  cfg.log_path = "/tmp/rosco_bench.log";
+#endif
+
+  for (arg = 1; arg < argc; arg++)
+  {
+    if ((argv[arg][0] != '-') || (argv[arg][1] == '\0') || (argv[arg][2] != '\0') || (arg + 1 >= argc))
+    {
+      usage(argv[0]);
+      return 1;
+    }
+
+    value = strtoul(argv[arg + 1], NULL, 0);
+    switch (argv[arg][1])
+    {
+    case 'n': cfg.cycles = (uint32_t)value;               break;
+    case 'b': cfg.baud_rate = (uint32_t)value;            break;
+    case 'j': cfg.jitter_us = (uint32_t)value;            break;
+    case 'd': cfg.dropout_per_mille = (uint16_t)value;    break;
+    case 's': cfg.seed = (uint32_t)value;                 break;
+    case 'l': cfg.log_path = argv[arg + 1];               break;
+    case 'o': cfg.output_path = argv[arg + 1];            break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+    arg++;
+  }
+
+  if ((cfg.cycles == 0) || (cfg.baud_rate == 0))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  frames80 = (mems_data_frame_80*)malloc(BENCH_FRAMES * sizeof(mems_data_frame_80));
+  frames7d = (mems_data_frame_7d*)malloc(BENCH_FRAMES * sizeof(mems_data_frame_7d));
+  if ((frames80 == NULL) || (frames7d == NULL))
+  {
+    fprintf(stderr, "Error: could not allocate frames.\n");
+    return 1;
+  }
+
+  json = cfg.output_path ? fopen(cfg.output_path, "w") : stdout;
+  if (json == NULL)
+  {
+    fprintf(stderr, "Error: could not open %s for writing.\n", cfg.output_path);
+    return 1;
+  }
+
+  mems_init(&info);
+
+  fprintf(json, "{\n");
+  fprintf(json, "  \"librosco_version\": \"%d.%d.%d\",\n", ver.major, ver.minor, ver.patch);
+  fprintf(json, "  \"config\": { \"cycles\": %u, \"baud_rate\": %u, \"jitter_us\": %u, \"dropout_per_mille\": %u, \"seed\": %u },\n",
+          cfg.cycles, cfg.baud_rate, cfg.jitter_us, cfg.dropout_per_mille, cfg.seed);
+
+  fprintf(json, "  \"read_cycle\": {\n");
+  bench_read_cycles(&info, &cfg, false, "stop_and_wait", false);
+  bench_read_cycles(&info, &cfg, true, "pipelined", true);
+  fprintf(json, "  },\n");
+
+  bench_latencies(&info, &cfg);
+
+  if (!generate_frames(frames80, frames7d, BENCH_FRAMES))
+  {
+    fprintf(stderr, "Error: could not read frames from the simulator.\n");
+    mems_cleanup(&info);
+    free(frames80);
+    free(frames7d);
+    if (json != stdout)
+    {
+      fclose(json);
+    }
+    return 1;
+  }
+  bench_decode(frames80, frames7d);
+
+  fprintf(json, "  \"log\": {\n");
+  bench_log(&cfg, frames80, frames7d, 0, "raw", false);
+  bench_log(&cfg, frames80, frames7d, MEMS_LOG_DELTA, "delta", true);
+  fprintf(json, "  }\n");
+  fprintf(json, "}\n");
+
+  mems_cleanup(&info);
+  free(frames80);
+  free(frames7d);
+  if (json != stdout)
+  {
+    fclose(json);
+  }
+
+  return 0;
+}
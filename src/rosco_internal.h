@@ -2,14 +2,362 @@
 #define LIBMEMS_INTERNAL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
-bool mems_openserial(mems_info *info, const char *devPath);
+//! Baud rate used by the MEMS diagnostic link (unless overridden with mems_connect_ex())
+#define MEMS_BAUD_RATE 9600
+
+//! Time (in microseconds) needed to transfer one 8N1 character at the given baud rate
+#define MEMS_BYTE_TIME_US(baud) ((10 * 1000000UL) / (baud))
+
+//! Default allowance (in milliseconds) for the ECU's turnaround time, added to the transfer time of each reply
+#define MEMS_REPLY_MARGIN_MS 60
+
+//! Default longest single wait (in milliseconds) for the first byte of a read under Win32
+#define MEMS_READ_POLL_MS 10
+
+//! Default value written to the latency timer of FTDI adapters in low-latency mode
+#define MEMS_FTDI_LATENCY_MS 1
+
+//! Version number written to the header of binary log files
+#define MEMS_LOG_VERSION 1
+
+//! Version number written to the header of delta-encoded binary log files
+#define MEMS_LOG_VERSION_DELTA 2
+
+//! Number of frames between successive entries in a binary log's index
+//! (and the number of frames in each delta-encoded block)
+#define MEMS_LOG_INDEX_INTERVAL 64
+
+//! Number of entries collected before an index block is written to a binary log
+#define MEMS_LOG_INDEX_ENTRIES 64
+
+// Memory-ordering primitives used by the lock-free sample ring
+#define MEMS_ATOMIC_LOAD(p)             __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define MEMS_ATOMIC_LOAD_RELAXED(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#define MEMS_ATOMIC_STORE(p, v)         __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define MEMS_ATOMIC_STORE_RELAXED(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define MEMS_ATOMIC_FENCE_ACQUIRE()     __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define MEMS_ATOMIC_FENCE_RELEASE()     __atomic_thread_fence(__ATOMIC_RELEASE)
+
+/**
+ * Progress of a single command/response exchange, as reported by the frame parser.
+ */
+typedef enum
+{
+  MEMS_Parse_Incomplete,
+  MEMS_Parse_Complete,
+  MEMS_Parse_Mismatch
+} mems_parse_status;
+
+/**
+ * Outcome of a single command/response exchange, as recorded in the
+ * per-command statistics.
+ */
+typedef enum
+{
+  MEMS_Exchange_Complete,
+  MEMS_Exchange_Timeout,
+  MEMS_Exchange_ShortRead,
+  MEMS_Exchange_Mismatch
+} mems_exchange_result;
+
+//! Number of stray bytes that a frame parser will discard while looking for
+//! its echo before it reports a mismatch (enough to pass over any one reply)
+#define MEMS_PARSER_MAX_SKIP MEMS_RX_BUFFER_SIZE
+
+/**
+ * Incremental parser for one exchange with the ECU: the echo of the command
+ * byte, followed by a fixed number of payload bytes. Bytes may be fed in
+ * arbitrarily-sized pieces as they arrive from the serial device. Stray
+ * bytes that arrive ahead of the echo are skipped, so that the parser
+ * falls back into step with the ECU's replies after a byte has been lost.
+ */
+typedef struct
+{
+  //! Command byte that is expected to be echoed by the ECU
+  uint8_t cmd;
+  //! Destination for the payload bytes that follow the echo
+  uint8_t* payload;
+  //! Number of payload bytes expected after the echo
+  uint16_t payload_len;
+  //! Number of bytes consumed so far, including the echo
+  uint16_t received;
+  //! Expected first payload byte (the length byte of a data frame), or -1 if any
+  int16_t header;
+  //! Number of stray bytes discarded while looking for the echo
+  uint16_t skipped;
+  //! Current state of the exchange
+  mems_parse_status status;
+  //! Time at which the command was sent, at which its echo arrived, and at
+  //! which the last byte of the reply arrived (0 if not yet)
+  uint64_t sent_us;
+  uint64_t echo_us;
+  uint64_t done_us;
+} mems_frame_parser;
+
+/**
+ * One command/response exchange: the command byte, and where to put the
+ * fixed number of payload bytes that follow its echo.
+ */
+typedef struct
+{
+  uint8_t cmd;
+  uint8_t* payload;
+  uint16_t payload_len;
+} mems_exchange;
+
+//! Maximum number of exchanges in a sequence run by the session manager
+#define MEMS_MAX_PROGRAM_STEPS 8
+
+//! Number of exchanges in the link initialization sequence
+#define MEMS_HANDSHAKE_STEPS 4
+
+//! Number of consecutive failed exchanges after which the link is considered lost
+#define MEMS_RECONNECT_THRESHOLD 2
+
+//! Delay before the session manager retries a failed initialization sequence
+#define MEMS_RECONNECT_RETRY_MS 250
+
+//! Time without a successful exchange after which mems_heartbeat() actually
+//! sends its command; any other traffic keeps the ECU's link alive as well
+#define MEMS_KEEPALIVE_IDLE_MS 500
+
+/**
+ * Describes where a data channel is stored in mems_data, and which request
+ * returns the raw data it is decoded from.
+ */
+typedef struct
+{
+  const char* name;
+  mems_value_type type;
+  size_t offset;
+  uint8_t source_cmd;
+} mems_channel_desc;
+
+extern const mems_channel_desc mems_channel_table[MEMS_Num_Channels];
+
+/**
+ * How the raw value of a frame field is converted to the value of its channel.
+ */
+typedef enum
+{
+  //! The raw value, unchanged
+  MEMS_Field_Raw,
+  //! raw * scale / divisor + bias (computed in double precision)
+  MEMS_Field_Linear,
+  //! The ECU's temperature encoding, converted to degrees F
+  MEMS_Field_TempF,
+  //! A single bit: (1 << shift) if any of the bits in 'mask' are set in the
+  //! raw value, ORed into the channel (so several fields may share one channel)
+  MEMS_Field_Bit
+} mems_field_kind;
+
+/**
+ * Describes where one channel (or one bit of it) is found in a data frame,
+ * and how it is scaled. Fields of two bytes are big-endian, and are only
+ * stored in U16 or float channels; MEMS_Field_TempF and MEMS_Field_Bit
+ * fields are of one byte.
+ */
+typedef struct
+{
+  mems_channel channel;
+  uint8_t source_cmd;
+  uint8_t offset;
+  uint8_t width;
+  mems_field_kind kind;
+  double scale;
+  double divisor;
+  double bias;
+  uint8_t mask;
+  uint8_t shift;
+} mems_field_desc;
+
+/**
+ * The converted value of a one-byte field for every possible raw byte, in
+ * the storage type of its channel.
+ */
+typedef union
+{
+  uint8_t u8[256];
+  uint16_t u16[256];
+  float f[256];
+} mems_field_table;
+
+/**
+ * Describes one ECU variant: the D0 reply that identifies it (compared in
+ * the bits set in the mask), and the layout of the fields of its data
+ * frames, which are decoded by mems_decode_fields().
+ */
+struct mems_variant
+{
+  const char* name;
+  uint8_t d0_response[4];
+  uint8_t d0_mask[4];
+  const mems_field_desc* fields;
+  size_t num_fields;
+  //! One lookup table per field (used by one-byte fields), built on first use
+  mems_field_table* tables;
+};
+
+extern const mems_variant* const mems_default_variant;
+
+/**
+ * A command queued to the polling thread by another thread. It lives on the
+ * submitting thread's stack until the polling thread marks it done.
+ */
+typedef struct mems_request
+{
+  uint8_t cmd;
+  mems_priority priority;
+  uint8_t response;
+  bool status;
+  bool done;
+  struct mems_request* next;
+} mems_request;
+
+/**
+ * A function registered to receive samples from the polling thread.
+ */
+typedef struct
+{
+  mems_data_callback callback;
+  void* user;
+} mems_subscriber;
+
+/**
+ * Adaptive rate controller of the polling thread, which only that thread
+ * uses once polling has started.
+ */
+typedef struct
+{
+  mems_adaptive_options options;
+  mems_adaptive_state state;
+  //! Reply margin in effect before the controller was enabled
+  uint32_t restore_margin_us;
+  //! Failed data frame exchanges counted as of the previous cycle, and the
+  //! send time of the last 0x80 exchange examined
+  bool primed;
+  uint64_t last_failures;
+  uint64_t last_sent_us;
+} mems_adaptive;
+
+/**
+ * State of the background polling thread for one connection.
+ */
+typedef struct mems_poller
+{
+#if defined(WIN32)
+  HANDLE thread;
+  DWORD thread_id;
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE cond;
+#else
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+  //! Set while the thread should keep running (read and written atomically,
+  //! as the thread reads it without the lock)
+  bool running;
+  //! Set from the thread's creation until it has been joined; a thread that
+  //! was stopped by one of its own subscribers is joined later, by the next
+  //! call to mems_stop_polling() or mems_start_polling() from another thread
+  bool started;
+  //! Minimum time between the starts of successive read cycles
+  uint32_t interval_ms;
+  //! Channels whose frames are read on every cycle; other frames are read
+  //! every slow_interval'th cycle (or never, if slow_interval is zero)
+  uint32_t fast_channels;
+  uint32_t slow_interval;
+  //! Functions that receive each decoded sample; whether the thread is
+  //! calling them now, and the number of deliveries it has completed
+  mems_subscriber subscribers[MEMS_MAX_SUBSCRIBERS];
+  bool delivering;
+  uint64_t deliveries;
+  //! Commands waiting to be sent by the polling thread, highest priority first
+  mems_request* queue_head;
+  mems_request* queue_tail;
+  //! Ring buffer into which every sample is published
+  mems_ring* ring;
+  //! Alarm rules evaluated against every sample (may be NULL), and whether
+  //! the thread is evaluating them now
+  mems_alarm_table* alarms;
+  bool evaluating;
+  //! Shared memory segment that holds the ring, if it is published to other processes
+  mems_shm* shm;
+  //! Rate controller (used only by the thread), a change to its settings
+  //! waiting to be applied by the thread, and a copy of its state for readers
+  mems_adaptive adaptive;
+  bool adapt_pending;
+  bool adapt_enable;
+  mems_adaptive_options adapt_options;
+  mems_adaptive_state adapt_snapshot;
+} mems_poller;
+
+/**
+ * Fault bits reported in the most recent 0x80 frame, with the history of
+ * each and the function that is told of changes.
+ */
+typedef struct mems_fault_tracker
+{
+  //! Faults in the most recent frame: dtc0 in the low byte, dtc1 in the high byte
+  uint16_t active;
+  mems_fault_status faults[MEMS_NUM_FAULTS];
+  mems_fault_callback callback;
+  void* user;
+} mems_fault_tracker;
+
+bool mems_openserial(mems_info *info, const char *devPath, const mems_connect_options* options);
 bool mems_send_command(mems_info *info, uint8_t cmd);
 int16_t mems_read_serial(mems_info* info, uint8_t *buffer, uint16_t quantity);
 int16_t mems_write_serial(mems_info* info, uint8_t *buffer, uint16_t quantity);
 bool mems_lock(mems_info* info);
+bool mems_lock_priority(mems_info* info, mems_priority priority);
 void mems_unlock(mems_info* info);
 uint8_t temperature_value_to_degrees_f(uint8_t val);
+int16_t mems_read_available(mems_info* info, uint8_t* buffer, uint16_t quantity, uint64_t deadline_us);
+int16_t mems_read_serial_deadline(mems_info* info, uint8_t* buffer, uint16_t quantity, uint64_t deadline_us);
+uint64_t mems_reply_deadline(mems_info* info, uint16_t quantity);
+bool mems_wait_readable(mems_info* info, uint64_t deadline_us);
+void mems_parser_init(mems_frame_parser* parser, uint8_t cmd, uint8_t* payload, uint16_t payload_len);
+uint16_t mems_parser_feed(mems_frame_parser* parser, const uint8_t* data, uint16_t count);
+size_t mems_value_size(mems_value_type type);
+double mems_value_at(mems_value_type type, const void* values, size_t idx);
+void mems_decode_fields(const mems_variant* variant, const mems_data_frame_80* frames80,
+                        const mems_data_frame_7d* frames7d, size_t n,
+                        void* const dest[MEMS_Num_Channels], size_t stride);
+void mems_decode_columns(const mems_data_frame_80* frames80, const mems_data_frame_7d* frames7d,
+                         size_t n, void* const columns[MEMS_Num_Channels]);
+void mems_decode_frames(const mems_variant* variant, const mems_data_frame_80* dframe80,
+                        const mems_data_frame_7d* dframe7d, mems_data* data);
+void mems_select_variant(mems_info* info);
+const mems_variant* mems_variant_at(size_t idx);
+int mems_handshake_program(mems_exchange* steps, uint8_t* f4_reply, uint8_t* d0_reply);
+void mems_link_result(mems_info* info, bool ok);
+void mems_flush_input(mems_info* info);
+bool mems_run_command(mems_info* info, uint8_t cmd, mems_priority priority, uint8_t* response);
+bool mems_poller_owns_link(mems_info* info);
+bool mems_poller_is_caller(mems_info* info);
+bool mems_poller_submit(mems_info* info, uint8_t cmd, mems_priority priority, uint8_t* response);
+void mems_poller_free(mems_info* info);
+bool mems_read_raw_pipelined(mems_info* info, mems_data_frame_80* frame80, mems_data_frame_7d* frame7d);
+bool mems_transact(mems_info* info, uint8_t cmd, uint8_t* payload, uint16_t payload_len);
+uint8_t mems_transact_burst(mems_info* info, uint8_t cmd, uint8_t count, uint8_t* response);
+void mems_stats_record(mems_info* info, uint8_t cmd, mems_exchange_result result,
+                       uint64_t sent_us, uint64_t echo_us, uint64_t done_us);
+void mems_stats_record_parser(mems_info* info, const mems_frame_parser* parser);
+void mems_stats_record_discard(mems_info* info, uint8_t cmd, uint16_t count);
+void mems_stats_free(mems_info* info);
+void mems_faults_update(mems_info* info, const mems_data_frame_80* frame80, uint64_t timestamp_us);
+void mems_faults_cleared(mems_info* info, uint64_t timestamp_us);
+void mems_faults_free(mems_info* info);
+mems_shm* mems_shm_create(const char* name, uint32_t capacity);
+mems_ring* mems_shm_publisher_ring(mems_shm* shm);
+void mems_shm_update(mems_shm* shm, mems_info* info);
+void mems_adapt_configure(mems_info* info, mems_adaptive* adapt, const mems_adaptive_options* options,
+                          uint32_t interval_ms);
+uint32_t mems_adapt_cycle(mems_info* info, mems_adaptive* adapt);
 
 #endif // LIBMEMS_INTERNAL_H
 
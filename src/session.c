@@ -0,0 +1,629 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// session.c: This file contains the session manager, which drives
+//            the read cycles of many ECU connections from a single
+//            event loop (epoll on Linux, kqueue on BSD/OS X, and
+//            poll() elsewhere) without blocking on any one link.
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(linux)
+  #define MEMS_SESSION_EPOLL
+  #include <sys/epoll.h>
+  #include <unistd.h>
+  #include <errno.h>
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
+  #define MEMS_SESSION_KQUEUE
+  #include <sys/types.h>
+  #include <sys/event.h>
+  #include <sys/time.h>
+  #include <unistd.h>
+  #include <errno.h>
+#elif !defined(WIN32)
+  #include <poll.h>
+  #include <errno.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Number of ready events collected per wait
+#define MEMS_SESSION_EVENTS 32
+
+/**
+ * State of the read cycle for one connection in a session. Each cycle runs
+ * a sequence of exchanges: normally the 0x80/0x7D reads, or the link
+ * initialization sequence if the link has not been initialized (or has
+ * been lost).
+ */
+typedef struct mems_session_link
+{
+  mems_info* info;
+  uint32_t interval_ms;
+  mems_data_callback callback;
+  void* user;
+  mems_exchange read_program[MEMS_MAX_PROGRAM_STEPS];
+  int read_program_len;
+  mems_exchange handshake_program[MEMS_MAX_PROGRAM_STEPS];
+  int handshake_program_len;
+  uint8_t f4_reply;
+  //! True while the initialization sequence is being run instead of reads
+  bool handshaking;
+  //! The exchanges that make up the current cycle, and the one in progress
+  const mems_exchange* program;
+  int program_len;
+  int step;
+  bool busy;
+  mems_frame_parser parser;
+  uint64_t deadline_us;
+  uint64_t cycle_start_us;
+  uint64_t next_cycle_us;
+  mems_data_frame_80 frame80;
+  mems_data_frame_7d frame7d;
+  //! Set when the link is removed while its session is handling events
+  //! (from a sample callback); the link is then freed once they are done
+  bool removed;
+  struct mems_session_link* next_removed;
+} mems_session_link;
+
+struct mems_session
+{
+#if defined(MEMS_SESSION_EPOLL) || defined(MEMS_SESSION_KQUEUE)
+  int evfd;
+#endif
+  mems_session_link* links[MEMS_SESSION_MAX_LINKS];
+  int link_count;
+  volatile bool stop;
+  //! True while ready events are being handled, and the links removed meanwhile
+  bool servicing;
+  mems_session_link* removed;
+};
+
+/**
+ * Starts the exchange at the link's current program step by writing its
+ * command byte.
+ */
+static bool mems_session_start_step(mems_session_link* link)
+{
+  const mems_exchange* ex = &link->program[link->step];
+
+  mems_parser_init(&link->parser, ex->cmd, ex->payload, ex->payload_len);
+  link->parser.sent_us = mems_time_us();
+  if (mems_write_serial(link->info, (uint8_t*)&ex->cmd, 1) != 1)
+  {
+    dprintf_err("mems_session_start_step(): failed to send command %02X\n", ex->cmd);
+    return false;
+  }
+
+  link->deadline_us = mems_reply_deadline(link->info, ex->payload_len + 2);
+  return true;
+}
+
+/**
+ * Starts a new cycle, running either the reads or the initialization
+ * sequence (which begins by flushing any stray input).
+ */
+static void mems_session_start_cycle(mems_session_link* link, uint64_t now)
+{
+  if (link->handshaking)
+  {
+    mems_flush_input(link->info);
+    link->program = link->handshake_program;
+    link->program_len = link->handshake_program_len;
+  }
+  else
+  {
+    link->program = link->read_program;
+    link->program_len = link->read_program_len;
+  }
+
+  link->cycle_start_us = now;
+  link->step = 0;
+  link->busy = true;
+}
+
+/**
+ * Ends the current cycle and schedules the next one. When automatic
+ * reconnection is enabled, a run of failed read cycles switches the link
+ * over to the initialization sequence, and a completed initialization
+ * sequence switches it back to reads; the port is never reopened.
+ * @param ok True if every exchange in the cycle completed
+ */
+static void mems_session_end_cycle(mems_session_link* link, bool ok)
+{
+  mems_info* info = link->info;
+
+  link->busy = false;
+  link->next_cycle_us = link->cycle_start_us + ((uint64_t)link->interval_ms * 1000);
+
+  if (ok)
+  {
+    info->failures = 0;
+    if (link->handshaking)
+    {
+      if (info->linked)
+      {
+        info->reconnects++;
+      }
+      info->linked = true;
+      link->handshaking = false;
+      mems_select_variant(info);
+      link->next_cycle_us = mems_time_us();
+    }
+  }
+  else if (link->handshaking)
+  {
+    link->next_cycle_us = mems_time_us() + (MEMS_RECONNECT_RETRY_MS * 1000);
+  }
+  else if ((++info->failures >= MEMS_RECONNECT_THRESHOLD) && info->auto_reconnect)
+  {
+    dprintf_err("mems_session_end_cycle(): %d consecutive failures; re-initializing link\n", info->failures);
+    link->handshaking = true;
+    link->next_cycle_us = mems_time_us();
+  }
+}
+
+/**
+ * Called when the current exchange has completed; moves on to the next
+ * exchange, or delivers the sample if the cycle is finished.
+ * @return Number of samples delivered (0 or 1)
+ */
+static int mems_session_step_done(mems_session_link* link)
+{
+  mems_data data;
+  bool reading = !link->handshaking;
+
+  link->step++;
+  if (link->step < link->program_len)
+  {
+    if (!mems_session_start_step(link))
+    {
+      mems_session_end_cycle(link, false);
+    }
+    return 0;
+  }
+
+  mems_session_end_cycle(link, true);
+  if (!reading)
+  {
+    return 0;
+  }
+
+  mems_faults_update(link->info, &link->frame80, mems_time_us());
+  mems_decode_frames(link->info->variant, &link->frame80, &link->frame7d, &data);
+  if (link->callback)
+  {
+    link->callback(link->info, &data, link->user);
+  }
+
+  return 1;
+}
+
+/**
+ * Reads whatever has arrived on a link and feeds it to the parser.
+ * @return Number of samples delivered (0 or 1)
+ */
+static int mems_session_service(mems_session_link* link)
+{
+  uint8_t buf[64];
+  int16_t count = 0;
+  uint16_t used = 0;
+
+  // the port is non-blocking (VMIN=0, VTIME=0), so this never waits
+  count = mems_read_available(link->info, buf, sizeof(buf), 0);
+  if (count <= 0)
+  {
+    return 0;
+  }
+
+  // stray bytes are counted against the most recent exchange
+  if (!link->busy)
+  {
+    dprintf_err("mems_session_service(): discarding %d unexpected bytes\n", count);
+    mems_stats_record_discard(link->info, link->parser.cmd, count);
+    return 0;
+  }
+
+  used = mems_parser_feed(&link->parser, buf, count);
+  if (link->parser.status == MEMS_Parse_Mismatch)
+  {
+    mems_stats_record_parser(link->info, &link->parser);
+    mems_stats_record_discard(link->info, link->parser.cmd, link->parser.skipped + (count - used));
+    mems_session_end_cycle(link, false);
+  }
+  else if (link->parser.status == MEMS_Parse_Complete)
+  {
+    mems_stats_record_parser(link->info, &link->parser);
+    if (used < count)
+    {
+      dprintf_err("mems_session_service(): discarding %d bytes after reply to %02X\n",
+                  count - used, link->parser.cmd);
+      mems_stats_record_discard(link->info, link->parser.cmd, count - used);
+    }
+    return mems_session_step_done(link);
+  }
+
+  return 0;
+}
+
+/**
+ * Starts any cycles that are due and fails any exchanges that have passed
+ * their deadlines.
+ * @return Time (from mems_time_us()) at which this should next be called
+ */
+static uint64_t mems_session_timers(mems_session* session, uint64_t now, uint64_t wake)
+{
+  mems_session_link* link = NULL;
+  int idx = 0;
+
+  for (idx = 0; idx < session->link_count; idx++)
+  {
+    link = session->links[idx];
+
+    if (link->busy && (now >= link->deadline_us))
+    {
+      dprintf_err("mems_session_timers(): timed out waiting for reply to %02X\n", link->parser.cmd);
+      mems_stats_record_parser(link->info, &link->parser);
+      mems_stats_record_discard(link->info, link->parser.cmd, link->parser.skipped);
+      mems_session_end_cycle(link, false);
+    }
+
+    if (!link->busy && (now >= link->next_cycle_us))
+    {
+      mems_session_start_cycle(link, now);
+      if (!mems_session_start_step(link))
+      {
+        mems_session_end_cycle(link, false);
+      }
+    }
+
+    if (link->busy && (link->deadline_us < wake))
+    {
+      wake = link->deadline_us;
+    }
+    else if (!link->busy && (link->next_cycle_us < wake))
+    {
+      wake = link->next_cycle_us;
+    }
+  }
+
+  return wake;
+}
+
+/**
+ * Services a link that has become readable, unless a callback has removed
+ * it from the session since the wait returned.
+ * @return Number of samples delivered (0 or 1)
+ */
+static int mems_session_service_ready(mems_session_link* link)
+{
+  return link->removed ? 0 : mems_session_service(link);
+}
+
+/**
+ * Frees the links that were removed while events were being handled.
+ */
+static void mems_session_free_removed(mems_session* session)
+{
+  mems_session_link* link = NULL;
+
+  session->servicing = false;
+  while (session->removed)
+  {
+    link = session->removed;
+    session->removed = link->next_removed;
+    free(link);
+  }
+}
+
+/**
+ * Waits for any link to become readable (or for the timeout to pass) and
+ * services the readable links. A sample callback may remove links from the
+ * session (even the one whose sample it is given); they are not freed
+ * until every ready event has been handled.
+ * @return Number of samples delivered, or -1 if the wait failed
+ */
+static int mems_session_wait(mems_session* session, int timeout_ms)
+{
+  int samples = 0;
+  int ready = 0;
+  int idx = 0;
+
+#if defined(WIN32)
+  return -1;
+#elif defined(MEMS_SESSION_EPOLL)
+  struct epoll_event events[MEMS_SESSION_EVENTS];
+
+  ready = epoll_wait(session->evfd, events, MEMS_SESSION_EVENTS, timeout_ms);
+  session->servicing = true;
+  for (idx = 0; idx < ready; idx++)
+  {
+    samples += mems_session_service_ready((mems_session_link*)events[idx].data.ptr);
+  }
+  mems_session_free_removed(session);
+#elif defined(MEMS_SESSION_KQUEUE)
+  struct kevent events[MEMS_SESSION_EVENTS];
+  struct timespec ts;
+
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+  ready = kevent(session->evfd, NULL, 0, events, MEMS_SESSION_EVENTS, &ts);
+  session->servicing = true;
+  for (idx = 0; idx < ready; idx++)
+  {
+    samples += mems_session_service_ready((mems_session_link*)events[idx].udata);
+  }
+  mems_session_free_removed(session);
+#else
+  struct pollfd pfds[MEMS_SESSION_MAX_LINKS];
+  mems_session_link* polled[MEMS_SESSION_MAX_LINKS];
+  int count = session->link_count;
+
+  // removing a link reorders the session's list, so work from a copy
+  for (idx = 0; idx < count; idx++)
+  {
+    polled[idx] = session->links[idx];
+    pfds[idx].fd = polled[idx]->info->sd;
+    pfds[idx].events = POLLIN;
+    pfds[idx].revents = 0;
+  }
+  ready = poll(pfds, count, timeout_ms);
+  session->servicing = true;
+  for (idx = 0; (ready > 0) && (idx < count); idx++)
+  {
+    if (pfds[idx].revents & POLLIN)
+    {
+      samples += mems_session_service_ready(polled[idx]);
+    }
+  }
+  mems_session_free_removed(session);
+#endif
+
+#if !defined(WIN32)
+  if ((ready < 0) && (errno != EINTR))
+  {
+    return -1;
+  }
+#endif
+
+  return samples;
+}
+
+/**
+ * Creates an empty session, to which ECU connections may be added with
+ * mems_session_add().
+ * @return Handle to the session, or NULL if it couldn't be created (or if
+ *   sessions are not supported on this platform)
+ */
+mems_session* mems_session_create()
+{
+#if defined(WIN32)
+  dprintf_err("mems_session_create(): sessions are not supported under Win32\n");
+  return NULL;
+#else
+  mems_session* session = (mems_session*)calloc(1, sizeof(mems_session));
+
+  if (session == NULL)
+  {
+    return NULL;
+  }
+
+#if defined(MEMS_SESSION_EPOLL)
+  session->evfd = epoll_create(MEMS_SESSION_MAX_LINKS);
+#elif defined(MEMS_SESSION_KQUEUE)
+  session->evfd = kqueue();
+#endif
+
+#if defined(MEMS_SESSION_EPOLL) || defined(MEMS_SESSION_KQUEUE)
+  if (session->evfd < 0)
+  {
+    free(session);
+    return NULL;
+  }
+#endif
+
+  return session;
+#endif
+}
+
+/**
+ * Removes all connections from the session and frees it. The connections
+ * themselves are left open.
+ */
+void mems_session_destroy(mems_session* session)
+{
+  if (session)
+  {
+    while (session->link_count > 0)
+    {
+      mems_session_remove(session, session->links[0]->info);
+    }
+#if defined(MEMS_SESSION_EPOLL) || defined(MEMS_SESSION_KQUEUE)
+    close(session->evfd);
+#endif
+    free(session);
+  }
+}
+
+/**
+ * Adds a connection to the session. If the link has not been initialized
+ * with mems_init_link(), the session runs the initialization sequence
+ * first. If automatic reconnection is enabled (mems_set_auto_reconnect()),
+ * the sequence is also re-run without reopening the port whenever the link
+ * is lost. The connection must not be used by any other thread (or by the
+ * polling thread) while it belongs to the session.
+ * @param info State information for the connection
+ * @param interval_ms Minimum time between the starts of successive reads
+ * @param callback Function to receive each sample read from this ECU
+ * @param user Opaque pointer that is passed to the callback
+ * @return True if the connection was added
+ */
+bool mems_session_add(mems_session* session, mems_info* info, uint32_t interval_ms,
+                      mems_data_callback callback, void* user)
+{
+  mems_session_link* link = NULL;
+#if defined(MEMS_SESSION_EPOLL)
+  struct epoll_event ev;
+#elif defined(MEMS_SESSION_KQUEUE)
+  struct kevent ev;
+#endif
+
+  // the event loop waits on the serial device itself, so connections that
+  // use another transport (such as the in-process simulator) can't be added
+  if ((session->link_count >= MEMS_SESSION_MAX_LINKS) ||
+      !mems_is_connected(info) || (info->transport != NULL) || mems_is_polling(info))
+  {
+    return false;
+  }
+
+  link = (mems_session_link*)calloc(1, sizeof(mems_session_link));
+  if (link == NULL)
+  {
+    return false;
+  }
+
+  link->info = info;
+  link->interval_ms = interval_ms;
+  link->callback = callback;
+  link->user = user;
+  link->read_program[0].cmd = MEMS_ReqData80;
+  link->read_program[0].payload = (uint8_t*)&link->frame80;
+  link->read_program[0].payload_len = sizeof(mems_data_frame_80);
+  link->read_program[1].cmd = MEMS_ReqData7D;
+  link->read_program[1].payload = (uint8_t*)&link->frame7d;
+  link->read_program[1].payload_len = sizeof(mems_data_frame_7d);
+  link->read_program_len = 2;
+  link->handshake_program_len = mems_handshake_program(link->handshake_program,
+                                                       &link->f4_reply, info->d0_response);
+  link->handshaking = !info->linked;
+  link->next_cycle_us = mems_time_us();
+
+#if defined(MEMS_SESSION_EPOLL)
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = link;
+  if (epoll_ctl(session->evfd, EPOLL_CTL_ADD, info->sd, &ev) != 0)
+  {
+    free(link);
+    return false;
+  }
+#elif defined(MEMS_SESSION_KQUEUE)
+  EV_SET(&ev, info->sd, EVFILT_READ, EV_ADD, 0, 0, link);
+  if (kevent(session->evfd, &ev, 1, NULL, 0, NULL) != 0)
+  {
+    free(link);
+    return false;
+  }
+#endif
+
+  session->links[session->link_count++] = link;
+  return true;
+}
+
+/**
+ * Removes a connection from the session. Any exchange in progress is
+ * abandoned. This may be called from a sample callback.
+ * @return True if the connection was found and removed
+ */
+bool mems_session_remove(mems_session* session, mems_info* info)
+{
+  mems_session_link* link = NULL;
+  int idx = 0;
+#if defined(MEMS_SESSION_EPOLL)
+  struct epoll_event ev;
+#elif defined(MEMS_SESSION_KQUEUE)
+  struct kevent ev;
+#endif
+
+  for (idx = 0; idx < session->link_count; idx++)
+  {
+    link = session->links[idx];
+    if (link->info == info)
+    {
+#if defined(MEMS_SESSION_EPOLL)
+      memset(&ev, 0, sizeof(ev));
+      epoll_ctl(session->evfd, EPOLL_CTL_DEL, info->sd, &ev);
+#elif defined(MEMS_SESSION_KQUEUE)
+      EV_SET(&ev, info->sd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+      kevent(session->evfd, &ev, 1, NULL, 0, NULL);
+#endif
+      session->links[idx] = session->links[--session->link_count];
+
+      // events already collected for the link may still refer to it
+      if (session->servicing)
+      {
+        link->removed = true;
+        link->next_removed = session->removed;
+        session->removed = link;
+      }
+      else
+      {
+        free(link);
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Runs one iteration of the session's event loop: starts any cycles that
+ * are due, waits (for no longer than the timeout) for replies, and handles
+ * whatever has arrived. Sample callbacks are called from here.
+ * @param timeout_ms Maximum time to wait for events
+ * @return Number of samples delivered, or -1 if waiting for events failed
+ */
+int mems_session_run_once(mems_session* session, uint32_t timeout_ms)
+{
+  uint64_t now = mems_time_us();
+  uint64_t wake = now + ((uint64_t)timeout_ms * 1000);
+  uint64_t wait_ms = 0;
+  int samples = 0;
+
+  wake = mems_session_timers(session, now, wake);
+
+  now = mems_time_us();
+  wait_ms = (wake > now) ? ((wake - now + 999) / 1000) : 0;
+  samples = mems_session_wait(session, (int)wait_ms);
+
+  if (samples >= 0)
+  {
+    mems_session_timers(session, mems_time_us(), wake);
+  }
+
+  return samples;
+}
+
+/**
+ * Runs the session's event loop until mems_session_stop() is called (from
+ * a callback or another thread) or waiting for events fails.
+ * @return True if the loop was stopped; false if it failed
+ */
+bool mems_session_run(mems_session* session)
+{
+  session->stop = false;
+  while (!session->stop)
+  {
+    if (mems_session_run_once(session, 1000) < 0)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Makes mems_session_run() return after its current iteration.
+ */
+void mems_session_stop(mems_session* session)
+{
+  session->stop = true;
+}
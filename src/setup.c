@@ -10,13 +10,22 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 
 #if defined(WIN32)
   #include <windows.h>
 #else
-  #include <string.h>
   #include <termios.h>
   #include <arpa/inet.h>
+  #include <stdio.h>
+  #include <stdlib.h>
+#endif
+
+#if defined(linux)
+  #include <sys/ioctl.h>
+  #include <linux/serial.h>
+  #include <limits.h>
+  #include <libgen.h>
 #endif
 
 #include "rosco.h"
@@ -33,32 +42,142 @@ void mems_init(mems_info *info)
 {
 #if defined(WIN32)
     info->sd = INVALID_HANDLE_VALUE;
-    info->mutex = CreateMutex(NULL, TRUE, NULL);
+    InitializeCriticalSection(&info->mutex);
+    InitializeConditionVariable(&info->link_free);
 #else
     info->sd = 0;
     pthread_mutex_init(&info->mutex, NULL);
+    pthread_cond_init(&info->link_free, NULL);
 #endif
+    info->transport = NULL;
+    info->transport_ctx = NULL;
+    info->link_busy = false;
+    memset(info->sched_waiting, 0, sizeof(info->sched_waiting));
+    memset(info->sched_next, 0, sizeof(info->sched_next));
+    memset(info->sched_serving, 0, sizeof(info->sched_serving));
+    info->last_exchange_us = 0;
+    memset(&info->frame_times, 0, sizeof(info->frame_times));
+    info->byte_time_us = MEMS_BYTE_TIME_US(MEMS_BAUD_RATE);
+    info->reply_margin_us = MEMS_REPLY_MARGIN_MS * 1000;
+    info->read_poll_ms = MEMS_READ_POLL_MS;
+    info->pipelined = false;
+    info->poller = NULL;
+    info->stats = NULL;
+    info->faults = NULL;
+    info->linked = false;
+    info->auto_reconnect = false;
+    info->failures = 0;
+    info->reconnects = 0;
+    memset(info->d0_response, 0, sizeof(info->d0_response));
+    info->variant = mems_default_variant;
+}
+
+/**
+ * Enables or disables pipelined reads. When enabled, mems_read_raw() (and
+ * therefore mems_read()) sends the 0x7D request at the moment the last byte
+ * of the 0x80 reply is expected, rather than waiting for the 0x80 exchange
+ * to finish completely.
+ * @param info State information for the current connection.
+ * @param enable True to enable pipelined reads, false to use stop-and-wait
+ */
+void mems_set_pipelined(mems_info *info, bool enable)
+{
+    if (mems_lock(info))
+    {
+        info->pipelined = enable;
+        mems_unlock(info);
+    }
+}
+
+/**
+ * Enables or disables automatic re-initialization of the link. When
+ * enabled, a run of failed exchanges (timeouts or mismatched echoes, as
+ * happen after the ignition is cycled) causes the input to be flushed and
+ * the initialization sequence to be re-run, without reopening the port.
+ * @param info State information for the current connection.
+ * @param enable True to re-initialize the link automatically
+ */
+void mems_set_auto_reconnect(mems_info *info, bool enable)
+{
+    if (mems_lock(info))
+    {
+        info->auto_reconnect = enable;
+        mems_unlock(info);
+    }
+}
+
+/**
+ * Discards any bytes waiting in the serial device's input buffer.
+ * @param info State information for the current connection.
+ */
+void mems_flush_input(mems_info *info)
+{
+    if (info->transport)
+    {
+        info->transport->flush_input(info->transport_ctx);
+    }
+    else if (mems_is_connected(info))
+    {
+#if defined(WIN32)
+        PurgeComm(info->sd, PURGE_RXCLEAR);
+#else
+        tcflush(info->sd, TCIFLUSH);
+#endif
+    }
+}
+
+/**
+ * Detaches the connection's transport (if it has one), letting the
+ * transport release its resources.
+ * @param info State information for the current connection.
+ */
+static void mems_close_transport(mems_info *info)
+{
+    if (info->transport)
+    {
+        if (info->transport->close)
+        {
+            info->transport->close(info->transport_ctx);
+        }
+        info->transport = NULL;
+        info->transport_ctx = NULL;
+    }
 }
 
 /**
- * Disconnects (if necessary) and closes the mutex handle.
+ * Disconnects (if necessary) and frees the lock and related resources.
+ * This must not be called from a polling thread's subscriber.
  * @param info State information for the current connection.
  */
 void mems_cleanup(mems_info *info)
 {
+    // the polling thread's own state can't be freed from under it
+    if (mems_poller_is_caller(info))
+    {
+        dprintf_err("mems_cleanup(): cannot be called from the polling thread\n");
+        return;
+    }
+
+    mems_stop_polling(info);
+    mems_poller_free(info);
+    mems_stats_free(info);
+    mems_faults_free(info);
+    mems_close_transport(info);
+
 #if defined(WIN32)
     if (mems_is_connected(info))
     {
         CloseHandle(info->sd);
         info->sd = INVALID_HANDLE_VALUE;
     }
-    CloseHandle(info->mutex);
+    DeleteCriticalSection(&info->mutex);
 #else
     if (mems_is_connected(info))
     {
         close(info->sd);
         info->sd = 0;
     }
+    pthread_cond_destroy(&info->link_free);
     pthread_mutex_destroy(&info->mutex);
 #endif
 }
@@ -79,33 +198,33 @@ librosco_version mems_get_lib_version()
 }
 
 /**
- * Closes the serial device.
+ * Closes the serial device, stopping the polling thread first if it is running.
  * @param info State information for the current connection.
  */
 void mems_disconnect(mems_info *info)
 {
-#if defined(WIN32)
-    if (WaitForSingleObject(info->mutex, INFINITE) == WAIT_OBJECT_0)
+    mems_stop_polling(info);
+
+    if (mems_lock_priority(info, MEMS_Priority_Keepalive))
     {
-        if (mems_is_connected(info))
+        if (info->transport)
+        {
+            mems_close_transport(info);
+        }
+        else if (mems_is_connected(info))
         {
+#if defined(WIN32)
             CloseHandle(info->sd);
             info->sd = INVALID_HANDLE_VALUE;
-        }
-
-        ReleaseMutex(info->mutex);
-    }
 #else
-    pthread_mutex_lock(&info->mutex);
+            close(info->sd);
+            info->sd = 0;
+#endif
+        }
+        info->linked = false;
 
-    if (mems_is_connected(info))
-    {
-        close(info->sd);
-        info->sd = 0;
+        mems_unlock(info);
     }
-
-    pthread_mutex_unlock(&info->mutex);
-#endif
 }
 
 /**
@@ -116,24 +235,176 @@ void mems_disconnect(mems_info *info)
  *   baud rate was set; false otherwise.
  */
 bool mems_connect(mems_info *info, const char *devPath)
+{
+    return mems_connect_ex(info, devPath, NULL);
+}
+
+/**
+ * Fills in the default settings for the serial link.
+ * @param options Settings to be filled in
+ */
+void mems_connect_options_init(mems_connect_options *options)
+{
+    options->baud_rate = MEMS_BAUD_RATE;
+    options->reply_margin_ms = MEMS_REPLY_MARGIN_MS;
+    options->read_poll_ms = MEMS_READ_POLL_MS;
+    options->low_latency = false;
+    options->ftdi_latency_ms = MEMS_FTDI_LATENCY_MS;
+}
+
+/**
+ * Fills in the settings for the link from those given by the caller, using
+ * the defaults for any that are left at zero.
+ * @param options Settings given by the caller (may be NULL)
+ * @param opts Receives the complete settings
+ */
+static void mems_merge_options(const mems_connect_options *options, mems_connect_options *opts)
+{
+    mems_connect_options_init(opts);
+    if (options)
+    {
+        opts->low_latency = options->low_latency;
+        if (options->baud_rate)
+            opts->baud_rate = options->baud_rate;
+        if (options->reply_margin_ms)
+            opts->reply_margin_ms = options->reply_margin_ms;
+        if (options->read_poll_ms)
+            opts->read_poll_ms = options->read_poll_ms;
+        if (options->ftdi_latency_ms)
+            opts->ftdi_latency_ms = options->ftdi_latency_ms;
+    }
+}
+
+/**
+ * Opens the serial port with the given settings (or returns with success
+ * if it is already open.) Every exchange with the ECU is a handful of
+ * single-byte round trips, so USB adapters that hold received bytes back
+ * (FTDI adapters wait up to 16 ms by default) add that delay to every
+ * echo; low-latency mode asks the driver and adapter not to.
+ * @param info State information for the current connection.
+ * @param devPath Full path to the serial device (e.g. "/dev/ttyUSB0" or "COM2")
+ * @param options Settings for the link, or NULL to use the defaults
+ * @return True if the serial device was successfully opened and configured;
+ *   false otherwise.
+ */
+bool mems_connect_ex(mems_info *info, const char *devPath, const mems_connect_options *options)
 {
     bool result = false;
+    mems_connect_options opts;
 
-#if defined(WIN32)
-    if (WaitForSingleObject(info->mutex, INFINITE) == WAIT_OBJECT_0)
+    mems_merge_options(options, &opts);
+
+    if (mems_lock_priority(info, MEMS_Priority_Keepalive))
     {
-        result = mems_is_connected(info) || mems_openserial(info, devPath);
-        ReleaseMutex(info->mutex);
+        result = mems_is_connected(info) || mems_openserial(info, devPath, &opts);
+        mems_unlock(info);
     }
-#else // Linux/Unix
-    pthread_mutex_lock(&info->mutex);
-    result = mems_is_connected(info) || mems_openserial(info, devPath);
-    pthread_mutex_unlock(&info->mutex);
-#endif
 
     return result;
 }
 
+/**
+ * Attaches the connection to a transport other than a serial device, such
+ * as the ECU simulator. The baud rate in the options is used only to time
+ * the waits for replies; the serial-specific settings are ignored.
+ * @param info State information for the current connection.
+ * @param transport Functions used to exchange bytes with the ECU
+ * @param ctx Passed through to each of the transport's functions
+ * @param options Settings for the link, or NULL to use the defaults
+ * @return True if the transport was attached; false if the connection is
+ *   already open.
+ */
+bool mems_connect_transport(mems_info *info, const mems_transport *transport, void *ctx,
+                            const mems_connect_options *options)
+{
+    bool result = false;
+    mems_connect_options opts;
+
+    mems_merge_options(options, &opts);
+
+    if (mems_lock_priority(info, MEMS_Priority_Keepalive))
+    {
+        if (!mems_is_connected(info))
+        {
+            info->byte_time_us = MEMS_BYTE_TIME_US(opts.baud_rate);
+            info->reply_margin_us = opts.reply_margin_ms * 1000;
+            info->read_poll_ms = opts.read_poll_ms;
+            info->transport = transport;
+            info->transport_ctx = ctx;
+            result = true;
+        }
+        mems_unlock(info);
+    }
+
+    return result;
+}
+
+#if !defined(WIN32)
+/**
+ * Converts a baud rate into the corresponding termios speed constant.
+ * @return True if the baud rate is supported
+ */
+static bool mems_speed_constant(uint32_t baud_rate, speed_t *speed)
+{
+    switch (baud_rate)
+    {
+    case 1200:   *speed = B1200;   break;
+    case 2400:   *speed = B2400;   break;
+    case 4800:   *speed = B4800;   break;
+    case 9600:   *speed = B9600;   break;
+    case 19200:  *speed = B19200;  break;
+    case 38400:  *speed = B38400;  break;
+    case 57600:  *speed = B57600;  break;
+    case 115200: *speed = B115200; break;
+    default:
+        return false;
+    }
+    return true;
+}
+#endif
+
+#if defined(linux)
+/**
+ * Asks the serial driver to push received bytes to the reader immediately
+ * (ASYNC_LOW_LATENCY), and sets the latency timer of FTDI adapters, which
+ * otherwise hold small amounts of received data for up to 16 ms. Neither
+ * is supported by every driver, and the latency timer is normally writable
+ * only by root, so failures are reported but are not fatal.
+ */
+static void mems_set_low_latency(mems_info *info, const char *devPath, uint8_t ftdi_latency_ms)
+{
+    struct serial_struct serial;
+    char devReal[PATH_MAX];
+    char sysPath[PATH_MAX];
+    FILE *timer = NULL;
+
+    if ((ioctl(info->sd, TIOCGSERIAL, &serial) == 0))
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(info->sd, TIOCSSERIAL, &serial) != 0)
+        {
+            dprintf_err("mems_set_low_latency(): could not set ASYNC_LOW_LATENCY on %s\n", devPath);
+        }
+    }
+
+    // the device may be given as a symlink, e.g. under /dev/serial/by-id
+    if (realpath(devPath, devReal) != NULL)
+    {
+        snprintf(sysPath, sizeof(sysPath), "/sys/bus/usb-serial/devices/%s/latency_timer", basename(devReal));
+        timer = fopen(sysPath, "w");
+        if (timer)
+        {
+            fprintf(timer, "%u\n", ftdi_latency_ms);
+            fclose(timer);
+        }
+        else if (access(sysPath, F_OK) == 0)
+        {
+            dprintf_err("mems_set_low_latency(): could not write %s\n", sysPath);
+        }
+    }
+}
+#endif
+
 /**
  * Opens the serial device for the USB<->TTL/serial converter and sets the
  * parameters for the link to match those on the MEMS ECU.
@@ -144,15 +415,26 @@ bool mems_connect(mems_info *info, const char *devPath)
  * Example: /dev/cuaU0 (instead of /dev/ttyU0)
  * @return True if the open/setup was successful, false otherwise
  */
-bool mems_openserial(mems_info *info, const char *devPath)
+bool mems_openserial(mems_info *info, const char *devPath, const mems_connect_options *options)
 {
     bool retVal = false;
 
+    info->byte_time_us = MEMS_BYTE_TIME_US(options->baud_rate);
+    info->reply_margin_us = options->reply_margin_ms * 1000;
+    info->read_poll_ms = options->read_poll_ms;
+
 #if defined(linux) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
 
     struct termios newtio;
+    speed_t speed = B9600;
     bool success = true;
 
+    if (!mems_speed_constant(options->baud_rate, &speed))
+    {
+        dprintf_err("mems_openserial(): unsupported baud rate %u\n", options->baud_rate);
+        return false;
+    }
+
     info->sd = open(devPath, O_RDWR | O_NOCTTY);
 
     if (info->sd > 0)
@@ -174,20 +456,14 @@ bool mems_openserial(mems_info *info, const char *devPath)
             newtio.c_iflag &= ~(INLCR | ICRNL | IGNCR | IXON | IXOFF | IXANY);
             newtio.c_oflag &= ~OPOST;
 
-#if defined(linux) || defined(__APPLE__)
-            // when waiting for responses, wait until we haven't received any
-            // characters for a period of time before returning with failure
-            newtio.c_cc[VTIME] = 1;
+            // reads return immediately with whatever is in the input buffer;
+            // waiting for replies is done with poll() against a deadline that
+            // is computed from the expected length of each reply
+            newtio.c_cc[VTIME] = 0;
             newtio.c_cc[VMIN] = 0;
-#else // BSD and other UNIXes
-            // This is set higher than the 0.1 seconds used by the Linux/OSX
-            // code, as values much lower than this cause the first echoed
-            // byte to be missed when running under BSD.
-            newtio.c_cc[VTIME] = 5;
-            newtio.c_cc[VMIN] = 0;
-#endif
-            cfsetispeed(&newtio, B9600);
-            cfsetospeed(&newtio, B9600);
+
+            cfsetispeed(&newtio, speed);
+            cfsetospeed(&newtio, speed);
 
             // flush the serial buffers and set the new parameters
             if ((tcflush(info->sd, TCIFLUSH) != 0) ||
@@ -200,6 +476,13 @@ bool mems_openserial(mems_info *info, const char *devPath)
 
         retVal = success;
 
+#if defined(linux)
+        if (retVal && options->low_latency)
+        {
+            mems_set_low_latency(info, devPath, options->ftdi_latency_ms);
+        }
+#endif
+
         // close the device if it couldn't be configured
         if (retVal == false)
         {
@@ -222,7 +505,7 @@ bool mems_openserial(mems_info *info, const char *devPath)
         if (GetCommState(info->sd, &dcb) == TRUE)
         {
             // set the serial port parameters
-            dcb.BaudRate = 9600;
+            dcb.BaudRate = options->baud_rate;
             dcb.fParity = FALSE;
             dcb.fOutxCtsFlow = FALSE;
             dcb.fOutxDsrFlow = FALSE;
@@ -235,10 +518,12 @@ bool mems_openserial(mems_info *info, const char *devPath)
             if ((SetCommState(info->sd, &dcb) == TRUE) &&
                 (GetCommTimeouts(info->sd, &commTimeouts) == TRUE))
             {
-                // modify the COM port parameters to wait 100 ms before timing out
-                commTimeouts.ReadIntervalTimeout = 100;
-                commTimeouts.ReadTotalTimeoutMultiplier = 0;
-                commTimeouts.ReadTotalTimeoutConstant = 100;
+                // return from ReadFile() as soon as any bytes are available,
+                // waiting no more than a short time for the first one; the
+                // overall deadline for each reply is enforced by the caller
+                commTimeouts.ReadIntervalTimeout = MAXDWORD;
+                commTimeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+                commTimeouts.ReadTotalTimeoutConstant = options->read_poll_ms;
 
                 if (SetCommTimeouts(info->sd, &commTimeouts) == TRUE)
                 {
@@ -262,11 +547,16 @@ bool mems_openserial(mems_info *info, const char *devPath)
 
 /**
  * Checks the file descriptor for the serial device to determine if it has
- * already been opened.
+ * already been opened (or whether a transport has been attached).
  * @return True if the serial device is open; false otherwise.
  */
 bool mems_is_connected(mems_info* info)
 {
+    if (info->transport)
+    {
+        return true;
+    }
+
 #if defined(WIN32)
     return (info->sd != INVALID_HANDLE_VALUE);
 #else
@@ -0,0 +1,432 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// shm.c: This file contains routines that place the polling thread's
+//        sample ring and a summary of the link's state in a named
+//        shared memory segment, and that let other processes attach
+//        to the segment and read from it.
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32)
+  #include <windows.h>
+#else
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <signal.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Identifies a segment created by mems_publish(), and its layout
+#define MEMS_SHM_MAGIC   0x4D534852
+#define MEMS_SHM_VERSION 1
+
+//! Number of times a reader retries a status copy that the publisher interrupted
+#define MEMS_SHM_STATUS_RETRIES 1000
+
+/**
+ * Start of a shared segment. The sample ring follows, at ring_offset (a
+ * multiple of 64 bytes, so that the ring's slots are aligned for atomic access).
+ */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  uint64_t ring_offset;
+  //! Sequence lock for the status: odd while the publisher is updating it
+  uint64_t status_seq;
+  mems_shm_status status;
+} mems_shm_header;
+
+struct mems_shm
+{
+#if defined(WIN32)
+  HANDLE handle;
+#else
+  char name[MEMS_SHM_NAME_MAX + 2];
+#endif
+  mems_shm_header* header;
+  size_t size;
+  mems_ring* ring;
+  //! True for the segment created by this process with mems_publish()
+  bool publisher;
+};
+
+/**
+ * Returns the size of the header, rounded up to the alignment of the ring.
+ */
+static size_t mems_shm_ring_offset()
+{
+  return (sizeof(mems_shm_header) + 63) & ~(size_t)63;
+}
+
+#if !defined(WIN32)
+/**
+ * Converts a segment name into the form required by shm_open(), which is a
+ * single path component with a leading slash.
+ * @return False if the name is empty or too long
+ */
+static bool mems_shm_path(const char* name, char* path)
+{
+  size_t len = strlen(name);
+
+  if ((len == 0) || (len > MEMS_SHM_NAME_MAX))
+  {
+    return false;
+  }
+
+  snprintf(path, MEMS_SHM_NAME_MAX + 2, "%s%s", (name[0] == '/') ? "" : "/", name);
+  return true;
+}
+
+/**
+ * Creates a new shared memory object, replacing one that was left behind by
+ * a publisher that has since exited.
+ * @return Descriptor of the object, or -1 if it could not be created (or
+ *   another process is still publishing under the name)
+ */
+static int mems_shm_create_object(const char* path)
+{
+  mems_shm_header header;
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+  if ((fd < 0) && (errno == EEXIST))
+  {
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd >= 0)
+    {
+      memset(&header, 0, sizeof(header));
+      if ((read(fd, &header, sizeof(header)) == sizeof(header)) && (header.magic == MEMS_SHM_MAGIC) &&
+          header.status.publishing && (kill((pid_t)header.status.publisher_pid, 0) == 0))
+      {
+        dprintf_err("mems_shm_create_object(): %s is in use by process %u\n", path,
+                    header.status.publisher_pid);
+        close(fd);
+        return -1;
+      }
+      close(fd);
+    }
+
+    shm_unlink(path);
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+  }
+
+  return fd;
+}
+#endif
+
+/**
+ * Creates a shared segment holding a sample ring of the given capacity. The
+ * ring is left empty, and the status marked as publishing.
+ * @param name Name under which the segment may be attached
+ * @param capacity Number of samples that the ring should retain
+ * @return The segment, or NULL if it could not be created
+ */
+mems_shm* mems_shm_create(const char* name, uint32_t capacity)
+{
+  mems_shm* shm = (mems_shm*)calloc(1, sizeof(mems_shm));
+  size_t size = mems_shm_ring_offset() + mems_ring_size(capacity);
+  void* base = NULL;
+#if !defined(WIN32)
+  int fd = -1;
+#endif
+
+  if (shm == NULL)
+  {
+    return NULL;
+  }
+
+#if defined(WIN32)
+  shm->handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                   (DWORD)((uint64_t)size >> 32), (DWORD)(size & 0xFFFFFFFF), name);
+  if ((shm->handle == NULL) || (GetLastError() == ERROR_ALREADY_EXISTS))
+  {
+    dprintf_err("mems_shm_create(): could not create mapping %s\n", name);
+    if (shm->handle)
+    {
+      CloseHandle(shm->handle);
+    }
+    free(shm);
+    return NULL;
+  }
+
+  base = MapViewOfFile(shm->handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+  if (base == NULL)
+  {
+    CloseHandle(shm->handle);
+    free(shm);
+    return NULL;
+  }
+#else
+  if (!mems_shm_path(name, shm->name) || ((fd = mems_shm_create_object(shm->name)) < 0))
+  {
+    dprintf_err("mems_shm_create(): could not create segment %s\n", name);
+    free(shm);
+    return NULL;
+  }
+
+  if (ftruncate(fd, (off_t)size) == 0)
+  {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if ((base == NULL) || (base == MAP_FAILED))
+  {
+    dprintf_err("mems_shm_create(): could not map segment %s\n", name);
+    shm_unlink(shm->name);
+    free(shm);
+    return NULL;
+  }
+#endif
+
+  shm->header = (mems_shm_header*)base;
+  shm->size = size;
+  shm->publisher = true;
+  shm->ring = mems_ring_init((uint8_t*)base + mems_shm_ring_offset(), capacity);
+
+  shm->header->version = MEMS_SHM_VERSION;
+  shm->header->size = size;
+  shm->header->ring_offset = mems_shm_ring_offset();
+  shm->header->status.publishing = true;
+#if defined(WIN32)
+  shm->header->status.publisher_pid = (uint32_t)GetCurrentProcessId();
+#else
+  shm->header->status.publisher_pid = (uint32_t)getpid();
+#endif
+  MEMS_ATOMIC_STORE(&shm->header->magic, MEMS_SHM_MAGIC);
+
+  return shm;
+}
+
+/**
+ * Returns the ring held in a segment created by mems_shm_create(), into
+ * which the polling thread writes.
+ */
+mems_ring* mems_shm_publisher_ring(mems_shm* shm)
+{
+  return shm->ring;
+}
+
+/**
+ * Begins an update of the status in a segment.
+ */
+static void mems_shm_status_begin(mems_shm_header* header)
+{
+  uint64_t seq = MEMS_ATOMIC_LOAD_RELAXED(&header->status_seq);
+
+  MEMS_ATOMIC_STORE_RELAXED(&header->status_seq, seq + 1);
+  MEMS_ATOMIC_FENCE_RELEASE();
+}
+
+/**
+ * Completes an update of the status, publishing it to readers.
+ */
+static void mems_shm_status_end(mems_shm_header* header)
+{
+  uint64_t seq = MEMS_ATOMIC_LOAD_RELAXED(&header->status_seq);
+
+  MEMS_ATOMIC_STORE(&header->status_seq, seq + 1);
+}
+
+/**
+ * Copies the state of the link into the segment's status. This is called
+ * by the polling thread after each sample, so it takes only the statistics
+ * of the data frame requests.
+ */
+void mems_shm_update(mems_shm* shm, mems_info* info)
+{
+  mems_shm_status* status = &shm->header->status;
+
+  if (!mems_lock(info))
+  {
+    return;
+  }
+
+  mems_shm_status_begin(shm->header);
+  status->updated_us = mems_time_us();
+  status->linked = info->linked;
+  status->reconnects = info->reconnects;
+  memcpy(status->d0_response, info->d0_response, sizeof(status->d0_response));
+  strncpy(status->variant_name, info->variant->name, sizeof(status->variant_name) - 1);
+  if (info->stats)
+  {
+    memcpy(&status->stats80, &info->stats[MEMS_ReqData80], sizeof(mems_command_stats));
+    memcpy(&status->stats7d, &info->stats[MEMS_ReqData7D], sizeof(mems_command_stats));
+  }
+  mems_shm_status_end(shm->header);
+
+  mems_unlock(info);
+}
+
+/**
+ * Attaches (read-only) to the segment in which another process publishes
+ * samples with mems_publish(). The samples are read with mems_ring_latest()
+ * or mems_ring_read_since() on the segment's ring, exactly as in the
+ * publishing process, and without any locking or copying through the
+ * publisher. Their timestamps are on the system-wide clock of mems_time_us().
+ * @param name Name passed to mems_publish()
+ * @return Handle to the segment, or NULL if there is no such segment
+ */
+mems_shm* mems_shm_attach(const char* name)
+{
+  mems_shm* shm = (mems_shm*)calloc(1, sizeof(mems_shm));
+  mems_shm_header* header = NULL;
+  size_t size = 0;
+  bool valid = false;
+#if defined(WIN32)
+  MEMORY_BASIC_INFORMATION region;
+#else
+  struct stat st;
+  int fd = -1;
+#endif
+
+  if (shm == NULL)
+  {
+    return NULL;
+  }
+
+#if defined(WIN32)
+  shm->handle = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+  if (shm->handle != NULL)
+  {
+    header = (mems_shm_header*)MapViewOfFile(shm->handle, FILE_MAP_READ, 0, 0, 0);
+    if ((header != NULL) && (VirtualQuery(header, &region, sizeof(region)) == sizeof(region)))
+    {
+      size = region.RegionSize;
+    }
+  }
+#else
+  if (mems_shm_path(name, shm->name) && ((fd = shm_open(shm->name, O_RDONLY, 0)) >= 0))
+  {
+    if ((fstat(fd, &st) == 0) && ((size_t)st.st_size >= sizeof(mems_shm_header)))
+    {
+      size = (size_t)st.st_size;
+      header = (mems_shm_header*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (header == MAP_FAILED)
+      {
+        header = NULL;
+      }
+    }
+    close(fd);
+  }
+#endif
+
+  if (header != NULL)
+  {
+    shm->header = header;
+    shm->size = size;
+    valid = (MEMS_ATOMIC_LOAD(&header->magic) == MEMS_SHM_MAGIC) &&
+            (header->version == MEMS_SHM_VERSION) &&
+            (header->size <= size) && (header->ring_offset == mems_shm_ring_offset());
+    if (valid)
+    {
+      shm->ring = (mems_ring*)((uint8_t*)header + header->ring_offset);
+      valid = (header->ring_offset + mems_ring_size(mems_ring_capacity(shm->ring)) <= header->size);
+    }
+  }
+
+  if (!valid)
+  {
+    dprintf_err("mems_shm_attach(): no valid segment named %s\n", name);
+    mems_shm_detach(shm);
+    return NULL;
+  }
+
+  return shm;
+}
+
+/**
+ * Returns the ring in an attached segment, to be read with
+ * mems_ring_latest() or mems_ring_read_since().
+ */
+const mems_ring* mems_shm_get_ring(const mems_shm* shm)
+{
+  return shm->ring;
+}
+
+/**
+ * Retrieves a consistent copy of the publisher's status: whether it is
+ * still publishing and connected, which ECU it is connected to, and the
+ * statistics of the data frame requests.
+ * @param status Receives the status
+ * @return True if the status was copied; false if the publisher exited
+ *   while updating it
+ */
+bool mems_shm_get_status(const mems_shm* shm, mems_shm_status* status)
+{
+  const mems_shm_header* header = shm->header;
+  uint64_t before = 0;
+  int attempt = 0;
+
+  for (attempt = 0; attempt < MEMS_SHM_STATUS_RETRIES; attempt++)
+  {
+    before = MEMS_ATOMIC_LOAD(&header->status_seq);
+    if ((before & 1) == 0)
+    {
+      memcpy(status, &header->status, sizeof(mems_shm_status));
+      MEMS_ATOMIC_FENCE_ACQUIRE();
+      if (MEMS_ATOMIC_LOAD_RELAXED(&header->status_seq) == before)
+      {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Detaches from a segment. For the publisher's own segment (which is
+ * detached by mems_cleanup()), the status is first marked as no longer
+ * publishing, and the name removed; processes that are still attached may
+ * go on reading the samples that were published.
+ */
+void mems_shm_detach(mems_shm* shm)
+{
+  if (shm == NULL)
+  {
+    return;
+  }
+
+  if (shm->publisher)
+  {
+    mems_shm_status_begin(shm->header);
+    shm->header->status.publishing = false;
+    shm->header->status.linked = false;
+    mems_shm_status_end(shm->header);
+  }
+
+#if defined(WIN32)
+  if (shm->header)
+  {
+    UnmapViewOfFile(shm->header);
+  }
+  if (shm->handle)
+  {
+    CloseHandle(shm->handle);
+  }
+#else
+  if (shm->header)
+  {
+    munmap(shm->header, shm->size);
+  }
+  if (shm->publisher)
+  {
+    shm_unlink(shm->name);
+  }
+#endif
+
+  free(shm);
+}
@@ -0,0 +1,674 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// sim.c: This file contains a simulated MEMS 1.6 ECU, which answers
+//        commands with recorded (or built-in) data frames at the timing
+//        of a real serial link. It can be attached to a connection as a
+//        transport, or served on a pseudo-terminal for end-to-end tests.
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#if defined(linux)
+  // for posix_openpt() and cfmakeraw()
+  #define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32)
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <termios.h>
+  #include <time.h>
+  #include <unistd.h>
+  #include <errno.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Number of reply bytes that may be in flight from the simulated ECU
+#define MEMS_SIM_QUEUE_SIZE 256
+
+//! Longest wait of the pseudo-terminal thread before it checks whether to stop
+#define MEMS_SIM_PTY_IDLE_MS 50
+
+//! Bits recording which frames of the current pair have been served
+#define MEMS_SIM_SERVED_80 0x01
+#define MEMS_SIM_SERVED_7D 0x02
+
+struct mems_sim
+{
+  mems_sim_options opts;
+  //! Frames replayed in turn, and the pair being served now
+  mems_data_frame_80* frames80;
+  mems_data_frame_7d* frames7d;
+  size_t frame_count;
+  size_t frame_idx;
+  uint8_t served;
+  //! Position of the simulated idle air control valve
+  uint8_t iac;
+  //! State of the generator for jitter and dropouts
+  uint32_t rng;
+  //! Reply bytes in flight, each with the time at which it has fully arrived
+  uint8_t out[MEMS_SIM_QUEUE_SIZE];
+  uint64_t out_us[MEMS_SIM_QUEUE_SIZE];
+  uint16_t out_head;
+  uint16_t out_count;
+  //! Times at which the lines towards and from the ECU become free
+  uint64_t rx_free_us;
+  uint64_t tx_free_us;
+  //! Number of commands received, and of those that were not answered
+  uint32_t commands;
+  uint32_t dropped;
+#if !defined(WIN32)
+  pthread_t thread;
+  volatile bool running;
+  int master;
+  int slave;
+#endif
+};
+
+//! Built-in pair of frames, as returned by a warm engine at idle
+static const uint8_t mems_sim_default_80[sizeof(mems_data_frame_80)] =
+{
+  0x1C, 0x03, 0x52, 0x9B, 0x90, 0x80, 0x7F, 0x23, 0x8A, 0x20, 0x10, 0x00, 0x01, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x32, 0x00, 0x05, 0x00, 0x60, 0x01, 0x10, 0x00, 0x00, 0x00
+};
+
+static const uint8_t mems_sim_default_7d[sizeof(mems_data_frame_7d)] =
+{
+  0x20, 0x10, 0x0C, 0x00, 0x00, 0x00, 0x00, 0x58, 0xFF, 0xFF, 0x01, 0x00, 0x80, 0x00,
+  0x00, 0x30, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00
+};
+
+/**
+ * Returns the next number from the simulator's pseudo-random sequence
+ * (xorshift32, so that a given seed always produces the same run).
+ */
+static uint32_t mems_sim_random(mems_sim* sim)
+{
+  uint32_t x = sim->rng;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sim->rng = x;
+
+  return x;
+}
+
+/**
+ * Sleeps until the given time (on the mems_time_us() clock).
+ */
+static void mems_sim_sleep_until(uint64_t wake_us)
+{
+  uint64_t now = mems_time_us();
+
+  if (wake_us > now)
+  {
+#if defined(WIN32)
+    Sleep((DWORD)((wake_us - now + 999) / 1000));
+#else
+    struct timespec ts;
+
+    ts.tv_sec = (wake_us - now) / 1000000;
+    ts.tv_nsec = ((wake_us - now) % 1000000) * 1000;
+    while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR))
+      ;
+#endif
+  }
+}
+
+/**
+ * Moves on to the next recorded pair of frames when a frame of the current
+ * pair is requested for the second time, so that the replay advances by
+ * one pair per read cycle whether or not both frames are read.
+ */
+static void mems_sim_advance(mems_sim* sim, uint8_t frame_bit)
+{
+  if (sim->served & frame_bit)
+  {
+    sim->frame_idx = (sim->frame_idx + 1) % sim->frame_count;
+    sim->served = 0;
+  }
+  sim->served |= frame_bit;
+}
+
+/**
+ * Builds the ECU's reply to one command: its echo, followed by the command's payload.
+ * @param reply Buffer of at least MEMS_RX_BUFFER_SIZE bytes
+ * @return Number of bytes in the reply
+ */
+static uint16_t mems_sim_reply(mems_sim* sim, uint8_t cmd, uint8_t* reply)
+{
+  uint16_t len = 0;
+  mems_data_frame_80* frame80 = NULL;
+
+  reply[len++] = cmd;
+
+  switch (cmd)
+  {
+  case MEMS_ReqData80:
+    mems_sim_advance(sim, MEMS_SIM_SERVED_80);
+    frame80 = (mems_data_frame_80*)(reply + len);
+    memcpy(frame80, &sim->frames80[sim->frame_idx], sizeof(mems_data_frame_80));
+    frame80->iac_position = sim->iac;
+    len += sizeof(mems_data_frame_80);
+    break;
+  case MEMS_ReqData7D:
+    mems_sim_advance(sim, MEMS_SIM_SERVED_7D);
+    memcpy(reply + len, &sim->frames7d[sim->frame_idx], sizeof(mems_data_frame_7d));
+    len += sizeof(mems_data_frame_7d);
+    break;
+  case 0xCA:
+  case 0x75:
+    break;
+  case 0xD0:
+    memcpy(reply + len, sim->opts.d0_response, sizeof(sim->opts.d0_response));
+    len += sizeof(sim->opts.d0_response);
+    break;
+  case MEMS_GetIACPosition:
+    reply[len++] = sim->iac;
+    break;
+  case MEMS_OpenIAC:
+    if (sim->iac < IAC_MAXIMUM)
+    {
+      sim->iac++;
+    }
+    reply[len++] = sim->iac;
+    break;
+  case MEMS_CloseIAC:
+    if (sim->iac > 0)
+    {
+      sim->iac--;
+    }
+    reply[len++] = sim->iac;
+    break;
+  default:
+    // heartbeat, fault clearing and the other actuator tests
+    reply[len++] = 0x00;
+    break;
+  }
+
+  return len;
+}
+
+/**
+ * Accepts command bytes sent to the ECU, and schedules the arrival of each
+ * byte of their replies: each command is transferred at the link's
+ * character time, and its reply starts after the turnaround time (plus
+ * jitter), but not before the reply to the previous command has finished.
+ */
+static void mems_sim_receive(mems_sim* sim, const uint8_t* data, uint16_t count, uint64_t now)
+{
+  uint8_t reply[MEMS_RX_BUFFER_SIZE];
+  uint16_t len = 0;
+  uint16_t idx = 0;
+  uint16_t byte = 0;
+  uint16_t slot = 0;
+  uint64_t start = 0;
+
+  for (idx = 0; idx < count; idx++)
+  {
+    sim->rx_free_us = ((sim->rx_free_us > now) ? sim->rx_free_us : now) + sim->opts.byte_time_us;
+    sim->commands++;
+
+    if ((mems_sim_random(sim) % 1000) < sim->opts.dropout_per_mille)
+    {
+      sim->dropped++;
+      continue;
+    }
+
+    len = mems_sim_reply(sim, data[idx], reply);
+
+    start = sim->rx_free_us + sim->opts.turnaround_us;
+    if (sim->opts.jitter_us)
+    {
+      start += mems_sim_random(sim) % (sim->opts.jitter_us + 1);
+    }
+    if (start < sim->tx_free_us)
+    {
+      start = sim->tx_free_us;
+    }
+
+    for (byte = 0; byte < len; byte++)
+    {
+      // like a UART overrun, bytes that don't fit are lost
+      if (sim->out_count < MEMS_SIM_QUEUE_SIZE)
+      {
+        slot = (sim->out_head + sim->out_count) % MEMS_SIM_QUEUE_SIZE;
+        sim->out[slot] = reply[byte];
+        sim->out_us[slot] = start + ((uint64_t)(byte + 1) * sim->opts.byte_time_us);
+        sim->out_count++;
+      }
+    }
+    sim->tx_free_us = start + ((uint64_t)len * sim->opts.byte_time_us);
+  }
+}
+
+/**
+ * Takes the reply bytes that have arrived by the given time.
+ * @return Number of bytes copied to the buffer
+ */
+static uint16_t mems_sim_take(mems_sim* sim, uint8_t* buffer, uint16_t quantity, uint64_t now)
+{
+  uint16_t taken = 0;
+
+  while ((taken < quantity) && (sim->out_count > 0) && (sim->out_us[sim->out_head] <= now))
+  {
+    buffer[taken++] = sim->out[sim->out_head];
+    sim->out_head = (sim->out_head + 1) % MEMS_SIM_QUEUE_SIZE;
+    sim->out_count--;
+  }
+
+  return taken;
+}
+
+/**
+ * Returns the time at which the next reply byte arrives, or 0 if none is in flight.
+ */
+static uint64_t mems_sim_next_arrival(mems_sim* sim)
+{
+  return (sim->out_count > 0) ? sim->out_us[sim->out_head] : 0;
+}
+
+static int16_t mems_sim_transport_read(void* ctx, uint8_t* buffer, uint16_t quantity)
+{
+  return (int16_t)mems_sim_take((mems_sim*)ctx, buffer, quantity, mems_time_us());
+}
+
+static int16_t mems_sim_transport_write(void* ctx, const uint8_t* buffer, uint16_t quantity)
+{
+  mems_sim_receive((mems_sim*)ctx, buffer, quantity, mems_time_us());
+  return (int16_t)quantity;
+}
+
+static bool mems_sim_transport_wait(void* ctx, uint64_t deadline_us)
+{
+  uint64_t next = mems_sim_next_arrival((mems_sim*)ctx);
+  uint64_t now = mems_time_us();
+
+  if ((next != 0) && ((next <= deadline_us) || (next <= now)))
+  {
+    mems_sim_sleep_until(next);
+    return true;
+  }
+
+  mems_sim_sleep_until(deadline_us);
+  return false;
+}
+
+static void mems_sim_transport_flush(void* ctx)
+{
+  mems_sim* sim = (mems_sim*)ctx;
+  uint8_t discard[MEMS_SIM_QUEUE_SIZE];
+
+  // as with a serial device, bytes that are still in flight survive the flush
+  mems_sim_take(sim, discard, sizeof(discard), mems_time_us());
+}
+
+static const mems_transport mems_sim_transport =
+{
+  mems_sim_transport_read,
+  mems_sim_transport_write,
+  mems_sim_transport_wait,
+  mems_sim_transport_flush,
+  NULL
+};
+
+/**
+ * Fills in the default behaviour of a simulated ECU: a perfect link at
+ * 9600 baud, and the D0 reply of the MEMS 1.6 fitted to the Mini SPi.
+ * @param options Settings to be filled in
+ */
+void mems_sim_options_init(mems_sim_options* options)
+{
+  memset(options, 0, sizeof(mems_sim_options));
+  options->byte_time_us = MEMS_BYTE_TIME_US(MEMS_BAUD_RATE);
+  options->turnaround_us = 500;
+  options->seed = 1;
+  options->d0_response[0] = 0x99;
+  options->d0_response[1] = 0x00;
+  options->d0_response[2] = 0x03;
+  options->d0_response[3] = 0x03;
+}
+
+/**
+ * Creates a simulated ECU, which replays a built-in pair of frames until
+ * others are given with mems_sim_set_frames() or mems_sim_load_log().
+ * @param options Behaviour of the simulated ECU, or NULL for the defaults
+ * @return The simulator, or NULL if it could not be allocated
+ */
+mems_sim* mems_sim_create(const mems_sim_options* options)
+{
+  mems_sim* sim = (mems_sim*)calloc(1, sizeof(mems_sim));
+
+  if (sim == NULL)
+  {
+    return NULL;
+  }
+
+  if (options)
+  {
+    memcpy(&sim->opts, options, sizeof(mems_sim_options));
+  }
+  else
+  {
+    mems_sim_options_init(&sim->opts);
+  }
+  if (sim->opts.byte_time_us == 0)
+  {
+    sim->opts.byte_time_us = MEMS_BYTE_TIME_US(MEMS_BAUD_RATE);
+  }
+  sim->rng = sim->opts.seed ? sim->opts.seed : 1;
+
+#if !defined(WIN32)
+  sim->master = -1;
+  sim->slave = -1;
+#endif
+
+  if (!mems_sim_set_frames(sim, (const mems_data_frame_80*)mems_sim_default_80,
+                           (const mems_data_frame_7d*)mems_sim_default_7d, 1))
+  {
+    free(sim);
+    return NULL;
+  }
+
+  return sim;
+}
+
+/**
+ * Stops the simulator's pseudo-terminal (if it was started) and frees it.
+ * Any connection attached with mems_sim_connect() must be closed first.
+ */
+void mems_sim_destroy(mems_sim* sim)
+{
+  if (sim)
+  {
+    mems_sim_stop_pty(sim);
+    free(sim->frames80);
+    free(sim->frames7d);
+    free(sim);
+  }
+}
+
+/**
+ * Sets the frames that the simulator replays, one pair per read cycle and
+ * starting again from the first after the last. The frames are copied. The
+ * IAC position starts at that of the first frame, and then follows the
+ * open and close commands.
+ * @param count Number of frames in each array (at least 1)
+ * @return True if the frames were copied
+ */
+bool mems_sim_set_frames(mems_sim* sim, const mems_data_frame_80* frames80,
+                         const mems_data_frame_7d* frames7d, size_t count)
+{
+  mems_data_frame_80* copy80 = NULL;
+  mems_data_frame_7d* copy7d = NULL;
+
+  if (count == 0)
+  {
+    return false;
+  }
+
+  copy80 = (mems_data_frame_80*)malloc(count * sizeof(mems_data_frame_80));
+  copy7d = (mems_data_frame_7d*)malloc(count * sizeof(mems_data_frame_7d));
+  if ((copy80 == NULL) || (copy7d == NULL))
+  {
+    free(copy80);
+    free(copy7d);
+    return false;
+  }
+
+  memcpy(copy80, frames80, count * sizeof(mems_data_frame_80));
+  memcpy(copy7d, frames7d, count * sizeof(mems_data_frame_7d));
+
+  free(sim->frames80);
+  free(sim->frames7d);
+  sim->frames80 = copy80;
+  sim->frames7d = copy7d;
+  sim->frame_count = count;
+  sim->frame_idx = 0;
+  sim->served = 0;
+  sim->iac = copy80[0].iac_position;
+
+  return true;
+}
+
+/**
+ * Loads the frames that the simulator replays from a binary log.
+ * @param path Path to a log written with mems_log_create()
+ * @return True if the log was read and contained at least one frame
+ */
+bool mems_sim_load_log(mems_sim* sim, const char* path)
+{
+  mems_log_reader* log = mems_log_open(path);
+  mems_log_cursor cursor;
+  mems_log_frame frame;
+  mems_data_frame_80* frames80 = NULL;
+  mems_data_frame_7d* frames7d = NULL;
+  uint64_t count = 0;
+  size_t idx = 0;
+  bool status = false;
+
+  if (log == NULL)
+  {
+    return false;
+  }
+
+  count = mems_log_frame_count(log);
+  if (count > 0)
+  {
+    frames80 = (mems_data_frame_80*)malloc(count * sizeof(mems_data_frame_80));
+    frames7d = (mems_data_frame_7d*)malloc(count * sizeof(mems_data_frame_7d));
+  }
+
+  if (frames80 && frames7d)
+  {
+    mems_log_rewind(log, &cursor);
+    while ((idx < count) && mems_log_next(log, &cursor, &frame))
+    {
+      memcpy(&frames80[idx], frame.frame80, sizeof(mems_data_frame_80));
+      memcpy(&frames7d[idx], frame.frame7d, sizeof(mems_data_frame_7d));
+      idx++;
+    }
+    status = mems_sim_set_frames(sim, frames80, frames7d, idx);
+  }
+
+  free(frames80);
+  free(frames7d);
+  mems_log_reader_close(log);
+
+  if (!status)
+  {
+    dprintf_err("mems_sim_load_log(): no frames could be read from %s\n", path);
+  }
+
+  return status;
+}
+
+/**
+ * Attaches a connection to the simulator, in place of a serial device.
+ * The simulator must not also be served on a pseudo-terminal, and may be
+ * attached to only one connection at a time.
+ * @return True if the connection was attached
+ */
+bool mems_sim_connect(mems_info* info, mems_sim* sim)
+{
+  mems_connect_options options;
+
+#if !defined(WIN32)
+  if (sim->running)
+  {
+    return false;
+  }
+#endif
+
+  mems_connect_options_init(&options);
+  options.baud_rate = (uint32_t)(MEMS_BYTE_TIME_US(1) / sim->opts.byte_time_us);
+
+  return mems_connect_transport(info, &mems_sim_transport, sim, &options);
+}
+
+/**
+ * Retrieves the number of commands the simulator has received, and the
+ * number of those that it deliberately left unanswered.
+ * @param commands Receives the number of commands (may be NULL)
+ * @param dropped Receives the number of dropped replies (may be NULL)
+ */
+void mems_sim_counts(mems_sim* sim, uint32_t* commands, uint32_t* dropped)
+{
+  if (commands)
+  {
+    *commands = sim->commands;
+  }
+  if (dropped)
+  {
+    *dropped = sim->dropped;
+  }
+}
+
+#if !defined(WIN32)
+/**
+ * Serves the simulator on the master side of its pseudo-terminal: commands
+ * are read as they arrive, and each reply byte is written when it is due.
+ */
+static void* mems_sim_pty_main(void* arg)
+{
+  mems_sim* sim = (mems_sim*)arg;
+  uint8_t buffer[MEMS_SIM_QUEUE_SIZE];
+  struct pollfd pfd;
+  uint64_t next = 0;
+  uint64_t now = 0;
+  int timeout_ms = 0;
+  ssize_t count = 0;
+
+  pfd.fd = sim->master;
+  pfd.events = POLLIN;
+
+  while (sim->running)
+  {
+    now = mems_time_us();
+    next = mems_sim_next_arrival(sim);
+    if (next == 0)
+    {
+      timeout_ms = MEMS_SIM_PTY_IDLE_MS;
+    }
+    else
+    {
+      timeout_ms = (next > now) ? (int)((next - now + 999) / 1000) : 0;
+    }
+
+    pfd.revents = 0;
+    if ((poll(&pfd, 1, timeout_ms) > 0) && (pfd.revents & POLLIN))
+    {
+      count = read(sim->master, buffer, sizeof(buffer));
+      if (count > 0)
+      {
+        mems_sim_receive(sim, buffer, (uint16_t)count, mems_time_us());
+      }
+    }
+
+    count = mems_sim_take(sim, buffer, sizeof(buffer), mems_time_us());
+    if (count > 0)
+    {
+      if (write(sim->master, buffer, count) != count)
+      {
+        dprintf_err("mems_sim_pty_main(): could not write reply to pseudo-terminal\n");
+      }
+    }
+  }
+
+  return NULL;
+}
+#endif
+
+/**
+ * Serves the simulator on a new pseudo-terminal from a background thread,
+ * so that it can be opened with mems_connect() like a real serial device
+ * (not available under Win32). The bytes are delivered with the timing of
+ * the simulated link, to within the resolution of poll().
+ * @param path Receives the path of the pseudo-terminal's device
+ * @param path_len Size of the buffer at 'path'
+ * @return True if the pseudo-terminal was created and is being served
+ */
+bool mems_sim_start_pty(mems_sim* sim, char* path, size_t path_len)
+{
+#if defined(WIN32)
+  return false;
+#else
+  struct termios tio;
+  const char* name = NULL;
+
+  if (sim->running)
+  {
+    return false;
+  }
+
+  sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+  if ((sim->master < 0) || (grantpt(sim->master) != 0) || (unlockpt(sim->master) != 0) ||
+      ((name = ptsname(sim->master)) == NULL) || (strlen(name) >= path_len))
+  {
+    dprintf_err("mems_sim_start_pty(): could not create pseudo-terminal\n");
+    if (sim->master >= 0)
+    {
+      close(sim->master);
+    }
+    sim->master = -1;
+    return false;
+  }
+  strcpy(path, name);
+
+  // holding the slave side open keeps the pseudo-terminal in existence
+  // while connections come and go, and setting it to raw mode now stops it
+  // from echoing commands back before the library has configured it
+  sim->slave = open(path, O_RDWR | O_NOCTTY);
+  if ((sim->slave >= 0) && (tcgetattr(sim->slave, &tio) == 0))
+  {
+    cfmakeraw(&tio);
+    tcsetattr(sim->slave, TCSANOW, &tio);
+  }
+
+  sim->running = true;
+  if (pthread_create(&sim->thread, NULL, mems_sim_pty_main, sim) != 0)
+  {
+    sim->running = false;
+    mems_sim_stop_pty(sim);
+    return false;
+  }
+
+  return true;
+#endif
+}
+
+/**
+ * Stops serving the simulator on its pseudo-terminal, and closes it.
+ */
+void mems_sim_stop_pty(mems_sim* sim)
+{
+#if !defined(WIN32)
+  if (sim->running)
+  {
+    sim->running = false;
+    pthread_join(sim->thread, NULL);
+  }
+
+  if (sim->slave >= 0)
+  {
+    close(sim->slave);
+    sim->slave = -1;
+  }
+  if (sim->master >= 0)
+  {
+    close(sim->master);
+    sim->master = -1;
+  }
+#endif
+}
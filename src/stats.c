@@ -0,0 +1,229 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// stats.c: This file contains routines that record counters and
+//          latencies for each command/response exchange with the ECU,
+//          so that the time spent on the serial link can be examined.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Upper bound of the first histogram bucket, in microseconds
+#define MEMS_STATS_HIST_BASE_US 1000
+
+/**
+ * Returns the histogram bucket for an exchange with the given total latency.
+ */
+static int mems_stats_bucket(uint64_t latency_us)
+{
+  int bucket = 0;
+  uint64_t bound = MEMS_STATS_HIST_BASE_US;
+
+  while ((bucket < MEMS_STATS_HIST_BUCKETS - 1) && (latency_us >= bound))
+  {
+    bucket++;
+    bound <<= 1;
+  }
+
+  return bucket;
+}
+
+/**
+ * Records the outcome and timing of one exchange with the ECU, and keeps
+ * the times of each completed data frame for mems_get_frame_times(). The
+ * caller must have exclusive use of the link (normally by holding the lock).
+ * @param cmd Command byte that was sent
+ * @param result Outcome of the exchange
+ * @param sent_us Time (from mems_time_us()) at which the command was sent
+ * @param echo_us Time at which the echo arrived, or 0 if it did not
+ * @param done_us Time at which the exchange completed or was abandoned
+ */
+void mems_stats_record(mems_info* info, uint8_t cmd, mems_exchange_result result,
+                       uint64_t sent_us, uint64_t echo_us, uint64_t done_us)
+{
+  mems_command_stats* stats = NULL;
+  mems_frame_times* frame_times = NULL;
+  uint32_t echo_latency = 0;
+  uint32_t payload_latency = 0;
+
+  // read without the lock by mems_heartbeat(), to see whether the link is idle
+  if (result == MEMS_Exchange_Complete)
+  {
+    MEMS_ATOMIC_STORE_RELAXED(&info->last_exchange_us, done_us);
+
+    if (cmd == MEMS_ReqData80)
+    {
+      frame_times = &info->frame_times.frame80;
+    }
+    else if (cmd == MEMS_ReqData7D)
+    {
+      frame_times = &info->frame_times.frame7d;
+    }
+
+    if (frame_times)
+    {
+      frame_times->sent_us = sent_us;
+      frame_times->first_byte_us = echo_us;
+      frame_times->last_byte_us = done_us;
+    }
+  }
+
+  if (info->stats == NULL)
+  {
+    info->stats = (mems_command_stats*)calloc(256, sizeof(mems_command_stats));
+    if (info->stats == NULL)
+    {
+      return;
+    }
+  }
+
+  stats = &info->stats[cmd];
+  stats->requests++;
+
+  if (echo_us != 0)
+  {
+    echo_latency = (uint32_t)(echo_us - sent_us);
+    stats->echo_us_total += echo_latency;
+    if (echo_latency > stats->echo_us_max)
+    {
+      stats->echo_us_max = echo_latency;
+    }
+  }
+
+  switch (result)
+  {
+  case MEMS_Exchange_Complete:
+    payload_latency = (uint32_t)(done_us - echo_us);
+    stats->payload_us_total += payload_latency;
+    if (payload_latency > stats->payload_us_max)
+    {
+      stats->payload_us_max = payload_latency;
+    }
+    stats->histogram[mems_stats_bucket(done_us - sent_us)]++;
+    stats->completed++;
+    break;
+  case MEMS_Exchange_Timeout:
+    stats->timeouts++;
+    break;
+  case MEMS_Exchange_ShortRead:
+    stats->short_reads++;
+    break;
+  case MEMS_Exchange_Mismatch:
+    stats->mismatches++;
+    break;
+  }
+}
+
+/**
+ * Records the outcome and timing of an exchange that was run through a
+ * frame parser. An exchange whose parser is still incomplete is counted as
+ * a short read if the echo was seen, as a mismatch if only stray bytes
+ * were, or as a timeout otherwise. A completed
+ * exchange is timed to the moment its last byte was parsed. Any stray bytes
+ * that the parser skipped before a completed exchange are counted as a
+ * resynchronization; for a failed exchange they are left to the caller, to
+ * be counted along with whatever it drains from the input afterwards.
+ */
+void mems_stats_record_parser(mems_info* info, const mems_frame_parser* parser)
+{
+  mems_exchange_result result = MEMS_Exchange_Complete;
+
+  if (parser->status == MEMS_Parse_Mismatch)
+  {
+    result = MEMS_Exchange_Mismatch;
+  }
+  else if (parser->status == MEMS_Parse_Incomplete)
+  {
+    if (parser->received > 0)
+    {
+      result = MEMS_Exchange_ShortRead;
+    }
+    else
+    {
+      // only stray bytes arrived
+      result = (parser->skipped > 0) ? MEMS_Exchange_Mismatch : MEMS_Exchange_Timeout;
+    }
+  }
+
+  mems_stats_record(info, parser->cmd, result, parser->sent_us, parser->echo_us,
+                    parser->done_us ? parser->done_us : mems_time_us());
+
+  // a failed exchange's skipped bytes are counted by whoever cleans up after it
+  if (result == MEMS_Exchange_Complete)
+  {
+    mems_stats_record_discard(info, parser->cmd, parser->skipped);
+  }
+}
+
+/**
+ * Records that stray bytes were discarded during (or just after) an exchange
+ * that used the given command, which must already have been recorded.
+ * @param count Number of bytes discarded (nothing is recorded if 0)
+ */
+void mems_stats_record_discard(mems_info* info, uint8_t cmd, uint16_t count)
+{
+  if ((count == 0) || (info->stats == NULL))
+  {
+    return;
+  }
+
+  info->stats[cmd].resyncs++;
+  info->stats[cmd].discarded += count;
+}
+
+/**
+ * Frees the statistics table.
+ */
+void mems_stats_free(mems_info* info)
+{
+  free(info->stats);
+  info->stats = NULL;
+}
+
+/**
+ * Retrieves the counters and timings accumulated for one command byte since
+ * mems_init() (or since the last call to mems_reset_stats()). Average
+ * latencies may be computed by dividing the totals by the number of
+ * exchanges that received an echo (completed plus short reads) or that
+ * completed, respectively.
+ * @param cmd Command byte whose statistics should be retrieved
+ * @param stats Receives the statistics (all zero if the command was never sent)
+ * @return True if the statistics were retrieved
+ */
+bool mems_get_stats(mems_info* info, uint8_t cmd, mems_command_stats* stats)
+{
+  bool status = false;
+
+  if (mems_lock(info))
+  {
+    if (info->stats)
+    {
+      memcpy(stats, &info->stats[cmd], sizeof(mems_command_stats));
+    }
+    else
+    {
+      memset(stats, 0, sizeof(mems_command_stats));
+    }
+    status = true;
+    mems_unlock(info);
+  }
+
+  return status;
+}
+
+/**
+ * Clears the counters and timings for all commands.
+ */
+void mems_reset_stats(mems_info* info)
+{
+  if (mems_lock(info))
+  {
+    if (info->stats)
+    {
+      memset(info->stats, 0, 256 * sizeof(mems_command_stats));
+    }
+    mems_unlock(info);
+  }
+}
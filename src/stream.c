@@ -0,0 +1,826 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// stream.c: This file contains the telemetry streamer, which collects
+//           the polling thread's samples into batches of raw or
+//           delta-encoded frames and sends them over TCP or UDP from
+//           a thread of its own, dropping the oldest batches when the
+//           network cannot keep up.
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32)
+  #include <winsock2.h>
+  #include <ws2tcpip.h>
+  #include <windows.h>
+#else
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <netdb.h>
+  #include <poll.h>
+  #include <pthread.h>
+  #include <time.h>
+  #include <unistd.h>
+  #include <sys/socket.h>
+  #include <sys/types.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+#if defined(WIN32)
+  typedef SOCKET mems_socket;
+  #define MEMS_INVALID_SOCKET INVALID_SOCKET
+  #define mems_close_socket closesocket
+  #define mems_poll WSAPoll
+#else
+  typedef int mems_socket;
+  #define MEMS_INVALID_SOCKET (-1)
+  #define mems_close_socket close
+  #define mems_poll poll
+#endif
+
+// a send to a closed TCP peer must not raise SIGPIPE: where MSG_NOSIGNAL is
+// missing (as on macOS and the BSDs), SO_NOSIGPIPE is set on the socket instead
+#if defined(MSG_NOSIGNAL)
+  #define MEMS_SEND_FLAGS MSG_NOSIGNAL
+#else
+  #define MEMS_SEND_FLAGS 0
+#endif
+
+//! Identifies a batch on the wire ("MSB1", little-endian), and its layout
+#define MEMS_STREAM_MAGIC   0x3142534D
+#define MEMS_STREAM_VERSION 1
+
+//! Batch flag: frames are delta-encoded (each batch starting with a keyframe)
+#define MEMS_STREAM_FLAG_DELTA 0x01
+
+//! Bytes in the header of each batch
+#define MEMS_STREAM_HEADER_SIZE 28
+
+//! Largest encoding of one frame: two varints and the frame pair itself
+#define MEMS_STREAM_FRAME_MAX (10 + 10 + MEMS_DELTA_MAX_SIZE)
+
+//! Longest time the thread sleeps between checks of the ring and the socket
+#define MEMS_STREAM_TICK_MS 20
+
+//! Time between attempts to connect a TCP stream
+#define MEMS_STREAM_RETRY_MS 1000
+
+//! Time allowed for queued batches to be sent when the streamer is stopped
+#define MEMS_STREAM_DRAIN_MS 500
+
+/**
+ * One batch in the send queue.
+ */
+typedef struct
+{
+  size_t len;
+  uint8_t* data;
+} mems_stream_batch;
+
+struct mems_streamer
+{
+  mems_info* info;
+  mems_stream_options options;
+#if defined(WIN32)
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+  volatile bool running;
+
+  mems_socket sock;
+  uint64_t next_connect_us;
+  //! Sequence number of the next sample wanted from the ring
+  uint64_t seq;
+
+  //! Batch being filled
+  uint8_t* building;
+  size_t building_len;
+  uint16_t building_count;
+  uint64_t building_start_us;
+  uint64_t last_seq;
+  uint64_t last_us;
+  mems_delta_encoder encoder;
+
+  //! Completed batches, oldest first; the head may be partly sent (over TCP)
+  mems_stream_batch* queue;
+  uint8_t* queue_mem;
+  uint32_t queue_head;
+  uint32_t queue_count;
+  size_t head_sent;
+
+  //! Counters, read by other threads (through mems_stream_get_stats())
+  mems_stream_stats stats;
+};
+
+/**
+ * Fills in the default options: delta-encoded frames in batches of up to
+ * 1400 bytes (to fit in one datagram on any link) sent at least once per
+ * second, with up to 256 batches queued while the network is unavailable.
+ */
+void mems_stream_options_init(mems_stream_options* options)
+{
+  memset(options, 0, sizeof(mems_stream_options));
+  options->protocol = MEMS_Stream_TCP;
+  options->delta = true;
+  options->keyframe_interval = MEMS_DELTA_KEYFRAME_INTERVAL;
+  options->max_batch_bytes = 1400;
+  options->max_batch_ms = 1000;
+  options->queue_batches = 256;
+}
+
+/**
+ * Writes a value as a little-endian field of the given width.
+ */
+static void mems_stream_put_le(uint8_t* out, uint64_t value, int bytes)
+{
+  int idx = 0;
+
+  for (idx = 0; idx < bytes; idx++)
+  {
+    out[idx] = (uint8_t)(value >> (8 * idx));
+  }
+}
+
+/**
+ * Reads a little-endian field of the given width.
+ */
+static uint64_t mems_stream_get_le(const uint8_t* in, int bytes)
+{
+  uint64_t value = 0;
+  int idx = 0;
+
+  for (idx = bytes - 1; idx >= 0; idx--)
+  {
+    value = (value << 8) | in[idx];
+  }
+
+  return value;
+}
+
+/**
+ * Writes an unsigned value in the variable-length (LEB128) encoding.
+ * @return Number of bytes written (at most 10)
+ */
+static size_t mems_stream_put_varint(uint8_t* out, uint64_t value)
+{
+  size_t len = 0;
+
+  while (value >= 0x80)
+  {
+    out[len++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = (uint8_t)value;
+
+  return len;
+}
+
+/**
+ * Reads a value written by mems_stream_put_varint().
+ * @return Number of bytes consumed, or 0 if the value is truncated
+ */
+static size_t mems_stream_get_varint(const uint8_t* in, size_t len, uint64_t* value)
+{
+  size_t pos = 0;
+  int shift = 0;
+
+  *value = 0;
+  while ((pos < len) && (shift < 64))
+  {
+    *value |= (uint64_t)(in[pos] & 0x7F) << shift;
+    if ((in[pos++] & 0x80) == 0)
+    {
+      return pos;
+    }
+    shift += 7;
+  }
+
+  return 0;
+}
+
+/**
+ * Counts the frames of a batch that will never be sent.
+ */
+static void mems_stream_count_drop(mems_streamer* streamer, const uint8_t* batch)
+{
+  MEMS_ATOMIC_STORE_RELAXED(&streamer->stats.batches_dropped, streamer->stats.batches_dropped + 1);
+  MEMS_ATOMIC_STORE_RELAXED(&streamer->stats.frames_dropped, streamer->stats.frames_dropped +
+                            mems_stream_get_le(batch + 6, 2));
+}
+
+/**
+ * Moves the batch being filled onto the send queue, first discarding the
+ * oldest queued batch that has not started to be sent if the queue is full.
+ */
+static void mems_stream_close_batch(mems_streamer* streamer)
+{
+  mems_stream_batch* batch = NULL;
+  uint8_t* data = NULL;
+  uint32_t capacity = streamer->options.queue_batches;
+  uint32_t victim = 0;
+  uint32_t idx = 0;
+
+  if (streamer->building_count == 0)
+  {
+    return;
+  }
+
+  mems_stream_put_le(streamer->building + 6, streamer->building_count, 2);
+  mems_stream_put_le(streamer->building + 8, streamer->building_len - MEMS_STREAM_HEADER_SIZE, 4);
+
+  if (streamer->queue_count == capacity)
+  {
+    // a partly-sent head must be finished, or the TCP stream would be corrupted
+    victim = (streamer->head_sent > 0) ? 1 : 0;
+    if (victim == streamer->queue_count)
+    {
+      // nothing can be dropped but the new batch itself
+      mems_stream_count_drop(streamer, streamer->building);
+      streamer->building_len = 0;
+      streamer->building_count = 0;
+      return;
+    }
+
+    // close the gap left by the victim, keeping its buffer for reuse
+    data = streamer->queue[(streamer->queue_head + victim) % capacity].data;
+    mems_stream_count_drop(streamer, data);
+    for (idx = victim; idx + 1 < streamer->queue_count; idx++)
+    {
+      streamer->queue[(streamer->queue_head + idx) % capacity] =
+        streamer->queue[(streamer->queue_head + idx + 1) % capacity];
+    }
+    streamer->queue_count--;
+    streamer->queue[(streamer->queue_head + streamer->queue_count) % capacity].data = data;
+  }
+
+  // the filled buffer joins the queue, and the tail slot's buffer is filled next
+  batch = &streamer->queue[(streamer->queue_head + streamer->queue_count) % capacity];
+  data = batch->data;
+  batch->data = streamer->building;
+  batch->len = streamer->building_len;
+  streamer->queue_count++;
+
+  streamer->building = data;
+  streamer->building_len = 0;
+  streamer->building_count = 0;
+}
+
+/**
+ * Appends one sample to the batch being filled, starting a new batch if it
+ * is full or old enough.
+ */
+static void mems_stream_add(mems_streamer* streamer, const mems_sample* sample)
+{
+  uint8_t* out = NULL;
+
+  if ((streamer->building_count > 0) &&
+      ((streamer->building_len + MEMS_STREAM_FRAME_MAX > streamer->options.max_batch_bytes) ||
+       (streamer->building_count == 0xFFFF)))
+  {
+    mems_stream_close_batch(streamer);
+  }
+
+  if (streamer->building_count == 0)
+  {
+    // each batch can be decoded on its own, so that losing one loses no others
+    out = streamer->building;
+    mems_stream_put_le(out, MEMS_STREAM_MAGIC, 4);
+    out[4] = MEMS_STREAM_VERSION;
+    out[5] = streamer->options.delta ? MEMS_STREAM_FLAG_DELTA : 0;
+    mems_stream_put_le(out + 12, sample->seq, 8);
+    mems_stream_put_le(out + 20, mems_to_wall_time_us(sample->timestamp_us), 8);
+    streamer->building_len = MEMS_STREAM_HEADER_SIZE;
+    streamer->building_start_us = mems_time_us();
+    streamer->last_seq = sample->seq;
+    streamer->last_us = sample->timestamp_us;
+    mems_delta_force_keyframe(&streamer->encoder);
+  }
+
+  out = streamer->building + streamer->building_len;
+  out += mems_stream_put_varint(out, sample->seq - streamer->last_seq);
+  out += mems_stream_put_varint(out, sample->timestamp_us - streamer->last_us);
+
+  if (streamer->options.delta)
+  {
+    out += mems_delta_encode(&streamer->encoder, &sample->frame80, &sample->frame7d, out);
+  }
+  else
+  {
+    memcpy(out, &sample->frame80, sizeof(mems_data_frame_80));
+    memcpy(out + sizeof(mems_data_frame_80), &sample->frame7d, sizeof(mems_data_frame_7d));
+    out += MEMS_DELTA_FRAME_SIZE;
+  }
+
+  streamer->building_len = out - streamer->building;
+  streamer->building_count++;
+  streamer->last_seq = sample->seq;
+  streamer->last_us = sample->timestamp_us;
+}
+
+/**
+ * Takes every new sample from the polling thread's ring, and closes the
+ * batch being filled once it has waited long enough.
+ */
+static void mems_stream_collect(mems_streamer* streamer)
+{
+  mems_ring* ring = mems_get_ring(streamer->info);
+  mems_sample samples[16];
+  uint32_t got = 0;
+  uint32_t idx = 0;
+
+  while ((got = mems_ring_read_since(ring, streamer->seq, samples, 16, &streamer->seq)) > 0)
+  {
+    for (idx = 0; idx < got; idx++)
+    {
+      // samples overwritten before this thread could take them are lost
+      if ((streamer->stats.frames_queued + streamer->stats.frames_lost > 0) &&
+          (samples[idx].seq > streamer->last_seq + 1))
+      {
+        MEMS_ATOMIC_STORE_RELAXED(&streamer->stats.frames_lost, streamer->stats.frames_lost +
+                                  (samples[idx].seq - streamer->last_seq - 1));
+      }
+      mems_stream_add(streamer, &samples[idx]);
+      MEMS_ATOMIC_STORE_RELAXED(&streamer->stats.frames_queued, streamer->stats.frames_queued + 1);
+    }
+  }
+
+  if ((streamer->building_count > 0) &&
+      (mems_time_us() - streamer->building_start_us >= (uint64_t)streamer->options.max_batch_ms * 1000))
+  {
+    mems_stream_close_batch(streamer);
+  }
+}
+
+/**
+ * Closes the socket, so that a TCP stream is reconnected after a pause.
+ */
+static void mems_stream_disconnect(mems_streamer* streamer)
+{
+  if (streamer->sock != MEMS_INVALID_SOCKET)
+  {
+    mems_close_socket(streamer->sock);
+    streamer->sock = MEMS_INVALID_SOCKET;
+  }
+
+  // a batch cut off part-way is sent again in full on the new connection
+  streamer->head_sent = 0;
+  streamer->next_connect_us = mems_time_us() + (MEMS_STREAM_RETRY_MS * 1000ULL);
+}
+
+/**
+ * Opens the socket to the destination (blocking only this thread), and
+ * makes it non-blocking for sending.
+ * @return True if the socket is ready to send
+ */
+static bool mems_stream_connect(mems_streamer* streamer)
+{
+  struct addrinfo hints;
+  struct addrinfo* result = NULL;
+  struct addrinfo* addr = NULL;
+  char port[8];
+  mems_socket sock = MEMS_INVALID_SOCKET;
+#if defined(WIN32)
+  u_long nonblocking = 1;
+#elif !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+  int nosigpipe = 1;
+#endif
+
+  if (mems_time_us() < streamer->next_connect_us)
+  {
+    return false;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = (streamer->options.protocol == MEMS_Stream_UDP) ? SOCK_DGRAM : SOCK_STREAM;
+  snprintf(port, sizeof(port), "%u", streamer->options.port);
+
+  if (getaddrinfo(streamer->options.host, port, &hints, &result) != 0)
+  {
+    dprintf_err("mems_stream_connect(): could not resolve %s\n", streamer->options.host);
+    streamer->next_connect_us = mems_time_us() + (MEMS_STREAM_RETRY_MS * 1000ULL);
+    return false;
+  }
+
+  for (addr = result; (addr != NULL) && (sock == MEMS_INVALID_SOCKET); addr = addr->ai_next)
+  {
+    sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if ((sock != MEMS_INVALID_SOCKET) && (connect(sock, addr->ai_addr, addr->ai_addrlen) != 0))
+    {
+      mems_close_socket(sock);
+      sock = MEMS_INVALID_SOCKET;
+    }
+  }
+  freeaddrinfo(result);
+
+  if (sock == MEMS_INVALID_SOCKET)
+  {
+    streamer->next_connect_us = mems_time_us() + (MEMS_STREAM_RETRY_MS * 1000ULL);
+    return false;
+  }
+
+#if defined(WIN32)
+  ioctlsocket(sock, FIONBIO, &nonblocking);
+#else
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+#if !defined(WIN32) && !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+  setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+
+  streamer->sock = sock;
+  MEMS_ATOMIC_STORE_RELAXED(&streamer->stats.connects, streamer->stats.connects + 1);
+
+  return true;
+}
+
+/**
+ * Returns true if the last socket call failed only because it would have blocked.
+ */
+static bool mems_stream_would_block()
+{
+#if defined(WIN32)
+  return (WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+  return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+#endif
+}
+
+/**
+ * Sleeps for the given number of milliseconds.
+ */
+static void mems_stream_sleep(uint32_t ms)
+{
+#if defined(WIN32)
+  Sleep(ms);
+#else
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR))
+    ;
+#endif
+}
+
+/**
+ * Removes the batch at the head of the queue.
+ */
+static void mems_stream_pop(mems_streamer* streamer)
+{
+  streamer->queue_head = (streamer->queue_head + 1) % streamer->options.queue_batches;
+  streamer->queue_count--;
+  streamer->head_sent = 0;
+}
+
+/**
+ * Sends as much of the queue as the socket accepts without blocking, then
+ * waits (for at most the given time) until the socket can take more.
+ */
+static void mems_stream_send(mems_streamer* streamer, uint32_t wait_ms)
+{
+  mems_stream_batch* batch = NULL;
+  struct pollfd pfd;
+  int rc = 0;
+
+  while ((streamer->queue_count > 0) &&
+         ((streamer->sock != MEMS_INVALID_SOCKET) || mems_stream_connect(streamer)))
+  {
+    batch = &streamer->queue[streamer->queue_head];
+    rc = send(streamer->sock, (const char*)batch->data + streamer->head_sent,
+              (int)(batch->len - streamer->head_sent), MEMS_SEND_FLAGS);
+
+    if (rc > 0)
+    {
+      MEMS_ATOMIC_STORE_RELAXED(&streamer->stats.bytes_sent, streamer->stats.bytes_sent + rc);
+      streamer->head_sent += rc;
+      if ((streamer->head_sent == batch->len) || (streamer->options.protocol == MEMS_Stream_UDP))
+      {
+        MEMS_ATOMIC_STORE_RELAXED(&streamer->stats.batches_sent, streamer->stats.batches_sent + 1);
+        MEMS_ATOMIC_STORE_RELAXED(&streamer->stats.frames_sent, streamer->stats.frames_sent +
+                                  mems_stream_get_le(batch->data + 6, 2));
+        mems_stream_pop(streamer);
+      }
+    }
+    else if (mems_stream_would_block())
+    {
+      break;
+    }
+    else if (streamer->options.protocol == MEMS_Stream_UDP)
+    {
+      // datagrams are not retried; the receiver may simply not be listening yet
+      mems_stream_count_drop(streamer, batch->data);
+      mems_stream_pop(streamer);
+    }
+    else
+    {
+      dprintf_err("mems_stream_send(): connection lost\n");
+      mems_stream_disconnect(streamer);
+    }
+  }
+
+  if ((streamer->queue_count > 0) && (streamer->sock != MEMS_INVALID_SOCKET))
+  {
+    pfd.fd = streamer->sock;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    mems_poll(&pfd, 1, wait_ms);
+  }
+  else
+  {
+    mems_stream_sleep(wait_ms);
+  }
+}
+
+/**
+ * Main loop of the streaming thread.
+ */
+#if defined(WIN32)
+static DWORD WINAPI mems_stream_main(LPVOID arg)
+#else
+static void* mems_stream_main(void* arg)
+#endif
+{
+  mems_streamer* streamer = (mems_streamer*)arg;
+  uint64_t deadline = 0;
+
+  while (streamer->running)
+  {
+    mems_stream_collect(streamer);
+    mems_stream_send(streamer, MEMS_STREAM_TICK_MS);
+  }
+
+  // send whatever remains, for as long as the network allows
+  mems_stream_collect(streamer);
+  mems_stream_close_batch(streamer);
+  deadline = mems_time_us() + (MEMS_STREAM_DRAIN_MS * 1000ULL);
+  while ((streamer->queue_count > 0) && (streamer->sock != MEMS_INVALID_SOCKET) &&
+         (mems_time_us() < deadline))
+  {
+    mems_stream_send(streamer, MEMS_STREAM_TICK_MS);
+  }
+
+#if defined(WIN32)
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+/**
+ * Frees a streamer's memory and closes its socket.
+ */
+static void mems_stream_free(mems_streamer* streamer)
+{
+  if (streamer->sock != MEMS_INVALID_SOCKET)
+  {
+    mems_close_socket(streamer->sock);
+  }
+  free(streamer->queue_mem);
+  free(streamer->queue);
+  free(streamer);
+#if defined(WIN32)
+  WSACleanup();
+#endif
+}
+
+/**
+ * Starts streaming every sample read by the polling thread to a remote
+ * receiver. Samples are taken from the polling thread's ring by a thread of
+ * the streamer's own, which does all of the encoding and network I/O, so
+ * that a slow or absent network never delays a read cycle. Frames are sent
+ * in batches (each a single datagram over UDP), which are queued while the
+ * network is unavailable; when the queue is full, the oldest batches are
+ * dropped. Each batch starts with a keyframe, so it can be decoded (with
+ * mems_stream_decode()) even if earlier batches were lost.
+ * Polling must have been started, and the streamer must be stopped (with
+ * mems_stream_stop()) before mems_cleanup() is called.
+ * @param info State information for the current connection.
+ * @param options Destination and batching options (see mems_stream_options_init())
+ * @return Handle to the streamer, or NULL if it could not be started
+ */
+mems_streamer* mems_stream_start(mems_info* info, const mems_stream_options* options)
+{
+  mems_streamer* streamer = NULL;
+  mems_ring* ring = mems_get_ring(info);
+  size_t batch_bytes = options->max_batch_bytes;
+  uint32_t idx = 0;
+  bool status = false;
+#if defined(WIN32)
+  WSADATA wsa;
+#endif
+
+  if ((ring == NULL) || (options->host == NULL) || (options->queue_batches == 0) ||
+      (batch_bytes < MEMS_STREAM_HEADER_SIZE + MEMS_STREAM_FRAME_MAX))
+  {
+    dprintf_err("mems_stream_start(): polling must be started, and the options valid\n");
+    return NULL;
+  }
+
+  if ((streamer = (mems_streamer*)calloc(1, sizeof(mems_streamer))) == NULL)
+  {
+    return NULL;
+  }
+
+#if defined(WIN32)
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+  {
+    free(streamer);
+    return NULL;
+  }
+#endif
+
+  streamer->info = info;
+  memcpy(&streamer->options, options, sizeof(mems_stream_options));
+  streamer->sock = MEMS_INVALID_SOCKET;
+  streamer->seq = mems_ring_head(ring);
+  mems_delta_encoder_init(&streamer->encoder, options->keyframe_interval);
+
+  // one buffer for each queue slot, plus the one being filled
+  streamer->queue = (mems_stream_batch*)calloc(options->queue_batches, sizeof(mems_stream_batch));
+  streamer->queue_mem = (uint8_t*)malloc((options->queue_batches + 1) * batch_bytes);
+  if ((streamer->queue == NULL) || (streamer->queue_mem == NULL))
+  {
+    mems_stream_free(streamer);
+    return NULL;
+  }
+
+  for (idx = 0; idx < options->queue_batches; idx++)
+  {
+    streamer->queue[idx].data = streamer->queue_mem + (idx * batch_bytes);
+  }
+  streamer->building = streamer->queue_mem + (options->queue_batches * batch_bytes);
+
+  streamer->running = true;
+#if defined(WIN32)
+  streamer->thread = CreateThread(NULL, 0, mems_stream_main, streamer, 0, NULL);
+  status = (streamer->thread != NULL);
+#else
+  status = (pthread_create(&streamer->thread, NULL, mems_stream_main, streamer) == 0);
+#endif
+
+  if (!status)
+  {
+    mems_stream_free(streamer);
+    return NULL;
+  }
+
+  return streamer;
+}
+
+/**
+ * Stops a streamer, first sending (for up to half a second) the samples
+ * that it has already taken, and frees it.
+ */
+void mems_stream_stop(mems_streamer* streamer)
+{
+  if (streamer == NULL)
+  {
+    return;
+  }
+
+  streamer->running = false;
+#if defined(WIN32)
+  WaitForSingleObject(streamer->thread, INFINITE);
+  CloseHandle(streamer->thread);
+#else
+  pthread_join(streamer->thread, NULL);
+#endif
+
+  mems_stream_free(streamer);
+}
+
+/**
+ * Retrieves the streamer's counters. They are updated by its thread without
+ * locking, so the values may be a moment apart from one another.
+ */
+void mems_stream_get_stats(const mems_streamer* streamer, mems_stream_stats* stats)
+{
+  stats->frames_queued = MEMS_ATOMIC_LOAD_RELAXED(&streamer->stats.frames_queued);
+  stats->frames_sent = MEMS_ATOMIC_LOAD_RELAXED(&streamer->stats.frames_sent);
+  stats->frames_dropped = MEMS_ATOMIC_LOAD_RELAXED(&streamer->stats.frames_dropped);
+  stats->frames_lost = MEMS_ATOMIC_LOAD_RELAXED(&streamer->stats.frames_lost);
+  stats->batches_sent = MEMS_ATOMIC_LOAD_RELAXED(&streamer->stats.batches_sent);
+  stats->batches_dropped = MEMS_ATOMIC_LOAD_RELAXED(&streamer->stats.batches_dropped);
+  stats->bytes_sent = MEMS_ATOMIC_LOAD_RELAXED(&streamer->stats.bytes_sent);
+  stats->connects = MEMS_ATOMIC_LOAD_RELAXED(&streamer->stats.connects);
+}
+
+/**
+ * Decodes one batch received from a streamer (a whole datagram over UDP;
+ * over TCP, batches follow one another in the byte stream). The samples'
+ * frames and sequence numbers are filled in, and their timestamps are in
+ * wall-clock time (microseconds since the Unix epoch); the decoded data
+ * fields are left to the receiver (see mems_decode_batch()).
+ * @param in Received bytes
+ * @param len Number of bytes available at 'in'
+ * @param out Array that receives the samples
+ * @param max Number of samples that 'out' can hold (a batch of the default
+ *   size holds no more than 1400 / 2 samples)
+ * @param count Receives the number of samples decoded; or, when 0 is
+ *   returned because the batch holds more than 'max' samples, the number
+ *   that 'out' must hold to decode it
+ * @return Number of bytes consumed by the batch, or 0 if 'in' does not
+ *   hold a whole, valid batch (over TCP, more bytes may be needed) or
+ *   'out' is too small for it (in which case '*count' is nonzero)
+ */
+size_t mems_stream_decode(const uint8_t* in, size_t len, mems_sample* out, size_t max, size_t* count)
+{
+  mems_data_frame_80 frame80;
+  mems_data_frame_7d frame7d;
+  uint64_t seq = 0;
+  uint64_t timestamp_us = 0;
+  uint64_t value = 0;
+  size_t total = 0;
+  size_t pos = MEMS_STREAM_HEADER_SIZE;
+  size_t used = 0;
+  size_t frames = 0;
+  size_t idx = 0;
+  bool delta = false;
+
+  *count = 0;
+  if (len < MEMS_STREAM_HEADER_SIZE)
+  {
+    return 0;
+  }
+
+  if ((mems_stream_get_le(in, 4) != MEMS_STREAM_MAGIC) || (in[4] != MEMS_STREAM_VERSION))
+  {
+    return 0;
+  }
+
+  delta = (in[5] & MEMS_STREAM_FLAG_DELTA) != 0;
+  frames = (size_t)mems_stream_get_le(in + 6, 2);
+  total = MEMS_STREAM_HEADER_SIZE + (size_t)mems_stream_get_le(in + 8, 4);
+  seq = mems_stream_get_le(in + 12, 8);
+  timestamp_us = mems_stream_get_le(in + 20, 8);
+
+  if (len < total)
+  {
+    return 0;
+  }
+
+  // the batch is whole but 'out' is too small: report how many it holds
+  if (frames > max)
+  {
+    *count = frames;
+    return 0;
+  }
+
+  memset(&frame80, 0, sizeof(frame80));
+  memset(&frame7d, 0, sizeof(frame7d));
+
+  for (idx = 0; idx < frames; idx++)
+  {
+    if ((used = mems_stream_get_varint(in + pos, total - pos, &value)) == 0)
+    {
+      return 0;
+    }
+    seq += value;
+    pos += used;
+
+    if ((used = mems_stream_get_varint(in + pos, total - pos, &value)) == 0)
+    {
+      return 0;
+    }
+    timestamp_us += value;
+    pos += used;
+
+    if (delta)
+    {
+      if ((used = mems_delta_decode(in + pos, total - pos, &frame80, &frame7d)) == 0)
+      {
+        return 0;
+      }
+    }
+    else
+    {
+      if (total - pos < MEMS_DELTA_FRAME_SIZE)
+      {
+        return 0;
+      }
+      memcpy(&frame80, in + pos, sizeof(mems_data_frame_80));
+      memcpy(&frame7d, in + pos + sizeof(mems_data_frame_80), sizeof(mems_data_frame_7d));
+      used = MEMS_DELTA_FRAME_SIZE;
+    }
+    pos += used;
+
+    memset(&out[idx], 0, sizeof(mems_sample));
+    out[idx].seq = seq;
+    out[idx].timestamp_us = timestamp_us;
+    memcpy(&out[idx].frame80, &frame80, sizeof(mems_data_frame_80));
+    memcpy(&out[idx].frame7d, &frame7d, sizeof(mems_data_frame_7d));
+  }
+
+  *count = frames;
+  return total;
+}
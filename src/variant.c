@@ -0,0 +1,186 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// variant.c: This file contains the table of supported ECU variants,
+//            each identified by its reply to the D0 command of the
+//            initialization sequence and carrying the layout and
+//            scaling of the fields of its data frames.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+#define MEMS_FIELD(ch, cmd, frame, field, width, kind, scale, divisor, bias, mask, shift) \
+  { ch, cmd, offsetof(frame, field), width, kind, scale, divisor, bias, mask, shift }
+
+//! A field of the 0x80 frame, copied unchanged
+#define MEMS_RAW_80(ch, field, width) \
+  MEMS_FIELD(ch, MEMS_ReqData80, mems_data_frame_80, field, width, MEMS_Field_Raw, 1.0, 1.0, 0.0, 0, 0)
+//! A field of the 0x80 frame, scaled linearly
+#define MEMS_LINEAR_80(ch, field, width, scale, divisor, bias) \
+  MEMS_FIELD(ch, MEMS_ReqData80, mems_data_frame_80, field, width, MEMS_Field_Linear, scale, divisor, bias, 0, 0)
+//! A temperature in the 0x80 frame
+#define MEMS_TEMP_80(ch, field) \
+  MEMS_FIELD(ch, MEMS_ReqData80, mems_data_frame_80, field, 1, MEMS_Field_TempF, 1.0, 1.0, 0.0, 0, 0)
+//! One bit of a channel, from a byte of the 0x80 frame
+#define MEMS_BIT_80(ch, field, mask, shift) \
+  MEMS_FIELD(ch, MEMS_ReqData80, mems_data_frame_80, field, 1, MEMS_Field_Bit, 1.0, 1.0, 0.0, mask, shift)
+//! A field of the 0x7D frame, copied unchanged
+#define MEMS_RAW_7D(ch, field, width) \
+  MEMS_FIELD(ch, MEMS_ReqData7D, mems_data_frame_7d, field, width, MEMS_Field_Raw, 1.0, 1.0, 0.0, 0, 0)
+//! A field of the 0x7D frame, scaled linearly
+#define MEMS_LINEAR_7D(ch, field, width, scale, divisor, bias) \
+  MEMS_FIELD(ch, MEMS_ReqData7D, mems_data_frame_7d, field, width, MEMS_Field_Linear, scale, divisor, bias, 0, 0)
+
+//! Number of entries in a table of fields
+#define MEMS_NUM_FIELDS(fields) (sizeof(fields) / sizeof(fields[0]))
+
+/**
+ * Fields of the data frames of the MEMS 1.6 (Mini SPi). Each scaling is
+ * written in the form of the expression it stands for (so the battery
+ * voltage is divided by 10.0 rather than multiplied by 0.1), so that the
+ * decoded values are identical to the bit to those of earlier releases.
+ */
+static const mems_field_desc mems_fields_1_6[] =
+{
+  MEMS_RAW_80(MEMS_Channel_EngineRPM, engine_rpm_hi, 2),
+  MEMS_TEMP_80(MEMS_Channel_CoolantTemp, coolant_temp),
+  MEMS_TEMP_80(MEMS_Channel_AmbientTemp, ambient_temp),
+  MEMS_TEMP_80(MEMS_Channel_IntakeAirTemp, intake_air_temp),
+  MEMS_TEMP_80(MEMS_Channel_FuelTemp, fuel_temp),
+  MEMS_RAW_80(MEMS_Channel_MAP, map_kpa, 1),
+  MEMS_LINEAR_80(MEMS_Channel_BatteryVoltage, battery_voltage, 1, 1.0, 10.0, 0.0),
+  MEMS_LINEAR_80(MEMS_Channel_ThrottlePot, throttle_pot, 1, 0.02, 1.0, 0.0),
+  MEMS_BIT_80(MEMS_Channel_IdleSwitch, idle_switch, 0x10, 0),
+  MEMS_BIT_80(MEMS_Channel_ParkNeutralSwitch, park_neutral_switch, 0xFF, 0),
+  MEMS_BIT_80(MEMS_Channel_FaultCodes, dtc0, 0x01, 0),  // coolant temp sensor fault
+  MEMS_BIT_80(MEMS_Channel_FaultCodes, dtc0, 0x02, 1),  // intake air temp sensor fault
+  MEMS_BIT_80(MEMS_Channel_FaultCodes, dtc1, 0x02, 2),  // fuel pump circuit fault
+  MEMS_BIT_80(MEMS_Channel_FaultCodes, dtc1, 0x80, 3),  // throttle pot circuit fault
+  MEMS_RAW_80(MEMS_Channel_IACPosition, iac_position, 1),
+  MEMS_RAW_80(MEMS_Channel_IdleError, idle_error_hi, 2),
+  MEMS_LINEAR_80(MEMS_Channel_IgnitionAdvance, ignition_advance, 1, 0.5, 1.0, -24.0),
+  MEMS_LINEAR_80(MEMS_Channel_CoilTime, coil_time_hi, 2, 0.002, 1.0, 0.0),
+  MEMS_LINEAR_7D(MEMS_Channel_LambdaVoltage, lambda_voltage, 1, 5.0, 1.0, 0.0),
+  MEMS_RAW_7D(MEMS_Channel_FuelTrim, fuel_trim, 1),
+  MEMS_RAW_7D(MEMS_Channel_ClosedLoop, closed_loop, 1),
+  MEMS_RAW_7D(MEMS_Channel_IdleBasePos, idle_base_pos, 1)
+};
+
+//! Lookup tables for the fields of the MEMS 1.6, built by mems_decode_fields()
+static mems_field_table mems_tables_1_6[MEMS_NUM_FIELDS(mems_fields_1_6)];
+
+/**
+ * Every variant that the library can decode. A variant is added by adding
+ * an entry with a table of its fields and room for their lookup tables
+ * (or sharing them, if its frames are the same); the first entry is used
+ * for ECUs whose D0 reply matches none of them.
+ */
+static const mems_variant mems_variant_table[] =
+{
+  // Mini SPi
+  { "MEMS 1.6", { 0x99, 0x00, 0x03, 0x03 }, { 0xFF, 0xFF, 0xFF, 0xFF },
+    mems_fields_1_6, MEMS_NUM_FIELDS(mems_fields_1_6), mems_tables_1_6 }
+};
+
+#define MEMS_NUM_VARIANTS (sizeof(mems_variant_table) / sizeof(mems_variant_table[0]))
+
+//! Variant assumed until the initialization sequence has identified the ECU
+const mems_variant* const mems_default_variant = &mems_variant_table[0];
+
+/**
+ * Returns an entry of the table of variants, or NULL past its end.
+ */
+const mems_variant* mems_variant_at(size_t idx)
+{
+  return (idx < MEMS_NUM_VARIANTS) ? &mems_variant_table[idx] : NULL;
+}
+
+/**
+ * Returns the variant whose D0 reply matches the given bytes (in every
+ * position that the variant's mask covers), or NULL if none matches.
+ * @param d0_response The four bytes sent by the ECU in reply to the D0 command
+ */
+const mems_variant* mems_find_variant(const uint8_t* d0_response)
+{
+  const mems_variant* variant = NULL;
+  size_t idx = 0;
+  int pos = 0;
+  bool match = false;
+
+  for (idx = 0; idx < MEMS_NUM_VARIANTS; idx++)
+  {
+    variant = &mems_variant_table[idx];
+    match = true;
+    for (pos = 0; match && (pos < 4); pos++)
+    {
+      match = ((d0_response[pos] & variant->d0_mask[pos]) == variant->d0_response[pos]);
+    }
+
+    if (match)
+    {
+      return variant;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Chooses the decoder for a connection from the ECU's reply to the D0
+ * command, once the initialization sequence has completed. An ECU that is
+ * not recognized is decoded as the default (first) variant.
+ */
+void mems_select_variant(mems_info* info)
+{
+  const mems_variant* variant = mems_find_variant(info->d0_response);
+
+  if (variant == NULL)
+  {
+    dprintf_err("mems_select_variant(): unrecognized D0 response %02X %02X %02X %02X; assuming %s\n",
+                info->d0_response[0], info->d0_response[1], info->d0_response[2], info->d0_response[3],
+                mems_default_variant->name);
+    variant = mems_default_variant;
+  }
+
+  info->variant = variant;
+}
+
+/**
+ * Returns the variant of the connected ECU, as identified by the most
+ * recent initialization sequence (or the default variant, before then).
+ */
+const mems_variant* mems_get_variant(mems_info* info)
+{
+  return info->variant;
+}
+
+/**
+ * Returns the name of a variant (such as "MEMS 1.6").
+ */
+const char* mems_variant_name(const mems_variant* variant)
+{
+  return variant->name;
+}
+
+/**
+ * Converts a series of raw frame pairs into the compact data structure,
+ * using the field layout of the given variant (see mems_decode_batch()).
+ */
+void mems_variant_decode_batch(const mems_variant* variant, const mems_data_frame_80* frames80,
+                               const mems_data_frame_7d* frames7d, size_t n, mems_data* out)
+{
+  void* dest[MEMS_Num_Channels];
+  int ch = 0;
+
+  // clear the whole array first so that padding bytes are also identical
+  memset(out, 0, n * sizeof(mems_data));
+
+  for (ch = 0; ch < MEMS_Num_Channels; ch++)
+  {
+    dest[ch] = (uint8_t*)out + mems_channel_table[ch].offset;
+  }
+  mems_decode_fields(variant, frames80, frames7d, n, dest, sizeof(mems_data));
+}